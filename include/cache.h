@@ -87,6 +87,15 @@ Service_t *CacheServiceFind(char *name);
  */
 Service_t *CacheServiceFindId(int id);
 
+/**
+ * Find a service in the cache by network id, TS id and service id.
+ * @param netId The original network id of the service.
+ * @param tsId The transport stream id of the service.
+ * @param serviceId The service/program id of the service.
+ * @return A Service_t instance or NULL if not found.
+ */
+Service_t *CacheServiceFindFQID(int netId, int tsId, int serviceId);
+
 /**
  * Find a service with a given name in the cache.
  * @param name Name of the service to look for.
@@ -78,6 +78,27 @@ Opens/Closes and setups the sqlite database for use by the rest of the applicati
  */
 #define SERVICE_DEFAUTHORITY    "defauthority"
 
+/**
+ * Constant for the list of columns (from the Services and Multiplexes tables)
+ * used to create a Service_t object, see ServiceGetCurrent().
+ */
+#define SERVICE_FIELDS SERVICES_TABLE "." SERVICE_MULTIPLEXUID "," \
+                       SERVICES_TABLE "." SERVICE_ID "," \
+                       SERVICES_TABLE "." SERVICE_SOURCE "," \
+                       SERVICES_TABLE "." SERVICE_CA "," \
+                       SERVICES_TABLE "." SERVICE_TYPE "," \
+                       SERVICES_TABLE "." SERVICE_NAME "," \
+                       SERVICES_TABLE "." SERVICE_PMTPID ","\
+                       SERVICES_TABLE "." SERVICE_PROVIDER "," \
+                       SERVICES_TABLE "." SERVICE_DEFAUTHORITY "," \
+                       MULTIPLEXES_TABLE "." MULTIPLEX_NETID ","  \
+                       MULTIPLEXES_TABLE "." MULTIPLEX_TSID " "
+
+/**
+ * Number of columns in SERVICE_FIELDS.
+ */
+#define SERVICE_FIELDS_COUNT    11
+
 /**
  * Constant for the Multiplexes table name.
  */
@@ -215,6 +236,32 @@ Opens/Closes and setups the sqlite database for use by the rest of the applicati
  */
 #define STATEMENT_PREPARE(_statement) rc = sqlite3_prepare( DBASE_CONNECTION_GET(),  _statement, -1, &stmt, NULL)
 
+/**
+ * Macro to retrieve a prepared sql statement from the statement cache of the
+ * current thread's connection, preparing it if it is not already cached.
+ * Values should be bound to the parameters in the statement with the
+ * STATEMENT_BIND_* macros, instead of formatting them into the statement.\n
+ * The statement is returned to the cache by STATEMENT_FINALIZE().
+ * @param _statement The sql statement to prepare, this must be a constant string
+ *                   as its address is used to identify the statement.
+ */
+#define STATEMENT_PREPARE_CACHED(_statement) rc = DBaseStatementPrepare(_statement, &stmt)
+
+/**
+ * Macro to bind an int value to a parameter of a prepared statement.
+ * @param _index Index of the parameter (starting at 1).
+ * @param _value The value to bind.
+ */
+#define STATEMENT_BIND_INT(_index, _value) sqlite3_bind_int(stmt, _index, _value)
+
+/**
+ * Macro to bind a string to a parameter of a prepared statement.
+ * A private copy of the string is taken.
+ * @param _index Index of the parameter (starting at 1).
+ * @param _value The string to bind, NULL binds an SQL NULL.
+ */
+#define STATEMENT_BIND_TEXT(_index, _value) sqlite3_bind_text(stmt, _index, _value, -1, SQLITE_TRANSIENT)
+
 /**
  * Macro to prepare an sql statement with arguments.
  * @param _statement The sql statement to prepare.
@@ -260,9 +307,10 @@ Opens/Closes and setups the sqlite database for use by the rest of the applicati
 #define STATEMENT_COLUMN_TEXT(_index)   (char*)sqlite3_column_text( stmt, _index)
 
 /**
- * Macro to finalise an sql statement.
+ * Macro to finalise an sql statement, or return it to the statement cache if
+ * it was prepared with STATEMENT_PREPARE_CACHED().
  */
-#define STATEMENT_FINALIZE()            rc = sqlite3_finalize(stmt)
+#define STATEMENT_FINALIZE()            rc = DBaseStatementRelease(stmt)
 
 /**
  * Macro to log the last SQLite error.
@@ -322,6 +370,50 @@ void DBaseDeInit();
  */
 sqlite3* DBaseConnectionGet(void);
     
+/**
+ * Maximum number of cached sql statements usage statistics are kept for.
+ */
+#define DBASE_STATEMENT_STATS_MAX 128
+
+/**
+ * Structure used to report the usage of a cached sql statement.
+ */
+typedef struct DBaseStatementStats_s
+{
+    const char *sql;                /**< The sql statement. */
+    unsigned long prepares;         /**< Number of times the statement has been compiled. */
+    unsigned long executions;       /**< Number of times the statement has been used. */
+    unsigned long long totalTime;   /**< Total time in microseconds the statement was in use. */
+    unsigned long maxTime;          /**< Longest time in microseconds the statement was in use. */
+}DBaseStatementStats_t;
+
+/**
+ * Retrieve a prepared statement from the current thread's statement cache,
+ * use STATEMENT_PREPARE_CACHED() rather than calling this function directly.
+ * If the cached statement is already in use a new statement is prepared, which
+ * will be finalised when it is released.
+ * @param sql The sql statement, its address is used as the key in the cache.
+ * @param stmt Location to store the prepared statement.
+ * @return SQLITE_OK on success, otherwise an SQLite error code.
+ */
+int DBaseStatementPrepare(const char *sql, sqlite3_stmt **stmt);
+
+/**
+ * Reset a statement and return it to the statement cache if it came from
+ * there, otherwise finalise it.
+ * @param stmt The statement to release, may be NULL.
+ * @return The result of resetting/finalising the statement.
+ */
+int DBaseStatementRelease(sqlite3_stmt *stmt);
+
+/**
+ * Retrieve the usage statistics for the cached statements.
+ * @param stats Array to store the statistics in.
+ * @param max Number of entries in stats.
+ * @return The number of entries filled in.
+ */
+int DBaseStatementStatsGet(DBaseStatementStats_t *stats, int max);
+
 /**
  * Start a transaction on the database.
  * Can be used to increase the speed when reading from multiple tables.
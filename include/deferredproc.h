@@ -32,7 +32,7 @@ Deferred Processing.
  */
 
 /**
- * Function pointer to a function to be called by the deferred processing thread.
+ * Function pointer to a function to be called by a deferred processing thread.
  */
 typedef void (*DeferredProcessor_t)(void*);
 
@@ -49,9 +49,11 @@ int DeferredProcessingInit(void);
 void DeferredProcessingDeinit(void);
 
 /**
- * Add a job to the queue of jobs to be executed in the deferred processing thread.
+ * Add a job to the queue of jobs to be executed by the deferred processing threads.
  * The function pointed to by processor will be called at an indeterminate time 
  * with the argument specified by arg.
+ * Jobs for the same processor are run one at a time in the order they were
+ * added, see DeferredProcessingAddJobKeyed().
  * @param processor Function pointer to function to call in the deferred processing thread.
  * @param arg Argument to be passed to processor when called. This must have 
  * been allocated using the Object memory system as the reference count will be 
@@ -60,6 +62,17 @@ void DeferredProcessingDeinit(void);
  */
 void DeferredProcessingAddJob(DeferredProcessor_t processor, void *arg);
 
+/**
+ * Add a job to the queue of jobs to be executed by the deferred processing
+ * threads, jobs added with the same key are run one at a time in the order they
+ * were added while jobs with different keys may run at the same time.
+ * @param processor Function pointer to function to call in the deferred processing thread.
+ * @param arg Argument to be passed to processor, see DeferredProcessingAddJob().
+ * @param key Any pointer identifying the jobs that must not run at the same
+ *            time, for example the state the processors share.
+ */
+void DeferredProcessingAddJobKeyed(DeferredProcessor_t processor, void *arg, const void *key);
+
 /** @} */
 #endif
 
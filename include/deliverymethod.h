@@ -22,6 +22,7 @@ Delivery Method management functions.
 */
 #ifndef _DELIVERYMETHOD_H
 #define _DELIVERYMETHOD_H
+#include <pthread.h>
 #include "ts.h"
 /**
  * @defgroup DeliveryMethod Delivery Method Management
@@ -63,6 +64,35 @@ typedef struct DeliveryMethodInstance_t
      * Field used to hold private information for the type of instance.
      */
     void *private;
+
+    /**
+     * Whether the instance is waiting for its Flush() function to be called,
+     * managed by DeliveryMethodFlushRequired() and DeliveryMethodFlushPending().
+     */
+    bool flushPending;
+
+    /**
+     * The thread that requested the flush and so will call Flush().
+     */
+    pthread_t flushThread;
+
+    /**
+     * Whether DeliveryMethodFlushPending() is currently flushing the instance,
+     * DeliveryMethodDestroy() waits for this to clear.
+     */
+    bool flushing;
+
+    /**
+     * Set by DeliveryMethodDestroy() so the instance is not queued to be
+     * flushed again.
+     */
+    bool destroying;
+
+    /**
+     * Packets waiting to be passed to OutputPackets(), managed by
+     * DeliveryMethodOutputPacket() and DeliveryMethodFlushPending().
+     */
+    struct DeliveryMethodGather_s *gather;
 }
 DeliveryMethodInstance_t;
 
@@ -111,8 +141,50 @@ typedef struct DeliveryMethodInstanceOps_t
      */
      void (*SetHeader)(struct DeliveryMethodInstance_t *this, 
                         TSPacket_t *packets, int count);
+
+    /**
+     * Send any output the instance has buffered.
+     * Only called for instances that have called DeliveryMethodFlushRequired(),
+     * on the thread that called it, once the current batch of packets from the
+     * TS Reader has been processed.
+     * @param this The instance of the DeliveryMethodInstance_t to flush.
+     * @return TRUE if the instance still has buffered output and should be
+     *         flushed again after the next batch of packets, FALSE otherwise.
+     */
+     bool (*Flush)(struct DeliveryMethodInstance_t *this);
+
+    /**
+     * Output a packet by reference.
+     * Called instead of OutputPacket() when the packet is part of a batch read
+     * by the TS Reader. The instance can take a reference to the batch (see
+     * TSPacketBatchRef()) and send the packet later without copying it, so a
+     * packet sent to a number of outputs is only held in memory once.
+     * @param this The instance of the DeliveryMethodInstance_t to send the packet using.
+     * @param packet The packet to send.
+     * @param batch The batch the packet belongs to.
+     */
+     void (*OutputPacketRef)(struct DeliveryMethodInstance_t *this, TSPacket_t *packet, TSPacketBatch_t *batch);
+
+    /**
+     * Output a number of packets at once.
+     * When set, packets sent to the instance are gathered and passed to this
+     * function once the current batch of packets from the TS Reader has been
+     * processed (or when DELIVERYMETHOD_MAX_GATHER packets have been gathered)
+     * instead of calling OutputPacket() for each one.
+     * The packets are only valid until the function returns, consecutive
+     * packets will often be next to each other in memory.
+     * @param this The instance of the DeliveryMethodInstance_t to send the packets using.
+     * @param packets Array of pointers to the packets to send.
+     * @param count The number of packets in the array.
+     */
+     void (*OutputPackets)(struct DeliveryMethodInstance_t *this, TSPacket_t **packets, int count);
 }DeliveryMethodInstanceOps_t;
 
+/**
+ * Maximum number of packets passed to OutputPackets() in one call.
+ */
+#define DELIVERYMETHOD_MAX_GATHER 512
+
 
 
 
@@ -216,5 +288,35 @@ void DeliveryMethodOutputPacket(DeliveryMethodInstance_t *instance, TSPacket_t*
  * @param blockLen Length in bytes of the data to output.
  */
 void DeliveryMethodOutputBlock(DeliveryMethodInstance_t *instance,  void *block, unsigned long blockLen);
+
+/**
+ * Request that the Flush() function of the specified instance is called once
+ * the TS Reader has finished processing the current batch of packets.
+ * This allows delivery methods to combine the output for a number of packets
+ * into a single system call.
+ * @param instance The delivery method instance that has buffered output.
+ */
+void DeliveryMethodFlushRequired(DeliveryMethodInstance_t *instance);
+
+/**
+ * @internal
+ * Call the Flush() function of all instances that requested it from the
+ * calling thread.
+ * Called by the TS Reader (and its worker threads) at the end of each batch of
+ * packets. Packets output on threads that have never called this function are
+ * sent immediately rather than gathered.
+ */
+void DeliveryMethodFlushPending(void);
+
+/**
+ * Write an array of packets to a file descriptor using as few writev() calls
+ * as possible, packets next to each other in memory are written as one block.
+ * Intended for use by OutputPackets() implementations.
+ * @param fd The file descriptor to write to.
+ * @param packets Array of pointers to the packets to write.
+ * @param count The number of packets in the array.
+ * @return 0 if all the packets were written, -1 otherwise.
+ */
+int DeliveryMethodWritePackets(int fd, TSPacket_t **packets, int count);
 /** @} */
 #endif
@@ -110,6 +110,13 @@ typedef struct dvbpsi_eit_s
   uint16_t                  i_network_id;       /*!< original network id */
   uint8_t                   i_segment_last_section_number; /*!< segment last section number */
   uint8_t                   i_last_table_id;    /*!< last table id */
+  uint8_t                   i_table_id;         /*!< table_id of the section
+                                                     the events came from */
+  uint8_t                   i_section_number;   /*!< section_number */
+  uint32_t                  i_section_crc;      /*!< CRC_32 of the section, 0
+                                                     if the events were not
+                                                     decoded from a single
+                                                     section */
 
   dvbpsi_eit_event_t *      p_first_event;      /*!< event information list */
 
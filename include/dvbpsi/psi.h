@@ -94,6 +94,8 @@ struct dvbpsi_psi_section_s
 
   /* for reusing this section */
   uint32_t      i_max_size;             /*!< maximum size of p_data */
+  struct dvbpsi_psi_buffer_s *          p_buffer;       /*!< reference counted
+                                                             storage for p_data */
   
   /* list handling */
   struct dvbpsi_psi_section_s *         p_next;         /*!< next element of
@@ -129,13 +131,38 @@ void dvbpsi_ReleasePSISections(dvbpsi_handle h_dvbpsi, dvbpsi_psi_section_t * p_
  *****************************************************************************/
  /*!
  * \fn void dvbpsi_ClonePSISection(dvbpsi_handle h_dvbpsi, dvbpsi_psi_section_t * p_section)
- * \brief Release a section so it can be reused.
+ * \brief Create a copy of a section with its own private data.
  * \param h_dvbpsi Handle to retrieve the currently unused section from.
  * \param p_section pointer to the PSI section structure to clone.
  * \return a pointer to the new PSI section structure.
  */
 dvbpsi_psi_section_t * dvbpsi_ClonePSISection(dvbpsi_handle h_dvbpsi, dvbpsi_psi_section_t * p_section);
 
+/*****************************************************************************
+ * dvbpsi_SharePSISection
+ *****************************************************************************/
+ /*!
+ * \fn dvbpsi_psi_section_t * dvbpsi_SharePSISection(dvbpsi_psi_section_t * p_section)
+ * \brief Create a new section structure that shares the data of p_section.
+ * The data is reference counted and is only returned to the pool once all
+ * sections sharing it have been released. Shared data must be treated as
+ * read only, use dvbpsi_UnsharePSISection() before modifying it.
+ * \param p_section pointer to the PSI section structure to share.
+ * \return a pointer to the new PSI section structure.
+ */
+dvbpsi_psi_section_t * dvbpsi_SharePSISection(dvbpsi_psi_section_t * p_section);
+
+/*****************************************************************************
+ * dvbpsi_UnsharePSISection
+ *****************************************************************************/
+ /*!
+ * \fn int dvbpsi_UnsharePSISection(dvbpsi_psi_section_t * p_section)
+ * \brief Make sure the section has a private copy of its data.
+ * \param p_section pointer to the PSI section structure.
+ * \return 0 on success, -1 if the data could not be copied.
+ */
+int dvbpsi_UnsharePSISection(dvbpsi_psi_section_t * p_section);
+
 /*****************************************************************************
  * dvbpsi_NewPSISection
  *****************************************************************************/
@@ -160,6 +187,49 @@ dvbpsi_psi_section_t * dvbpsi_NewPSISection(int i_max_size);
 void dvbpsi_DeletePSISections(dvbpsi_psi_section_t * p_section);
 
 
+/*****************************************************************************
+ * dvbpsi_CRC32
+ *****************************************************************************/
+/*!
+ * \fn uint32_t dvbpsi_CRC32(const uint8_t *p_data, int i_length)
+ * \brief Calculate the MPEG-2 CRC_32 (polynomial 0x04c11db7, initial value
+ * 0xffffffff, no final XOR) of a block of data.
+ * The fastest implementation available on the CPU is selected on first use.
+ * \param p_data pointer to the data.
+ * \param i_length number of bytes to process.
+ * \return the CRC_32, 0 if the data includes a valid trailing CRC_32.
+ */
+uint32_t dvbpsi_CRC32(const uint8_t *p_data, int i_length);
+
+
+/*****************************************************************************
+ * dvbpsi_crc32_engine_t
+ *****************************************************************************/
+/*!
+ * \enum dvbpsi_crc32_engine_e
+ * \brief CRC_32 implementations dvbpsi_CRC32 can use.
+ */
+typedef enum dvbpsi_crc32_engine_e
+{
+    DVBPSI_CRC32_BYTE,          /*!< One byte per step (s_crc32_table) */
+    DVBPSI_CRC32_SLICE8,        /*!< Eight bytes per step (slicing-by-8) */
+    DVBPSI_CRC32_PCLMUL         /*!< PCLMULQDQ folding, x86-64 only */
+} dvbpsi_crc32_engine_t;
+
+
+/*****************************************************************************
+ * dvbpsi_SelectCRC32Engine
+ *****************************************************************************/
+/*!
+ * \fn int dvbpsi_SelectCRC32Engine(dvbpsi_crc32_engine_t engine)
+ * \brief Force the implementation used by dvbpsi_CRC32, intended for tests
+ * and benchmarks. Must not be called while other threads calculate CRCs.
+ * \param engine the implementation to use.
+ * \return 0 on success, -1 if the CPU doesn't support the implementation.
+ */
+int dvbpsi_SelectCRC32Engine(dvbpsi_crc32_engine_t engine);
+
+
 /*****************************************************************************
  * dvbpsi_ValidPSISection
  *****************************************************************************/
@@ -0,0 +1,176 @@
+/*
+Copyright (C) 2009  Adam Charrett
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+epgdbase.h
+
+In memory store of the EPG information received on the EPG channel.
+
+*/
+
+#ifndef _EPGDBASE_H
+#define _EPGDBASE_H
+#include <time.h>
+#include "types.h"
+#include "epgtypes.h"
+
+/**
+ * @defgroup EPGDBase EPG Database
+ * This module listens on the EPG channel and keeps the events, details and
+ * ratings received in memory so they can be queried by service and time.\n
+ * Events on a service are kept in start time order and never overlap, when an
+ * event is received that overlaps existing events the existing events are
+ * removed, as the schedule must have changed.\n
+ * Events that ended more than an hour ago are discarded.
+ * @{
+ */
+
+/**
+ * Handle used to enumerate events, details or ratings.
+ */
+typedef void *EPGDBaseEnumerator_t;
+
+/**
+ * Initialises the EPG database and starts listening on the EPG channel.
+ * @return 0 on success.
+ */
+int EPGDBaseInit(void);
+
+/**
+ * Stops listening on the EPG channel and frees all stored information.
+ * @return 0 on success.
+ */
+int EPGDBaseDeInit(void);
+
+/**
+ * Stops the EPG database being updated until EPGDBaseTransactionCommit() is
+ * called, so that a consistent view can be read using several queries.
+ * Transactions may be nested.
+ */
+void EPGDBaseTransactionStart(void);
+
+/**
+ * Ends a transaction started with EPGDBaseTransactionStart().
+ */
+void EPGDBaseTransactionCommit(void);
+
+/**
+ * Retrieve the number of events stored for all services.
+ * @return The number of events.
+ */
+int EPGDBaseEventCount(void);
+
+/**
+ * Retrieve an enumerator for all the events stored for a service, in start
+ * time order.
+ * @param serviceRef The service to retrieve the events for.
+ * @return An enumerator to pass to EPGDBaseEventGetNext() or NULL if no events
+ *         are stored for the service.
+ */
+EPGDBaseEnumerator_t EPGDBaseEventEnumeratorGetService(EPGServiceRef_t *serviceRef);
+
+/**
+ * Retrieve an enumerator for the events on a service that are showing at any
+ * point between the 2 times specified, in start time order.
+ * @param serviceRef The service to retrieve the events for.
+ * @param from Start of the time range.
+ * @param to End of the time range (exclusive).
+ * @return An enumerator to pass to EPGDBaseEventGetNext() or NULL if no events
+ *         are stored for the service.
+ */
+EPGDBaseEnumerator_t EPGDBaseEventEnumeratorGetRange(EPGServiceRef_t *serviceRef, time_t from, time_t to);
+
+/**
+ * Retrieve an enumerator for the events on a service that have been added or
+ * had their times, details or ratings changed at or after the specified time,
+ * in start time order.
+ * @param serviceRef The service to retrieve the events for.
+ * @param since Time the events must have changed at or after.
+ * @return An enumerator to pass to EPGDBaseEventGetNext() or NULL if no events
+ *         are stored for the service.
+ */
+EPGDBaseEnumerator_t EPGDBaseEventEnumeratorGetChanged(EPGServiceRef_t *serviceRef, time_t since);
+
+/**
+ * Retrieve the next event from an enumerator.
+ * @param enumerator The enumerator to retrieve the event from.
+ * @return An EPGEvent_t object (release with ObjectRefDec) or NULL if there
+ *         are no more events.
+ */
+EPGEvent_t *EPGDBaseEventGetNext(EPGDBaseEnumerator_t enumerator);
+
+/**
+ * Retrieve the event showing on a service at the specified time.
+ * @param serviceRef The service to look up.
+ * @param when The time to find the event for.
+ * @return An EPGEvent_t object (release with ObjectRefDec) or NULL if no event
+ *         is stored for that time.
+ */
+EPGEvent_t *EPGDBaseEventGetAt(EPGServiceRef_t *serviceRef, time_t when);
+
+/**
+ * Retrieve the first event on a service starting after the specified time.
+ * @param serviceRef The service to look up.
+ * @param when The time the event must start after.
+ * @return An EPGEvent_t object (release with ObjectRefDec) or NULL if no later
+ *         event is stored.
+ */
+EPGEvent_t *EPGDBaseEventGetAfter(EPGServiceRef_t *serviceRef, time_t when);
+
+/**
+ * Retrieve an enumerator for the details of an event with the specified name.
+ * @param serviceRef The service the event is on.
+ * @param eventId The id of the event.
+ * @param name The name of the details to retrieve, ie EPG_EVENT_DETAIL_TITLE,
+ *             or NULL to retrieve all the details of the event.
+ * @return An enumerator to pass to EPGDBaseDetailGetNext() or NULL if the
+ *         event has no details with the name.
+ */
+EPGDBaseEnumerator_t EPGDBaseDetailGet(EPGServiceRef_t *serviceRef, unsigned int eventId, char *name);
+
+/**
+ * Retrieve the next detail from an enumerator.
+ * @param enumerator The enumerator to retrieve the detail from.
+ * @return An EPGEventDetail_t object (release with ObjectRefDec) or NULL if
+ *         there are no more details.
+ */
+EPGEventDetail_t *EPGDBaseDetailGetNext(EPGDBaseEnumerator_t enumerator);
+
+/**
+ * Retrieve an enumerator for the ratings of an event.
+ * @param serviceRef The service the event is on.
+ * @param eventId The id of the event.
+ * @return An enumerator to pass to EPGDBaseRatingGetNext() or NULL if the
+ *         event has no ratings.
+ */
+EPGDBaseEnumerator_t EPGDBaseRatingGet(EPGServiceRef_t *serviceRef, unsigned int eventId);
+
+/**
+ * Retrieve the next rating from an enumerator.
+ * @param enumerator The enumerator to retrieve the rating from.
+ * @return An EPGEventRating_t object (release with ObjectRefDec) or NULL if
+ *         there are no more ratings.
+ */
+EPGEventRating_t *EPGDBaseRatingGetNext(EPGDBaseEnumerator_t enumerator);
+
+/**
+ * Free an enumerator and any objects it has not returned.
+ * @param enumerator The enumerator to free, may be NULL.
+ */
+void EPGDBaseEnumeratorDestroy(EPGDBaseEnumerator_t enumerator);
+
+/**@}*/
+#endif
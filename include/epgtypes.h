@@ -69,6 +69,7 @@ typedef struct EPGEvent_s
     struct tm    startTime;     /**< Start time of the event.*/
     struct tm    endTime;       /**< Finish time of the event. */
     bool         ca;            /**< Whether the event is encrypted. */
+    unsigned int eventId;       /**< Id of the event on its service. */
 }EPGEvent_t;
 
 /**
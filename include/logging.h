@@ -24,6 +24,7 @@ Logging levels and functions.
 #define _LOGGING_H
 #include <stdarg.h>
 #include <pthread.h>
+#include "config.h"
 #include "types.h"
 
 /**
@@ -57,6 +58,41 @@ Logging levels and functions.
  */
 #define LOG_DIARRHEA 10
 
+/**
+ * Highest logging level compiled in, messages logged at a higher level are
+ * removed at compile time. Set using ./configure --with-log-level=LEVEL, by
+ * default all levels are compiled in.
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_DIARRHEA
+#endif
+
+/**
+ * @internal
+ * Current logging level, use LogLevelGet()/LogLevelSet() rather than accessing
+ * this directly.
+ */
+extern int logVerbosity;
+
+/**
+ * @internal
+ * TRUE if levels have been loaded for specific modules by LogLoadModuleLevels().
+ */
+extern bool logModuleLevelsSet;
+
+/**
+ * Determine if text logged by a module at the specified level will be output.
+ * Only the current level is checked inline, the level for the module is only
+ * looked up if module levels have been loaded.
+ * @param _level The level to check.
+ * @param _module The module doing the logging.
+ * @return TRUE if the text will be output, FALSE otherwise.
+ */
+#define LogModuleIsEnabled(_level, _module) \
+    (((_level) == LOG_ERROR) || \
+     (((_level) <= LOG_LEVEL_MAX) && ((_level) <= logVerbosity) && \
+      (!logModuleLevelsSet || LogModuleLevelIsEnabled((_level), (_module)))))
+
 /**
  * @internal 
  * Initialises logging, by first attempting to create the log file in /var/log, 
@@ -84,6 +120,24 @@ int LoggingInitFile(char *filename, int logLevel);
  */
 void LoggingRedirectStdErrStdOut(void);
 
+/**
+ * @internal
+ * Start writing the log from a background thread. Once started messages are
+ * formatted in to a buffer owned by the logging thread and written to the log
+ * file in batches by the background thread, if a thread's buffer is full its
+ * messages are dropped and a count of dropped messages is written to the log.
+ * Must be called after any fork() as the background thread will not survive it.
+ * @return 0 on success.
+ */
+int LoggingAsyncStart(void);
+
+/**
+ * Retrieve the number of log messages dropped because the logging thread's
+ * buffer was full when logging asynchronously.
+ * @return The number of messages dropped.
+ */
+unsigned long LogDroppedCount(void);
+
 /**
  * @internal
  * Deinitialise logging.
@@ -119,6 +173,16 @@ void LogLevelDec(void);
  */
 bool LogLevelIsEnabled(int level);
 
+/**
+ * @internal
+ * Determine if the specified level is enabled for a module, taking into account
+ * any levels loaded by LogLoadModuleLevels(). Use LogModuleIsEnabled() instead.
+ * @param level The level to check.
+ * @param module The module doing the logging.
+ * @return TRUE if the level is enabled, FALSE otherwise.
+ */
+bool LogModuleLevelIsEnabled(int level, const char *module);
+
 /**
  * Load module/level settings so that levels can be set for specific modules.
  * @param path Path to file to load.
@@ -147,4 +211,20 @@ void LogUnregisterThread(pthread_t thread);
  * @param format String in printf format to output.
  */
 extern void LogModule(int level, const char *module, char *format, ...);
+
+#ifdef HAVE_VARIADIC_MACROS
+/*
+ * Check the level before calling LogModule so that disabled messages cost a
+ * compare and their arguments are not evaluated, and messages above
+ * LOG_LEVEL_MAX are removed completely.
+ */
+#define LogModule(_level, _module, ...) \
+    do \
+    { \
+        if (LogModuleIsEnabled((_level), (_module))) \
+        { \
+            (LogModule)((_level), (_module), __VA_ARGS__); \
+        } \
+    }while(0)
+#endif
 #endif
@@ -36,6 +36,20 @@ Thread safe message queue.
  */
 typedef struct MessageQ_s *MessageQ_t;
 
+/**
+ * Statistics for a message queue, see MessageQStatsGet().
+ */
+typedef struct MessageQStats_s
+{
+    unsigned long sent;           /**< Number of messages sent to the queue. */
+    unsigned long received;       /**< Number of messages received from the queue. */
+    unsigned long overflowed;     /**< Number of messages sent while the queue was full. */
+    int depth;                    /**< Number of messages currently waiting. */
+    int maxDepth;                 /**< Largest number of messages that have been waiting. */
+    unsigned long averageLatency; /**< Average time in microseconds messages waited in the queue. */
+    unsigned long maxLatency;     /**< Longest time in microseconds a message waited in the queue. */
+}MessageQStats_t;
+
 /**
  * Creates a new double linked list.
  * @return A new MessageQ_t instance or NULL if there is not enough memory.
@@ -75,6 +89,18 @@ int MessageQAvailable(MessageQ_t msgQ);
  */
 void *MessageQReceive(MessageQ_t msgQ);
 
+/**
+ * Receive all the messages waiting in the queue (up to maxMsgs), waiting for at
+ * least one to arrive if the queue is empty. Each message should be unref'ed
+ * once finished with via ObjectRefDec.
+ * If the quit flag is set on the message queue 0 will be returned.
+ * @param msgQ The queue to receive the messages from.
+ * @param msgs Array to store the messages in.
+ * @param maxMsgs The maximum number of messages to store in msgs.
+ * @return The number of messages received or 0 if quit is set.
+ */
+int MessageQReceiveMany(MessageQ_t msgQ, void **msgs, int maxMsgs);
+
 /**
  * Receive a message from the queue waiting for upto timeout milliseconds. 
  * The return object should be unref'ed once finished with via ObjectRefDec.
@@ -107,6 +133,13 @@ void MessageQResetQuit(MessageQ_t msgQ);
  */
 bool MessageQIsQuitSet(MessageQ_t msgQ);
 
+/**
+ * Retrieve the statistics for the specified message queue.
+ * @param msgQ The message queue to retrieve the statistics of.
+ * @param stats Structure to fill in.
+ */
+void MessageQStatsGet(MessageQ_t msgQ, MessageQStats_t *stats);
+
 /** @} */
 #endif
 
@@ -51,6 +51,28 @@ typedef struct ObjectCollection_s{
  */
 typedef void (*ObjectDestructor_t)(void *ptr);
 
+/**
+ * Handle to a registered class, see ObjectClassGet().
+ */
+typedef struct Class_s *ObjectClass_t;
+
+/**
+ * Type for a function called with a class handle, see ObjectClassForEach().
+ */
+typedef void (*ObjectClassCallback_t)(ObjectClass_t clazz);
+
+/**
+ * Statistics for the pool objects of a class are allocated from.
+ */
+typedef struct ObjectPoolStats_s
+{
+    unsigned int blockSize;         /**< Size of each block in the pool. */
+    unsigned int nrofBlocks;        /**< Number of blocks in the pool. */
+    unsigned int nrofFreeBlocks;    /**< Number of blocks not currently in use. */
+    unsigned long long hits;        /**< Number of allocations satisfied from free blocks. */
+    unsigned long long misses;      /**< Number of allocations that required the pool to grow. */
+}ObjectPoolStats_t;
+
 /**
  * Initialise object memory system.
  * @returns 0 on success.
@@ -99,22 +121,77 @@ int ObjectRegisterCollection(char *name, unsigned entrysize,  ObjectDestructor_t
  */
 #define ObjectRegisterTypeDestructor(_type, _destructor) ObjectRegisterClass(TOSTRING(_type), sizeof(_type), _destructor)
 
+/**
+ * Retrieve the handle of a registered class.
+ * @param classname Name of the class.
+ * @return The handle of the class or NULL if the class has not been registered.
+ */
+ObjectClass_t ObjectClassGet(char *classname);
+
+/**
+ * Retrieve the name of a class.
+ * @param clazz Handle of the class.
+ * @return The name of the class.
+ */
+char *ObjectClassName(ObjectClass_t clazz);
+
+/**
+ * Call the specified function for every registered class.
+ * @param callback Function to call with the handle of each class.
+ */
+void ObjectClassForEach(ObjectClassCallback_t callback);
+
+/**
+ * Set the function to call whenever a new class is registered.
+ * @param callback Function to call with the handle of the new class or NULL.
+ */
+void ObjectClassRegisteredCallbackSet(ObjectClassCallback_t callback);
+
+/**
+ * Retrieve the statistics for the pool objects of a class are allocated from.
+ * Only classes (not collections) of a small enough size are allocated from pools.
+ * @param clazz Handle of the class.
+ * @param stats Location to store the statistics.
+ * @return TRUE if the class is allocated from a pool, FALSE otherwise.
+ */
+bool ObjectClassPoolStatsGet(ObjectClass_t clazz, ObjectPoolStats_t *stats);
+
 /**
  * Create a new object of class \<classname\>. The initial reference count for the
  * returned object will be 1.
+ * The handle of the class is looked up the first time each use of this macro
+ * is executed, so _classname must be constant.
  * @param _classname Class of object to create.
  * @return A pointer to the new object or NULL.
  */
-#define ObjectCreate(_classname) ObjectCreateImpl(_classname, __FILE__, __LINE__)
+#define ObjectCreate(_classname) \
+    ({ \
+        static ObjectClass_t _objectClass = NULL; \
+        if (_objectClass == NULL) \
+        { \
+            _objectClass = ObjectClassGet(_classname); \
+        } \
+        ObjectCreateClassImpl(_objectClass, _classname, __FILE__, __LINE__); \
+    })
 
 /**
  * Create a new collection of class \<classname\>. The initial reference count for the
  * returned object will be 1.
+ * The handle of the class is looked up the first time each use of this macro
+ * is executed, so _classname must be constant.
  * @param _classname Class of object to create.
  * @param _entries The number of entries in the collection.
  * @return A pointer to the new object or NULL.
  */
-#define ObjectCollectionCreate(_classname, _entries) ObjectCollectionCreateImpl(_classname, _entries,__FILE__, __LINE__)
+#define ObjectCollectionCreate(_classname, _entries) \
+    ({ \
+        static ObjectClass_t _objectClass = NULL; \
+        if (_objectClass == NULL) \
+        { \
+            _objectClass = ObjectClassGet(_classname); \
+        } \
+        ObjectCollectionCreateClassImpl(_objectClass, _classname, _entries, __FILE__, __LINE__); \
+    })
 
 /**
  * Create a new object of class \<classname\>. The initial reference count for the
@@ -128,6 +205,20 @@ int ObjectRegisterCollection(char *name, unsigned entrysize,  ObjectDestructor_t
  * @return A pointer to the new object or NULL.
  */
 void *ObjectCreateImpl(char *classname, char *file, int line);
+
+/**
+ * Create a new object of the specified class. The initial reference count for
+ * the returned object will be 1.
+ *
+ * @note This function should not be used instead the macro ObjectCreate should be used.
+ *
+ * @param clazz Handle of the class of object to create.
+ * @param classname Name of the class of object to create.
+ * @param file The file this function is being called from.
+ * @param line The line this function is being called from.
+ * @return A pointer to the new object or NULL.
+ */
+void *ObjectCreateClassImpl(ObjectClass_t clazz, char *classname, char *file, int line);
  
 /**
  * Helper macro to create a new object of the specfied type.
@@ -149,6 +240,21 @@ void *ObjectCreateImpl(char *classname, char *file, int line);
  */
 ObjectCollection_t *ObjectCollectionCreateImpl(char *classname, unsigned int entries, char *file, int line);
 
+/**
+ * Create a new collection of the specified class. The initial reference count
+ * for the returned object will be 1.
+ *
+ * @note This function should not be used instead the macro ObjectCollectionCreate should be used.
+ *
+ * @param clazz Handle of the class of collection to create.
+ * @param classname Name of the class of collection to create.
+ * @param entries The number of entries the collection should contain.
+ * @param file The file this function is being called from.
+ * @param line The line this function is being called from.
+ * @return A pointer to the new object or NULL.
+ */
+ObjectCollection_t *ObjectCollectionCreateClassImpl(ObjectClass_t clazz, char *classname, unsigned int entries, char *file, int line);
+
 
 /**
  * Increment the reference count for the specified object.
@@ -191,8 +297,12 @@ int ObjectRefCount(void *ptr);
 
 /**
  * Queries the supplied pointer to determine if it is an object instance.
+ * This can only be determined when built with OBJECT_TRACK or OBJECT_CHECK
+ * defined, otherwise FALSE is always returned.
  * @param ptr Pointer to check to see if it is an object pointer.
  * @return True if the pointer is an object pointer, false otherwise.
+ * @deprecated Default builds no longer track objects, so this cannot be
+ * answered without OBJECT_TRACK or OBJECT_CHECK.
  */
 bool ObjectIsObject(void *ptr);
 
@@ -91,6 +91,25 @@ int ProgramInfoSet(Service_t *service, ProgramInfo_t *info);
 ProgramInfo_t *ProgramInfoGet(Service_t *service);
 
 
+/**
+ * Callback used by ProgramInfoGetForMultiplex() for each service found.
+ * @param userArg The user argument passed to ProgramInfoGetForMultiplex().
+ * @param service The service, the callee takes ownership of the reference.
+ * @param info The ProgramInfo for the service or NULL if it has no PIDs, the
+ *             callee takes ownership of the reference.
+ */
+typedef void (*ProgramInfoServiceCallback_t)(void *userArg, Service_t *service, ProgramInfo_t *info);
+
+/**
+ * Retrieve all the services on a multiplex and their ProgramInfo using a single
+ * query, rather than a query per service.
+ * @param multiplex The multiplex to retrieve the services of.
+ * @param callback Function to call with each service and its ProgramInfo.
+ * @param userArg Argument to pass to the callback.
+ * @return 0 on success otherwise an sqlite3 error code.
+ */
+int ProgramInfoGetForMultiplex(Multiplex_t *multiplex, ProgramInfoServiceCallback_t callback, void *userArg);
+
 /**
  * Remove all pids for the specified service.
  * @param service The service to remove pids from.
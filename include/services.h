@@ -317,6 +317,16 @@ void ServiceEnumeratorDestroy(ServiceEnumerator_t enumerator);
  */
 Service_t *ServiceGetNext(ServiceEnumerator_t enumerator);
 
+/**
+ * Create a service from the current row of an enumerator without moving on to
+ * the next row. This allows queries that select SERVICE_FIELDS as their first
+ * columns, followed by other information, to create the service objects.
+ * The returned service should be released with ServiceRefDec.
+ * @param enumerator The enumerator (sqlite3 statement) positioned on a row.
+ * @return A Service_t structure or NULL if one could not be allocated.
+ */
+Service_t *ServiceGetCurrent(ServiceEnumerator_t enumerator);
+
 #define SERVICE_ID_STRING_LENGTH (4 + 1 + 4 + 1 + 4 + 1)
 /**
  * Retreive a string containing the NetID.TSID.ServiceId.
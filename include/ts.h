@@ -25,6 +25,7 @@ Transport stream processing and filter management.
 
 #include <stdint.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <ev.h>
 
 #include "dvbpsi/dvbpsi.h"
@@ -150,6 +151,51 @@ TSPacket_t;
 #define TSPACKET_GETADAPTATION_LEN(packet) \
     ((packet).payload[0])
 
+/**
+ * Frequency of the Program Clock Reference (27MHz).
+ */
+#define TSPACKET_PCR_HZ 27000000ULL
+
+/**
+ * Value at which the Program Clock Reference wraps (2^33 * 300).
+ */
+#define TSPACKET_PCR_WRAP ((1ULL << 33) * 300)
+
+/**
+ * Convert a Program Clock Reference duration to nanoseconds. Whole seconds
+ * and the remainder are converted separately as multiplying by 10^9 first
+ * overflows 64bits after about 683 seconds.
+ * @param ticks Duration in 27MHz units.
+ * @return The duration in nanoseconds as a 64bit unsigned integer.
+ */
+#define TSPACKET_PCR_TO_NS(ticks) \
+    ((((uint64_t)(ticks) / TSPACKET_PCR_HZ) * 1000000000ULL) + \
+     ((((uint64_t)(ticks) % TSPACKET_PCR_HZ) * 1000000000ULL) / TSPACKET_PCR_HZ))
+
+/**
+ * Retrieve whether the packet carries a Program Clock Reference.
+ * @param packet The packet to check.
+ * @return True if the adaptation field contains a PCR.
+ */
+#define TSPACKET_HASPCR(packet) \
+    ((TSPACKET_GETADAPTATION(packet) & 0x2) && \
+     (TSPACKET_GETADAPTATION_LEN(packet) >= 7) && \
+     ((packet).payload[1] & 0x10))
+
+/**
+ * Retrieve the Program Clock Reference from a packet, only valid if
+ * TSPACKET_HASPCR() is true.
+ * @param packet The packet to extract the PCR from.
+ * @return The PCR in 27MHz units as a 64bit unsigned integer.
+ */
+#define TSPACKET_GETPCR(packet) \
+    (((((uint64_t)(packet).payload[2] << 25) | \
+        ((uint64_t)(packet).payload[3] << 17) | \
+        ((uint64_t)(packet).payload[4] << 9) | \
+        ((uint64_t)(packet).payload[5] << 1) | \
+        ((uint64_t)(packet).payload[6] >> 7)) * 300) + \
+     ((((packet).payload[6] & 0x1) << 8) | (packet).payload[7]))
+
 
 /**@}*/
 
@@ -160,9 +206,41 @@ TSPacket_t;
  * @{
  */
  /**
- * Maximum number of packets to read from the DVB adapter in one go,
+ * Default number of packets the ingest buffer can hold, this is the maximum
+ * number of packets that will be read from the DVB adapter in one wakeup.
  */
-#define TSREADER_MAX_PACKETS 20
+#define TSREADER_DEFAULT_BUFFER_PACKETS 4096
+
+/**
+ * Minimum number of packets the ingest buffer can be set to.
+ */
+#define TSREADER_MIN_BUFFER_PACKETS 20
+
+/**
+ * Maximum number of packets the ingest buffer can be set to.
+ */
+#define TSREADER_MAX_BUFFER_PACKETS 65536
+
+/**
+ * Maximum number of worker threads packet filters can be dispatched on.
+ */
+#define TSREADER_MAX_WORKERS 16
+
+/**
+ * Number of packet batches that can be waiting for a worker thread before
+ * further batches are dropped.
+ */
+#define TSREADER_WORKER_QUEUE_SIZE 256
+
+/**
+ * Filter group affinity, assign the group to a worker thread automatically.
+ */
+#define TSFILTERGROUP_AFFINITY_AUTO  -1
+
+/**
+ * Filter group affinity, always run the group's filters on the input thread.
+ */
+#define TSFILTERGROUP_AFFINITY_INPUT -2
 
 typedef enum TSFilterEventType_e
 {
@@ -188,6 +266,30 @@ typedef struct TSPacketFilter_t
     struct TSPacketFilter_t *flNext;
 }TSPacketFilter_t;
 
+/**
+ * Entry in a PID dispatch table, a flattened copy of the details from a
+ * TSPacketFilter_t required to deliver a packet.
+ */
+typedef struct TSPacketFilterDispatch_t
+{
+    TSPacketFilterCallback_t callback;
+    void *userArg;
+    struct TSFilterGroup_t *group;
+    TSPacketFilter_t *filter;
+}TSPacketFilterDispatch_t;
+
+/**
+ * Array of packet filters for a single PID. The table is rebuilt and replaced
+ * whenever the filters for the PID change, so it is never modified while
+ * packets are being dispatched using it.
+ */
+typedef struct TSPIDDispatchTable_t
+{
+    int nrofFilters;
+    struct TSPIDDispatchTable_t *nextRetired;  /**< Next table waiting to be freed once dispatching has finished. */
+    TSPacketFilterDispatch_t filters[];
+}TSPIDDispatchTable_t;
+
 typedef struct TSSectionFilter_t
 {
     uint16_t pid;
@@ -227,12 +329,51 @@ typedef struct TSFilterGroup_t
     volatile unsigned long long packetsProcessed;
     volatile unsigned long long sectionsProcessed;
 
+    int affinity;                          /**< Worker thread the group's packet filters should run on (or TSFILTERGROUP_AFFINITY_*). */
+    unsigned int index;                    /**< Creation order of the group, used to automatically assign a worker thread. */
 }TSFilterGroup_t;
 
 #define TSREADER_PID_ALL 8192
 #define TSREADER_NROF_FILTERS 8193
 #define TSREADER_PIDFILTER_BUCKETS 8
 
+/**
+ * Reference counted batch of packets read from the DVR or supplied directly by
+ * the adapter.
+ * References are held by the TS Reader, by worker threads still to process the
+ * batch and by delivery methods that are sending packets from the batch by
+ * reference rather than copying them.
+ */
+typedef struct TSPacketBatch_t
+{
+    volatile int refCount;              /**< Number of references to the batch. */
+    int nrofPackets;
+    TSPacket_t *packets;                /**< Packets, either following this structure or in memory owned by owner. */
+    void *owner;                        /**< Object that owns the memory packets points to or NULL. */
+}TSPacketBatch_t;
+
+/**
+ * Worker thread used to run packet filters when the TSReader is in pipeline mode.
+ * Batches are passed from the input thread to the worker using a single
+ * producer/single consumer ring.
+ */
+typedef struct TSReaderWorker_t
+{
+    struct TSReader_t *reader;
+    int index;
+    pthread_t thread;
+    volatile bool quit;
+    pthread_mutex_t mutex;              /**< Held by the worker while processing a batch. */
+    sem_t batchesAvailable;             /**< Number of batches in the queue. */
+    volatile unsigned int head;         /**< Next slot to fill, only modified by the input thread. */
+    volatile unsigned int tail;         /**< Next slot to process, only modified by the worker thread. */
+    TSPacketBatch_t *queue[TSREADER_WORKER_QUEUE_SIZE];
+    TSPIDDispatchTable_t *dispatchTables[TSREADER_NROF_FILTERS]; /**< Packet filters to run on this worker. */
+
+    volatile unsigned long long batchesProcessed;
+    volatile unsigned long long batchesDropped;
+}TSReaderWorker_t;
+
 /**
  * Structure describing a Transport Stream Filter instance.
  */
@@ -254,6 +395,13 @@ typedef struct TSReader_t
     uint16_t currentlyProcessingPid;
 
     TSPacketFilter_t *packetFilters[TSREADER_NROF_FILTERS];
+    TSPIDDispatchTable_t *dispatchTables[TSREADER_NROF_FILTERS]; /**< Flattened packetFilters lists used when dispatching packets. */
+    TSPIDDispatchTable_t *retiredTables;    /**< Tables replaced while dispatching, freed once dispatching has finished. */
+    TSPacketFilter_t *retiredFilters;       /**< Filters removed while dispatching, freed once dispatching has finished. */
+
+    int nrofWorkers;                    /**< Number of worker threads, 0 if all filters are run on the input thread. */
+    TSReaderWorker_t *workers[TSREADER_MAX_WORKERS];
+    unsigned int nextGroupIndex;
 
     List_t *sectionFilters;             /**< List of section filters that are awaiting scheduling */
     List_t *activeSectionFilters;       /**< List of active section filters. */
@@ -264,7 +412,18 @@ typedef struct TSReader_t
     
     unsigned long long prevTotalPackets;
     ev_tstamp prevTime;
-    TSPacket_t buffer[TSREADER_MAX_PACKETS];
+
+    volatile unsigned long long totalWakeups; /**< Number of times the DVR has been read from. */
+    volatile unsigned long wakeupsPerSec;     /**< Approximate number of DVR wakeups per second. */
+    volatile unsigned int lastBatchPackets;   /**< Number of packets processed in the last wakeup. */
+    volatile unsigned int maxBatchPackets;    /**< Largest number of packets processed in one wakeup. */
+    unsigned long long prevTotalWakeups;
+
+    int requestedBufferPackets;         /**< Size (in packets) the ingest buffer should be resized to. */
+    unsigned int bufferPackets;         /**< Size (in packets) of the ingest buffer. */
+    unsigned int bufferBytesUsed;       /**< Number of bytes of a partial packet left at the start of the buffer. */
+    TSPacketBatch_t *buffer;            /**< Ingest buffer packets are read into from the DVR. */
+    volatile unsigned long long buffersReplaced; /**< Number of times the ingest buffer was still referenced after processing. */
 }
 TSReader_t;
 
@@ -287,6 +446,14 @@ typedef struct TSReaderStats_t
 {
     unsigned long long totalPackets; /**< Total number of packets processed by this instance. */
     unsigned long bitrate;           /**< Approximate bit rate of the transport stream being processed. */    
+    unsigned long long totalWakeups; /**< Total number of times the DVR has been read from. */
+    unsigned long wakeupsPerSec;     /**< Approximate number of DVR wakeups per second. */
+    unsigned int lastBatchPackets;   /**< Number of packets processed in the last wakeup. */
+    unsigned int maxBatchPackets;    /**< Largest number of packets processed in one wakeup. */
+    unsigned int bufferPackets;      /**< Size (in packets) of the ingest buffer. */
+    unsigned long long buffersReplaced; /**< Number of times the ingest buffer was still referenced by delivery methods after processing. */
+    int nrofWorkers;                 /**< Number of worker threads in use. */
+    unsigned long long batchesDropped; /**< Total number of batches dropped as worker queues were full. */
     TSFilterGroupTypeStats_t *types;
 }TSReaderStats_t;
 
@@ -334,16 +501,39 @@ void TSReaderZeroStats(TSReader_t *reader);
 void TSReaderMultiplexChanged(TSReader_t *reader, Multiplex_t *newmultiplex);
 
 /**
- * Lock access to the TSReader_t structure to this thread.
+ * Set the number of worker threads used to run packet filters. When set to 0
+ * all filters are run on the input thread as packets are read from the DVR,
+ * otherwise packets are passed in batches to the worker threads and each filter
+ * group's packet filters are run on the worker it has an affinity for.
+ * Section filters are always run on the input thread.
+ * @note Filters running on a worker thread must not add or remove filters or
+ * lock the reader from their callbacks.
+ * This function must not be called while holding the reader lock.
+ * @param reader The instance to change.
+ * @param nrofWorkers Number of worker threads (0 - TSREADER_MAX_WORKERS).
+ * @return 0 on success, -1 on failure.
+ */
+int TSReaderWorkersSet(TSReader_t *reader, int nrofWorkers);
+
+/**
+ * Retrieve the number of worker threads used to run packet filters.
+ * @param reader The instance to query.
+ * @return The number of worker threads.
+ */
+int TSReaderWorkersGet(TSReader_t *reader);
+
+/**
+ * Lock access to the TSReader_t structure to this thread, this also
+ * prevents any worker threads from processing packets.
  * @param reader The instance to lock access to.
  */
-#define TSReaderLock(reader)   pthread_mutex_lock(&(reader)->mutex)
+void TSReaderLock(TSReader_t *reader);
 
 /**
  * Unlock access to the TSReader_t structure.
  * @param reader The instance to unlock access to.
  */
-#define TSReaderUnLock(reader) pthread_mutex_unlock(&(reader)->mutex)
+void TSReaderUnLock(TSReader_t *reader);
 
 TSFilterGroup_t* TSReaderCreateFilterGroup(TSReader_t *reader, const char *name, const char *type, TSFilterGroupEventCallback_t callback, void *userArg );
 TSFilterGroup_t* TSReaderFindFilterGroup(TSReader_t *reader, const char *name, const char *type);
@@ -354,5 +544,65 @@ void TSFilterGroupRemoveSectionFilter(TSFilterGroup_t *group, uint16_t pid);
 bool TSFilterGroupAddPacketFilter(TSFilterGroup_t *group, uint16_t pid, TSPacketFilterCallback_t callback, void *userArg);
 void TSFilterGroupRemovePacketFilter(TSFilterGroup_t *group, uint16_t pid);
 
+/**
+ * Set the worker thread the packet filters of the group should be run on.
+ * @param group The group to change.
+ * @param affinity Index of the worker thread (modulo the number of workers),
+ *                 TSFILTERGROUP_AFFINITY_AUTO or TSFILTERGROUP_AFFINITY_INPUT.
+ */
+void TSFilterGroupAffinitySet(TSFilterGroup_t *group, int affinity);
+
+/**
+ * Retrieve the worker thread affinity of the group.
+ * @param group The group to query.
+ * @return The affinity of the group.
+ */
+int TSFilterGroupAffinityGet(TSFilterGroup_t *group);
+
+/**
+ * Retrieve the batch a packet passed to a packet filter callback belongs to.
+ * The batch stays valid for as long as a reference is held on it, allowing the
+ * packet to be used after the callback has returned without copying it.
+ * Only valid when called from a packet filter callback.
+ * @param packet The packet passed to the packet filter callback.
+ * @return The batch containing the packet or NULL if the packet is not part of
+ *         a batch (ie it is a copy made by the filter).
+ */
+TSPacketBatch_t *TSPacketBatchGetCurrent(TSPacket_t *packet);
+
+/**
+ * Take a reference to a batch of packets.
+ * @param batch The batch to reference.
+ */
+void TSPacketBatchRef(TSPacketBatch_t *batch);
+
+/**
+ * Release a reference to a batch of packets, the batch is freed once the last
+ * reference is released.
+ * @param batch The batch to release.
+ */
+void TSPacketBatchRelease(TSPacketBatch_t *batch);
+
+/**
+ * Create a batch describing packets held in memory owned by another object
+ * (ie a memory mapped file), the packets are not copied.
+ * A reference is held on the owner until the batch is freed.
+ * @param packets The packets to include in the batch.
+ * @param nrofPackets The number of packets.
+ * @param owner Object that owns the memory the packets are stored in.
+ * @return A new batch with a reference count of 1 or NULL.
+ */
+TSPacketBatch_t *TSPacketBatchCreateExternal(TSPacket_t *packets, int nrofPackets, void *owner);
+
+/**
+ * Process a batch of packets supplied directly by the adapter rather than read
+ * from the DVR device. The packets are processed exactly as if they had been
+ * read from the DVR. Must be called from the input thread.
+ * @param reader The TSReader to process the packets.
+ * @param batch The packets to process, a reference is taken by anything that
+ *              needs the packets after this function returns.
+ */
+void TSReaderProcessBatch(TSReader_t *reader, TSPacketBatch_t *batch);
+
 /**@}*/
 #endif
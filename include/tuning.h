@@ -43,6 +43,7 @@ Frontend Tuner control.
  * 
  * \li \ref servicechanged Fired when the primary service is changed.
  * \li \ref multiplexchanged Fired when the current multiplex changes.
+ * \li \ref cacheloaded Fired when the services of a new multiplex have been cached.
  *
  * \subsection servicechanged Tuning.ServiceChanged
  * Fired when the primary service filter service is changed. \n
@@ -53,8 +54,25 @@ Frontend Tuner control.
  * Fired when the tuned multiplex changes. \n
  * \par 
  * \c payload = The new Multiplex_t.
+ *
+ * \subsection cacheloaded Tuning.CacheLoaded
+ * Fired when the services and PIDs of the multiplex being tuned to have been
+ * loaded in to the cache. \n
+ * \par
+ * \c payload = A TuningCacheLoaded_t containing the multiplex, the number of
+ * services loaded and the time taken.
  * @{
  */
+
+/**
+ * Payload of the Tuning.CacheLoaded event.
+ */
+typedef struct TuningCacheLoaded_s
+{
+    Multiplex_t *multiplex;      /**< Multiplex the services were loaded for. */
+    int nrofServices;            /**< Number of services loaded. */
+    unsigned long loadTime;      /**< Time taken to load the cache in microseconds. */
+}TuningCacheLoaded_t;
  
 /**
  * Initialise the Tuning module for use.
@@ -24,6 +24,8 @@ Caches service and PID information from the database for the current multiplex.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
 #include "ts.h"
 #include "multiplexes.h"
@@ -33,8 +35,8 @@ Caches service and PID information from the database for the current multiplex.
 #include "cache.h"
 #include "dbase.h"
 #include "main.h"
-#include "deferredproc.h"
 #include "events.h"
+#include "properties.h"
 
 /*******************************************************************************
 * Defines                                                                      *
@@ -42,6 +44,15 @@ Caches service and PID information from the database for the current multiplex.
 
 #define SERVICES_MAX (256)
 
+/* Size of the id and name indexes, must be a power of 2 and kept well above
+ * SERVICES_MAX so probe sequences stay short. */
+#define SERVICE_INDEX_SIZE  (SERVICES_MAX * 4)
+#define SERVICE_INDEX_MASK  (SERVICE_INDEX_SIZE - 1)
+#define SERVICE_INDEX_EMPTY (-1)
+
+#define MAX_WRITEBEHIND_BATCH 1000
+#define MAX_WRITEBEHIND_DELAY 60000 /* ms */
+
 /*******************************************************************************
 * Typedefs                                                                     *
 *******************************************************************************/
@@ -159,11 +170,34 @@ typedef struct CacheUpdateMessage_s
     }details;
 }CacheUpdateMessage_t;
 
+typedef unsigned int (*CacheIndexHash_t)(Service_t *service);
+
 /*******************************************************************************
 * Prototypes                                                                   *
 *******************************************************************************/
 static void CacheServicesFree(void);
-static void CacheProcessUpdateMessage(void *ptr);
+static void CacheLoadService(void *userArg, Service_t *service, ProgramInfo_t *info);
+static int CacheServiceIndex(Service_t *service);
+static int CacheServiceIndexId(int id);
+static int CacheServiceIndexName(char *name);
+static unsigned int CacheHashId(int id);
+static unsigned int CacheHashName(char *name);
+static unsigned int CacheServiceHashId(Service_t *service);
+static unsigned int CacheServiceHashName(Service_t *service);
+static void CacheIndexAdd(short *index, unsigned int hash, int slot);
+static void CacheIndexRemove(short *index, CacheIndexHash_t hashFunc, int slot);
+static void CacheIndexesAdd(int slot);
+static void CacheIndexesRemove(int slot);
+static void CacheIndexesClear(void);
+static void CacheProcessUpdateMessage(CacheUpdateMessage_t *msg);
+static void CacheQueueUpdate(CacheUpdateMessage_t *msg);
+static bool CacheUpdateSupersedes(CacheUpdateMessage_t *msg, CacheUpdateMessage_t *pending);
+static Service_t *CacheUpdateMessageService(CacheUpdateMessage_t *msg);
+static void CacheFlushUpdates(void);
+static void *CacheWriteBehindThread(void *arg);
+static int CacheWriteBehindBatchSizeSet(void *userArg, PropertyValue_t *value);
+static int CacheWriteBehindMaxDelaySet(void *userArg, PropertyValue_t *value);
+static void CacheUpdateMessageFree(CacheUpdateMessage_t *msg);
 
 /*******************************************************************************
 * Global variables                                                             *
@@ -179,6 +213,35 @@ static enum CacheFlags cacheFlags[SERVICES_MAX];
 static Service_t*      cachedServices[SERVICES_MAX];
 static ProgramInfo_t*  cachedPIDs[SERVICES_MAX];
 
+/* Open addressed (linear probing) indexes of slots in cachedServices by service
+ * id and by name, updated whenever a service is added, renamed or removed.
+ * As all cached services are on the same multiplex the id index also serves
+ * lookups by network id, TS id and service id.
+ */
+static short serviceIdIndex[SERVICE_INDEX_SIZE];
+static short serviceNameIndex[SERVICE_INDEX_SIZE];
+
+/* Database updates are queued and committed by the write behind thread in
+ * batches of up to writeBehindBatchSize updates, or writeBehindMaxDelay ms
+ * after the first update in the batch was queued.
+ */
+static char propertyParent[] = "cache.writebehind";
+static pthread_t writeBehindThread;
+static pthread_mutex_t writeBehindMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t writeBehindCommitMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeBehindCond = PTHREAD_COND_INITIALIZER;
+static bool writeBehindQuit = FALSE;
+static bool writeBehindRunning = FALSE;
+static int writeBehindBatchSize = 64;
+static int writeBehindMaxDelay = 1000;
+static List_t *pendingUpdates;
+static struct timespec firstPendingTime;
+static int updatesPending = 0;
+static int updatesQueued = 0;
+static int updatesCoalesced = 0;
+static int updatesCommitted = 0;
+static int updateTransactions = 0;
+
 /*******************************************************************************
 * Global functions                                                             *
 *******************************************************************************/
@@ -191,17 +254,52 @@ int CacheInit()
     pthread_mutexattr_settype(&mutexAttr, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&cacheUpdateMutex, &mutexAttr);
     pthread_mutexattr_destroy(&mutexAttr);
-
+    CacheIndexesClear();
 
     eventSource = EventsRegisterSource("Cache");
     pidsUpdatedEvent = EventsRegisterEvent(eventSource, "PIDsUpdated", NULL);
     
     ObjectRegisterType(CacheUpdateMessage_t);
+
+    pendingUpdates = ListCreate();
+    writeBehindQuit = FALSE;
+    writeBehindRunning = pthread_create(&writeBehindThread, NULL, CacheWriteBehindThread, NULL) == 0;
+    if (!writeBehindRunning)
+    {
+        LogModule(LOG_ERROR, CACHE, "Failed to start write behind thread, updates will be committed immediately.\n");
+    }
+
+    PropertiesAddProperty(propertyParent, "batchsize", "Maximum number of updates committed to the database in one transaction.",
+        PropertyType_Int, &writeBehindBatchSize, PropertiesSimplePropertyGet, CacheWriteBehindBatchSizeSet);
+    PropertiesAddProperty(propertyParent, "maxdelay", "Maximum time in milliseconds an update is held before being committed.",
+        PropertyType_Int, &writeBehindMaxDelay, PropertiesSimplePropertyGet, CacheWriteBehindMaxDelaySet);
+    PropertiesAddSimpleProperty(propertyParent, "queued", "Number of updates queued.",
+        PropertyType_Int, &updatesQueued, SIMPLEPROPERTY_R);
+    PropertiesAddSimpleProperty(propertyParent, "coalesced", "Number of queued updates replaced by a later update to the same field.",
+        PropertyType_Int, &updatesCoalesced, SIMPLEPROPERTY_R);
+    PropertiesAddSimpleProperty(propertyParent, "committed", "Number of updates written to the database.",
+        PropertyType_Int, &updatesCommitted, SIMPLEPROPERTY_R);
+    PropertiesAddSimpleProperty(propertyParent, "transactions", "Number of transactions used to write the updates.",
+        PropertyType_Int, &updateTransactions, SIMPLEPROPERTY_R);
     return 0;
 }
 
 void CacheDeInit()
 {
+    PropertiesRemoveAllProperties(propertyParent);
+
+    if (writeBehindRunning)
+    {
+        pthread_mutex_lock(&writeBehindMutex);
+        writeBehindQuit = TRUE;
+        pthread_cond_signal(&writeBehindCond);
+        pthread_mutex_unlock(&writeBehindMutex);
+        pthread_join(writeBehindThread, NULL);
+        writeBehindRunning = FALSE;
+    }
+    CacheFlushUpdates();
+    ListFree(pendingUpdates, NULL);
+
     CacheServicesFree();
     pthread_mutex_destroy(&cacheUpdateMutex);
 }
@@ -209,37 +307,19 @@ void CacheDeInit()
 int CacheLoad(Multiplex_t *multiplex)
 {
     int result = 1;
-    List_t *list = NULL;
 
     pthread_mutex_lock(&cacheUpdateMutex);
+    /* Make sure the database is up to date before reading from it */
+    CacheFlushUpdates();
     LogModule(LOG_DEBUG, CACHE, "Freeing services\n");
 
     /* Free the services and PIDs from the previous multiplex */
     CacheServicesFree();
 
-    list = ServiceListForMultiplex(multiplex);
-    
-    LogModule(LOG_DEBUG, CACHE, "Loading %d services for %d\n", ListCount(list), multiplex->uid);
-    cachedServicesCount = ListCount(list);
-    if (ListCount(list) > 0)
-    {
-        ListIterator_t iterator;
-        int i = 0;
-        
-        for (ListIterator_Init(iterator, list); 
-             ListIterator_MoreEntries(iterator);
-             ListIterator_Next(iterator), i++)
-        {
-            cachedServices[i] = (Service_t*)ListIterator_Current(iterator);
-            LogModule(LOG_DEBUG,CACHE, "Loaded 0x%04x %s\n", cachedServices[i]->id, cachedServices[i]->name);
-            cachedPIDs[i] = ProgramInfoGet(cachedServices[i]);
-            cacheFlags[i] = CacheFlag_Clean;
-        }
-        /* Use ListFree with no destructor as we don't want to free the objects 
-         * only the list.
-         */
-        ListFree(list, NULL);
-    }
+    /* Load the services and their PIDs with a single query rather than a
+     * query per service. */
+    ProgramInfoGetForMultiplex(multiplex, CacheLoadService, NULL);
+    LogModule(LOG_DEBUG, CACHE, "Loaded %d services for %d\n", cachedServicesCount, multiplex->uid);
 
     MultiplexRefInc(multiplex);
     cachedServicesMultiplex = multiplex;
@@ -258,40 +338,56 @@ Multiplex_t *CacheMultiplexGet(void)
 Service_t *CacheServiceFind(char *name)
 {
     Service_t *result = NULL;
-    int netId;
-    int tsId;
-    int serviceId;
+    unsigned long ids[3];
+    char *ptr = name;
+    char *end;
+    int i;
 
     result = CacheServiceFindName(name);
     if (!result)
     {
-        if (sscanf(name,"%x.%x.%x", &netId, &tsId, &serviceId) == 3)
+        for (i = 0; i < 3; i ++)
         {
-            if ((cachedServicesMultiplex->networkId == netId) &&
-                (cachedServicesMultiplex->tsId== tsId))
+            ids[i] = strtoul(ptr, &end, 16);
+            if ((end == ptr) || (*end != ((i < 2) ? '.' : 0)))
             {
-                result = CacheServiceFindId(serviceId);
+                return NULL;
             }
+            ptr = end + 1;
         }
+        result = CacheServiceFindFQID(ids[0], ids[1], ids[2]);
     }
     return result;
 }
 
+Service_t *CacheServiceFindFQID(int netId, int tsId, int serviceId)
+{
+    Service_t *result = NULL;
+
+    pthread_mutex_lock(&cacheUpdateMutex);
+    if (cachedServicesMultiplex &&
+        (cachedServicesMultiplex->networkId == netId) &&
+        (cachedServicesMultiplex->tsId == tsId))
+    {
+        result = CacheServiceFindId(serviceId);
+    }
+    pthread_mutex_unlock(&cacheUpdateMutex);
+    return result;
+}
+
 Service_t *CacheServiceFindId(int id)
 {
     Service_t *result = NULL;
     int i;
 
-    for (i = 0; i < cachedServicesCount; i ++)
+    pthread_mutex_lock(&cacheUpdateMutex);
+    i = CacheServiceIndexId(id);
+    if (i != -1)
     {
-        if (cachedServices[i]->id == id)
-        {
-            result = cachedServices[i];
-            ServiceRefInc(result);
-            break;
-        }
+        result = cachedServices[i];
+        ServiceRefInc(result);
     }
-
+    pthread_mutex_unlock(&cacheUpdateMutex);
     return result;
 }
 
@@ -299,23 +395,16 @@ Service_t *CacheServiceFindName(char *name)
 {
     Service_t *result = NULL;
     int i;
-    LogModule(LOG_DEBUGV,CACHE, "Checking cached services for \"%s\"\n", name);
-    for (i = 0; i < cachedServicesCount; i ++)
-    {
-        LogModule(LOG_DEBUGV, CACHE, "cachedServices[%d]->name = %s\n", i, cachedServices[i]->name);
-        if (strcmp(cachedServices[i]->name, name) == 0)
-        {
-            result = cachedServices[i];
-            ServiceRefInc(result);
-            LogModule(LOG_DEBUGV, CACHE, "Found in cached services!\n");
-            break;
-        }
-    }
 
-    if (result == NULL)
+    pthread_mutex_lock(&cacheUpdateMutex);
+    i = CacheServiceIndexName(name);
+    if (i != -1)
     {
-        LogModule(LOG_DEBUGV, CACHE, "Not found in cached services\n");
+        result = cachedServices[i];
+        ServiceRefInc(result);
     }
+    pthread_mutex_unlock(&cacheUpdateMutex);
+    LogModule(LOG_DEBUGV, CACHE, "\"%s\" %sfound in cached services\n", name, result ? "" : "not ");
     return result;
 }
 
@@ -336,16 +425,13 @@ ProgramInfo_t *CacheProgramInfoGet(Service_t *service)
     ProgramInfo_t *result = NULL;
     int i;
     pthread_mutex_lock(&cacheUpdateMutex);
-    for (i = 0; i < cachedServicesCount; i ++)
+    i = CacheServiceIndex(service);
+    if (i != -1)
     {
-        if ((cachedServices[i]) && ServiceAreEqual(service, cachedServices[i]))
+        result = cachedPIDs[i];
+        if (result)
         {
-            result = cachedPIDs[i];
-            if (result)
-            {
-                ObjectRefInc(result);
-            }
-            break;
+            ObjectRefInc(result);
         }
     }
     pthread_mutex_unlock(&cacheUpdateMutex);
@@ -374,7 +460,7 @@ void CacheUpdateMultiplex(Multiplex_t *multiplex, int patversion, int tsid)
             ObjectRefInc(multiplex);
             msg->details.multiplexTSId.multiplex = multiplex;
             msg->details.multiplexTSId.tsId = tsid;
-            DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
+            CacheQueueUpdate(msg);
             ObjectRefDec(msg);
         }
     }
@@ -402,7 +488,7 @@ void CacheUpdateNetworkId(Multiplex_t *multiplex, int netid)
             ObjectRefInc(multiplex);
             msg->details.multiplexNetworkId.multiplex = multiplex;
             msg->details.multiplexNetworkId.networkId = netid;
-            DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
+            CacheQueueUpdate(msg);
             ObjectRefDec(msg);
         }
     }
@@ -416,22 +502,19 @@ void CacheUpdateServicePMTPID(Service_t *service, int pmtpid)
     int i;
     pthread_mutex_lock(&cacheUpdateMutex);
 
-    for (i = 0; i < cachedServicesCount; i ++)
+    i = CacheServiceIndex(service);
+    if (i != -1)
     {
-        if ((cachedServices[i]) && ServiceAreEqual(service, cachedServices[i]))
+        cachedServices[i]->pmtPID = pmtpid;
+        msg = ObjectCreateType(CacheUpdateMessage_t);
+        if (msg)
         {
-            cachedServices[i]->pmtPID = pmtpid;
-            msg = ObjectCreateType(CacheUpdateMessage_t);
-            if (msg)
-            {
-                msg->type = CacheUpdate_Service_PMT_PID;
-                ObjectRefInc(service);
-                msg->details.servicePMTPID.service = service;
-                msg->details.servicePMTPID.pmtPid = pmtpid;
-                DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
-                ObjectRefDec(msg);
-            }
-            break;
+            msg->type = CacheUpdate_Service_PMT_PID;
+            ObjectRefInc(service);
+            msg->details.servicePMTPID.service = service;
+            msg->details.servicePMTPID.pmtPid = pmtpid;
+            CacheQueueUpdate(msg);
+            ObjectRefDec(msg);
         }
     }
 
@@ -444,36 +527,38 @@ void CacheUpdateServiceName(Service_t *service, char *name)
     int i;
     pthread_mutex_lock(&cacheUpdateMutex);
 
-    for (i = 0; i < cachedServicesCount; i ++)
+    i = CacheServiceIndex(service);
+    if (i != -1)
     {
-        if ((cachedServices[i]) && ServiceAreEqual(service, cachedServices[i]))
+        if (cachedServices[i]->name)
+        {
+            CacheIndexRemove(serviceNameIndex, CacheServiceHashName, i);
+            free(cachedServices[i]->name);
+        }
+        if (name)
         {
+            cachedServices[i]->name = strdup(name);
             if (cachedServices[i]->name)
             {
-                free(cachedServices[i]->name);
+                CacheIndexAdd(serviceNameIndex, CacheHashName(name), i);
             }
+        }
+        else
+        {
+            cachedServices[i]->name = NULL;
+        }
+        msg = ObjectCreateType(CacheUpdateMessage_t);
+        if (msg)
+        {
+            msg->type = CacheUpdate_Service_Name;
+            ObjectRefInc(service);
+            msg->details.serviceName.service = service;
             if (name)
             {
-                cachedServices[i]->name = strdup(name);
-            }
-            else
-            {
-                cachedServices[i]->name = NULL;
-            }
-            msg = ObjectCreateType(CacheUpdateMessage_t);
-            if (msg)
-            {
-                msg->type = CacheUpdate_Service_Name;
-                ObjectRefInc(service);
-                msg->details.serviceName.service = service;
-                if (name)
-                {
-                    msg->details.serviceName.name = strdup(name);
-                }
-                DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
-                ObjectRefDec(msg);
+                msg->details.serviceName.name = strdup(name);
             }
-            break;
+            CacheQueueUpdate(msg);
+            ObjectRefDec(msg);
         }
     }
 
@@ -486,36 +571,33 @@ void CacheUpdateServiceProvider(Service_t *service, char *provider)
     int i;
     pthread_mutex_lock(&cacheUpdateMutex);
 
-    for (i = 0; i < cachedServicesCount; i ++)
+    i = CacheServiceIndex(service);
+    if (i != -1)
     {
-        if ((cachedServices[i]) && ServiceAreEqual(service, cachedServices[i]))
+        if (cachedServices[i]->provider)
         {
-            if (cachedServices[i]->provider)
-            {
-                free(cachedServices[i]->provider);
-            }
+            free(cachedServices[i]->provider);
+        }
+        if (provider)
+        {
+            cachedServices[i]->provider = strdup(provider);
+        }
+        else
+        {
+            cachedServices[i]->provider = NULL;
+        }
+        msg = ObjectCreateType(CacheUpdateMessage_t);
+        if (msg)
+        {
+            msg->type = CacheUpdate_Service_Provider;
+            ObjectRefInc(service);
+            msg->details.serviceProvider.service = service;
             if (provider)
             {
-                cachedServices[i]->provider = strdup(provider);
-            }
-            else
-            {
-                cachedServices[i]->provider = NULL;
-            }
-            msg = ObjectCreateType(CacheUpdateMessage_t);
-            if (msg)
-            {
-                msg->type = CacheUpdate_Service_Provider;
-                ObjectRefInc(service);
-                msg->details.serviceProvider.service = service;
-                if (provider)
-                {
-                    msg->details.serviceProvider.provider = strdup(provider);
-                }
-                DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
-                ObjectRefDec(msg);
+                msg->details.serviceProvider.provider = strdup(provider);
             }
-            break;
+            CacheQueueUpdate(msg);
+            ObjectRefDec(msg);
         }
     }
 
@@ -528,36 +610,33 @@ void CacheUpdateServiceDefaultAuthority(Service_t *service, char *defaultAuthori
     int i;
     pthread_mutex_lock(&cacheUpdateMutex);
 
-    for (i = 0; i < cachedServicesCount; i ++)
+    i = CacheServiceIndex(service);
+    if (i != -1)
     {
-        if ((cachedServices[i]) && ServiceAreEqual(service, cachedServices[i]))
+        if (cachedServices[i]->defaultAuthority)
         {
-            if (cachedServices[i]->defaultAuthority)
-            {
-                free(cachedServices[i]->defaultAuthority);
-            }
+            free(cachedServices[i]->defaultAuthority);
+        }
+        if (defaultAuthority)
+        {
+            cachedServices[i]->defaultAuthority = strdup(defaultAuthority);
+        }
+        else
+        {
+            cachedServices[i]->defaultAuthority = NULL;
+        }
+        msg = ObjectCreateType(CacheUpdateMessage_t);
+        if (msg)
+        {
+            msg->type = CacheUpdate_Service_Default_Auth;
+            ObjectRefInc(service);
+            msg->details.serviceDefaultAuthority.service = service;
             if (defaultAuthority)
             {
-                cachedServices[i]->defaultAuthority = strdup(defaultAuthority);
+                msg->details.serviceDefaultAuthority.defaultAuthority = strdup(defaultAuthority);
             }
-            else
-            {
-                cachedServices[i]->defaultAuthority = NULL;
-            }
-            msg = ObjectCreateType(CacheUpdateMessage_t);
-            if (msg)
-            {
-                msg->type = CacheUpdate_Service_Default_Auth;
-                ObjectRefInc(service);
-                msg->details.serviceDefaultAuthority.service = service;
-                if (defaultAuthority)
-                {
-                    msg->details.serviceDefaultAuthority.defaultAuthority = strdup(defaultAuthority);
-                }
-                DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
-                ObjectRefDec(msg);
-            }
-            break;
+            CacheQueueUpdate(msg);
+            ObjectRefDec(msg);
         }
     }
 
@@ -570,22 +649,19 @@ void CacheUpdateServiceSource(Service_t *service, uint16_t source)
     int i;
     pthread_mutex_lock(&cacheUpdateMutex);
 
-    for (i = 0; i < cachedServicesCount; i ++)
+    i = CacheServiceIndex(service);
+    if (i != -1)
     {
-        if ((cachedServices[i]) && ServiceAreEqual(service, cachedServices[i]))
+        cachedServices[i]->source = source;
+        msg = ObjectCreateType(CacheUpdateMessage_t);
+        if (msg)
         {
-            cachedServices[i]->source = source;
-            msg = ObjectCreateType(CacheUpdateMessage_t);
-            if (msg)
-            {
-                msg->type = CacheUpdate_Service_Source;
-                ObjectRefInc(service);
-                msg->details.serviceSource.service = service;
-                msg->details.serviceSource.source = source;
-                DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
-                ObjectRefDec(msg);
-            }
-            break;
+            msg->type = CacheUpdate_Service_Source;
+            ObjectRefInc(service);
+            msg->details.serviceSource.service = service;
+            msg->details.serviceSource.source = source;
+            CacheQueueUpdate(msg);
+            ObjectRefDec(msg);
         }
     }
 
@@ -598,22 +674,19 @@ void CacheUpdateServiceConditionalAccess(Service_t *service, bool ca)
     int i;
     pthread_mutex_lock(&cacheUpdateMutex);
 
-    for (i = 0; i < cachedServicesCount; i ++)
+    i = CacheServiceIndex(service);
+    if (i != -1)
     {
-        if ((cachedServices[i]) && ServiceAreEqual(service, cachedServices[i]))
+        cachedServices[i]->conditionalAccess = ca;
+        msg = ObjectCreateType(CacheUpdateMessage_t);
+        if (msg)
         {
-            cachedServices[i]->conditionalAccess = ca;
-            msg = ObjectCreateType(CacheUpdateMessage_t);
-            if (msg)
-            {
-                msg->type = CacheUpdate_Service_CA;
-                ObjectRefInc(service);
-                msg->details.serviceCA.service = service;
-                msg->details.serviceCA.ca = ca;
-                DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
-                ObjectRefDec(msg);
-            }
-            break;
+            msg->type = CacheUpdate_Service_CA;
+            ObjectRefInc(service);
+            msg->details.serviceCA.service = service;
+            msg->details.serviceCA.ca = ca;
+            CacheQueueUpdate(msg);
+            ObjectRefDec(msg);
         }
     }
 
@@ -626,22 +699,19 @@ void CacheUpdateServiceType(Service_t *service, ServiceType type)
     int i;
     pthread_mutex_lock(&cacheUpdateMutex);
 
-    for (i = 0; i < cachedServicesCount; i ++)
+    i = CacheServiceIndex(service);
+    if (i != -1)
     {
-        if ((cachedServices[i]) && ServiceAreEqual(service, cachedServices[i]))
+        cachedServices[i]->type = type;
+        msg = ObjectCreateType(CacheUpdateMessage_t);
+        if (msg)
         {
-            cachedServices[i]->type = type;
-            msg = ObjectCreateType(CacheUpdateMessage_t);
-            if (msg)
-            {
-                msg->type = CacheUpdate_Service_Type;
-                ObjectRefInc(service);
-                msg->details.serviceType.service = service;
-                msg->details.serviceType.type = type;
-                DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
-                ObjectRefDec(msg);
-            }
-            break;
+            msg->type = CacheUpdate_Service_Type;
+            ObjectRefInc(service);
+            msg->details.serviceType.service = service;
+            msg->details.serviceType.type = type;
+            CacheQueueUpdate(msg);
+            ObjectRefDec(msg);
         }
     }
 
@@ -654,31 +724,28 @@ void CacheUpdateProgramInfo(Service_t *service, ProgramInfo_t *info)
     int i;
     pthread_mutex_lock(&cacheUpdateMutex);
 
-    for (i = 0; i < cachedServicesCount; i ++)
+    i = CacheServiceIndex(service);
+    if (i != -1)
     {
-        if ((cachedServices[i]) && ServiceAreEqual(service, cachedServices[i]))
+        if (cachedPIDs[i])
         {
-            if (cachedPIDs[i])
-            {
-                ObjectRefDec(cachedPIDs[i]);
-            }
+            ObjectRefDec(cachedPIDs[i]);
+        }
 
-            cachedPIDs[i] = info;
+        cachedPIDs[i] = info;
 
-            msg = ObjectCreateType(CacheUpdateMessage_t);
-            if (msg)
-            {
-                msg->type = CacheUpdate_Service_PIDs;
-                ObjectRefInc(service);
-                msg->details.servicePIDs.service = service;
-                ObjectRefInc(info);
-                msg->details.servicePIDs.info = info;
-                DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
-                ObjectRefDec(msg);
-            }
-            EventsFireEventListeners(pidsUpdatedEvent, cachedServices[i]);
-            break;
+        msg = ObjectCreateType(CacheUpdateMessage_t);
+        if (msg)
+        {
+            msg->type = CacheUpdate_Service_PIDs;
+            ObjectRefInc(service);
+            msg->details.servicePIDs.service = service;
+            ObjectRefInc(info);
+            msg->details.servicePIDs.info = info;
+            CacheQueueUpdate(msg);
+            ObjectRefDec(msg);
         }
+        EventsFireEventListeners(pidsUpdatedEvent, cachedServices[i]);
     }
 
     pthread_mutex_unlock(&cacheUpdateMutex);
@@ -707,6 +774,7 @@ Service_t *CacheServiceAdd(int id, int source)
         cachedServices[cachedServicesCount] = result;
         cachedPIDs[cachedServicesCount] = NULL;
         cacheFlags[cachedServicesCount] = CacheFlag_Clean;
+        CacheIndexesAdd(cachedServicesCount);
         cachedServicesCount ++;
 
         msg = ObjectCreateType(CacheUpdateMessage_t);
@@ -717,7 +785,7 @@ Service_t *CacheServiceAdd(int id, int source)
             msg->details.serviceAdd.multiplexUID = cachedServicesMultiplex->uid;
             msg->details.serviceAdd.source = result->source;
             msg->details.serviceAdd.name = strdup(result->name);
-            DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
+            CacheQueueUpdate(msg);
             ObjectRefDec(msg);
         }
 
@@ -729,17 +797,10 @@ Service_t *CacheServiceAdd(int id, int source)
 bool CacheServiceSeen(Service_t *service, bool seen, bool pat)
 {
     bool exists = FALSE;
-    int seenIndex = -1;
-    int i;
+    int seenIndex;
 
-    for (i = 0; i < cachedServicesCount; i ++)
-    {
-        if ((cachedServices[i]) && ServiceAreEqual(service, cachedServices[i]))
-        {
-            seenIndex = i;
-            break;
-        }
-    }
+    pthread_mutex_lock(&cacheUpdateMutex);
+    seenIndex = CacheServiceIndex(service);
     if (seenIndex != -1)
     {
         int flag = pat ? CacheFlag_Not_Seen_In_PAT : CacheFlag_Not_Seen_In_SDT;
@@ -762,25 +823,18 @@ bool CacheServiceSeen(Service_t *service, bool seen, bool pat)
             exists = TRUE;
         }
     }
+    pthread_mutex_unlock(&cacheUpdateMutex);
     return exists;
 }
 
 void CacheServiceDelete(Service_t *service)
 {
     CacheUpdateMessage_t *msg;
-    int deletedIndex = -1;
+    int deletedIndex;
     int i;
     pthread_mutex_lock(&cacheUpdateMutex);
 
-    for (i = 0; i < cachedServicesCount; i ++)
-    {
-        if ((cachedServices[i]) && ServiceAreEqual(service, cachedServices[i]))
-        {
-            deletedIndex = i;
-            break;
-        }
-    }
-
+    deletedIndex = CacheServiceIndex(service);
     if (deletedIndex != -1)
     {
         LogModule(LOG_DEBUG, CACHE, "Removing service at index %d\n", deletedIndex);
@@ -790,7 +844,7 @@ void CacheServiceDelete(Service_t *service)
             ObjectRefDec(cachedPIDs[deletedIndex]);
         }
 
-        
+        CacheIndexesRemove(deletedIndex);
         cachedServicesCount --;
         /* Remove the deleted service from the list */
         for (i = deletedIndex; i < cachedServicesCount; i ++)
@@ -800,6 +854,18 @@ void CacheServiceDelete(Service_t *service)
             cachedServices[i] = cachedServices[i + 1];
             cacheFlags[i] = cacheFlags [i + 1];
         }
+        /* Services after the deleted one have moved down a slot. */
+        for (i = 0; i < SERVICE_INDEX_SIZE; i ++)
+        {
+            if (serviceIdIndex[i] > deletedIndex)
+            {
+                serviceIdIndex[i] --;
+            }
+            if (serviceNameIndex[i] > deletedIndex)
+            {
+                serviceNameIndex[i] --;
+            }
+        }
 
         msg = ObjectCreateType(CacheUpdateMessage_t);
         if (msg)
@@ -807,7 +873,7 @@ void CacheServiceDelete(Service_t *service)
             msg->type = CacheUpdate_Service_Deleted;
             ObjectRefInc(service);
             msg->details.serviceDelete.service = service;
-            DeferredProcessingAddJob(CacheProcessUpdateMessage, msg);
+            CacheQueueUpdate(msg);
             ObjectRefDec(msg);
         }
     }
@@ -817,7 +883,7 @@ void CacheServiceDelete(Service_t *service)
 
 void CacheWriteback()
 {
-  /* Do nothing, move to CacheUpdateProcessor. */
+    CacheFlushUpdates();
 }
 
 static void CacheServicesFree()
@@ -837,18 +903,186 @@ static void CacheServicesFree()
         }
     }
     cachedServicesCount = 0;
+    CacheIndexesClear();
     MultiplexRefDec(cachedServicesMultiplex);
     cachedServicesMultiplex = NULL;
 }
 
-static void CacheProcessUpdateMessage(void *ptr)
+static void CacheLoadService(void *userArg, Service_t *service, ProgramInfo_t *info)
+{
+    int i = cachedServicesCount;
+
+    if (i >= SERVICES_MAX)
+    {
+        LogModule(LOG_ERROR, CACHE, "Too many services, ignoring 0x%04x %s\n", service->id, service->name);
+        ServiceRefDec(service);
+        if (info)
+        {
+            ObjectRefDec(info);
+        }
+        return;
+    }
+    LogModule(LOG_DEBUG, CACHE, "Loaded 0x%04x %s\n", service->id, service->name);
+    cachedServices[i] = service;
+    cachedPIDs[i] = info;
+    cacheFlags[i] = CacheFlag_Clean;
+    cachedServicesCount ++;
+    CacheIndexesAdd(i);
+}
+
+static int CacheServiceIndex(Service_t *service)
+{
+    int i = CacheServiceIndexId(service->id);
+
+    if ((i != -1) && !ServiceAreEqual(service, cachedServices[i]))
+    {
+        i = -1;
+    }
+    return i;
+}
+
+static int CacheServiceIndexId(int id)
+{
+    unsigned int pos;
+    int slot;
+
+    for (pos = CacheHashId(id) & SERVICE_INDEX_MASK;
+         (slot = serviceIdIndex[pos]) != SERVICE_INDEX_EMPTY;
+         pos = (pos + 1) & SERVICE_INDEX_MASK)
+    {
+        if (cachedServices[slot]->id == id)
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+static int CacheServiceIndexName(char *name)
+{
+    unsigned int pos;
+    int result = -1;
+    int slot;
+
+    /* Names are not unique, so return the first matching service in the cache
+     * to behave the same as a scan of cachedServices. */
+    for (pos = CacheHashName(name) & SERVICE_INDEX_MASK;
+         (slot = serviceNameIndex[pos]) != SERVICE_INDEX_EMPTY;
+         pos = (pos + 1) & SERVICE_INDEX_MASK)
+    {
+        if (((result == -1) || (slot < result)) &&
+            (strcmp(cachedServices[slot]->name, name) == 0))
+        {
+            result = slot;
+        }
+    }
+    return result;
+}
+
+static unsigned int CacheHashId(int id)
+{
+    return ((unsigned int)id * 2654435761U) >> 16;
+}
+
+static unsigned int CacheHashName(char *name)
+{
+    unsigned int hash = 2166136261U;
+
+    for (; *name; name ++)
+    {
+        hash = (hash ^ (unsigned char)*name) * 16777619U;
+    }
+    return hash;
+}
+
+static unsigned int CacheServiceHashId(Service_t *service)
+{
+    return CacheHashId(service->id);
+}
+
+static unsigned int CacheServiceHashName(Service_t *service)
+{
+    return CacheHashName(service->name);
+}
+
+static void CacheIndexAdd(short *index, unsigned int hash, int slot)
+{
+    unsigned int pos;
+
+    for (pos = hash & SERVICE_INDEX_MASK;
+         index[pos] != SERVICE_INDEX_EMPTY;
+         pos = (pos + 1) & SERVICE_INDEX_MASK);
+    index[pos] = slot;
+}
+
+static void CacheIndexRemove(short *index, CacheIndexHash_t hashFunc, int slot)
+{
+    unsigned int hole;
+    unsigned int pos;
+    unsigned int home;
+
+    for (hole = hashFunc(cachedServices[slot]) & SERVICE_INDEX_MASK;
+         index[hole] != slot;
+         hole = (hole + 1) & SERVICE_INDEX_MASK)
+    {
+        if (index[hole] == SERVICE_INDEX_EMPTY)
+        {
+            return;
+        }
+    }
+    index[hole] = SERVICE_INDEX_EMPTY;
+
+    /* Shift back any following entries that can no longer be reached now there
+     * is a hole in their probe sequence. */
+    for (pos = (hole + 1) & SERVICE_INDEX_MASK;
+         index[pos] != SERVICE_INDEX_EMPTY;
+         pos = (pos + 1) & SERVICE_INDEX_MASK)
+    {
+        home = hashFunc(cachedServices[index[pos]]) & SERVICE_INDEX_MASK;
+        if (((pos - home) & SERVICE_INDEX_MASK) >= ((pos - hole) & SERVICE_INDEX_MASK))
+        {
+            index[hole] = index[pos];
+            index[pos] = SERVICE_INDEX_EMPTY;
+            hole = pos;
+        }
+    }
+}
+
+static void CacheIndexesAdd(int slot)
+{
+    CacheIndexAdd(serviceIdIndex, CacheServiceHashId(cachedServices[slot]), slot);
+    if (cachedServices[slot]->name)
+    {
+        CacheIndexAdd(serviceNameIndex, CacheServiceHashName(cachedServices[slot]), slot);
+    }
+}
+
+static void CacheIndexesRemove(int slot)
+{
+    CacheIndexRemove(serviceIdIndex, CacheServiceHashId, slot);
+    if (cachedServices[slot]->name)
+    {
+        CacheIndexRemove(serviceNameIndex, CacheServiceHashName, slot);
+    }
+}
+
+static void CacheIndexesClear(void)
+{
+    int i;
+
+    for (i = 0; i < SERVICE_INDEX_SIZE; i ++)
+    {
+        serviceIdIndex[i] = SERVICE_INDEX_EMPTY;
+        serviceNameIndex[i] = SERVICE_INDEX_EMPTY;
+    }
+}
+
+static void CacheProcessUpdateMessage(CacheUpdateMessage_t *msg)
 {
-    CacheUpdateMessage_t *msg = ptr;
     int rc;
     Multiplex_t *mux = NULL;
     Service_t *service = NULL;
 
-    DBaseTransactionBegin();
     switch(msg->type)
     {
         case CacheUpdate_Multiplex_TS_id:
@@ -882,7 +1116,6 @@ static void CacheProcessUpdateMessage(void *ptr)
             LogModule(LOG_DEBUG, CACHE, "Updating PIDs for %s\n", service->name);
             ProgramInfoRemove(service);
             ProgramInfoSet(service, msg->details.servicePIDs.info);
-            ObjectRefDec(msg->details.servicePIDs.info);
             break;
 
         case CacheUpdate_Service_Name:
@@ -890,7 +1123,6 @@ static void CacheProcessUpdateMessage(void *ptr)
             LogModule(LOG_DEBUG, CACHE, "Updating name for 0x%04x new name %s\n",
                 service->id, msg->details.serviceName.name);
             ServiceNameSet(service, msg->details.serviceName.name);
-            free(msg->details.serviceName.name);
             break;
 
         case CacheUpdate_Service_Source:
@@ -919,7 +1151,6 @@ static void CacheProcessUpdateMessage(void *ptr)
             LogModule(LOG_DEBUG, CACHE, "Updating provider for 0x%04x new provider %s\n",
                 service->id, service->provider);
             ServiceProviderSet(service, msg->details.serviceProvider.provider);
-            free(msg->details.serviceProvider.provider);
             break;
 
         case CacheUpdate_Service_Default_Auth:
@@ -927,7 +1158,6 @@ static void CacheProcessUpdateMessage(void *ptr)
             LogModule(LOG_DEBUG, CACHE, "Updating default authority for 0x%04x new authority %s\n",
                 service->id, msg->details.serviceDefaultAuthority.defaultAuthority);
             ServiceDefaultAuthoritySet(service, msg->details.serviceDefaultAuthority.defaultAuthority);
-            free(msg->details.serviceDefaultAuthority.defaultAuthority);
             break;
 
         case CacheUpdate_Service_Added:
@@ -935,7 +1165,6 @@ static void CacheProcessUpdateMessage(void *ptr)
             ServiceAdd(msg->details.serviceAdd.multiplexUID,
                        msg->details.serviceAdd.name, msg->details.serviceAdd.id,
                        msg->details.serviceAdd.source);
-            free(msg->details.serviceAdd.name);
             break;
 
         case CacheUpdate_Service_Deleted:
@@ -943,10 +1172,263 @@ static void CacheProcessUpdateMessage(void *ptr)
             LogModule(LOG_DEBUG, CACHE, "Deleting service %s (0x%04x)\n", service->name, service->id);
             ServiceDelete(service);
             ProgramInfoRemove(service);
+            break;
+    }
+}
+
+static void CacheQueueUpdate(CacheUpdateMessage_t *msg)
+{
+    ListIterator_t iterator;
+    CacheUpdateMessage_t *superseded = NULL;
+
+    pthread_mutex_lock(&writeBehindMutex);
+    if ((msg->type != CacheUpdate_Service_Added) && (msg->type != CacheUpdate_Service_Deleted))
+    {
+        /* Look for an update of the same field of the same service/multiplex
+         * queued after the last service addition/deletion, as an addition or
+         * deletion may change what the update applies to.
+         */
+        ListIterator_t match;
+        bool found = FALSE;
+        for (ListIterator_Init(iterator, pendingUpdates);
+             ListIterator_MoreEntries(iterator);
+             ListIterator_Next(iterator))
+        {
+            CacheUpdateMessage_t *pending = ListIterator_Current(iterator);
+            if ((pending->type == CacheUpdate_Service_Added) ||
+                (pending->type == CacheUpdate_Service_Deleted))
+            {
+                found = FALSE;
+            }
+            else if (CacheUpdateSupersedes(msg, pending))
+            {
+                match = iterator;
+                found = TRUE;
+            }
+        }
+        if (found)
+        {
+            superseded = ListIterator_Current(match);
+            ListIterator_SetCurrent(match, msg);
+            updatesCoalesced ++;
+        }
+    }
+    if (superseded == NULL)
+    {
+        if (ListCount(pendingUpdates) == 0)
+        {
+            clock_gettime(CLOCK_REALTIME, &firstPendingTime);
+        }
+        ListAdd(pendingUpdates, msg);
+        updatesPending ++;
+    }
+    ObjectRefInc(msg);
+    updatesQueued ++;
+    if (updatesPending >= writeBehindBatchSize)
+    {
+        pthread_cond_signal(&writeBehindCond);
+    }
+    pthread_mutex_unlock(&writeBehindMutex);
+
+    if (superseded)
+    {
+        CacheUpdateMessageFree(superseded);
+    }
+
+    if (!writeBehindRunning)
+    {
+        CacheFlushUpdates();
+    }
+}
+
+static bool CacheUpdateSupersedes(CacheUpdateMessage_t *msg, CacheUpdateMessage_t *pending)
+{
+    if (msg->type != pending->type)
+    {
+        return FALSE;
+    }
+    switch(msg->type)
+    {
+        case CacheUpdate_Multiplex_TS_id:
+            return MultiplexAreEqual(msg->details.multiplexTSId.multiplex, pending->details.multiplexTSId.multiplex);
+        case CacheUpdate_Multiplex_Network_id:
+            return MultiplexAreEqual(msg->details.multiplexNetworkId.multiplex, pending->details.multiplexNetworkId.multiplex);
+        case CacheUpdate_Service_PMT_PID:
+        case CacheUpdate_Service_PIDs:
+        case CacheUpdate_Service_Name:
+        case CacheUpdate_Service_Source:
+        case CacheUpdate_Service_CA:
+        case CacheUpdate_Service_Type:
+        case CacheUpdate_Service_Provider:
+        case CacheUpdate_Service_Default_Auth:
+            return ServiceAreEqual(CacheUpdateMessageService(msg), CacheUpdateMessageService(pending));
+        default:
+            break;
+    }
+    return FALSE;
+}
+
+static Service_t *CacheUpdateMessageService(CacheUpdateMessage_t *msg)
+{
+    switch(msg->type)
+    {
+        case CacheUpdate_Service_PMT_PID:
+            return msg->details.servicePMTPID.service;
+        case CacheUpdate_Service_PIDs:
+            return msg->details.servicePIDs.service;
+        case CacheUpdate_Service_Name:
+            return msg->details.serviceName.service;
+        case CacheUpdate_Service_Source:
+            return msg->details.serviceSource.service;
+        case CacheUpdate_Service_CA:
+            return msg->details.serviceCA.service;
+        case CacheUpdate_Service_Type:
+            return msg->details.serviceType.service;
+        case CacheUpdate_Service_Provider:
+            return msg->details.serviceProvider.service;
+        case CacheUpdate_Service_Default_Auth:
+            return msg->details.serviceDefaultAuthority.service;
+        case CacheUpdate_Service_Deleted:
+            return msg->details.serviceDelete.service;
+        default:
+            break;
+    }
+    return NULL;
+}
+
+static void CacheFlushUpdates(void)
+{
+    List_t *updates;
+    ListIterator_t iterator;
+
+    /* Serialise flushes so batches are committed in the order they were queued */
+    pthread_mutex_lock(&writeBehindCommitMutex);
+    pthread_mutex_lock(&writeBehindMutex);
+    updates = pendingUpdates;
+    pendingUpdates = ListCreate();
+    updatesPending = 0;
+    pthread_mutex_unlock(&writeBehindMutex);
+
+    if (ListCount(updates))
+    {
+        LogModule(LOG_DEBUG, CACHE, "Committing %d updates\n", ListCount(updates));
+        DBaseTransactionBegin();
+        for (ListIterator_Init(iterator, updates);
+             ListIterator_MoreEntries(iterator);
+             ListIterator_Next(iterator))
+        {
+            CacheProcessUpdateMessage(ListIterator_Current(iterator));
+        }
+        DBaseTransactionCommit();
+
+        pthread_mutex_lock(&writeBehindMutex);
+        updatesCommitted += ListCount(updates);
+        updateTransactions ++;
+        pthread_mutex_unlock(&writeBehindMutex);
+    }
+    ListFree(updates, (void(*)(void*))CacheUpdateMessageFree);
+    pthread_mutex_unlock(&writeBehindCommitMutex);
+}
+
+static void *CacheWriteBehindThread(void *arg)
+{
+    struct timespec deadline;
+    int rc;
+
+    LogRegisterThread(pthread_self(), CACHE);
+    pthread_mutex_lock(&writeBehindMutex);
+    while (!writeBehindQuit)
+    {
+        if (updatesPending == 0)
+        {
+            pthread_cond_wait(&writeBehindCond, &writeBehindMutex);
+            continue;
+        }
+        rc = 0;
+        if (updatesPending < writeBehindBatchSize)
+        {
+            deadline = firstPendingTime;
+            deadline.tv_sec += writeBehindMaxDelay / 1000;
+            deadline.tv_nsec += (writeBehindMaxDelay % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec ++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            rc = pthread_cond_timedwait(&writeBehindCond, &writeBehindMutex, &deadline);
+        }
+        if ((rc == ETIMEDOUT) || (updatesPending >= writeBehindBatchSize))
+        {
+            pthread_mutex_unlock(&writeBehindMutex);
+            CacheFlushUpdates();
+            pthread_mutex_lock(&writeBehindMutex);
+        }
+    }
+    pthread_mutex_unlock(&writeBehindMutex);
+    return NULL;
+}
+
+static int CacheWriteBehindBatchSizeSet(void *userArg, PropertyValue_t *value)
+{
+    if ((value->u.integer < 1) || (value->u.integer > MAX_WRITEBEHIND_BATCH))
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&writeBehindMutex);
+    writeBehindBatchSize = value->u.integer;
+    pthread_cond_signal(&writeBehindCond);
+    pthread_mutex_unlock(&writeBehindMutex);
+    return 0;
+}
+
+static int CacheWriteBehindMaxDelaySet(void *userArg, PropertyValue_t *value)
+{
+    if ((value->u.integer < 0) || (value->u.integer > MAX_WRITEBEHIND_DELAY))
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&writeBehindMutex);
+    writeBehindMaxDelay = value->u.integer;
+    pthread_cond_signal(&writeBehindCond);
+    pthread_mutex_unlock(&writeBehindMutex);
+    return 0;
+}
+
+static void CacheUpdateMessageFree(CacheUpdateMessage_t *msg)
+{
+    Multiplex_t *mux = NULL;
+    Service_t *service = CacheUpdateMessageService(msg);
+
+    switch(msg->type)
+    {
+        case CacheUpdate_Multiplex_TS_id:
+            mux = msg->details.multiplexTSId.multiplex;
+            break;
+        case CacheUpdate_Multiplex_Network_id:
+            mux = msg->details.multiplexNetworkId.multiplex;
+            break;
+        case CacheUpdate_Service_PIDs:
+            ObjectRefDec(msg->details.servicePIDs.info);
+            break;
+        case CacheUpdate_Service_Name:
+            free(msg->details.serviceName.name);
+            break;
+        case CacheUpdate_Service_Provider:
+            free(msg->details.serviceProvider.provider);
+            break;
+        case CacheUpdate_Service_Default_Auth:
+            free(msg->details.serviceDefaultAuthority.defaultAuthority);
+            break;
+        case CacheUpdate_Service_Added:
+            free(msg->details.serviceAdd.name);
+            break;
+        case CacheUpdate_Service_Deleted:
+            /* Release the reference the cache held */
             ServiceRefDec(service);
             break;
+        default:
+            break;
     }
-    DBaseTransactionCommit();
 
     if (mux)
     {
@@ -37,11 +37,61 @@ Command functions to access EPG information.
 #include "main.h"
 #include "utf8.h"
 
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define MAX_BATCH_MESSAGES  64
+#define BATCH_BUFFER_SIZE   (128 * 1024)
+#define MAX_SERVICE_FILTERS 32
+#define EVENT_BUCKETS       1024
+#define MAX_TRACKED_EVENTS  16384
+#define MAX_WINDOW_HOURS    (24 * 31)
+
+#define BINARY_MAGIC        "EPGB"
+#define BINARY_VERSION      1
+#define FRAME_HEADER_SIZE   15 /* length(4) type(1) net(2) ts(2) service(2) event(4) */
+
+/*******************************************************************************
+* Typedefs                                                                     *
+*******************************************************************************/
+typedef struct TrackedEvent_s
+{
+    EPGEventRef_t eventRef;
+    bool inWindow;
+    struct TrackedEvent_s *next;
+}TrackedEvent_t;
+
+typedef struct EPGDataFilter_s
+{
+    int nrofServices;
+    EPGServiceRef_t services[MAX_SERVICE_FILTERS];
+    time_t window;      /* Seconds from now an event must start within, 0 for no window. */
+    int nrofTracked;
+    TrackedEvent_t *tracked[EVENT_BUCKETS];
+}EPGDataFilter_t;
+
+typedef struct EPGDataBuffer_s
+{
+    int used;
+    unsigned char data[BATCH_BUFFER_SIZE];
+}EPGDataBuffer_t;
 
 /*******************************************************************************
 * Prototypes                                                                   *
 *******************************************************************************/
 static void CommandEPGData(int argc, char **argv);
+static bool ParseServiceRef(char *text, EPGServiceRef_t *serviceRef);
+static bool FilterMessage(EPGDataFilter_t *filter, EPGChannelMessage_t *msg);
+static bool FilterEventInWindow(EPGDataFilter_t *filter, EPGChannelMessage_t *msg);
+static TrackedEvent_t **FilterFindTracked(EPGDataFilter_t *filter, EPGEventRef_t *eventRef);
+static void FilterClearTracked(EPGDataFilter_t *filter);
+static void PrintXmlMessage(EPGChannelMessage_t *msg);
+static void BufferFlush(EPGDataBuffer_t *buffer, FILE *fp);
+static void BufferAddMessage(EPGDataBuffer_t *buffer, FILE *fp, EPGChannelMessage_t *msg);
+static int LimitedLength(char *text, int max);
+static unsigned char *BufferPut16(unsigned char *ptr, unsigned int value);
+static unsigned char *BufferPut32(unsigned char *ptr, unsigned int value);
+static unsigned char *BufferPutString(unsigned char *ptr, char *text, int len, bool longLen);
 static void PrintXmlified(char *text);
 
 /*******************************************************************************
@@ -51,10 +101,26 @@ Command_t CommandEPGInfo[] =
 {
     {
         "epgdata",
-        0, 0,
-        "Register to receive EPG data in XML format.",
+        0, 2 * MAX_SERVICE_FILTERS + 3,
+        "Register to receive EPG data in XML or binary format.",
+        "epgdata [-b] [-w <hours>] [-s <net id>.<ts id>.<service id>]...\n"
         "EPG data is output to the command context in XML format until DVBStreamer"
-        "terminates or the command context is closed (ie the socket is disconnected).",
+        " terminates or the command context is closed (ie the socket is disconnected).\n"
+        "\n"
+        "-b             Output length prefixed binary frames instead of XML.\n"
+        "-w <hours>     Only output events (and their details/ratings) that have not"
+        " finished and start within the specified number of hours (1 to 744).\n"
+        "-s <ref>       Only output EPG data for the specified service, ids are in hex."
+        " May be specified multiple times.\n"
+        "\n"
+        "Binary output starts with the 4 characters \"EPGB\" followed by a version byte (1)"
+        ", then each message is sent as a frame, all numbers are big endian:\n"
+        "  uint32 length of the rest of the frame\n"
+        "  uint8  type (0 = event, 1 = detail, 2 = rating)\n"
+        "  uint16 net id, uint16 ts id, uint16 service id, uint32 event id\n"
+        "Event:  uint32 start, uint32 end (seconds since 1970 UTC), uint8 ca\n"
+        "Detail: char lang[3], uint8 name length, name, uint16 value length, value\n"
+        "Rating: uint8 system length, system, uint8 rating length, rating",
         CommandEPGData
     },
     COMMANDS_SENTINEL
@@ -78,52 +144,420 @@ void CommandUnInstallEPG(void)
 *******************************************************************************/
 static void CommandEPGData(int argc, char **argv)
 {
-    MessageQ_t msgQ = MessageQCreate();
-    char startTimeStr[25];
-    char endTimeStr[25];
+    MessageQ_t msgQ;
+    EPGChannelMessage_t *msgs[MAX_BATCH_MESSAGES];
+    EPGDataFilter_t *filter;
+    EPGDataBuffer_t *buffer = NULL;
     CommandContext_t *cmdContext = CommandContextGet();
-    
+    bool binary = FALSE;
+    int nrofMsgs;
+    int i;
+
+    filter = calloc(1, sizeof(EPGDataFilter_t));
+    if (filter == NULL)
+    {
+        CommandError(COMMAND_ERROR_GENERIC, "Out of memory!");
+        return;
+    }
+
+    for (i = 0; i < argc; i ++)
+    {
+        if (strcmp(argv[i], "-b") == 0)
+        {
+            binary = TRUE;
+        }
+        else if ((strcmp(argv[i], "-w") == 0) && (i + 1 < argc))
+        {
+            long hours;
+            char *end;
+            i ++;
+            errno = 0;
+            hours = strtol(argv[i], &end, 10);
+            if ((errno != 0) || (end == argv[i]) || (*end != 0) ||
+                (hours <= 0) || (hours > MAX_WINDOW_HOURS))
+            {
+                CommandError(COMMAND_ERROR_WRONG_ARGS, "Invalid window \"%s\"", argv[i]);
+                free(filter);
+                return;
+            }
+            filter->window = (time_t)hours * 60 * 60;
+        }
+        else if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc))
+        {
+            i ++;
+            if (filter->nrofServices == MAX_SERVICE_FILTERS)
+            {
+                CommandError(COMMAND_ERROR_WRONG_ARGS, "Too many services, maximum is %d", MAX_SERVICE_FILTERS);
+                free(filter);
+                return;
+            }
+            if (!ParseServiceRef(argv[i], &filter->services[filter->nrofServices]))
+            {
+                CommandError(COMMAND_ERROR_WRONG_ARGS, "Invalid service reference \"%s\"", argv[i]);
+                free(filter);
+                return;
+            }
+            filter->nrofServices ++;
+        }
+        else
+        {
+            CommandError(COMMAND_ERROR_WRONG_ARGS, "Unknown or incomplete option \"%s\"", argv[i]);
+            free(filter);
+            return;
+        }
+    }
+
+    if (binary)
+    {
+        buffer = malloc(sizeof(EPGDataBuffer_t));
+        if (buffer == NULL)
+        {
+            CommandError(COMMAND_ERROR_GENERIC, "Out of memory!");
+            free(filter);
+            return;
+        }
+        memcpy(buffer->data, BINARY_MAGIC, 4);
+        buffer->data[4] = BINARY_VERSION;
+        buffer->used = 5;
+        BufferFlush(buffer, cmdContext->outfp);
+    }
+    else
+    {
+        CommandPrintf("<epg>\n");
+        fflush(cmdContext->outfp);
+    }
+
+    msgQ = MessageQCreate();
     EPGChannelRegisterListener(msgQ);
-    CommandPrintf("<epg>\n");
-    fflush(cmdContext->outfp);
 
     while (!ferror(cmdContext->outfp) && !MessageQIsQuitSet(msgQ) && !ExitProgram)
     {
-        EPGChannelMessage_t *msg = MessageQReceiveTimed(msgQ, 400);
-        if (msg != NULL)
+        msgs[0] = MessageQReceiveTimed(msgQ, 400);
+        if (msgs[0] == NULL)
+        {
+            continue;
+        }
+        /* Drain whatever else is already queued so the batch is written and
+         * flushed in one go rather than a write per message. */
+        nrofMsgs = 1;
+        if (MessageQAvailable(msgQ) > 0)
+        {
+            nrofMsgs += MessageQReceiveMany(msgQ, (void**)&msgs[1], MAX_BATCH_MESSAGES - 1);
+        }
+
+        for (i = 0; i < nrofMsgs; i ++)
         {
-            CommandPrintf("<event net=\"0x%04x\" ts=\"0x%04x\" source=\"0x%04x\" event=\"0x%08x\">\n",
-                msg->eventRef.serviceRef.netId, msg->eventRef.serviceRef.tsId, msg->eventRef.serviceRef.serviceId,
-                msg->eventRef.eventId);
-            switch(msg->type)
+            if (FilterMessage(filter, msgs[i]))
             {
-                case EPGChannelMessageType_Event:
-                    strftime(startTimeStr, sizeof(startTimeStr), "%Y-%m-%d %T", &msg->data.event.startTime);
-                    strftime(endTimeStr, sizeof(startTimeStr), "%Y-%m-%d %T", &msg->data.event.endTime);                        
-                    CommandPrintf("<new start=\"%s\" end=\"%s\" ca=\"%s\"/>\n",
-                               startTimeStr, endTimeStr, msg->data.event.ca ? "yes":"no");
-                    break;
-                case EPGChannelMessageType_Detail:
-                    CommandPrintf("<detail lang=\"%s\" name=\"%s\">",
-                             msg->data.detail.lang,  msg->data.detail.name);
-                    PrintXmlified(msg->data.detail.value);
-                    CommandPrintf("</detail>\n");
-                    break;
-                case EPGChannelMessageType_Rating:
-                    CommandPrintf("<rating system=\"%s\" value=\"%s\"/>\n", 
-                                msg->data.rating.system, msg->data.rating.rating);
-                    break;
+                if (binary)
+                {
+                    BufferAddMessage(buffer, cmdContext->outfp, msgs[i]);
+                }
+                else
+                {
+                    PrintXmlMessage(msgs[i]);
+                }
             }
+            ObjectRefDec(msgs[i]);
+        }
 
-
-            CommandPrintf("</event>\n");
+        if (binary)
+        {
+            BufferFlush(buffer, cmdContext->outfp);
+        }
+        else
+        {
             fflush(cmdContext->outfp);
-            ObjectRefDec(msg);
-        }    
+        }
     }
-    
+
     EPGChannelUnregisterListener(msgQ);
     MessageQDestroy(msgQ);
+
+    FilterClearTracked(filter);
+    free(filter);
+    if (buffer)
+    {
+        free(buffer);
+    }
+}
+
+static bool ParseServiceRef(char *text, EPGServiceRef_t *serviceRef)
+{
+    char *end;
+    unsigned long ids[3];
+    int i;
+
+    for (i = 0; i < 3; i ++)
+    {
+        ids[i] = strtoul(text, &end, 16);
+        if ((end == text) || (ids[i] > 0xffff) || (*end != ((i < 2) ? '.' : 0)))
+        {
+            return FALSE;
+        }
+        text = end + 1;
+    }
+    serviceRef->netId = ids[0];
+    serviceRef->tsId = ids[1];
+    serviceRef->serviceId = ids[2];
+    return TRUE;
+}
+
+static bool FilterMessage(EPGDataFilter_t *filter, EPGChannelMessage_t *msg)
+{
+    TrackedEvent_t **tracked;
+
+    if (filter->nrofServices)
+    {
+        EPGServiceRef_t *serviceRef = &msg->eventRef.serviceRef;
+        int i;
+
+        for (i = 0; i < filter->nrofServices; i ++)
+        {
+            if ((filter->services[i].serviceId == serviceRef->serviceId) &&
+                (filter->services[i].tsId == serviceRef->tsId) &&
+                (filter->services[i].netId == serviceRef->netId))
+            {
+                break;
+            }
+        }
+        if (i == filter->nrofServices)
+        {
+            return FALSE;
+        }
+    }
+
+    if (filter->window == 0)
+    {
+        return TRUE;
+    }
+
+    if (msg->type == EPGChannelMessageType_Event)
+    {
+        return FilterEventInWindow(filter, msg);
+    }
+
+    /* Details and ratings don't carry times, so they follow the decision made
+     * for their event, if the event hasn't been seen they are dropped. */
+    tracked = FilterFindTracked(filter, &msg->eventRef);
+    return (*tracked != NULL) && (*tracked)->inWindow;
+}
+
+static bool FilterEventInWindow(EPGDataFilter_t *filter, EPGChannelMessage_t *msg)
+{
+    TrackedEvent_t **tracked;
+    time_t now = time(NULL);
+    struct tm tmTime;
+    time_t startTime;
+    time_t endTime;
+    bool inWindow;
+
+    /* timegm normalises its argument, so work on copies as the message is
+     * shared with the other epgdata clients.
+     */
+    tmTime = msg->data.event.startTime;
+    startTime = timegm(&tmTime);
+    tmTime = msg->data.event.endTime;
+    endTime = timegm(&tmTime);
+    inWindow = (endTime > now) && (startTime < now + filter->window);
+
+    tracked = FilterFindTracked(filter, &msg->eventRef);
+    if (*tracked == NULL)
+    {
+        if (filter->nrofTracked >= MAX_TRACKED_EVENTS)
+        {
+            FilterClearTracked(filter);
+            tracked = FilterFindTracked(filter, &msg->eventRef);
+        }
+        *tracked = calloc(1, sizeof(TrackedEvent_t));
+        if (*tracked == NULL)
+        {
+            return inWindow;
+        }
+        (*tracked)->eventRef = msg->eventRef;
+        filter->nrofTracked ++;
+    }
+    (*tracked)->inWindow = inWindow;
+    return inWindow;
+}
+
+static TrackedEvent_t **FilterFindTracked(EPGDataFilter_t *filter, EPGEventRef_t *eventRef)
+{
+    unsigned int hash = (eventRef->serviceRef.serviceId * 31 + eventRef->eventId) % EVENT_BUCKETS;
+    TrackedEvent_t **entry;
+
+    for (entry = &filter->tracked[hash]; *entry != NULL; entry = &(*entry)->next)
+    {
+        if (((*entry)->eventRef.eventId == eventRef->eventId) &&
+            ((*entry)->eventRef.serviceRef.serviceId == eventRef->serviceRef.serviceId) &&
+            ((*entry)->eventRef.serviceRef.tsId == eventRef->serviceRef.tsId) &&
+            ((*entry)->eventRef.serviceRef.netId == eventRef->serviceRef.netId))
+        {
+            break;
+        }
+    }
+    return entry;
+}
+
+static void FilterClearTracked(EPGDataFilter_t *filter)
+{
+    TrackedEvent_t *entry;
+    TrackedEvent_t *next;
+    int i;
+
+    for (i = 0; i < EVENT_BUCKETS; i ++)
+    {
+        for (entry = filter->tracked[i]; entry != NULL; entry = next)
+        {
+            next = entry->next;
+            free(entry);
+        }
+        filter->tracked[i] = NULL;
+    }
+    filter->nrofTracked = 0;
+}
+
+static void PrintXmlMessage(EPGChannelMessage_t *msg)
+{
+    char startTimeStr[25];
+    char endTimeStr[25];
+
+    CommandPrintf("<event net=\"0x%04x\" ts=\"0x%04x\" source=\"0x%04x\" event=\"0x%08x\">\n",
+        msg->eventRef.serviceRef.netId, msg->eventRef.serviceRef.tsId, msg->eventRef.serviceRef.serviceId,
+        msg->eventRef.eventId);
+    switch(msg->type)
+    {
+        case EPGChannelMessageType_Event:
+            strftime(startTimeStr, sizeof(startTimeStr), "%Y-%m-%d %T", &msg->data.event.startTime);
+            strftime(endTimeStr, sizeof(endTimeStr), "%Y-%m-%d %T", &msg->data.event.endTime);
+            CommandPrintf("<new start=\"%s\" end=\"%s\" ca=\"%s\"/>\n",
+                       startTimeStr, endTimeStr, msg->data.event.ca ? "yes":"no");
+            break;
+        case EPGChannelMessageType_Detail:
+            CommandPrintf("<detail lang=\"%s\" name=\"%s\">",
+                     msg->data.detail.lang,  msg->data.detail.name);
+            PrintXmlified(msg->data.detail.value);
+            CommandPrintf("</detail>\n");
+            break;
+        case EPGChannelMessageType_Rating:
+            CommandPrintf("<rating system=\"%s\" value=\"%s\"/>\n",
+                        msg->data.rating.system, msg->data.rating.rating);
+            break;
+    }
+    CommandPrintf("</event>\n");
+}
+
+static void BufferFlush(EPGDataBuffer_t *buffer, FILE *fp)
+{
+    if (buffer->used)
+    {
+        fwrite(buffer->data, 1, buffer->used, fp);
+        fflush(fp);
+        buffer->used = 0;
+    }
+}
+
+static void BufferAddMessage(EPGDataBuffer_t *buffer, FILE *fp, EPGChannelMessage_t *msg)
+{
+    unsigned char *start;
+    unsigned char *ptr;
+    struct tm tmTime;
+    int len1 = 0;
+    int len2 = 0;
+    int size = FRAME_HEADER_SIZE;
+
+    switch(msg->type)
+    {
+        case EPGChannelMessageType_Event:
+            size += 9;
+            break;
+        case EPGChannelMessageType_Detail:
+            len1 = LimitedLength(msg->data.detail.name, 0xff);
+            len2 = LimitedLength(msg->data.detail.value, 0xffff);
+            size += 3 + 1 + len1 + 2 + len2;
+            break;
+        case EPGChannelMessageType_Rating:
+            len1 = LimitedLength(msg->data.rating.system, 0xff);
+            len2 = LimitedLength(msg->data.rating.rating, 0xff);
+            size += 1 + len1 + 1 + len2;
+            break;
+        default:
+            return;
+    }
+
+    if (buffer->used + size > BATCH_BUFFER_SIZE)
+    {
+        BufferFlush(buffer, fp);
+    }
+
+    start = &buffer->data[buffer->used];
+    ptr = BufferPut32(start, size - 4);
+    *ptr++ = (unsigned char)msg->type;
+    ptr = BufferPut16(ptr, msg->eventRef.serviceRef.netId);
+    ptr = BufferPut16(ptr, msg->eventRef.serviceRef.tsId);
+    ptr = BufferPut16(ptr, msg->eventRef.serviceRef.serviceId);
+    ptr = BufferPut32(ptr, msg->eventRef.eventId);
+
+    switch(msg->type)
+    {
+        case EPGChannelMessageType_Event:
+            tmTime = msg->data.event.startTime;
+            ptr = BufferPut32(ptr, (unsigned int)timegm(&tmTime));
+            tmTime = msg->data.event.endTime;
+            ptr = BufferPut32(ptr, (unsigned int)timegm(&tmTime));
+            *ptr++ = msg->data.event.ca ? 1 : 0;
+            break;
+        case EPGChannelMessageType_Detail:
+            memset(ptr, 0, 3);
+            memcpy(ptr, msg->data.detail.lang, strnlen(msg->data.detail.lang, 3));
+            ptr += 3;
+            ptr = BufferPutString(ptr, msg->data.detail.name, len1, FALSE);
+            ptr = BufferPutString(ptr, msg->data.detail.value, len2, TRUE);
+            break;
+        case EPGChannelMessageType_Rating:
+            ptr = BufferPutString(ptr, msg->data.rating.system, len1, FALSE);
+            ptr = BufferPutString(ptr, msg->data.rating.rating, len2, FALSE);
+            break;
+    }
+    buffer->used += ptr - start;
+}
+
+static int LimitedLength(char *text, int max)
+{
+    return text ? strnlen(text, max) : 0;
+}
+
+static unsigned char *BufferPut16(unsigned char *ptr, unsigned int value)
+{
+    ptr[0] = (value >> 8) & 0xff;
+    ptr[1] = value & 0xff;
+    return ptr + 2;
+}
+
+static unsigned char *BufferPut32(unsigned char *ptr, unsigned int value)
+{
+    ptr[0] = (value >> 24) & 0xff;
+    ptr[1] = (value >> 16) & 0xff;
+    ptr[2] = (value >> 8) & 0xff;
+    ptr[3] = value & 0xff;
+    return ptr + 4;
+}
+
+static unsigned char *BufferPutString(unsigned char *ptr, char *text, int len, bool longLen)
+{
+    if (longLen)
+    {
+        ptr = BufferPut16(ptr, len);
+    }
+    else
+    {
+        *ptr++ = len;
+    }
+    if (len)
+    {
+        memcpy(ptr, text, len);
+    }
+    return ptr + len;
 }
 
 static void PrintXmlified(char *text)
@@ -46,6 +46,7 @@ Command functions to supply the user with information about the system.
 #include "servicefilter.h"
 #include "tuning.h"
 #include "properties.h"
+#include "dbase.h"
 
 /*******************************************************************************
 * Defines                                                                      *
@@ -80,6 +81,7 @@ static void CommandSetProperty(int argc, char **argv);
 static void CommandPropertyInfo(int argc, char **argv);
 static void CommandDumpTSReader(int argc, char **argv);
 static void CommandListLNBs(int argc, char **argv);
+static void CommandDBaseStats(int argc, char **argv);
 static char* GetPropertyTypeString(PropertyType_e type);
 
 /*******************************************************************************
@@ -222,6 +224,14 @@ Command_t CommandDetailsInfo[] =
         "List the LNBs that dvbstreamer knows about and the name used to select them",
         CommandListLNBs 
     },
+    {
+        "dbstats",
+        0, 0,
+        "Display statistics for the cached database statements.",
+        "For each cached database statement display the number of times it has been"
+        " compiled and used, and the average and maximum time in microseconds it was in use.",
+        CommandDBaseStats
+    },
     COMMANDS_SENTINEL
 };
 
@@ -563,6 +573,13 @@ static void CommandStats(int argc, char **argv)
     }
     CommandPrintf("Total packets processed: %lld\n", stats->totalPackets);
     CommandPrintf("Approximate TS bitrate : %gMbs\n", ((double)stats->bitrate / (1024.0 * 1024.0)));
+    CommandPrintf("DVR wakeups            : %lld (%lu/s)\n", stats->totalWakeups, stats->wakeupsPerSec);
+    CommandPrintf("Packets per wakeup     : %u (max %u, buffer %u)\n", stats->lastBatchPackets, stats->maxBatchPackets, stats->bufferPackets);
+    CommandPrintf("Buffers held by outputs: %lld\n", stats->buffersReplaced);
+    if (stats->nrofWorkers)
+    {
+        CommandPrintf("Worker threads         : %d (%lld batches dropped)\n", stats->nrofWorkers, stats->batchesDropped);
+    }
     ObjectRefDec(stats);
 }
 
@@ -897,6 +914,21 @@ static void CommandDumpTSReader(int argc, char **argv)
     TSReaderUnLock(reader);
 }
 
+static void CommandDBaseStats(int argc, char **argv)
+{
+    DBaseStatementStats_t stats[DBASE_STATEMENT_STATS_MAX];
+    int count = DBaseStatementStatsGet(stats, DBASE_STATEMENT_STATS_MAX);
+    int i;
+
+    CommandPrintf("Prepares  Executions  Avg (us)  Max (us)  Statement\n");
+    for (i = 0; i < count; i ++)
+    {
+        CommandPrintf("%8lu  %10lu  %8llu  %8lu  %s\n", stats[i].prepares, stats[i].executions,
+            stats[i].executions ? stats[i].totalTime / stats[i].executions : 0,
+            stats[i].maxTime, stats[i].sql);
+    }
+}
+
 static void CommandListLNBs(int argc, char **argv)
 {
     LNBInfo_t *knownLNB;
@@ -217,8 +217,13 @@ static void CommandSelect(int argc, char **argv)
 
     CommandCheckAuthenticated();
 
-    UpdateDatabase();
-    service = ServiceFind(argv[0]);
+    /* Services on the current multiplex can be found without a database query */
+    service = CacheServiceFind(argv[0]);
+    if (service == NULL)
+    {
+        UpdateDatabase();
+        service = ServiceFind(argv[0]);
+    }
     
     if (service)
     {
@@ -355,7 +360,11 @@ static void CommandSetSFService(int argc, char **argv)
 
     FIND_SERVICE_FILTER(outputName);
 
-    service = ServiceFindName(serviceName);
+    service = CacheServiceFind(serviceName);
+    if (service == NULL)
+    {
+        service = ServiceFindName(serviceName);
+    }
     if (service == NULL)
     {
         /* Attempt to look up the service using the fully qualified name */
@@ -28,6 +28,8 @@ Opens/Closes and setups the sqlite database for use by the rest of the applicati
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "dbase.h"
 #include "types.h"
@@ -37,18 +39,59 @@ Opens/Closes and setups the sqlite database for use by the rest of the applicati
 #include "deferredproc.h"
 
 
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define STATEMENT_BUCKETS   64
+
+/*******************************************************************************
+* Typedefs                                                                     *
+*******************************************************************************/
+typedef struct DBaseCachedStatement_s
+{
+    const char *sql;                /* Key, the address of the sql string. */
+    sqlite3_stmt *stmt;             /* Statement ready to be used or NULL if it is in use. */
+    sqlite3_stmt *inUse;            /* Statement handed out by DBaseStatementPrepare(). */
+    struct timespec started;
+    DBaseStatementStats_t *stats;
+    struct DBaseCachedStatement_s *next;
+    struct DBaseCachedStatement_s *nextInUse;
+}DBaseCachedStatement_t;
+
+typedef struct DBaseConnection_s
+{
+    sqlite3 *db;
+    DBaseCachedStatement_t *statements[STATEMENT_BUCKETS];
+    /* Statements can be released on a different thread to the one that
+     * prepared them so the in use list is protected by mutex. */
+    pthread_mutex_t mutex;
+    DBaseCachedStatement_t *inUse;
+    struct DBaseConnection_s *next;
+}DBaseConnection_t;
+
 /*******************************************************************************
 * Prototypes                                                                   *
 *******************************************************************************/
 
 static int DBaseCreateTables(void);
 static int DBaseCheckVersion();
-
+static DBaseConnection_t *DBaseConnectionCreate(sqlite3 *db);
+static void DBaseConnectionFree(DBaseConnection_t *connection);
+static DBaseConnection_t *DBaseConnectionInfoGet(void);
+static DBaseConnection_t *DBaseConnectionFind(sqlite3 *db);
+static DBaseCachedStatement_t *DBaseStatementUntrack(DBaseConnection_t *connection, sqlite3_stmt *stmt);
+static DBaseStatementStats_t *DBaseStatementStatsFind(const char *sql);
 
 /*******************************************************************************
 * Global variables                                                             *
 *******************************************************************************/
 static sqlite3 *DBaseInstance;
+static DBaseConnection_t *DBaseInstanceConnection;
+static pthread_mutex_t connectionsMutex = PTHREAD_MUTEX_INITIALIZER;
+static DBaseConnection_t *connections = NULL;
+static pthread_mutex_t statementStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static DBaseStatementStats_t statementStats[DBASE_STATEMENT_STATS_MAX];
+static int nrofStatementStats = 0;
 
 static char DBASE[] = "dbase";
 static char dbaseFile[PATH_MAX];
@@ -60,7 +103,7 @@ int DBaseInit(int adapter)
 {
     int rc;
 
-    pthread_key_create(&dbaseKey, (void(*)(void *))sqlite3_close);
+    pthread_key_create(&dbaseKey, (void(*)(void *))DBaseConnectionFree);
 
     sprintf(dbaseFile, "%s/adapter%d.db", DataDirectory, adapter);
     rc = sqlite3_open(dbaseFile, &DBaseInstance);
@@ -71,7 +114,8 @@ int DBaseInit(int adapter)
     }
     else
     {
-        pthread_setspecific(dbaseKey, (void*)DBaseInstance);
+        DBaseInstanceConnection = DBaseConnectionCreate(DBaseInstance);
+        pthread_setspecific(dbaseKey, (void*)DBaseInstanceConnection);
         sqlite3_busy_timeout(DBaseInstance, 500);
         rc = DBaseCheckVersion();
     }
@@ -83,30 +127,161 @@ int DBaseInit(int adapter)
 void DBaseDeInit()
 {
     pthread_setspecific(dbaseKey, NULL);
-    sqlite3_close(DBaseInstance);
+    if (DBaseInstanceConnection)
+    {
+        DBaseConnectionFree(DBaseInstanceConnection);
+        DBaseInstanceConnection = NULL;
+    }
+    else
+    {
+        sqlite3_close(DBaseInstance);
+    }
 }
 
 sqlite3* DBaseConnectionGet(void)
 {
-    
-    sqlite3 *connection = pthread_getspecific(dbaseKey);
+    DBaseConnection_t *connection = DBaseConnectionInfoGet();
+    return connection ? connection->db : NULL;
+}
+
+int DBaseStatementPrepare(const char *sql, sqlite3_stmt **stmt)
+{
+    DBaseConnection_t *connection = DBaseConnectionInfoGet();
+    DBaseCachedStatement_t *entry;
+    unsigned int bucket = ((unsigned long)sql >> 3) % STATEMENT_BUCKETS;
+    int rc;
+
+    *stmt = NULL;
     if (connection == NULL)
     {
-        int rc = sqlite3_open(dbaseFile, &connection);
-        if (rc)
+        return SQLITE_CANTOPEN;
+    }
+
+    for (entry = connection->statements[bucket]; entry; entry = entry->next)
+    {
+        if (entry->sql == sql)
         {
-            LogModule(LOG_ERROR, DBASE, "Can't open database: %s\n", sqlite3_errmsg(connection));
-            sqlite3_close(connection);
-            connection = NULL;
+            break;
         }
-        else
+    }
+
+    if (entry == NULL)
+    {
+        entry = calloc(1, sizeof(DBaseCachedStatement_t));
+        if (entry == NULL)
         {
-            LogModule(LOG_DEBUG, DBASE, "Database opened successfully. (%p)\n", connection);
-            sqlite3_busy_timeout(connection, 500);            
-            pthread_setspecific(dbaseKey, (void*)connection);
+            return SQLITE_NOMEM;
         }
+        entry->sql = sql;
+        entry->stats = DBaseStatementStatsFind(sql);
+        entry->next = connection->statements[bucket];
+        connection->statements[bucket] = entry;
     }
-    return connection;
+
+    if (entry->stmt)
+    {
+        *stmt = entry->stmt;
+        entry->stmt = NULL;
+        rc = SQLITE_OK;
+    }
+    else
+    {
+        rc = sqlite3_prepare_v2(connection->db, sql, -1, stmt, NULL);
+        if ((rc == SQLITE_OK) && entry->stats)
+        {
+            pthread_mutex_lock(&statementStatsMutex);
+            entry->stats->prepares ++;
+            pthread_mutex_unlock(&statementStatsMutex);
+        }
+    }
+
+    /* If the cached statement is already in use (ie an enumerator is open) the
+     * new statement is not tracked and will be finalised when released. */
+    if (rc == SQLITE_OK)
+    {
+        pthread_mutex_lock(&connection->mutex);
+        if (entry->inUse == NULL)
+        {
+            entry->inUse = *stmt;
+            entry->nextInUse = connection->inUse;
+            connection->inUse = entry;
+            clock_gettime(CLOCK_MONOTONIC, &entry->started);
+        }
+        pthread_mutex_unlock(&connection->mutex);
+    }
+    return rc;
+}
+
+int DBaseStatementRelease(sqlite3_stmt *stmt)
+{
+    DBaseConnection_t *connection;
+    DBaseCachedStatement_t *entry;
+    struct timespec now;
+    unsigned long elapsed;
+    int rc;
+
+    if (stmt == NULL)
+    {
+        return SQLITE_OK;
+    }
+
+    connection = pthread_getspecific(dbaseKey);
+    if ((connection == NULL) || (sqlite3_db_handle(stmt) != connection->db))
+    {
+        /* Released on a different thread to the one that prepared it, the
+         * owning connection must stop tracking it before it is finalised or
+         * the connection would finalise it again when it is freed.
+         */
+        pthread_mutex_lock(&connectionsMutex);
+        connection = DBaseConnectionFind(sqlite3_db_handle(stmt));
+        if (connection)
+        {
+            pthread_mutex_lock(&connection->mutex);
+            DBaseStatementUntrack(connection, stmt);
+            pthread_mutex_unlock(&connection->mutex);
+        }
+        pthread_mutex_unlock(&connectionsMutex);
+        return sqlite3_finalize(stmt);
+    }
+
+    pthread_mutex_lock(&connection->mutex);
+    entry = DBaseStatementUntrack(connection, stmt);
+    pthread_mutex_unlock(&connection->mutex);
+    if (entry == NULL)
+    {
+        return sqlite3_finalize(stmt);
+    }
+
+    rc = sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    entry->stmt = stmt;
+
+    if (entry->stats)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - entry->started.tv_sec) * 1000000 +
+                  (now.tv_nsec - entry->started.tv_nsec) / 1000;
+        pthread_mutex_lock(&statementStatsMutex);
+        entry->stats->executions ++;
+        entry->stats->totalTime += elapsed;
+        if (elapsed > entry->stats->maxTime)
+        {
+            entry->stats->maxTime = elapsed;
+        }
+        pthread_mutex_unlock(&statementStatsMutex);
+    }
+    return rc;
+}
+
+int DBaseStatementStatsGet(DBaseStatementStats_t *stats, int max)
+{
+    int count;
+
+    pthread_mutex_lock(&statementStatsMutex);
+    count = (nrofStatementStats < max) ? nrofStatementStats : max;
+    memcpy(stats, statementStats, count * sizeof(DBaseStatementStats_t));
+    pthread_mutex_unlock(&statementStatsMutex);
+    return count;
 }
 
 int DBaseTransactionBegin(void)
@@ -148,6 +323,163 @@ int DBaseCount(char *table, char *where)
 /*******************************************************************************
 * Local Functions                                                              *
 *******************************************************************************/
+static DBaseConnection_t *DBaseConnectionCreate(sqlite3 *db)
+{
+    DBaseConnection_t *connection = calloc(1, sizeof(DBaseConnection_t));
+    if (connection)
+    {
+        connection->db = db;
+        pthread_mutex_init(&connection->mutex, NULL);
+        pthread_mutex_lock(&connectionsMutex);
+        connection->next = connections;
+        connections = connection;
+        pthread_mutex_unlock(&connectionsMutex);
+    }
+    return connection;
+}
+
+static void DBaseConnectionFree(DBaseConnection_t *connection)
+{
+    DBaseCachedStatement_t *entry;
+    DBaseCachedStatement_t *next;
+    DBaseConnection_t **prev;
+    sqlite3_stmt *stmt;
+    int i;
+
+    pthread_mutex_lock(&connectionsMutex);
+    for (prev = &connections; *prev; prev = &(*prev)->next)
+    {
+        if (*prev == connection)
+        {
+            *prev = connection->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&connectionsMutex);
+
+    for (i = 0; i < STATEMENT_BUCKETS; i ++)
+    {
+        for (entry = connection->statements[i]; entry; entry = next)
+        {
+            next = entry->next;
+            if (entry->stmt)
+            {
+                sqlite3_finalize(entry->stmt);
+            }
+            if (entry->inUse)
+            {
+                sqlite3_finalize(entry->inUse);
+            }
+            free(entry);
+        }
+    }
+    /* Statements that weren't cached (because the cached one was in use) and
+     * were never released would stop the connection being closed. */
+    while ((stmt = sqlite3_next_stmt(connection->db, NULL)) != NULL)
+    {
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(connection->db);
+    pthread_mutex_destroy(&connection->mutex);
+    free(connection);
+}
+
+static DBaseConnection_t *DBaseConnectionInfoGet(void)
+{
+    DBaseConnection_t *connection = pthread_getspecific(dbaseKey);
+    if (connection == NULL)
+    {
+        sqlite3 *db;
+        int rc = sqlite3_open(dbaseFile, &db);
+        if (rc)
+        {
+            LogModule(LOG_ERROR, DBASE, "Can't open database: %s\n", sqlite3_errmsg(db));
+            sqlite3_close(db);
+        }
+        else
+        {
+            LogModule(LOG_DEBUG, DBASE, "Database opened successfully. (%p)\n", db);
+            sqlite3_busy_timeout(db, 500);
+            connection = DBaseConnectionCreate(db);
+            if (connection)
+            {
+                pthread_setspecific(dbaseKey, (void*)connection);
+            }
+            else
+            {
+                sqlite3_close(db);
+            }
+        }
+    }
+    return connection;
+}
+
+/*
+ * Find the connection a database handle belongs to, called with
+ * connectionsMutex held.
+ */
+static DBaseConnection_t *DBaseConnectionFind(sqlite3 *db)
+{
+    DBaseConnection_t *connection;
+
+    for (connection = connections; connection; connection = connection->next)
+    {
+        if (connection->db == db)
+        {
+            break;
+        }
+    }
+    return connection;
+}
+
+/*
+ * Remove a statement from the connection's in use list, returns the cache entry
+ * it was handed out from or NULL if it isn't tracked. Called with the
+ * connection's mutex held.
+ */
+static DBaseCachedStatement_t *DBaseStatementUntrack(DBaseConnection_t *connection, sqlite3_stmt *stmt)
+{
+    DBaseCachedStatement_t **prev;
+    DBaseCachedStatement_t *entry;
+
+    for (prev = &connection->inUse; *prev; prev = &(*prev)->nextInUse)
+    {
+        entry = *prev;
+        if ((entry->inUse == stmt) && (strcmp(sqlite3_sql(stmt), entry->sql) == 0))
+        {
+            *prev = entry->nextInUse;
+            entry->nextInUse = NULL;
+            entry->inUse = NULL;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static DBaseStatementStats_t *DBaseStatementStatsFind(const char *sql)
+{
+    DBaseStatementStats_t *result = NULL;
+    int i;
+
+    pthread_mutex_lock(&statementStatsMutex);
+    for (i = 0; i < nrofStatementStats; i ++)
+    {
+        if (statementStats[i].sql == sql)
+        {
+            result = &statementStats[i];
+            break;
+        }
+    }
+    if ((result == NULL) && (nrofStatementStats < DBASE_STATEMENT_STATS_MAX))
+    {
+        result = &statementStats[nrofStatementStats];
+        result->sql = sql;
+        nrofStatementStats ++;
+    }
+    pthread_mutex_unlock(&statementStatsMutex);
+    return result;
+}
+
 static int DBaseCheckVersion()
 {
     int rc;
@@ -22,13 +22,41 @@ Delivery Method management functions.
 */
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 #include "logging.h"
 #include "list.h"
 #include "deliverymethod.h"
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define WRITE_MAX_IOVS 256
+
+/*******************************************************************************
+* Typedefs                                                                     *
+*******************************************************************************/
+/* Packets gathered for an instance's OutputPackets() function. */
+typedef struct DeliveryMethodGather_s
+{
+    int nrofPackets;
+    TSPacket_t *packets[DELIVERYMETHOD_MAX_GATHER];
+    int nrofRefs;
+    TSPacketBatch_t *refs[DELIVERYMETHOD_MAX_GATHER]; /* Batches the gathered packets belong to. */
+    int nrofCopies;
+    TSPacket_t copies[DELIVERYMETHOD_MAX_GATHER];     /* Packets that weren't part of a batch. */
+}DeliveryMethodGather_t;
+
 /*******************************************************************************
 * Prototypes                                                                   *
 *******************************************************************************/
+static void DeliveryMethodGatherPacket(DeliveryMethodInstance_t *instance, TSPacket_t *packet);
+static void DeliveryMethodGatherSend(DeliveryMethodInstance_t *instance);
+static void DeliveryMethodAddFlushPending(DeliveryMethodInstance_t *instance);
+static int DeliveryMethodWriteAll(int fd, struct iovec *iovs, int nrofIovs);
 
 bool NullOutputCanHandle(char *mrl);
 DeliveryMethodInstance_t *NullOutputCreate(char *arg);
@@ -39,6 +67,13 @@ void NullOutputDestroy(DeliveryMethodInstance_t *this);
 static char DELIVERYMETHOD[] = "DeliveryMethod";
 static List_t *DeliveryMethodsList;
 static List_t *InstancesList;
+static List_t *FlushPendingList;
+static pthread_mutex_t FlushPendingMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t FlushingCond = PTHREAD_COND_INITIALIZER;
+/* Set once a thread has called DeliveryMethodFlushPending(), packets are only
+ * gathered on threads that will flush them.
+ */
+static __thread bool threadFlushes = FALSE;
 
 /** Constants for the start of the MRL **/
 #define PREFIX_LEN (sizeof(NullPrefix) - 1)
@@ -55,6 +90,7 @@ static DeliveryMethodInstanceOps_t nullInstanceOps = {
     NULL,
     NullOutputDestroy,
     NULL,
+    NULL,
     NULL
 };
 
@@ -80,6 +116,13 @@ int DeliveryMethodManagerInit(void)
         ListFree(DeliveryMethodsList, NULL);
         return -1;
     }
+    FlushPendingList = ListCreate();
+    if (FlushPendingList == NULL)
+    {
+        ListFree(InstancesList, NULL);
+        ListFree(DeliveryMethodsList, NULL);
+        return -1;
+    }
     DeliveryMethodManagerRegister(&NullOutputHandler);
     return 0;
 }
@@ -92,6 +135,7 @@ void DeliveryMethodManagerDeInit(void)
         LogModule(LOG_ERROR, DELIVERYMETHOD, "Instances still exist when shutting down Delivery Method Manager!\n");
     }
     ListFree(InstancesList, NULL);
+    ListFree(FlushPendingList, NULL);
 }
 
 void DeliveryMethodManagerRegister(DeliveryMethodHandler_t *handler)
@@ -134,6 +178,25 @@ DeliveryMethodInstance_t *DeliveryMethodCreate(char *mrl)
 void DeliveryMethodDestroy(DeliveryMethodInstance_t *instance)
 {
     LogModule(LOG_DEBUG, DELIVERYMETHOD, "Released DeliveryMethodInstance(%p) for %s\n" ,instance, instance->mrl);
+    pthread_mutex_lock(&FlushPendingMutex);
+    instance->destroying = TRUE;
+    if (instance->flushPending)
+    {
+        ListRemove(FlushPendingList, instance);
+        instance->flushPending = FALSE;
+    }
+    /* Another thread may be part way through flushing the instance. */
+    while (instance->flushing)
+    {
+        pthread_cond_wait(&FlushingCond, &FlushPendingMutex);
+    }
+    pthread_mutex_unlock(&FlushPendingMutex);
+    if (instance->gather)
+    {
+        DeliveryMethodGatherSend(instance);
+        free(instance->gather);
+        instance->gather = NULL;
+    }
     instance->ops->DestroyInstance(instance);
     ListRemove(InstancesList, instance);
 }
@@ -173,6 +236,28 @@ void DeliveryMethodSetHeader(DeliveryMethodInstance_t *instance, TSPacket_t *pac
 
 void DeliveryMethodOutputPacket(DeliveryMethodInstance_t *instance, TSPacket_t* packet)
 {
+    if (instance->ops->OutputPackets)
+    {
+        if (threadFlushes)
+        {
+            DeliveryMethodGatherPacket(instance, packet);
+        }
+        else
+        {
+            DeliveryMethodGatherSend(instance);
+            instance->ops->OutputPackets(instance, &packet, 1);
+        }
+        return;
+    }
+    if (instance->ops->OutputPacketRef)
+    {
+        TSPacketBatch_t *batch = TSPacketBatchGetCurrent(packet);
+        if (batch)
+        {
+            instance->ops->OutputPacketRef(instance, packet, batch);
+            return;
+        }
+    }
     if (instance->ops->OutputPacket)
     {
         instance->ops->OutputPacket(instance, packet);
@@ -183,10 +268,233 @@ void DeliveryMethodOutputBlock(DeliveryMethodInstance_t *instance, void *block,
 {
     if (instance->ops->OutputBlock)
     {
+        /* Keep the block in order with any packets already gathered. */
+        DeliveryMethodGatherSend(instance);
         instance->ops->OutputBlock(instance, block, blockLen);
     }
 }
 
+void DeliveryMethodFlushRequired(DeliveryMethodInstance_t *instance)
+{
+    if ((instance->ops->Flush == NULL) && (instance->ops->OutputPackets == NULL))
+    {
+        return;
+    }
+    pthread_mutex_lock(&FlushPendingMutex);
+    DeliveryMethodAddFlushPending(instance);
+    pthread_mutex_unlock(&FlushPendingMutex);
+}
+
+void DeliveryMethodFlushPending(void)
+{
+    ListIterator_t iterator;
+    pthread_t self = pthread_self();
+    int count = 0;
+    int i;
+
+    threadFlushes = TRUE;
+    pthread_mutex_lock(&FlushPendingMutex);
+    if (ListCount(FlushPendingList) == 0)
+    {
+        pthread_mutex_unlock(&FlushPendingMutex);
+        return;
+    }
+    {
+        DeliveryMethodInstance_t *instances[ListCount(FlushPendingList)];
+
+        /* Only take the instances for this thread, the others will be flushed
+         * by the threads writing to them.
+         */
+        for (ListIterator_Init(iterator, FlushPendingList); ListIterator_MoreEntries(iterator);)
+        {
+            DeliveryMethodInstance_t *instance = ListIterator_Current(iterator);
+            if (pthread_equal(instance->flushThread, self))
+            {
+                ListRemoveCurrent(&iterator);
+                instance->flushPending = FALSE;
+                instance->flushing = TRUE;
+                instances[count] = instance;
+                count ++;
+            }
+            else
+            {
+                ListIterator_Next(iterator);
+            }
+        }
+        pthread_mutex_unlock(&FlushPendingMutex);
+
+        /* Flush without holding the mutex so threads don't wait on each other's
+         * system calls.
+         */
+        for (i = 0; i < count; i ++)
+        {
+            bool again = FALSE;
+            DeliveryMethodGatherSend(instances[i]);
+            if (instances[i]->ops->Flush)
+            {
+                again = instances[i]->ops->Flush(instances[i]);
+            }
+            pthread_mutex_lock(&FlushPendingMutex);
+            instances[i]->flushing = FALSE;
+            if (again)
+            {
+                DeliveryMethodAddFlushPending(instances[i]);
+            }
+            pthread_cond_broadcast(&FlushingCond);
+            pthread_mutex_unlock(&FlushPendingMutex);
+        }
+    }
+}
+
+int DeliveryMethodWritePackets(int fd, TSPacket_t **packets, int count)
+{
+    struct iovec iovs[WRITE_MAX_IOVS];
+    struct iovec *last;
+    int nrofIovs = 0;
+    int i;
+
+    for (i = 0; i < count; i ++)
+    {
+        last = nrofIovs ? &iovs[nrofIovs - 1] : NULL;
+        if (last && (((uint8_t *)last->iov_base) + last->iov_len == (uint8_t *)packets[i]))
+        {
+            last->iov_len += TSPACKET_SIZE;
+            continue;
+        }
+        if (nrofIovs == WRITE_MAX_IOVS)
+        {
+            if (DeliveryMethodWriteAll(fd, iovs, nrofIovs))
+            {
+                return -1;
+            }
+            nrofIovs = 0;
+        }
+        iovs[nrofIovs].iov_base = packets[i];
+        iovs[nrofIovs].iov_len = TSPACKET_SIZE;
+        nrofIovs ++;
+    }
+    return DeliveryMethodWriteAll(fd, iovs, nrofIovs);
+}
+
+/*******************************************************************************
+* Local Functions                                                              *
+*******************************************************************************/
+static void DeliveryMethodGatherPacket(DeliveryMethodInstance_t *instance, TSPacket_t *packet)
+{
+    DeliveryMethodGather_t *gather = instance->gather;
+    TSPacketBatch_t *batch;
+
+    if (gather == NULL)
+    {
+        gather = malloc(sizeof(DeliveryMethodGather_t));
+        if (gather == NULL)
+        {
+            LogModule(LOG_ERROR, DELIVERYMETHOD, "Failed to allocate packet gather buffer for %s\n", instance->mrl);
+            if (instance->ops->OutputPacket)
+            {
+                instance->ops->OutputPacket(instance, packet);
+            }
+            return;
+        }
+        gather->nrofPackets = 0;
+        gather->nrofRefs = 0;
+        gather->nrofCopies = 0;
+        instance->gather = gather;
+    }
+
+    /* Hold on to the batch rather than copying the packet where possible,
+     * packets nearly always come from the same batch as the previous one.
+     */
+    batch = TSPacketBatchGetCurrent(packet);
+    if (batch)
+    {
+        if ((gather->nrofRefs == 0) || (gather->refs[gather->nrofRefs - 1] != batch))
+        {
+            TSPacketBatchRef(batch);
+            gather->refs[gather->nrofRefs] = batch;
+            gather->nrofRefs ++;
+        }
+    }
+    else
+    {
+        gather->copies[gather->nrofCopies] = *packet;
+        packet = &gather->copies[gather->nrofCopies];
+        gather->nrofCopies ++;
+    }
+    gather->packets[gather->nrofPackets] = packet;
+    gather->nrofPackets ++;
+
+    if (gather->nrofPackets == 1)
+    {
+        DeliveryMethodFlushRequired(instance);
+    }
+    else if (gather->nrofPackets >= DELIVERYMETHOD_MAX_GATHER)
+    {
+        DeliveryMethodGatherSend(instance);
+    }
+}
+
+/* Must be called with FlushPendingMutex held. */
+static void DeliveryMethodAddFlushPending(DeliveryMethodInstance_t *instance)
+{
+    if (!instance->flushPending && !instance->destroying)
+    {
+        instance->flushPending = TRUE;
+        instance->flushThread = pthread_self();
+        ListAdd(FlushPendingList, instance);
+    }
+}
+
+static void DeliveryMethodGatherSend(DeliveryMethodInstance_t *instance)
+{
+    DeliveryMethodGather_t *gather = instance->gather;
+    int i;
+
+    if ((gather == NULL) || (gather->nrofPackets == 0))
+    {
+        return;
+    }
+    instance->ops->OutputPackets(instance, gather->packets, gather->nrofPackets);
+    for (i = 0; i < gather->nrofRefs; i ++)
+    {
+        TSPacketBatchRelease(gather->refs[i]);
+    }
+    gather->nrofPackets = 0;
+    gather->nrofRefs = 0;
+    gather->nrofCopies = 0;
+}
+
+static int DeliveryMethodWriteAll(int fd, struct iovec *iovs, int nrofIovs)
+{
+    ssize_t written;
+
+    while (nrofIovs)
+    {
+        written = writev(fd, iovs, nrofIovs);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        /* Skip over what was written and retry the rest. */
+        while (nrofIovs && (written >= (ssize_t)iovs->iov_len))
+        {
+            written -= iovs->iov_len;
+            iovs ++;
+            nrofIovs --;
+        }
+        if (nrofIovs)
+        {
+            iovs->iov_base = ((uint8_t *)iovs->iov_base) + written;
+            iovs->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
 /*******************************************************************************
 * NULL Delivery Method Functions                                                    *
 *******************************************************************************/
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #if defined(HAVE_INTTYPES_H)
 #include <inttypes.h>
@@ -138,37 +139,369 @@ static uint32_t s_crc32_table[256] =
 };
 
 /*****************************************************************************
- * dvbpsi_ClaimPSISection
+ * CRC_32 engine
  *****************************************************************************
- * Return a previously released section if one is available or create a new one.
+ * The byte by byte table above is extended to 8 tables at startup so 8 bytes
+ * can be processed per step (slicing-by-8). On x86-64 CPUs with PCLMULQDQ,
+ * 64 byte blocks are folded with carry-less multiplies and the remaining
+ * 128bit residue is finished with the tables. The implementation is chosen
+ * the first time a CRC is calculated.
  *****************************************************************************/
-dvbpsi_psi_section_t * dvbpsi_ClaimPSISection(dvbpsi_handle h_dvbpsi, int i_max_size)
+#define CRC32_POLY 0x04c11db7
+
+typedef uint32_t (*dvbpsi_crc32_fn)(uint32_t i_crc, const uint8_t *p_data, size_t i_length);
+
+static uint32_t s_crc32_slice_table[8][256];
+static dvbpsi_crc32_fn s_crc32_fn;
+static pthread_once_t s_crc32_once = PTHREAD_ONCE_INIT;
+
+static uint32_t CRC32Byte(uint32_t i_crc, const uint8_t *p_data, size_t i_length)
+{
+    while (i_length--)
+    {
+        i_crc = (i_crc << 8) ^ s_crc32_table[(i_crc >> 24) ^ *p_data++];
+    }
+    return i_crc;
+}
+
+static uint32_t CRC32Slice8(uint32_t i_crc, const uint8_t *p_data, size_t i_length)
+{
+    /* Align to 8 bytes so the main loop can use aligned loads */
+    while (i_length && ((uintptr_t)p_data & 7))
+    {
+        i_crc = (i_crc << 8) ^ s_crc32_table[(i_crc >> 24) ^ *p_data++];
+        i_length --;
+    }
+
+    while (i_length >= 8)
+    {
+        uint32_t i_hi = i_crc ^ (((uint32_t)p_data[0] << 24) | ((uint32_t)p_data[1] << 16) |
+                                 ((uint32_t)p_data[2] << 8) | p_data[3]);
+        i_crc = s_crc32_slice_table[7][i_hi >> 24] ^
+                s_crc32_slice_table[6][(i_hi >> 16) & 0xff] ^
+                s_crc32_slice_table[5][(i_hi >> 8) & 0xff] ^
+                s_crc32_slice_table[4][i_hi & 0xff] ^
+                s_crc32_slice_table[3][p_data[4]] ^
+                s_crc32_slice_table[2][p_data[5]] ^
+                s_crc32_slice_table[1][p_data[6]] ^
+                s_crc32_slice_table[0][p_data[7]];
+        p_data += 8;
+        i_length -= 8;
+    }
+
+    while (i_length--)
+    {
+        i_crc = (i_crc << 8) ^ s_crc32_table[(i_crc >> 24) ^ *p_data++];
+    }
+    return i_crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+/* Folding constants, x^n mod P(x), calculated in CRC32Init */
+static uint64_t s_crc32_k_fold4[2];
+static uint64_t s_crc32_k_fold1[2];
+
+static uint32_t CRC32XPowMod(int n)
+{
+    uint32_t i_r = 1;
+    while (n--)
+    {
+        i_r = (i_r << 1) ^ ((i_r & 0x80000000) ? CRC32_POLY : 0);
+    }
+    return i_r;
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i CRC32Fold(__m128i x, __m128i k, __m128i data)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+                                       _mm_clmulepi64_si128(x, k, 0x00)),
+                         data);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static uint32_t CRC32PCLMul(uint32_t i_crc, const uint8_t *p_data, size_t i_length)
+{
+    const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i k4, k1, x0, x1, x2, x3;
+    uint8_t residue[16];
+
+    if (i_length < 64)
+    {
+        return CRC32Slice8(i_crc, p_data, i_length);
+    }
+
+    k4 = _mm_set_epi64x(s_crc32_k_fold4[1], s_crc32_k_fold4[0]);
+    k1 = _mm_set_epi64x(s_crc32_k_fold1[1], s_crc32_k_fold1[0]);
+
+    /* Bytes are reversed so bit n of a register is the coefficient of x^n,
+     * the running CRC is added to the first 32 bits of the message. */
+    x0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p_data), swap);
+    x0 = _mm_xor_si128(x0, _mm_set_epi32((int)i_crc, 0, 0, 0));
+    x1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p_data + 16)), swap);
+    x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p_data + 32)), swap);
+    x3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p_data + 48)), swap);
+    p_data += 64;
+    i_length -= 64;
+
+    while (i_length >= 64)
+    {
+        x0 = CRC32Fold(x0, k4, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p_data), swap));
+        x1 = CRC32Fold(x1, k4, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p_data + 16)), swap));
+        x2 = CRC32Fold(x2, k4, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p_data + 32)), swap));
+        x3 = CRC32Fold(x3, k4, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p_data + 48)), swap));
+        p_data += 64;
+        i_length -= 64;
+    }
+
+    x0 = CRC32Fold(x0, k1, x1);
+    x0 = CRC32Fold(x0, k1, x2);
+    x0 = CRC32Fold(x0, k1, x3);
+
+    while (i_length >= 16)
+    {
+        x0 = CRC32Fold(x0, k1, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p_data), swap));
+        p_data += 16;
+        i_length -= 16;
+    }
+
+    /* The residue is congruent to the message so far, finish with the tables */
+    _mm_storeu_si128((__m128i *)residue, _mm_shuffle_epi8(x0, swap));
+    i_crc = CRC32Slice8(0, residue, sizeof(residue));
+    return CRC32Slice8(i_crc, p_data, i_length);
+}
+#endif
+
+static int CRC32HavePCLMul(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#else
+    return 0;
+#endif
+}
+
+static void CRC32Init(void)
 {
-    dvbpsi_psi_section_t *p_current = h_dvbpsi->p_free_sections;
-    dvbpsi_psi_section_t *p_prev = NULL;
+    int i, j;
 
-    while (p_current)
+    for (i = 0; i < 256; i ++)
+    {
+        s_crc32_slice_table[0][i] = s_crc32_table[i];
+    }
+    for (j = 1; j < 8; j ++)
     {
-        if (p_current->i_max_size == i_max_size)
+        for (i = 0; i < 256; i ++)
         {
-            p_current->p_payload_end = p_current->p_data;
-            
-            if (p_prev)
-            {
-                p_prev->p_next = p_current->p_next;
-            }
-            else
+            uint32_t i_prev = s_crc32_slice_table[j - 1][i];
+            s_crc32_slice_table[j][i] = (i_prev << 8) ^ s_crc32_table[i_prev >> 24];
+        }
+    }
+    s_crc32_fn = CRC32Slice8;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (CRC32HavePCLMul())
+    {
+        /* Folding a 128bit block forward by n bits multiplies its high and
+         * low 64bit halves by x^(n+64) and x^n respectively. */
+        s_crc32_k_fold4[1] = CRC32XPowMod(512 + 64);
+        s_crc32_k_fold4[0] = CRC32XPowMod(512);
+        s_crc32_k_fold1[1] = CRC32XPowMod(128 + 64);
+        s_crc32_k_fold1[0] = CRC32XPowMod(128);
+        s_crc32_fn = CRC32PCLMul;
+    }
+#endif
+}
+
+/*****************************************************************************
+ * dvbpsi_SelectCRC32Engine
+ *****************************************************************************
+ * Override the implementation chosen by CRC32Init.
+ *****************************************************************************/
+int dvbpsi_SelectCRC32Engine(dvbpsi_crc32_engine_t engine)
+{
+    pthread_once(&s_crc32_once, CRC32Init);
+    switch (engine)
+    {
+        case DVBPSI_CRC32_BYTE:
+            s_crc32_fn = CRC32Byte;
+            return 0;
+        case DVBPSI_CRC32_SLICE8:
+            s_crc32_fn = CRC32Slice8;
+            return 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+        case DVBPSI_CRC32_PCLMUL:
+            if (CRC32HavePCLMul())
             {
-                h_dvbpsi->p_free_sections = p_current->p_next;
+                s_crc32_fn = CRC32PCLMul;
+                return 0;
             }
-            
-            p_current->p_next = NULL;
-            return p_current;
+            break;
+#endif
+        default:
+            break;
+    }
+    return -1;
+}
+
+/*****************************************************************************
+ * dvbpsi_CRC32
+ *****************************************************************************
+ * Calculate the MPEG-2 CRC_32 of a block of data.
+ *****************************************************************************/
+uint32_t dvbpsi_CRC32(const uint8_t *p_data, int i_length)
+{
+    pthread_once(&s_crc32_once, CRC32Init);
+    return s_crc32_fn(0xffffffff, p_data, (size_t)i_length);
+}
+
+/*****************************************************************************
+ * Section pool
+ *****************************************************************************
+ * Section data is allocated from a process wide pool of size bucketed free
+ * lists (256 to 4096 bytes) so claiming and releasing a section is O(1) and
+ * sections released by one decoder can be reused by any other.
+ * The data buffer is reference counted so a section can be handed to
+ * several decoders without copying, a buffer is only copied before it is
+ * modified while shared (see dvbpsi_UnsharePSISection).
+ *****************************************************************************/
+#define SECTION_BUCKET_MIN_SHIFT 8
+#define SECTION_BUCKET_COUNT     5
+#define SECTION_POOL_MAX_FREE    128
+
+struct dvbpsi_psi_buffer_s
+{
+    volatile int i_refcount;
+    int i_bucket;             /* -1 if not from a pool bucket */
+    struct dvbpsi_psi_buffer_s *p_next;
+    uint8_t data[];
+};
+
+typedef struct
+{
+    struct dvbpsi_psi_buffer_s *p_free;
+    int i_free;
+}dvbpsi_psi_bucket_t;
+
+static pthread_mutex_t s_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dvbpsi_psi_bucket_t s_buckets[SECTION_BUCKET_COUNT];
+static dvbpsi_psi_section_t *s_free_sections = NULL;
+static int s_free_sections_count = 0;
+
+static int SectionBucket(int i_max_size)
+{
+    int i_bucket;
+    for (i_bucket = 0; i_bucket < SECTION_BUCKET_COUNT; i_bucket ++)
+    {
+        if (i_max_size <= (1 << (SECTION_BUCKET_MIN_SHIFT + i_bucket)))
+        {
+            return i_bucket;
+        }
+    }
+    return -1;
+}
+
+static struct dvbpsi_psi_buffer_s *SectionBufferGet(int i_max_size)
+{
+    struct dvbpsi_psi_buffer_s *p_buffer = NULL;
+    int i_bucket = SectionBucket(i_max_size);
+    int i_alloc_size = i_max_size;
+
+    if (i_bucket != -1)
+    {
+        pthread_mutex_lock(&s_pool_mutex);
+        p_buffer = s_buckets[i_bucket].p_free;
+        if (p_buffer)
+        {
+            s_buckets[i_bucket].p_free = p_buffer->p_next;
+            s_buckets[i_bucket].i_free --;
         }
-        p_prev = p_current;
-        p_current = p_current->p_next;
+        pthread_mutex_unlock(&s_pool_mutex);
+        i_alloc_size = 1 << (SECTION_BUCKET_MIN_SHIFT + i_bucket);
     }
 
+    if (p_buffer == NULL)
+    {
+        p_buffer = malloc(sizeof(struct dvbpsi_psi_buffer_s) + i_alloc_size);
+        if (p_buffer == NULL)
+        {
+            return NULL;
+        }
+        p_buffer->i_bucket = i_bucket;
+    }
+    p_buffer->i_refcount = 1;
+    p_buffer->p_next = NULL;
+    return p_buffer;
+}
+
+static void SectionBufferPut(struct dvbpsi_psi_buffer_s *p_buffer)
+{
+    int i_bucket = p_buffer->i_bucket;
+
+    if (__sync_sub_and_fetch(&p_buffer->i_refcount, 1) != 0)
+    {
+        return;
+    }
+
+    if (i_bucket != -1)
+    {
+        pthread_mutex_lock(&s_pool_mutex);
+        if (s_buckets[i_bucket].i_free < SECTION_POOL_MAX_FREE)
+        {
+            p_buffer->p_next = s_buckets[i_bucket].p_free;
+            s_buckets[i_bucket].p_free = p_buffer;
+            s_buckets[i_bucket].i_free ++;
+            p_buffer = NULL;
+        }
+        pthread_mutex_unlock(&s_pool_mutex);
+    }
+    free(p_buffer);
+}
+
+static dvbpsi_psi_section_t *SectionHeaderGet(void)
+{
+    dvbpsi_psi_section_t *p_section;
+
+    pthread_mutex_lock(&s_pool_mutex);
+    p_section = s_free_sections;
+    if (p_section)
+    {
+        s_free_sections = p_section->p_next;
+        s_free_sections_count --;
+    }
+    pthread_mutex_unlock(&s_pool_mutex);
+
+    if (p_section == NULL)
+    {
+        p_section = malloc(sizeof(dvbpsi_psi_section_t));
+    }
+    return p_section;
+}
+
+static void SectionHeaderPut(dvbpsi_psi_section_t *p_section)
+{
+    pthread_mutex_lock(&s_pool_mutex);
+    if (s_free_sections_count < SECTION_POOL_MAX_FREE * SECTION_BUCKET_COUNT)
+    {
+        p_section->p_next = s_free_sections;
+        s_free_sections = p_section;
+        s_free_sections_count ++;
+        p_section = NULL;
+    }
+    pthread_mutex_unlock(&s_pool_mutex);
+    free(p_section);
+}
+
+/*****************************************************************************
+ * dvbpsi_ClaimPSISection
+ *****************************************************************************
+ * Return a previously released section if one is available or create a new one.
+ *****************************************************************************/
+dvbpsi_psi_section_t * dvbpsi_ClaimPSISection(dvbpsi_handle h_dvbpsi, int i_max_size)
+{
     return dvbpsi_NewPSISection(i_max_size);
 }
 
@@ -179,15 +512,7 @@ dvbpsi_psi_section_t * dvbpsi_ClaimPSISection(dvbpsi_handle h_dvbpsi, int i_max_
  *****************************************************************************/
 void dvbpsi_ReleasePSISections(dvbpsi_handle h_dvbpsi, dvbpsi_psi_section_t * p_section)
 {
-    dvbpsi_psi_section_t *p_tail = p_section;
-    /* find the last section in the sections to release */
-    while (p_tail->p_next)
-    {
-        p_tail = p_tail->p_next;
-    }
-    
-    p_tail->p_next = h_dvbpsi->p_free_sections;
-    h_dvbpsi->p_free_sections = p_section;
+    dvbpsi_DeletePSISections(p_section);
 }
 
 /*****************************************************************************
@@ -197,30 +522,73 @@ void dvbpsi_ReleasePSISections(dvbpsi_handle h_dvbpsi, dvbpsi_psi_section_t * p_
  *****************************************************************************/
 dvbpsi_psi_section_t * dvbpsi_ClonePSISection(dvbpsi_handle h_dvbpsi, dvbpsi_psi_section_t * p_section)
 {
-    dvbpsi_psi_section_t *p_cloned = NULL;
-    p_cloned = dvbpsi_ClaimPSISection(h_dvbpsi, p_section->i_max_size);
+    dvbpsi_psi_section_t *p_cloned = dvbpsi_SharePSISection(p_section);
     if (p_cloned == NULL)
     {
         return NULL;
     }
-    p_cloned->i_table_id = p_section->i_table_id;
-    p_cloned->b_syntax_indicator = p_section->b_syntax_indicator;
-    p_cloned->b_private_indicator = p_section->b_private_indicator;
-    p_cloned->i_length = p_section->i_length;
-
-    p_cloned->i_extension = p_section->i_extension;
-    p_cloned->i_version = p_section->i_version;
-    p_cloned->b_current_next = p_section->b_current_next;
-    p_cloned->i_number = p_section->i_number;
-    p_cloned->i_last_number = p_section->i_last_number;
-    p_cloned->i_crc = p_section->i_crc;
-    memcpy(p_cloned->p_data, p_section->p_data, p_section->i_max_size);
-    p_cloned->p_payload_start = p_cloned->p_data + (p_section->p_payload_start - p_section->p_data);
-    p_cloned->p_payload_end = p_cloned->p_data + (p_section->p_payload_end - p_section->p_data);
-
+    if (dvbpsi_UnsharePSISection(p_cloned))
+    {
+        dvbpsi_DeletePSISections(p_cloned);
+        return NULL;
+    }
     return p_cloned;
 }
-    
+
+/*****************************************************************************
+ * dvbpsi_SharePSISection
+ *****************************************************************************
+ * Create a new section structure referencing the data of an existing section.
+ *****************************************************************************/
+dvbpsi_psi_section_t * dvbpsi_SharePSISection(dvbpsi_psi_section_t * p_section)
+{
+    dvbpsi_psi_section_t *p_shared = SectionHeaderGet();
+    if (p_shared == NULL)
+    {
+        return NULL;
+    }
+    *p_shared = *p_section;
+    p_shared->p_next = NULL;
+    __sync_add_and_fetch(&p_section->p_buffer->i_refcount, 1);
+    return p_shared;
+}
+
+/*****************************************************************************
+ * dvbpsi_UnsharePSISection
+ *****************************************************************************
+ * Give the section a private copy of its data if the data is shared.
+ *****************************************************************************/
+int dvbpsi_UnsharePSISection(dvbpsi_psi_section_t * p_section)
+{
+    struct dvbpsi_psi_buffer_s *p_buffer;
+    int i_used;
+
+    if (p_section->p_buffer->i_refcount == 1)
+    {
+        return 0;
+    }
+
+    p_buffer = SectionBufferGet(p_section->i_max_size);
+    if (p_buffer == NULL)
+    {
+        return -1;
+    }
+    /* Only copy the bytes of the section plus the CRC */
+    i_used = p_section->p_payload_end - p_section->p_data + 4;
+    if (i_used > p_section->i_max_size)
+    {
+        i_used = p_section->i_max_size;
+    }
+    memcpy(p_buffer->data, p_section->p_data, i_used);
+    p_section->p_payload_start = p_buffer->data + (p_section->p_payload_start - p_section->p_data);
+    p_section->p_payload_end = p_buffer->data + (p_section->p_payload_end - p_section->p_data);
+    p_section->p_data = p_buffer->data;
+
+    SectionBufferPut(p_section->p_buffer);
+    p_section->p_buffer = p_buffer;
+    return 0;
+}
+
 /*****************************************************************************
  * dvbpsi_NewPSISection
  *****************************************************************************
@@ -229,22 +597,22 @@ dvbpsi_psi_section_t * dvbpsi_ClonePSISection(dvbpsi_handle h_dvbpsi, dvbpsi_psi
 dvbpsi_psi_section_t * dvbpsi_NewPSISection(int i_max_size)
 {
   /* Allocate the dvbpsi_psi_section_t structure */
-  dvbpsi_psi_section_t * p_section
-                = (dvbpsi_psi_section_t*)malloc(sizeof(dvbpsi_psi_section_t));
+  dvbpsi_psi_section_t * p_section = SectionHeaderGet();
 
   if(p_section != NULL)
   {
     /* Allocate the p_data memory area */
-    p_section->p_data = (uint8_t*)malloc(i_max_size * sizeof(uint8_t));
+    p_section->p_buffer = SectionBufferGet(i_max_size);
 
-    if(p_section->p_data != NULL)
+    if(p_section->p_buffer != NULL)
     {
+      p_section->p_data = p_section->p_buffer->data;
       p_section->i_max_size = i_max_size;
       p_section->p_payload_end = p_section->p_data;
     }
     else
     {
-      free(p_section);
+      SectionHeaderPut(p_section);
       return NULL;
     }
 
@@ -265,10 +633,8 @@ void dvbpsi_DeletePSISections(dvbpsi_psi_section_t * p_section)
   {
     dvbpsi_psi_section_t* p_next = p_section->p_next;
 
-    if(p_section->p_data != NULL)
-      free(p_section->p_data);
-
-    free(p_section);
+    SectionBufferPut(p_section->p_buffer);
+    SectionHeaderPut(p_section);
     p_section = p_next;
   }
 }
@@ -284,14 +650,8 @@ int dvbpsi_ValidPSISection(dvbpsi_psi_section_t* p_section)
   if(p_section->b_syntax_indicator)
   {
     /* Check the CRC_32 if b_syntax_indicator is 0 */
-    uint32_t i_crc = 0xffffffff;
-    uint8_t* p_byte = p_section->p_data;
-
-    while(p_byte < p_section->p_payload_end + 4)
-    {
-      i_crc = (i_crc << 8) ^ s_crc32_table[(i_crc >> 24) ^ (*p_byte)];
-      p_byte++;
-    }
+    uint32_t i_crc = dvbpsi_CRC32(p_section->p_data,
+                                  p_section->p_payload_end + 4 - p_section->p_data);
 
     if(i_crc == 0)
     {
@@ -319,7 +679,11 @@ int dvbpsi_ValidPSISection(dvbpsi_psi_section_t* p_section)
  *****************************************************************************/
 void dvbpsi_BuildPSISection(dvbpsi_psi_section_t* p_section)
 {
-  uint8_t* p_byte = p_section->p_data;
+  if(dvbpsi_UnsharePSISection(p_section))
+  {
+    DVBPSI_ERROR("misc PSI", "Failed to unshare section data");
+    return;
+  }
 
   /* table_id */
   p_section->p_data[0] = p_section->i_table_id;
@@ -349,14 +713,8 @@ void dvbpsi_BuildPSISection(dvbpsi_psi_section_t* p_section)
     p_section->p_data[7] = p_section->i_last_number;
 
     /* CRC_32 */
-    p_section->i_crc = 0xffffffff;
-
-    while(p_byte < p_section->p_payload_end)
-    {
-      p_section->i_crc =   (p_section->i_crc << 8)
-                         ^ s_crc32_table[(p_section->i_crc >> 24) ^ (*p_byte)];
-      p_byte++;
-    }
+    p_section->i_crc = dvbpsi_CRC32(p_section->p_data,
+                                    p_section->p_payload_end - p_section->p_data);
 
     p_section->p_payload_end[0] = (p_section->i_crc >> 24) & 0xff;
     p_section->p_payload_end[1] = (p_section->i_crc >> 16) & 0xff;
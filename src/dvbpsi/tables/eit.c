@@ -178,6 +178,9 @@ void dvbpsi_InitEIT(dvbpsi_eit_t* p_eit, uint16_t i_service_id, uint8_t i_versio
   p_eit->i_network_id = i_network_id;
   p_eit->i_segment_last_section_number = i_segment_last_section_number;
   p_eit->i_last_table_id = i_last_table_id;
+  p_eit->i_table_id = 0;
+  p_eit->i_section_number = 0;
+  p_eit->i_section_crc = 0;
   p_eit->p_first_event = NULL;
 }
 
@@ -438,6 +441,15 @@ void dvbpsi_GatherEITSections(dvbpsi_decoder_t * p_psi_decoder,
         /* Decode the sections */
         p_section->p_next = NULL;
         p_eit_decoder->current_eit = *p_eit_decoder->p_building_eit;
+
+        /* Identify the section so the receiver can recognise repeats */
+        p_eit_decoder->p_building_eit->i_table_id = p_section->i_table_id;
+        p_eit_decoder->p_building_eit->i_section_number = p_section->i_number;
+        p_eit_decoder->p_building_eit->i_section_crc =
+                                  ((uint32_t)p_section->p_payload_end[0] << 24)
+                                | ((uint32_t)p_section->p_payload_end[1] << 16)
+                                | ((uint32_t)p_section->p_payload_end[2] << 8)
+                                |  (uint32_t)p_section->p_payload_end[3];
         
         dvbpsi_DecodeEITSections(p_eit_decoder->p_building_eit,
                                p_section);
@@ -112,6 +112,7 @@ int EPGChannelNewEvent(EPGEventRef_t *eventRef, struct tm *startTime, struct tm
     msg->data.event.startTime = *startTime;
     msg->data.event.endTime = *endTime;
     msg->data.event.ca = ca;
+    msg->data.event.eventId = eventRef->eventId;
     EPGChannelSendMessage(msg);
     return 0;
 }
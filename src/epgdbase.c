@@ -0,0 +1,959 @@
+/*
+Copyright (C) 2009  Adam Charrett
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+epgdbase.c
+
+In memory store of the EPG information received on the EPG channel.
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "main.h"
+#include "types.h"
+
+#include "logging.h"
+#include "objects.h"
+#include "messageq.h"
+#include "properties.h"
+#include "epgchannel.h"
+#include "epgdbase.h"
+
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define MAX_MESSAGES_PER_WAKEUP 64
+
+#define SERVICE_BUCKETS 256
+#define STRING_BUCKETS  256
+#define EVENT_MIN_BUCKETS 1024
+
+#define EVENT_HISTORY   (60 * 60) /* seconds */
+#define PRUNE_INTERVAL  60 /* seconds */
+
+/*******************************************************************************
+* Typedefs                                                                     *
+*******************************************************************************/
+typedef struct EPGDBaseString_s
+{
+    struct EPGDBaseString_s *next;
+    char str[0];
+}EPGDBaseString_t;
+
+typedef struct EPGDBaseDetail_s
+{
+    const char *lang;   /* Interned */
+    const char *name;   /* Interned */
+    char *value;
+}EPGDBaseDetail_t;
+
+typedef struct EPGDBaseRating_s
+{
+    const char *system; /* Interned */
+    const char *rating; /* Interned */
+}EPGDBaseRating_t;
+
+typedef struct EPGDBaseEvent_s
+{
+    struct EPGDBaseEvent_s *hashNext;
+    struct EPGDBaseService_s *service;
+    unsigned int eventId;
+    time_t startTime;
+    time_t endTime;
+    bool ca;
+    time_t updated; /* When the event or its details/ratings last changed */
+    int nrofDetails;
+    EPGDBaseDetail_t *details;
+    int nrofRatings;
+    EPGDBaseRating_t *ratings;
+}EPGDBaseEvent_t;
+
+typedef struct EPGDBaseService_s
+{
+    struct EPGDBaseService_s *hashNext;
+    EPGServiceRef_t ref;
+    int nrofEvents;
+    int eventsSize;
+    EPGDBaseEvent_t **events; /* Sorted by start time, never overlapping */
+}EPGDBaseService_t;
+
+typedef struct EPGDBaseSnapshot_s
+{
+    int count;
+    int next;
+    void *objects[0];
+}EPGDBaseSnapshot_t;
+
+/*******************************************************************************
+* Prototypes                                                                   *
+*******************************************************************************/
+static void *EPGDBaseThread(void *arg);
+static void EPGDBaseProcessMessage(EPGChannelMessage_t *msg);
+static void EPGDBaseAddEvent(EPGEventRef_t *eventRef, EPGEvent_t *event);
+static void EPGDBaseAddDetail(EPGEventRef_t *eventRef, EPGEventDetail_t *detail);
+static void EPGDBaseAddRating(EPGEventRef_t *eventRef, EPGEventRating_t *rating);
+static void EPGDBasePrune(time_t before);
+static void EPGDBaseClear(void);
+
+static EPGDBaseService_t *EPGDBaseServiceFind(EPGServiceRef_t *serviceRef, bool create);
+static EPGDBaseEvent_t *EPGDBaseEventFind(EPGDBaseService_t *service, unsigned int eventId);
+static void EPGDBaseEventInsert(EPGDBaseService_t *service, int index, EPGDBaseEvent_t *event);
+static void EPGDBaseEventRemove(EPGDBaseService_t *service, int index);
+static void EPGDBaseEventFree(EPGDBaseEvent_t *event);
+static void EPGDBaseEventHashAdd(EPGDBaseEvent_t *event);
+static void EPGDBaseEventHashRemove(EPGDBaseEvent_t *event);
+static unsigned int EPGDBaseEventHash(EPGDBaseService_t *service, unsigned int eventId);
+static int EPGDBaseFirstEndingAfter(EPGDBaseService_t *service, time_t when);
+static int EPGDBaseFirstStartingAfter(EPGDBaseService_t *service, time_t when);
+static int EPGDBaseEventIndex(EPGDBaseService_t *service, EPGDBaseEvent_t *event);
+static const char *EPGDBaseIntern(const char *str);
+
+static EPGEvent_t *EPGDBaseEventCreate(EPGDBaseEvent_t *event);
+static EPGDBaseEnumerator_t EPGDBaseSnapshotEvents(EPGDBaseService_t *service, int first, time_t to, time_t since);
+static EPGDBaseSnapshot_t *EPGDBaseSnapshotCreate(int count);
+static void *EPGDBaseSnapshotNext(EPGDBaseEnumerator_t enumerator);
+
+/*******************************************************************************
+* Global variables                                                             *
+*******************************************************************************/
+static const char EPGDBASE[] = "EPGDBase";
+static const char propertyParent[] = "epg.store";
+
+static pthread_mutex_t epgdbaseMutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static pthread_t epgdbaseThread;
+static MessageQ_t epgdbaseMsgQ;
+
+static EPGDBaseService_t *serviceBuckets[SERVICE_BUCKETS];
+static EPGDBaseString_t *stringBuckets[STRING_BUCKETS];
+static EPGDBaseEvent_t **eventBuckets = NULL;
+static unsigned int eventBucketCount = 0;
+
+static int nrofServices = 0;
+static int nrofEvents = 0;
+static int nrofStrings = 0;
+static int nrofOrphans = 0;
+static time_t lastPrune = 0;
+
+/*******************************************************************************
+* Global functions                                                             *
+*******************************************************************************/
+int EPGDBaseInit(void)
+{
+    epgdbaseMsgQ = MessageQCreate();
+    if (epgdbaseMsgQ == NULL)
+    {
+        return -1;
+    }
+    EPGChannelRegisterListener(epgdbaseMsgQ);
+    pthread_create(&epgdbaseThread, NULL, EPGDBaseThread, NULL);
+
+    PropertiesAddSimpleProperty(propertyParent, "services", "Number of services with events stored.",
+        PropertyType_Int, &nrofServices, SIMPLEPROPERTY_R);
+    PropertiesAddSimpleProperty(propertyParent, "events", "Number of events stored.",
+        PropertyType_Int, &nrofEvents, SIMPLEPROPERTY_R);
+    PropertiesAddSimpleProperty(propertyParent, "strings", "Number of distinct detail names, languages and ratings stored.",
+        PropertyType_Int, &nrofStrings, SIMPLEPROPERTY_R);
+    PropertiesAddSimpleProperty(propertyParent, "orphans", "Number of details and ratings dropped because their event was not stored.",
+        PropertyType_Int, &nrofOrphans, SIMPLEPROPERTY_R);
+    return 0;
+}
+
+int EPGDBaseDeInit(void)
+{
+    PropertiesRemoveAllProperties(propertyParent);
+    EPGChannelUnregisterListener(epgdbaseMsgQ);
+    MessageQSetQuit(epgdbaseMsgQ);
+    pthread_join(epgdbaseThread, NULL);
+    MessageQDestroy(epgdbaseMsgQ);
+    EPGDBaseClear();
+    return 0;
+}
+
+void EPGDBaseTransactionStart(void)
+{
+    pthread_mutex_lock(&epgdbaseMutex);
+}
+
+void EPGDBaseTransactionCommit(void)
+{
+    pthread_mutex_unlock(&epgdbaseMutex);
+}
+
+int EPGDBaseEventCount(void)
+{
+    return nrofEvents;
+}
+
+EPGDBaseEnumerator_t EPGDBaseEventEnumeratorGetService(EPGServiceRef_t *serviceRef)
+{
+    EPGDBaseEnumerator_t result = NULL;
+    EPGDBaseService_t *service;
+
+    pthread_mutex_lock(&epgdbaseMutex);
+    service = EPGDBaseServiceFind(serviceRef, FALSE);
+    if (service)
+    {
+        result = EPGDBaseSnapshotEvents(service, 0, (time_t)-1, 0);
+    }
+    pthread_mutex_unlock(&epgdbaseMutex);
+    return result;
+}
+
+EPGDBaseEnumerator_t EPGDBaseEventEnumeratorGetRange(EPGServiceRef_t *serviceRef, time_t from, time_t to)
+{
+    EPGDBaseEnumerator_t result = NULL;
+    EPGDBaseService_t *service;
+
+    pthread_mutex_lock(&epgdbaseMutex);
+    service = EPGDBaseServiceFind(serviceRef, FALSE);
+    if (service)
+    {
+        result = EPGDBaseSnapshotEvents(service, EPGDBaseFirstEndingAfter(service, from), to, 0);
+    }
+    pthread_mutex_unlock(&epgdbaseMutex);
+    return result;
+}
+
+EPGDBaseEnumerator_t EPGDBaseEventEnumeratorGetChanged(EPGServiceRef_t *serviceRef, time_t since)
+{
+    EPGDBaseEnumerator_t result = NULL;
+    EPGDBaseService_t *service;
+
+    pthread_mutex_lock(&epgdbaseMutex);
+    service = EPGDBaseServiceFind(serviceRef, FALSE);
+    if (service)
+    {
+        result = EPGDBaseSnapshotEvents(service, 0, (time_t)-1, since);
+    }
+    pthread_mutex_unlock(&epgdbaseMutex);
+    return result;
+}
+
+EPGEvent_t *EPGDBaseEventGetNext(EPGDBaseEnumerator_t enumerator)
+{
+    return EPGDBaseSnapshotNext(enumerator);
+}
+
+EPGEvent_t *EPGDBaseEventGetAt(EPGServiceRef_t *serviceRef, time_t when)
+{
+    EPGEvent_t *result = NULL;
+    EPGDBaseService_t *service;
+    int index;
+
+    pthread_mutex_lock(&epgdbaseMutex);
+    service = EPGDBaseServiceFind(serviceRef, FALSE);
+    if (service)
+    {
+        index = EPGDBaseFirstEndingAfter(service, when);
+        if ((index < service->nrofEvents) && (service->events[index]->startTime <= when))
+        {
+            result = EPGDBaseEventCreate(service->events[index]);
+        }
+    }
+    pthread_mutex_unlock(&epgdbaseMutex);
+    return result;
+}
+
+EPGEvent_t *EPGDBaseEventGetAfter(EPGServiceRef_t *serviceRef, time_t when)
+{
+    EPGEvent_t *result = NULL;
+    EPGDBaseService_t *service;
+    int index;
+
+    pthread_mutex_lock(&epgdbaseMutex);
+    service = EPGDBaseServiceFind(serviceRef, FALSE);
+    if (service)
+    {
+        index = EPGDBaseFirstStartingAfter(service, when);
+        if (index < service->nrofEvents)
+        {
+            result = EPGDBaseEventCreate(service->events[index]);
+        }
+    }
+    pthread_mutex_unlock(&epgdbaseMutex);
+    return result;
+}
+
+EPGDBaseEnumerator_t EPGDBaseDetailGet(EPGServiceRef_t *serviceRef, unsigned int eventId, char *name)
+{
+    EPGDBaseSnapshot_t *result = NULL;
+    EPGDBaseService_t *service;
+    EPGDBaseEvent_t *event = NULL;
+    int i;
+
+    pthread_mutex_lock(&epgdbaseMutex);
+    service = EPGDBaseServiceFind(serviceRef, FALSE);
+    if (service)
+    {
+        event = EPGDBaseEventFind(service, eventId);
+    }
+    if (event && event->nrofDetails)
+    {
+        result = EPGDBaseSnapshotCreate(event->nrofDetails);
+        for (i = 0; result && (i < event->nrofDetails); i ++)
+        {
+            EPGEventDetail_t *detail;
+            if (name && strcmp(event->details[i].name, name))
+            {
+                continue;
+            }
+            detail = ObjectCreateType(EPGEventDetail_t);
+            if (detail)
+            {
+                strncpy(detail->lang, event->details[i].lang, sizeof(detail->lang) - 1);
+                detail->name = strdup(event->details[i].name);
+                detail->value = strdup(event->details[i].value);
+                result->objects[result->count ++] = detail;
+            }
+        }
+    }
+    pthread_mutex_unlock(&epgdbaseMutex);
+    return result;
+}
+
+EPGEventDetail_t *EPGDBaseDetailGetNext(EPGDBaseEnumerator_t enumerator)
+{
+    return EPGDBaseSnapshotNext(enumerator);
+}
+
+EPGDBaseEnumerator_t EPGDBaseRatingGet(EPGServiceRef_t *serviceRef, unsigned int eventId)
+{
+    EPGDBaseSnapshot_t *result = NULL;
+    EPGDBaseService_t *service;
+    EPGDBaseEvent_t *event = NULL;
+    int i;
+
+    pthread_mutex_lock(&epgdbaseMutex);
+    service = EPGDBaseServiceFind(serviceRef, FALSE);
+    if (service)
+    {
+        event = EPGDBaseEventFind(service, eventId);
+    }
+    if (event && event->nrofRatings)
+    {
+        result = EPGDBaseSnapshotCreate(event->nrofRatings);
+        for (i = 0; result && (i < event->nrofRatings); i ++)
+        {
+            EPGEventRating_t *rating = ObjectCreateType(EPGEventRating_t);
+            if (rating)
+            {
+                rating->system = strdup(event->ratings[i].system);
+                rating->rating = strdup(event->ratings[i].rating);
+                result->objects[result->count ++] = rating;
+            }
+        }
+    }
+    pthread_mutex_unlock(&epgdbaseMutex);
+    return result;
+}
+
+EPGEventRating_t *EPGDBaseRatingGetNext(EPGDBaseEnumerator_t enumerator)
+{
+    return EPGDBaseSnapshotNext(enumerator);
+}
+
+void EPGDBaseEnumeratorDestroy(EPGDBaseEnumerator_t enumerator)
+{
+    EPGDBaseSnapshot_t *snapshot = enumerator;
+    if (snapshot)
+    {
+        for (; snapshot->next < snapshot->count; snapshot->next ++)
+        {
+            ObjectRefDec(snapshot->objects[snapshot->next]);
+        }
+        free(snapshot);
+    }
+}
+
+/*******************************************************************************
+* Local Functions                                                              *
+*******************************************************************************/
+static void *EPGDBaseThread(void *arg)
+{
+    EPGChannelMessage_t *msgs[MAX_MESSAGES_PER_WAKEUP];
+    int count;
+    int i;
+    time_t now;
+
+    LogRegisterThread(pthread_self(), EPGDBASE);
+    while (!MessageQIsQuitSet(epgdbaseMsgQ))
+    {
+        count = MessageQReceiveMany(epgdbaseMsgQ, (void **)msgs, MAX_MESSAGES_PER_WAKEUP);
+        pthread_mutex_lock(&epgdbaseMutex);
+        for (i = 0; i < count; i ++)
+        {
+            EPGDBaseProcessMessage(msgs[i]);
+        }
+        now = time(NULL);
+        if (now - lastPrune >= PRUNE_INTERVAL)
+        {
+            EPGDBasePrune(now - EVENT_HISTORY);
+            lastPrune = now;
+        }
+        pthread_mutex_unlock(&epgdbaseMutex);
+        for (i = 0; i < count; i ++)
+        {
+            ObjectRefDec(msgs[i]);
+        }
+    }
+    return NULL;
+}
+
+static void EPGDBaseProcessMessage(EPGChannelMessage_t *msg)
+{
+    switch (msg->type)
+    {
+        case EPGChannelMessageType_Event:
+            EPGDBaseAddEvent(&msg->eventRef, &msg->data.event);
+            break;
+        case EPGChannelMessageType_Detail:
+            EPGDBaseAddDetail(&msg->eventRef, &msg->data.detail);
+            break;
+        case EPGChannelMessageType_Rating:
+            EPGDBaseAddRating(&msg->eventRef, &msg->data.rating);
+            break;
+    }
+}
+
+static void EPGDBaseAddEvent(EPGEventRef_t *eventRef, EPGEvent_t *newEvent)
+{
+    EPGDBaseService_t *service;
+    EPGDBaseEvent_t *event;
+    struct tm tmTime;
+    time_t startTime;
+    time_t endTime;
+    int index;
+
+    tmTime = newEvent->startTime;
+    startTime = timegm(&tmTime);
+    tmTime = newEvent->endTime;
+    endTime = timegm(&tmTime);
+    if (endTime < startTime)
+    {
+        endTime = startTime;
+    }
+
+    service = EPGDBaseServiceFind(&eventRef->serviceRef, TRUE);
+    if (service == NULL)
+    {
+        return;
+    }
+    event = EPGDBaseEventFind(service, eventRef->eventId);
+    if (event)
+    {
+        if (event->ca != newEvent->ca)
+        {
+            event->ca = newEvent->ca;
+            event->updated = time(NULL);
+        }
+        if ((event->startTime == startTime) && (event->endTime == endTime))
+        {
+            return;
+        }
+        /* Rescheduled, keep the details but move it to its new slot. */
+        index = EPGDBaseEventIndex(service, event);
+        memmove(&service->events[index], &service->events[index + 1],
+                (service->nrofEvents - index - 1) * sizeof(EPGDBaseEvent_t *));
+        service->nrofEvents --;
+    }
+    else
+    {
+        event = calloc(1, sizeof(EPGDBaseEvent_t));
+        if (event == NULL)
+        {
+            return;
+        }
+        event->service = service;
+        event->eventId = eventRef->eventId;
+        event->ca = newEvent->ca;
+        EPGDBaseEventHashAdd(event);
+        nrofEvents ++;
+    }
+    event->startTime = startTime;
+    event->endTime = endTime;
+    event->updated = time(NULL);
+
+    /* A service can only show one thing at a time, so anything the new event
+     * overlaps has been replaced. */
+    index = EPGDBaseFirstEndingAfter(service, startTime);
+    while ((index < service->nrofEvents) && (service->events[index]->startTime < endTime))
+    {
+        LogModule(LOG_DEBUG, EPGDBASE, "(%x:%x:%x) Event %x replaced by %x\n",
+            service->ref.netId, service->ref.tsId, service->ref.serviceId,
+            service->events[index]->eventId, event->eventId);
+        EPGDBaseEventRemove(service, index);
+    }
+    EPGDBaseEventInsert(service, index, event);
+}
+
+static void EPGDBaseAddDetail(EPGEventRef_t *eventRef, EPGEventDetail_t *detail)
+{
+    EPGDBaseService_t *service;
+    EPGDBaseEvent_t *event = NULL;
+    EPGDBaseDetail_t *details;
+    const char *lang;
+    const char *name;
+    char *value;
+    int i;
+
+    service = EPGDBaseServiceFind(&eventRef->serviceRef, FALSE);
+    if (service)
+    {
+        event = EPGDBaseEventFind(service, eventRef->eventId);
+    }
+    if (event == NULL)
+    {
+        nrofOrphans ++;
+        return;
+    }
+    lang = EPGDBaseIntern(detail->lang);
+    name = EPGDBaseIntern(detail->name);
+    value = strdup(detail->value);
+    if ((lang == NULL) || (name == NULL) || (value == NULL))
+    {
+        free(value);
+        return;
+    }
+    for (i = 0; i < event->nrofDetails; i ++)
+    {
+        if ((event->details[i].lang == lang) && (event->details[i].name == name))
+        {
+            if (strcmp(event->details[i].value, value))
+            {
+                free(event->details[i].value);
+                event->details[i].value = value;
+                event->updated = time(NULL);
+            }
+            else
+            {
+                free(value);
+            }
+            return;
+        }
+    }
+    details = realloc(event->details, (event->nrofDetails + 1) * sizeof(EPGDBaseDetail_t));
+    if (details == NULL)
+    {
+        free(value);
+        return;
+    }
+    details[event->nrofDetails].lang = lang;
+    details[event->nrofDetails].name = name;
+    details[event->nrofDetails].value = value;
+    event->details = details;
+    event->nrofDetails ++;
+    event->updated = time(NULL);
+}
+
+static void EPGDBaseAddRating(EPGEventRef_t *eventRef, EPGEventRating_t *rating)
+{
+    EPGDBaseService_t *service;
+    EPGDBaseEvent_t *event = NULL;
+    EPGDBaseRating_t *ratings;
+    const char *system;
+    const char *value;
+    int i;
+
+    service = EPGDBaseServiceFind(&eventRef->serviceRef, FALSE);
+    if (service)
+    {
+        event = EPGDBaseEventFind(service, eventRef->eventId);
+    }
+    if (event == NULL)
+    {
+        nrofOrphans ++;
+        return;
+    }
+    system = EPGDBaseIntern(rating->system);
+    value = EPGDBaseIntern(rating->rating);
+    if ((system == NULL) || (value == NULL))
+    {
+        return;
+    }
+    for (i = 0; i < event->nrofRatings; i ++)
+    {
+        if (event->ratings[i].system == system)
+        {
+            if (event->ratings[i].rating != value)
+            {
+                event->ratings[i].rating = value;
+                event->updated = time(NULL);
+            }
+            return;
+        }
+    }
+    ratings = realloc(event->ratings, (event->nrofRatings + 1) * sizeof(EPGDBaseRating_t));
+    if (ratings == NULL)
+    {
+        return;
+    }
+    ratings[event->nrofRatings].system = system;
+    ratings[event->nrofRatings].rating = value;
+    event->ratings = ratings;
+    event->nrofRatings ++;
+    event->updated = time(NULL);
+}
+
+static void EPGDBasePrune(time_t before)
+{
+    EPGDBaseService_t *service;
+    int i;
+    int count;
+
+    for (i = 0; i < SERVICE_BUCKETS; i ++)
+    {
+        for (service = serviceBuckets[i]; service; service = service->hashNext)
+        {
+            /* Events are in end time order as well as start time order. */
+            count = EPGDBaseFirstEndingAfter(service, before);
+            if (count == 0)
+            {
+                continue;
+            }
+            LogModule(LOG_DEBUG, EPGDBASE, "(%x:%x:%x) Pruning %d events\n",
+                service->ref.netId, service->ref.tsId, service->ref.serviceId, count);
+            while (count --)
+            {
+                EPGDBaseEventRemove(service, 0);
+            }
+        }
+    }
+}
+
+static void EPGDBaseClear(void)
+{
+    EPGDBaseService_t *service;
+    EPGDBaseString_t *string;
+    int i;
+
+    pthread_mutex_lock(&epgdbaseMutex);
+    for (i = 0; i < SERVICE_BUCKETS; i ++)
+    {
+        while (serviceBuckets[i])
+        {
+            service = serviceBuckets[i];
+            serviceBuckets[i] = service->hashNext;
+            while (service->nrofEvents)
+            {
+                EPGDBaseEventRemove(service, service->nrofEvents - 1);
+            }
+            free(service->events);
+            free(service);
+        }
+    }
+    for (i = 0; i < STRING_BUCKETS; i ++)
+    {
+        while (stringBuckets[i])
+        {
+            string = stringBuckets[i];
+            stringBuckets[i] = string->next;
+            free(string);
+        }
+    }
+    free(eventBuckets);
+    eventBuckets = NULL;
+    eventBucketCount = 0;
+    nrofServices = 0;
+    nrofStrings = 0;
+    pthread_mutex_unlock(&epgdbaseMutex);
+}
+
+static EPGDBaseService_t *EPGDBaseServiceFind(EPGServiceRef_t *serviceRef, bool create)
+{
+    EPGDBaseService_t *service;
+    unsigned int hash = ((serviceRef->netId * 31) + serviceRef->tsId) * 31 + serviceRef->serviceId;
+
+    hash %= SERVICE_BUCKETS;
+    for (service = serviceBuckets[hash]; service; service = service->hashNext)
+    {
+        if ((service->ref.serviceId == serviceRef->serviceId) &&
+            (service->ref.tsId == serviceRef->tsId) &&
+            (service->ref.netId == serviceRef->netId))
+        {
+            return service;
+        }
+    }
+    if (create)
+    {
+        service = calloc(1, sizeof(EPGDBaseService_t));
+        if (service)
+        {
+            service->ref = *serviceRef;
+            service->hashNext = serviceBuckets[hash];
+            serviceBuckets[hash] = service;
+            nrofServices ++;
+        }
+    }
+    return service;
+}
+
+static EPGDBaseEvent_t *EPGDBaseEventFind(EPGDBaseService_t *service, unsigned int eventId)
+{
+    EPGDBaseEvent_t *event = NULL;
+    if (eventBucketCount)
+    {
+        for (event = eventBuckets[EPGDBaseEventHash(service, eventId) % eventBucketCount];
+             event; event = event->hashNext)
+        {
+            if ((event->service == service) && (event->eventId == eventId))
+            {
+                break;
+            }
+        }
+    }
+    return event;
+}
+
+static void EPGDBaseEventInsert(EPGDBaseService_t *service, int index, EPGDBaseEvent_t *event)
+{
+    if (service->nrofEvents == service->eventsSize)
+    {
+        int newSize = service->eventsSize ? service->eventsSize * 2 : 16;
+        EPGDBaseEvent_t **events = realloc(service->events, newSize * sizeof(EPGDBaseEvent_t *));
+        if (events == NULL)
+        {
+            EPGDBaseEventFree(event);
+            return;
+        }
+        service->events = events;
+        service->eventsSize = newSize;
+    }
+    memmove(&service->events[index + 1], &service->events[index],
+            (service->nrofEvents - index) * sizeof(EPGDBaseEvent_t *));
+    service->events[index] = event;
+    service->nrofEvents ++;
+}
+
+static void EPGDBaseEventRemove(EPGDBaseService_t *service, int index)
+{
+    EPGDBaseEvent_t *event = service->events[index];
+    memmove(&service->events[index], &service->events[index + 1],
+            (service->nrofEvents - index - 1) * sizeof(EPGDBaseEvent_t *));
+    service->nrofEvents --;
+    EPGDBaseEventFree(event);
+}
+
+static void EPGDBaseEventFree(EPGDBaseEvent_t *event)
+{
+    int i;
+    EPGDBaseEventHashRemove(event);
+    for (i = 0; i < event->nrofDetails; i ++)
+    {
+        free(event->details[i].value);
+    }
+    free(event->details);
+    free(event->ratings);
+    free(event);
+    nrofEvents --;
+}
+
+static void EPGDBaseEventHashAdd(EPGDBaseEvent_t *event)
+{
+    unsigned int hash;
+
+    if (nrofEvents >= (int)(eventBucketCount * 2))
+    {
+        unsigned int newCount = eventBucketCount ? eventBucketCount * 2 : EVENT_MIN_BUCKETS;
+        EPGDBaseEvent_t **newBuckets = calloc(newCount, sizeof(EPGDBaseEvent_t *));
+        if (newBuckets)
+        {
+            unsigned int i;
+            for (i = 0; i < eventBucketCount; i ++)
+            {
+                while (eventBuckets[i])
+                {
+                    EPGDBaseEvent_t *current = eventBuckets[i];
+                    eventBuckets[i] = current->hashNext;
+                    hash = EPGDBaseEventHash(current->service, current->eventId) % newCount;
+                    current->hashNext = newBuckets[hash];
+                    newBuckets[hash] = current;
+                }
+            }
+            free(eventBuckets);
+            eventBuckets = newBuckets;
+            eventBucketCount = newCount;
+        }
+    }
+    hash = EPGDBaseEventHash(event->service, event->eventId) % eventBucketCount;
+    event->hashNext = eventBuckets[hash];
+    eventBuckets[hash] = event;
+}
+
+static void EPGDBaseEventHashRemove(EPGDBaseEvent_t *event)
+{
+    EPGDBaseEvent_t **link;
+    for (link = &eventBuckets[EPGDBaseEventHash(event->service, event->eventId) % eventBucketCount];
+         *link; link = &(*link)->hashNext)
+    {
+        if (*link == event)
+        {
+            *link = event->hashNext;
+            break;
+        }
+    }
+}
+
+static unsigned int EPGDBaseEventHash(EPGDBaseService_t *service, unsigned int eventId)
+{
+    return (((unsigned int)(uintptr_t)service) >> 4) * 31 + eventId;
+}
+
+/* Returns the index of the first event that ends after the time specified, as
+ * events do not overlap this is also the first event showing at or after it. */
+static int EPGDBaseFirstEndingAfter(EPGDBaseService_t *service, time_t when)
+{
+    int low = 0;
+    int high = service->nrofEvents;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (service->events[mid]->endTime > when)
+        {
+            high = mid;
+        }
+        else
+        {
+            low = mid + 1;
+        }
+    }
+    return low;
+}
+
+static int EPGDBaseFirstStartingAfter(EPGDBaseService_t *service, time_t when)
+{
+    int low = 0;
+    int high = service->nrofEvents;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (service->events[mid]->startTime > when)
+        {
+            high = mid;
+        }
+        else
+        {
+            low = mid + 1;
+        }
+    }
+    return low;
+}
+
+static int EPGDBaseEventIndex(EPGDBaseService_t *service, EPGDBaseEvent_t *event)
+{
+    int index = EPGDBaseFirstEndingAfter(service, event->startTime);
+    while ((index < service->nrofEvents) && (service->events[index] != event))
+    {
+        index ++;
+    }
+    return index;
+}
+
+static const char *EPGDBaseIntern(const char *str)
+{
+    EPGDBaseString_t *string;
+    unsigned int hash = 0;
+    const char *ch;
+    size_t len;
+
+    for (ch = str; *ch; ch ++)
+    {
+        hash = (hash * 31) + (unsigned char)*ch;
+    }
+    len = ch - str;
+    hash %= STRING_BUCKETS;
+    for (string = stringBuckets[hash]; string; string = string->next)
+    {
+        if (strcmp(string->str, str) == 0)
+        {
+            return string->str;
+        }
+    }
+    string = malloc(sizeof(EPGDBaseString_t) + len + 1);
+    if (string == NULL)
+    {
+        return NULL;
+    }
+    memcpy(string->str, str, len + 1);
+    string->next = stringBuckets[hash];
+    stringBuckets[hash] = string;
+    nrofStrings ++;
+    return string->str;
+}
+
+static EPGEvent_t *EPGDBaseEventCreate(EPGDBaseEvent_t *event)
+{
+    EPGEvent_t *result = ObjectCreateType(EPGEvent_t);
+    if (result)
+    {
+        gmtime_r(&event->startTime, &result->startTime);
+        gmtime_r(&event->endTime, &result->endTime);
+        result->ca = event->ca;
+        result->eventId = event->eventId;
+    }
+    return result;
+}
+
+static EPGDBaseEnumerator_t EPGDBaseSnapshotEvents(EPGDBaseService_t *service, int first, time_t to, time_t since)
+{
+    EPGDBaseSnapshot_t *snapshot;
+    int i;
+
+    snapshot = EPGDBaseSnapshotCreate(service->nrofEvents - first);
+    for (i = first; snapshot && (i < service->nrofEvents); i ++)
+    {
+        EPGEvent_t *event;
+        if ((to != (time_t)-1) && (service->events[i]->startTime >= to))
+        {
+            break;
+        }
+        if (service->events[i]->updated < since)
+        {
+            continue;
+        }
+        event = EPGDBaseEventCreate(service->events[i]);
+        if (event)
+        {
+            snapshot->objects[snapshot->count ++] = event;
+        }
+    }
+    return snapshot;
+}
+
+static EPGDBaseSnapshot_t *EPGDBaseSnapshotCreate(int count)
+{
+    EPGDBaseSnapshot_t *snapshot = malloc(sizeof(EPGDBaseSnapshot_t) + (count * sizeof(void *)));
+    if (snapshot)
+    {
+        snapshot->count = 0;
+        snapshot->next = 0;
+    }
+    return snapshot;
+}
+
+static void *EPGDBaseSnapshotNext(EPGDBaseEnumerator_t enumerator)
+{
+    EPGDBaseSnapshot_t *snapshot = enumerator;
+    if ((snapshot == NULL) || (snapshot->next >= snapshot->count))
+    {
+        return NULL;
+    }
+    return snapshot->objects[snapshot->next ++];
+}
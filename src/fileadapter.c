@@ -32,6 +32,8 @@ Opens/Closes and setups dvb adapter for use in the rest of the application.
 #include <sys/types.h>
 #include <sys/poll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <linux/dvb/dmx.h>
 #include <linux/dvb/frontend.h>
 #include <pthread.h>
@@ -46,6 +48,7 @@ Opens/Closes and setups dvb adapter for use in the rest of the application.
 #include "main.h"
 #include "dispatchers.h"
 #include "yamlutils.h"
+#include "ts.h"
 
 /*******************************************************************************
 * Defines                                                                      *
@@ -54,9 +57,44 @@ Opens/Closes and setups dvb adapter for use in the rest of the application.
 #define MONITOR_CMD_RETUNING          1
 #define MONITOR_CMD_FE_ACTIVATE       2
 #define MONITOR_CMD_FE_DEACTIVATE     3
+
+#define FILTER_PID_ALL                8192
+
+#define REPLAY_DEFAULT_BATCH_PACKETS  1024
+#define REPLAY_INTERVAL               0.01 /* seconds between paced wakeups */
+#define REPLAY_MAX_BATCHES_PER_WAKEUP 16
+#define REPLAY_PCR_PID_NONE           0xffff
+#define REPLAY_PCR_MAX_JUMP           1.0  /* seconds */
 /*******************************************************************************
 * Typedefs                                                                     *
 *******************************************************************************/
+typedef enum ReplayPacing_e
+{
+    ReplayPacing_Fast,    /**< Send packets as fast as the TS reader can process them. */
+    ReplayPacing_Bitrate, /**< Send packets at a fixed bitrate. */
+    ReplayPacing_PCR,     /**< Send packets in real time using the PCRs in the stream. */
+    ReplayPacing_Count
+}ReplayPacing_e;
+
+/**
+ * Memory mapped stream file, unmapped once the last batch referencing it is
+ * released.
+ */
+typedef struct ReplayMapping_s
+{
+    void *base;
+    size_t length;
+}ReplayMapping_t;
+
+/**
+ * Collection of packets used when only passing some PIDs to the TS reader.
+ */
+typedef struct ReplayStaging_s
+{
+    int nrofPackets;
+    TSPacket_t packets[0];
+}ReplayStaging_t;
+
 struct DVBAdapter_s
 {
     int adapter;                      /**< The adapter number ie /dev/dvb/adapter<#adapter> */
@@ -84,6 +122,25 @@ struct DVBAdapter_s
     ev_io commandWatcher;
     int sendFd;
     ev_timer sendTimer; 
+
+    bool pidEnabled[FILTER_PID_ALL + 1]; /**< PIDs with a filter allocated, FILTER_PID_ALL for the whole TS. */
+    unsigned long streamRate;         /**< Bitrate of the stream file in bits per second. */
+
+    bool replay;                      /**< Whether to map the stream file and pass packets directly to the TS reader. */
+    ReplayPacing_e replayPacing;
+    int replayBitrate;                /**< Bitrate for ReplayPacing_Bitrate, 0 to use the stream file rate. */
+    int replayBatchPackets;           /**< Maximum packets passed to the TS reader at once. */
+    int replayPasses;                 /**< Number of times the whole file has been replayed. */
+    ReplayMapping_t *replayMapping;
+    unsigned long replayNrofPackets;
+    unsigned long replayPos;
+    unsigned long long replayPacketsSent;
+    ev_tstamp replayStartTime;
+    uint16_t replayPCRPid;
+    uint64_t replayPCRBase;
+    ReplayStaging_t *replayStaging;   /**< Packets of PIDs with a filter allocated when not sending the whole TS. */
+    ev_timer replayTimer;
+    ev_idle replayIdle;
 } ;
 
 /*******************************************************************************
@@ -95,10 +152,24 @@ static void DVBFrontEndMonitorSend(DVBAdapter_t *adapter, char cmd);
 static void DVBCommandCallback(struct ev_loop *loop, ev_io *w, int revents);
 static void DVBFilterPackets(struct ev_loop *loop, ev_timer *w, int revents);
 static int DVBEventToString(yaml_document_t *document, Event_t event, void *payload);
+static void DVBStreamClose(DVBAdapter_t *adapter, struct ev_loop *loop);
+static bool DVBReplayStart(DVBAdapter_t *adapter, struct ev_loop *loop);
+static void DVBReplayRewind(DVBAdapter_t *adapter, struct ev_loop *loop);
+static void DVBReplayIdle(struct ev_loop *loop, ev_idle *w, int revents);
+static void DVBReplayTimer(struct ev_loop *loop, ev_timer *w, int revents);
+static void DVBReplayPackets(DVBAdapter_t *adapter, struct ev_loop *loop);
+static unsigned long DVBReplayPCRPacketsDue(DVBAdapter_t *adapter, unsigned long max, ev_tstamp elapsed);
+static void DVBReplayPush(DVBAdapter_t *adapter, unsigned long start, unsigned long count);
+static TSPacket_t *DVBReplayStagingGet(DVBAdapter_t *adapter);
+static void ReplayMappingDestructor(void *ptr);
 
 static int DVBPropertyActiveGet(void *userArg, PropertyValue_t *value);
 static int DVBPropertyActiveSet(void *userArg, PropertyValue_t *value);
 static int DVBPropertyDeliverySystemsGet(void *userArg, PropertyValue_t *value);
+static int DVBPropertyReplayPacingGet(void *userArg, PropertyValue_t *value);
+static int DVBPropertyReplayPacingSet(void *userArg, PropertyValue_t *value);
+static int DVBPropertyReplayBatchPacketsSet(void *userArg, PropertyValue_t *value);
+static int DVBPropertyReplayBitrateSet(void *userArg, PropertyValue_t *value);
 static uint32_t ConvertStringToUInt32(const char *str, uint32_t defaultValue);
 static uint32_t ConvertYamlNode(yaml_document_t * document, const char *key, 
                         uint32_t (*convert)(const char *, uint32_t), uint32_t defaultValue);
@@ -108,6 +179,8 @@ static uint32_t ConvertYamlNode(yaml_document_t * document, const char *key,
 *******************************************************************************/
 static const char FILEADAPTER[] = "FileAdapter";
 static const char propertyParent[] = "adapter";
+static const char replayPropertyParent[] = "adapter.replay";
+static const char *ReplayPacingStr[] = {"fast", "bitrate", "pcr"};
 static const char adapterName[] = "File Adapter";
 static EventSource_t dvbSource = NULL;
 static Event_t lockedEvent;
@@ -137,6 +210,8 @@ DVBAdapter_t *DVBInit(int adapter, bool hwRestricted, bool forceISDB)
     }
     
     ObjectRegisterType(DVBAdapter_t);
+    ObjectRegisterTypeDestructor(ReplayMapping_t, ReplayMappingDestructor);
+    ObjectRegisterCollection(TOSTRING(TSPacket_t), sizeof(TSPacket_t), NULL);
     ObjectRegisterCollection(TOSTRING(DVBSupportedDeliverySys_t), sizeof(DVBDeliverySystem_e), NULL);
     result = (DVBAdapter_t*)ObjectCreateType(DVBAdapter_t);
     
@@ -152,6 +227,8 @@ DVBAdapter_t *DVBInit(int adapter, bool hwRestricted, bool forceISDB)
         result->frontEndFd = -1;
         result->dvrFd = -1;
         result->adapter = adapter;
+        result->replayPacing = ReplayPacing_PCR;
+        result->replayBatchPackets = REPLAY_DEFAULT_BATCH_PACKETS;
 
         if (DVBOpenAdapterFile(result) == -1)
         {
@@ -207,6 +284,10 @@ DVBAdapter_t *DVBInit(int adapter, bool hwRestricted, bool forceISDB)
         result->commandWatcher.data = result;
         ev_timer_start(inputLoop, &result->sendTimer);
         ev_io_start(inputLoop, &result->commandWatcher);   
+        ev_timer_init(&result->replayTimer, DVBReplayTimer, REPLAY_INTERVAL, REPLAY_INTERVAL);
+        ev_idle_init(&result->replayIdle, DVBReplayIdle);
+        result->replayTimer.data = result;
+        result->replayIdle.data = result;
 
         /* Add properties */
         PropertiesAddSimpleProperty(propertyParent, "number", "The number of the adapter being used",
@@ -219,6 +300,22 @@ DVBAdapter_t *DVBInit(int adapter, bool hwRestricted, bool forceISDB)
             PropertyType_String, result, DVBPropertyDeliverySystemsGet, NULL);
         PropertiesAddProperty(propertyParent, "active","Whether the frontend is currently in use.",
             PropertyType_Boolean, result,DVBPropertyActiveGet,DVBPropertyActiveSet);
+
+        PropertiesAddSimpleProperty(replayPropertyParent, "enabled",
+            "Whether to memory map the stream file and pass packets directly to the TS reader (takes effect on the next tune).",
+            PropertyType_Boolean, &result->replay, SIMPLEPROPERTY_RW);
+        PropertiesAddProperty(replayPropertyParent, "pacing",
+            "How fast to replay the stream file, one of fast, bitrate or pcr (takes effect on the next tune).",
+            PropertyType_String, result, DVBPropertyReplayPacingGet, DVBPropertyReplayPacingSet);
+        PropertiesAddProperty(replayPropertyParent, "bitrate",
+            "Bitrate in bits per second used for bitrate pacing, 0 to use the rate in the stream description file.",
+            PropertyType_Int, &result->replayBitrate, PropertiesSimplePropertyGet, DVBPropertyReplayBitrateSet);
+        PropertiesAddProperty(replayPropertyParent, "batchpackets",
+            "Maximum number of packets passed to the TS reader at once.",
+            PropertyType_Int, &result->replayBatchPackets, PropertiesSimplePropertyGet, DVBPropertyReplayBatchPacketsSet);
+        PropertiesAddSimpleProperty(replayPropertyParent, "passes",
+            "Number of times the whole stream file has been replayed.",
+            PropertyType_Int, &result->replayPasses, SIMPLEPROPERTY_R);
     }
     return result;
 }
@@ -236,16 +333,14 @@ void DVBDispose(DVBAdapter_t *adapter)
     LogModule(LOG_DEBUGV, FILEADAPTER, "Closing Demux file descriptors\n");
     DVBDemuxReleaseAllFilters(adapter);
 
-    if (adapter->frontEndFd > -1)
+    LogModule(LOG_DEBUGV, FILEADAPTER, "Closing Frontend file descriptor\n");
+    DVBStreamClose(adapter, inputLoop);
+    if (adapter->replayStaging)
     {
-        LogModule(LOG_DEBUGV, FILEADAPTER, "Closing Frontend file descriptor\n");
-        close(adapter->frontEndFd);
-        LogModule(LOG_DEBUGV, FILEADAPTER, "Closed Frontend file descriptor\n");
-        adapter->frontEndFd = -1;
+        ObjectRefDec(adapter->replayStaging);
     }
 
     ev_io_stop(inputLoop, &adapter->commandWatcher);
-    ev_timer_stop(inputLoop, &adapter->sendTimer);
     
     close(adapter->cmdRecvFd);
     close(adapter->cmdSendFd);
@@ -438,6 +533,7 @@ int DVBDemuxAllocateFilter(DVBAdapter_t *adapter, uint16_t pid)
         LogModule(LOG_DEBUG, FILEADAPTER, "Allocated filter for pid 0x%x\n", pid);
         adapter->filters[idxToUse].demuxFd = 1;
         adapter->filters[idxToUse].pid = pid;
+        adapter->pidEnabled[pid] = TRUE;
         result = 0;
     }
 
@@ -456,6 +552,7 @@ int DVBDemuxReleaseFilter(DVBAdapter_t *adapter, uint16_t pid)
             {
                 LogModule(LOG_DEBUG, FILEADAPTER, "Releasing filter for pid 0x%x\n", pid);
                 adapter->filters[i].demuxFd = -1;
+                adapter->pidEnabled[pid] = FALSE;
                 result = 0;
                 break;
             }
@@ -475,6 +572,7 @@ int DVBDemuxReleaseAllFilters(DVBAdapter_t *adapter)
         {
             close(adapter->filters[i].demuxFd);
             adapter->filters[i].demuxFd = -1;
+            adapter->pidEnabled[adapter->filters[i].pid] = FALSE;
             result = 0;
         }
     }
@@ -500,7 +598,6 @@ static void DVBFrontEndMonitorSend(DVBAdapter_t *adapter, char cmd)
 static void DVBCommandCallback(struct ev_loop *loop, ev_io *w, int revents)
 {
     DVBAdapter_t *adapter = w->data;
-    unsigned long rate;
     char cmd;
     ev_io_start(loop, w);
     
@@ -515,23 +612,21 @@ static void DVBCommandCallback(struct ev_loop *loop, ev_io *w, int revents)
                 EventsFireEventListeners(unlockedEvent, adapter);
 
             case MONITOR_CMD_FE_ACTIVATE:
+                DVBStreamClose(adapter, loop);
                 /* Open description file for freq */
-                if (DVBOpenStreamFile(adapter->adapter, adapter->frontEndRequestedFreq, &adapter->frontEndFd, &rate) == 0)
+                if (DVBOpenStreamFile(adapter->adapter, adapter->frontEndRequestedFreq, &adapter->frontEndFd, &adapter->streamRate) == 0)
                 {
                     adapter->frontEndLocked = TRUE;
                     EventsFireEventListeners(lockedEvent, adapter);
-                    ev_timer_set(&adapter->sendTimer, 0.1,0.1);
-                    ev_timer_start(loop, &adapter->sendTimer);
-                }
-                else
-                {
-                    ev_timer_stop(loop, &adapter->sendTimer);
+                    if (!adapter->replay || !DVBReplayStart(adapter, loop))
+                    {
+                        ev_timer_set(&adapter->sendTimer, 0.1,0.1);
+                        ev_timer_start(loop, &adapter->sendTimer);
+                    }
                 }
                 break;
             case MONITOR_CMD_FE_DEACTIVATE:
-                close(adapter->frontEndFd);
-                adapter->frontEndFd = -1;
-                ev_timer_stop(loop, &adapter->sendTimer);
+                DVBStreamClose(adapter, loop);
                 break;
         }
     }
@@ -550,22 +645,17 @@ static void DVBFilterPackets(struct ev_loop *loop, ev_timer *w, int revents)
         }
         else
         {
-            int i, p;
+            int i;
 
             for (i = 0; i < r/188; i ++)
             {
                 TSPacket_t *packet = (TSPacket_t*)&buffer[i * 188];
                 uint16_t pid = TSPACKET_GETPID(*packet);
-                for (p = 0; p < adapter->maxFilters; p ++)
+                if (adapter->pidEnabled[FILTER_PID_ALL] || adapter->pidEnabled[pid])
                 {
-                    if (((adapter->filters[p].pid == 8192) || (pid == adapter->filters[p].pid)) && 
-                         (adapter->filters[p].demuxFd != -1))
+                    if (write(adapter->sendFd, packet, 188) == -1)
                     {
-                        if (write(adapter->sendFd, packet, 188) == -1)
-                        {
-                            /* do nothing */
-                        }
-                        break;
+                        /* do nothing */
                     }
                 }
             }
@@ -573,6 +663,331 @@ static void DVBFilterPackets(struct ev_loop *loop, ev_timer *w, int revents)
     }
 }
 
+static void DVBStreamClose(DVBAdapter_t *adapter, struct ev_loop *loop)
+{
+    ev_timer_stop(loop, &adapter->sendTimer);
+    ev_timer_stop(loop, &adapter->replayTimer);
+    ev_idle_stop(loop, &adapter->replayIdle);
+    if (adapter->replayMapping)
+    {
+        /* The file is unmapped once any batches still referencing it have
+         * been released. */
+        ObjectRefDec(adapter->replayMapping);
+        adapter->replayMapping = NULL;
+    }
+    if (adapter->frontEndFd != -1)
+    {
+        close(adapter->frontEndFd);
+        adapter->frontEndFd = -1;
+    }
+}
+
+static bool DVBReplayStart(DVBAdapter_t *adapter, struct ev_loop *loop)
+{
+    struct stat st;
+    ReplayMapping_t *mapping;
+    void *base;
+
+    if ((fstat(adapter->frontEndFd, &st) == -1) || (st.st_size < TSPACKET_SIZE))
+    {
+        LogModule(LOG_ERROR, FILEADAPTER, "Stream file is empty or could not be queried, falling back to pipe mode\n");
+        return FALSE;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, adapter->frontEndFd, 0);
+    if (base == MAP_FAILED)
+    {
+        LogModule(LOG_ERROR, FILEADAPTER, "Failed to map stream file (%s), falling back to pipe mode\n", strerror(errno));
+        return FALSE;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    mapping = ObjectCreateType(ReplayMapping_t);
+    if (mapping == NULL)
+    {
+        munmap(base, st.st_size);
+        return FALSE;
+    }
+    mapping->base = base;
+    mapping->length = st.st_size;
+    adapter->replayMapping = mapping;
+    adapter->replayNrofPackets = st.st_size / TSPACKET_SIZE;
+    DVBReplayRewind(adapter, loop);
+
+    LogModule(LOG_DEBUG, FILEADAPTER, "Replaying %lu packets (pacing %s)\n",
+        (unsigned long)adapter->replayNrofPackets, ReplayPacingStr[adapter->replayPacing]);
+    if (adapter->replayPacing == ReplayPacing_Fast)
+    {
+        ev_idle_start(loop, &adapter->replayIdle);
+    }
+    else
+    {
+        ev_timer_set(&adapter->replayTimer, REPLAY_INTERVAL, REPLAY_INTERVAL);
+        ev_timer_start(loop, &adapter->replayTimer);
+    }
+    return TRUE;
+}
+
+static void DVBReplayRewind(DVBAdapter_t *adapter, struct ev_loop *loop)
+{
+    adapter->replayPos = 0;
+    adapter->replayStartTime = ev_time();
+    adapter->replayPacketsSent = 0;
+    adapter->replayPCRPid = REPLAY_PCR_PID_NONE;
+}
+
+static void DVBReplayIdle(struct ev_loop *loop, ev_idle *w, int revents)
+{
+    DVBReplayPackets(w->data, loop);
+}
+
+static void DVBReplayTimer(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    DVBReplayPackets(w->data, loop);
+}
+
+static void DVBReplayPackets(DVBAdapter_t *adapter, struct ev_loop *loop)
+{
+    ev_tstamp elapsed;
+    unsigned long count;
+    int batches;
+
+    if (adapter->replayMapping == NULL)
+    {
+        return;
+    }
+
+    for (batches = 0; batches < REPLAY_MAX_BATCHES_PER_WAKEUP; batches ++)
+    {
+        elapsed = ev_time() - adapter->replayStartTime;
+        count = adapter->replayNrofPackets - adapter->replayPos;
+        if (count > (unsigned long)adapter->replayBatchPackets)
+        {
+            count = adapter->replayBatchPackets;
+        }
+
+        switch (adapter->replayPacing)
+        {
+            case ReplayPacing_Fast:
+            default:
+                /* Only one batch per wakeup so other events still get processed */
+                batches = REPLAY_MAX_BATCHES_PER_WAKEUP;
+                break;
+
+            case ReplayPacing_Bitrate:
+            {
+                unsigned long bitrate = adapter->replayBitrate ? adapter->replayBitrate : adapter->streamRate;
+                unsigned long long due = (unsigned long long)(elapsed * bitrate / (TSPACKET_SIZE * 8));
+                if (due <= adapter->replayPacketsSent)
+                {
+                    return;
+                }
+                if (due - adapter->replayPacketsSent < count)
+                {
+                    count = due - adapter->replayPacketsSent;
+                }
+                break;
+            }
+
+            case ReplayPacing_PCR:
+                count = DVBReplayPCRPacketsDue(adapter, count, elapsed);
+                if (count == 0)
+                {
+                    return;
+                }
+                break;
+        }
+
+        DVBReplayPush(adapter, adapter->replayPos, count);
+        adapter->replayPos += count;
+        adapter->replayPacketsSent += count;
+        if (adapter->replayPos >= adapter->replayNrofPackets)
+        {
+            adapter->replayPasses ++;
+            if (adapter->replayPacing == ReplayPacing_PCR)
+            {
+                /* Resynchronise to the PCRs at the start of the file */
+                DVBReplayRewind(adapter, loop);
+            }
+            else
+            {
+                adapter->replayPos = 0;
+            }
+        }
+    }
+}
+
+/*
+ * Returns the number of packets (up to max) from the current position that
+ * are due to be sent, stopping at the first PCR that is still in the future.
+ */
+static unsigned long DVBReplayPCRPacketsDue(DVBAdapter_t *adapter, unsigned long max, ev_tstamp elapsed)
+{
+    TSPacket_t *packets = (TSPacket_t *)adapter->replayMapping->base;
+    unsigned long i;
+
+    for (i = 0; i < max; i ++)
+    {
+        TSPacket_t *packet = &packets[adapter->replayPos + i];
+        uint16_t pid = TSPACKET_GETPID(*packet);
+        uint64_t pcr;
+        ev_tstamp pcrTime;
+
+        if (!TSPACKET_HASPCR(*packet) ||
+            ((adapter->replayPCRPid != REPLAY_PCR_PID_NONE) && (pid != adapter->replayPCRPid)))
+        {
+            continue;
+        }
+
+        pcr = TSPACKET_GETPCR(*packet);
+        if (adapter->replayPCRPid == REPLAY_PCR_PID_NONE)
+        {
+            /* Pace against the first PID seen carrying a PCR */
+            adapter->replayPCRPid = pid;
+            adapter->replayPCRBase = pcr;
+            adapter->replayStartTime += elapsed;
+            elapsed = 0;
+            continue;
+        }
+
+        pcrTime = (double)((pcr - adapter->replayPCRBase + TSPACKET_PCR_WRAP) % TSPACKET_PCR_WRAP) / TSPACKET_PCR_HZ;
+        if (pcrTime > elapsed + REPLAY_PCR_MAX_JUMP)
+        {
+            /* Discontinuity (or the PCR went backwards), restart the clock */
+            LogModule(LOG_DEBUG, FILEADAPTER, "PCR discontinuity on PID 0x%x\n", pid);
+            adapter->replayPCRBase = pcr;
+            adapter->replayStartTime += elapsed;
+            elapsed = 0;
+            continue;
+        }
+        if (pcrTime > elapsed)
+        {
+            return i;
+        }
+    }
+    return i;
+}
+
+static void DVBReplayPush(DVBAdapter_t *adapter, unsigned long start, unsigned long count)
+{
+    TSReader_t *reader = MainTSReaderGet();
+    TSPacket_t *packets = &((TSPacket_t *)adapter->replayMapping->base)[start];
+    TSPacketBatch_t *batch;
+
+    if (reader == NULL)
+    {
+        return;
+    }
+
+    if (adapter->pidEnabled[FILTER_PID_ALL])
+    {
+        /* Pass the packets straight from the mapped file */
+        batch = TSPacketBatchCreateExternal(packets, count, adapter->replayMapping);
+    }
+    else
+    {
+        /* Only the PIDs with a filter allocated, as a restricted adapter would */
+        TSPacket_t *staging = DVBReplayStagingGet(adapter);
+        unsigned long i;
+        int used = 0;
+
+        if (staging == NULL)
+        {
+            return;
+        }
+        for (i = 0; i < count; i ++)
+        {
+            if (adapter->pidEnabled[TSPACKET_GETPID(packets[i])])
+            {
+                staging[used ++] = packets[i];
+            }
+        }
+        if (used == 0)
+        {
+            return;
+        }
+        batch = TSPacketBatchCreateExternal(staging, used, adapter->replayStaging);
+    }
+
+    if (batch)
+    {
+        TSReaderProcessBatch(reader, batch);
+        if ((batch->owner == adapter->replayStaging) && (batch->refCount > 1))
+        {
+            /* Still in use by a delivery method, don't overwrite it */
+            ObjectRefDec(adapter->replayStaging);
+            adapter->replayStaging = NULL;
+        }
+        TSPacketBatchRelease(batch);
+    }
+}
+
+static TSPacket_t *DVBReplayStagingGet(DVBAdapter_t *adapter)
+{
+    if (adapter->replayStaging && (adapter->replayStaging->nrofPackets != adapter->replayBatchPackets))
+    {
+        ObjectRefDec(adapter->replayStaging);
+        adapter->replayStaging = NULL;
+    }
+    if (adapter->replayStaging == NULL)
+    {
+        adapter->replayStaging = (ReplayStaging_t*)ObjectCollectionCreate(TOSTRING(TSPacket_t), adapter->replayBatchPackets);
+        if (adapter->replayStaging == NULL)
+        {
+            return NULL;
+        }
+    }
+    return adapter->replayStaging->packets;
+}
+
+static void ReplayMappingDestructor(void *ptr)
+{
+    ReplayMapping_t *mapping = ptr;
+    munmap(mapping->base, mapping->length);
+}
+
+static int DVBPropertyReplayPacingGet(void *userArg, PropertyValue_t *value)
+{
+    DVBAdapter_t *adapter = userArg;
+    value->u.string = strdup(ReplayPacingStr[adapter->replayPacing]);
+    return 0;
+}
+
+static int DVBPropertyReplayPacingSet(void *userArg, PropertyValue_t *value)
+{
+    DVBAdapter_t *adapter = userArg;
+    int i;
+    for (i = 0; i < ReplayPacing_Count; i ++)
+    {
+        if (strcasecmp(value->u.string, ReplayPacingStr[i]) == 0)
+        {
+            adapter->replayPacing = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int DVBPropertyReplayBatchPacketsSet(void *userArg, PropertyValue_t *value)
+{
+    int *batchPackets = userArg;
+    if ((value->u.integer < 1) || (value->u.integer > TSREADER_MAX_BUFFER_PACKETS))
+    {
+        return -1;
+    }
+    *batchPackets = value->u.integer;
+    return 0;
+}
+
+static int DVBPropertyReplayBitrateSet(void *userArg, PropertyValue_t *value)
+{
+    int *bitrate = userArg;
+    if (value->u.integer < 0)
+    {
+        return -1;
+    }
+    *bitrate = value->u.integer;
+    return 0;
+}
 
 static int DVBOpenAdapterFile(DVBAdapter_t *adapter)
 {
@@ -658,7 +1073,7 @@ static int DVBOpenStreamFile(int adapter, uint32_t freq, int *fd, unsigned long
             LogModule(LOG_DEBUG, FILEADAPTER, "Opening stream file %s", path);
             if (fscanf(fp, "%lu", &temp_rate) == 1)
             {
-                LogModule(LOG_DEBUG, FILEADAPTER, "Stream rate : %lu bps (UNUSED)", temp_rate);
+                LogModule(LOG_DEBUG, FILEADAPTER, "Stream rate : %lu bps", temp_rate);
                 if (temp_rate > 0)
                 {
                     *fd = open(path, O_RDONLY);
@@ -28,6 +28,7 @@ Logging functions.
 #include <limits.h>
 #include <time.h>
 #include <unistd.h>
+#include <semaphore.h>
 
 #include "main.h"
 #include "logging.h"
@@ -38,14 +39,36 @@ Logging functions.
 *******************************************************************************/
 #define MAX_THREADS 100
 
+/* Number of entries in the module level cache, must be a power of 2. */
+#define MODULE_LEVEL_CACHE_SIZE 128
+
+/* Number of records in each thread's log buffer, must be a power of 2. */
+#define LOG_BUFFER_RECORDS  512
+/* Maximum length of the text of a record, longer text is truncated. */
+#define LOG_RECORD_TEXT     256
+#define LOG_RECORD_NAME     16
+
+/* How often the writer thread checks the thread buffers (ms) */
+#define LOG_WRITER_INTERVAL 20
+
+/* Size of the buffer the writer thread formats records in to before writing */
+#define LOG_WRITER_BATCH    (64 * 1024)
+
 /*******************************************************************************
 * Prototypes                                                                   *
 *******************************************************************************/
 static void LoggingInitCommon(int logLevel);
 static void LogImpl(int level, const char *module, const char * format, va_list valist);
 static int LogGetModuleLevel(const char *module, int level);
+static int LogFindModuleMinLevel(const char *module);
 static char *LogGetThreadName(pthread_t thread);
-static int LogGetModuleLevel(const char *module, int level);
+static void LogAsync(int level, const char *module, const char * format, va_list valist);
+static struct LogThreadBuffer_s *LogThreadBufferGet(void);
+static void LogThreadBufferExited(void *arg);
+static void *LogWriterThread(void *arg);
+static void LogWriterDrain(void);
+static void LogWriterAppend(const char *format, ...);
+static void LogWriterFlush(void);
 
 /*******************************************************************************
 * Typedefs                                                                     *
@@ -63,6 +86,39 @@ typedef struct ModuleLevel_s
     struct ModuleLevel_s *next;
 }ModuleLevel_t;
 
+typedef struct ModuleLevelCache_s
+{
+    const char *module; /* Module name pointer as passed to LogModule */
+    int minLevel;       /* Lowest level output for the module */
+}ModuleLevelCache_t;
+
+typedef struct LogRecord_s
+{
+    time_t time;
+    int level;
+    int errnum;                     /* errno for LOG_ERROR records, otherwise 0 */
+    char module[LOG_RECORD_NAME];
+    char thread[LOG_RECORD_NAME];
+    char text[LOG_RECORD_TEXT];
+}LogRecord_t;
+
+/*
+ * Single producer/single consumer ring of records, head is only written by the
+ * owning thread and tail only by the writer thread.
+ */
+typedef struct LogThreadBuffer_s
+{
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    volatile unsigned int dropped;  /* Records dropped because the buffer was full */
+    unsigned int droppedReported;   /* Only accessed by the writer thread */
+    volatile bool exited;
+    unsigned int nameGeneration;    /* threadNamesGeneration the name was looked up at */
+    char name[LOG_RECORD_NAME];
+    struct LogThreadBuffer_s *next;
+    LogRecord_t records[LOG_BUFFER_RECORDS];
+}LogThreadBuffer_t;
+
 /*******************************************************************************
 * Global variables                                                             *
 *******************************************************************************/
@@ -71,12 +127,39 @@ typedef struct ModuleLevel_s
  * Current verbosity level.
  * Used to determine when to send text from a printlog call to the log output.
  */
-static int verbosity = 0;
+int logVerbosity = 0;
+bool logModuleLevelsSet = FALSE;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static FILE *logFP = NULL;
 static ThreadName_t threadNames[MAX_THREADS];
 static ModuleLevel_t *moduleLevels = NULL;
 
+/*
+ * Module names are static strings so the level for a module is cached by the
+ * address of its name, to avoid comparing against every module level on each
+ * call. Entries are only ever added (under moduleLevelCacheMutex) so they can
+ * be read without locking.
+ */
+static pthread_mutex_t moduleLevelCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static ModuleLevelCache_t moduleLevelCache[MODULE_LEVEL_CACHE_SIZE];
+
+/*
+ * Asynchronous logging, when started threads format their messages in to a
+ * buffer of their own and the writer thread timestamps and writes them to the
+ * log file, so logging doesn't block on the file or the logging mutex.
+ */
+static volatile bool asyncStarted = FALSE;
+static volatile bool asyncQuit = FALSE;
+static pthread_t writerThread;
+static sem_t writerWakeup;
+static pthread_key_t threadBufferKey;
+static pthread_mutex_t threadBuffersMutex = PTHREAD_MUTEX_INITIALIZER;
+static LogThreadBuffer_t *threadBuffers = NULL;
+static volatile unsigned int threadNamesGeneration = 0;
+static unsigned long droppedTotal = 0;
+static char writerBatch[LOG_WRITER_BATCH];
+static size_t writerBatchLen = 0;
+
 /*******************************************************************************
 * Global functions                                                             *
 *******************************************************************************/
@@ -131,34 +214,86 @@ void LoggingRedirectStdErrStdOut(void)
     dup2(fileno(logFP), 2);
 }
 
+int LoggingAsyncStart(void)
+{
+    if (asyncStarted)
+    {
+        return 0;
+    }
+    if (pthread_key_create(&threadBufferKey, LogThreadBufferExited))
+    {
+        return -1;
+    }
+    sem_init(&writerWakeup, 0, 0);
+    asyncQuit = FALSE;
+    if (pthread_create(&writerThread, NULL, LogWriterThread, NULL))
+    {
+        sem_destroy(&writerWakeup);
+        pthread_key_delete(threadBufferKey);
+        return -1;
+    }
+    asyncStarted = TRUE;
+    return 0;
+}
+
+unsigned long LogDroppedCount(void)
+{
+    unsigned long result = 0;
+    LogThreadBuffer_t *buffer;
+
+    pthread_mutex_lock(&threadBuffersMutex);
+    result = droppedTotal;
+    for (buffer = threadBuffers; buffer; buffer = buffer->next)
+    {
+        result += buffer->dropped - buffer->droppedReported;
+    }
+    pthread_mutex_unlock(&threadBuffersMutex);
+    return result;
+}
+
 void LoggingDeInit(void)
 {
+    if (asyncStarted)
+    {
+        /* Buffers of threads still running are left allocated as they may
+         * still be in use, messages logged from now on are written directly. */
+        asyncStarted = FALSE;
+        asyncQuit = TRUE;
+        sem_post(&writerWakeup);
+        pthread_join(writerThread, NULL);
+        sem_destroy(&writerWakeup);
+    }
     fclose(logFP);
 }
 
 void LogLevelSet(int level)
 {
-    verbosity = level;
+    logVerbosity = level;
 }
 
 int LogLevelGet(void)
 {
-    return verbosity;
+    return logVerbosity;
 }
 
 void LogLevelInc(void)
 {
-    verbosity ++;
+    logVerbosity ++;
 }
 
 void LogLevelDec(void)
 {
-    verbosity ++;
+    logVerbosity ++;
 }
 
 bool LogLevelIsEnabled(int level)
 {
-    return (level <= verbosity);
+    return (level <= LOG_LEVEL_MAX) && (level <= logVerbosity);
+}
+
+bool LogModuleLevelIsEnabled(int level, const char *module)
+{
+    return LogGetModuleLevel(module, level) <= logVerbosity;
 }
 
 void LogLoadModuleLevels(const char *path)
@@ -186,6 +321,11 @@ void LogLoadModuleLevels(const char *path)
                 }
             }
         }
+        fclose(fp);
+        pthread_mutex_lock(&moduleLevelCacheMutex);
+        memset(moduleLevelCache, 0, sizeof(moduleLevelCache));
+        logModuleLevelsSet = (moduleLevels != NULL);
+        pthread_mutex_unlock(&moduleLevelCacheMutex);
     }
 }
 
@@ -202,6 +342,7 @@ void LogRegisterThread(pthread_t thread, const char *name)
             break;
         }
     }
+    threadNamesGeneration ++;
     pthread_mutex_unlock(&mutex);
 }
 
@@ -218,10 +359,12 @@ void LogUnregisterThread(pthread_t thread)
             break;
         }
     }
+    threadNamesGeneration ++;
     pthread_mutex_unlock(&mutex);
 }
 
-void LogModule(int level, const char *module, char *format, ...)
+/* The name is in brackets so the LogModule macro in logging.h isn't expanded. */
+void (LogModule)(int level, const char *module, char *format, ...)
 {
     va_list valist;
 
@@ -235,10 +378,17 @@ void LogModule(int level, const char *module, char *format, ...)
             fprintf(stderr, "\n");
         }
     }
-    if (LogGetModuleLevel(module, level) <= verbosity)
+    if ((level <= LOG_LEVEL_MAX) && (LogGetModuleLevel(module, level) <= logVerbosity))
     {
         va_start(valist, format);
-        LogImpl(level, module, format, valist);
+        if (asyncStarted)
+        {
+            LogAsync(level, module, format, valist);
+        }
+        else
+        {
+            LogImpl(level, module, format, valist);
+        }
         va_end(valist);
     }
     
@@ -251,7 +401,7 @@ static void LoggingInitCommon(int logLevel)
     fprintf(logFP, "------------------- | --------------- | -- | --------------- | ----------------------------------------\n");
     fprintf(logFP, "Date       Time     | Module          | Lv | Thread          | Details\n");
     fprintf(logFP, "------------------- | --------------- | -- | --------------- | ----------------------------------------\n");
-    verbosity = logLevel;
+    logVerbosity = logLevel;
     memset(&threadNames, 0, sizeof(threadNames));
 }
 
@@ -291,6 +441,202 @@ static void LogImpl(int level, const char *module, const char * format, va_list
     pthread_mutex_unlock(&mutex);
 }
 
+static void LogAsync(int level, const char *module, const char * format, va_list valist)
+{
+    int errnum = errno;
+    LogThreadBuffer_t *buffer = LogThreadBufferGet();
+    LogRecord_t *record;
+    unsigned int head;
+    unsigned int used;
+
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    head = buffer->head;
+    used = head - buffer->tail;
+    if (used >= LOG_BUFFER_RECORDS)
+    {
+        buffer->dropped ++;
+        return;
+    }
+
+    if (buffer->nameGeneration != threadNamesGeneration)
+    {
+        pthread_mutex_lock(&mutex);
+        buffer->nameGeneration = threadNamesGeneration;
+        snprintf(buffer->name, LOG_RECORD_NAME, "%.*s", LOG_RECORD_NAME - 1, LogGetThreadName(pthread_self()));
+        pthread_mutex_unlock(&mutex);
+    }
+
+    record = &buffer->records[head & (LOG_BUFFER_RECORDS - 1)];
+    record->time = time(NULL);
+    record->level = level;
+    record->errnum = (level == LOG_ERROR) ? errnum : 0;
+    strncpy(record->module, module ? module : "<Unknown>", LOG_RECORD_NAME - 1);
+    record->module[LOG_RECORD_NAME - 1] = 0;
+    memcpy(record->thread, buffer->name, LOG_RECORD_NAME);
+    vsnprintf(record->text, LOG_RECORD_TEXT, format, valist);
+
+    /* Make sure the record is complete before the writer can see it. */
+    __sync_synchronize();
+    buffer->head = head + 1;
+
+    /* Wake the writer early rather than waiting for it to poll if the buffer
+     * is filling up. */
+    if (used == LOG_BUFFER_RECORDS / 2)
+    {
+        sem_post(&writerWakeup);
+    }
+}
+
+static LogThreadBuffer_t *LogThreadBufferGet(void)
+{
+    LogThreadBuffer_t *buffer = pthread_getspecific(threadBufferKey);
+
+    if (buffer == NULL)
+    {
+        buffer = calloc(1, sizeof(LogThreadBuffer_t));
+        if (buffer == NULL)
+        {
+            return NULL;
+        }
+        buffer->nameGeneration = threadNamesGeneration - 1;
+        pthread_setspecific(threadBufferKey, buffer);
+        pthread_mutex_lock(&threadBuffersMutex);
+        buffer->next = threadBuffers;
+        threadBuffers = buffer;
+        pthread_mutex_unlock(&threadBuffersMutex);
+    }
+    return buffer;
+}
+
+static void LogThreadBufferExited(void *arg)
+{
+    LogThreadBuffer_t *buffer = arg;
+    /* The writer thread frees the buffer once it has been emptied. */
+    buffer->exited = TRUE;
+}
+
+static void *LogWriterThread(void *arg)
+{
+    struct timespec timeout;
+
+    while (!asyncQuit)
+    {
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += LOG_WRITER_INTERVAL * 1000000;
+        if (timeout.tv_nsec >= 1000000000)
+        {
+            timeout.tv_sec ++;
+            timeout.tv_nsec -= 1000000000;
+        }
+        sem_timedwait(&writerWakeup, &timeout);
+        LogWriterDrain();
+    }
+    LogWriterDrain();
+    return NULL;
+}
+
+static void LogWriterDrain(void)
+{
+    static time_t lastTime = 0;
+    static char timeBuffer[24]; /* "YYYY-MM-DD HH:MM:SS" */
+    LogThreadBuffer_t *buffer;
+    LogThreadBuffer_t **prevNext;
+    LogRecord_t *record;
+    unsigned int head;
+    unsigned int dropped;
+    bool exited;
+    struct tm loctime;
+
+    pthread_mutex_lock(&threadBuffersMutex);
+    prevNext = &threadBuffers;
+    while ((buffer = *prevNext) != NULL)
+    {
+        exited = buffer->exited;
+        head = buffer->head;
+        __sync_synchronize();
+        for (; buffer->tail != head; buffer->tail ++)
+        {
+            record = &buffer->records[buffer->tail & (LOG_BUFFER_RECORDS - 1)];
+            if (record->time != lastTime)
+            {
+                lastTime = record->time;
+                localtime_r(&lastTime, &loctime);
+                strftime(timeBuffer, sizeof(timeBuffer), "%F %T", &loctime);
+            }
+            LogWriterAppend("%-19s | %-15s | %2d | %-15s | %s%s", timeBuffer, record->module,
+                record->level, record->thread, record->text,
+                (strchr(record->text, '\n') == NULL) ? "\n" : "");
+            if (record->errnum != 0)
+            {
+                LogWriterAppend("%-19s | %-15s | %2d | %-15s | errno = %d (%s)\n", timeBuffer,
+                    record->module, record->level, record->thread, record->errnum, strerror(record->errnum));
+            }
+            /* Record has been consumed, don't let the owner overwrite it
+             * until it has been read. */
+            __sync_synchronize();
+        }
+
+        dropped = buffer->dropped;
+        if (dropped != buffer->droppedReported)
+        {
+            if (lastTime == 0)
+            {
+                lastTime = time(NULL);
+                localtime_r(&lastTime, &loctime);
+                strftime(timeBuffer, sizeof(timeBuffer), "%F %T", &loctime);
+            }
+            LogWriterAppend("%-19s | %-15s | %2d | %-15s | %u log messages dropped, buffer full\n",
+                timeBuffer, "Logging", LOG_ERROR, buffer->name, dropped - buffer->droppedReported);
+            droppedTotal += dropped - buffer->droppedReported;
+            buffer->droppedReported = dropped;
+        }
+
+        if (exited && (buffer->tail == head))
+        {
+            *prevNext = buffer->next;
+            free(buffer);
+        }
+        else
+        {
+            prevNext = &buffer->next;
+        }
+    }
+    pthread_mutex_unlock(&threadBuffersMutex);
+    LogWriterFlush();
+}
+
+static void LogWriterAppend(const char *format, ...)
+{
+    va_list valist;
+    int len;
+
+    /* Always leave room for a complete record. */
+    if (LOG_WRITER_BATCH - writerBatchLen < LOG_RECORD_TEXT + 128)
+    {
+        LogWriterFlush();
+    }
+    va_start(valist, format);
+    len = vsnprintf(writerBatch + writerBatchLen, LOG_WRITER_BATCH - writerBatchLen, format, valist);
+    va_end(valist);
+    if (len > 0)
+    {
+        writerBatchLen += ((size_t)len < LOG_WRITER_BATCH - writerBatchLen) ? (size_t)len : LOG_WRITER_BATCH - writerBatchLen - 1;
+    }
+}
+
+static void LogWriterFlush(void)
+{
+    if (writerBatchLen > 0)
+    {
+        fwrite(writerBatch, 1, writerBatchLen, logFP);
+        writerBatchLen = 0;
+    }
+}
+
 static char *LogGetThreadName(pthread_t thread)
 {
     static char numericName[20];
@@ -308,16 +654,58 @@ static char *LogGetThreadName(pthread_t thread)
 
 static int LogGetModuleLevel(const char *module, int level)
 {
-    int result = level;
+    unsigned int hash;
+    unsigned int i;
+    ModuleLevelCache_t *entry;
+    const char *cachedModule;
+    int minLevel;
+
+    if (!logModuleLevelsSet || (module == NULL))
+    {
+        return level;
+    }
+
+    hash = ((unsigned long)module >> 2) * 2654435761U;
+    for (i = 0; i < MODULE_LEVEL_CACHE_SIZE; i ++)
+    {
+        entry = &moduleLevelCache[(hash + i) & (MODULE_LEVEL_CACHE_SIZE - 1)];
+        cachedModule = entry->module;
+        if (cachedModule == module)
+        {
+            __sync_synchronize();
+            minLevel = entry->minLevel;
+            break;
+        }
+        if (cachedModule == NULL)
+        {
+            minLevel = LogFindModuleMinLevel(module);
+            pthread_mutex_lock(&moduleLevelCacheMutex);
+            if (entry->module == NULL)
+            {
+                entry->minLevel = minLevel;
+                __sync_synchronize();
+                entry->module = module;
+            }
+            pthread_mutex_unlock(&moduleLevelCacheMutex);
+            break;
+        }
+    }
+    if (i == MODULE_LEVEL_CACHE_SIZE)
+    {
+        minLevel = LogFindModuleMinLevel(module);
+    }
+    return (level < minLevel) ? logVerbosity + 1 : level;
+}
+
+static int LogFindModuleMinLevel(const char *module)
+{
+    int result = 0;
     ModuleLevel_t *modLevel;
     for (modLevel = moduleLevels; modLevel; modLevel = modLevel->next)
     {
         if (strcmp(modLevel->module, module) == 0)
         {
-            if (level < modLevel->level)
-            {
-                result = verbosity + 1;
-            }
+            result = modLevel->level;
             break;
         }
     }
@@ -41,6 +41,7 @@ Entry point to the application.
 #include "dbase.h"
 #include "epgtypes.h"
 #include "epgchannel.h"
+#include "epgdbase.h"
 #include "multiplexes.h"
 #include "services.h"
 #include "dvbadapter.h"
@@ -116,6 +117,10 @@ static void DeInitDaemon(void);
 static void InstallSysProperties(void);
 static int SysPropertyGetUptime(void *userArg, PropertyValue_t *value);
 static int SysPropertyGetUptimeSecs(void *userArg, PropertyValue_t *value);
+static void SysObjectClassPropertiesAdd(ObjectClass_t clazz);
+static int SysPropertyGetPoolBlocks(void *userArg, PropertyValue_t *value);
+static int SysPropertyGetPoolFree(void *userArg, PropertyValue_t *value);
+static int SysPropertyGetPoolHitRate(void *userArg, PropertyValue_t *value);
 
 /*******************************************************************************
 * Global variables                                                             *
@@ -157,6 +162,7 @@ int main(int argc, char *argv[])
     
     DeliveryMethodInstance_t *dmInstance;
     char logFilename[PATH_MAX] = {0};
+    bool asyncLogging = FALSE;
 
     /* Create the data directory */
     sprintf(DataDirectory, "%s/.dvbstreamer", getenv("HOME"));
@@ -167,7 +173,7 @@ int main(int argc, char *argv[])
     while (!ExitProgram)
     {
         int c;
-        c = getopt(argc, argv, "vVdDro:a:f:u:p:n:F:i:RL:I");
+        c = getopt(argc, argv, "vVdDro:a:f:u:p:n:F:i:RL:IA");
         if (c == -1)
         {
             break;
@@ -178,6 +184,8 @@ int main(int argc, char *argv[])
                 break;
                 case 'L': strcpy(logFilename, optarg);
                 break;
+                case 'A': asyncLogging = TRUE;
+                break;
                 case 'V':
                 version();
                 exit(0);
@@ -268,6 +276,11 @@ int main(int argc, char *argv[])
         InitDaemon(adapterNumber);
     }
 
+    if (asyncLogging && LoggingAsyncStart())
+    {
+        LogModule(LOG_ERROR, MAIN, "Failed to start asynchronous logging!\n");
+    }
+
     StartTime = time(NULL);
 
 
@@ -293,6 +306,7 @@ int main(int argc, char *argv[])
     INIT(DBaseInit(adapterNumber), "database");
     INIT(EPGTypesInit(), "EPG types");
     INIT(EPGChannelInit(), "EPG channel");
+    INIT(EPGDBaseInit(), "EPG database");
     INIT(MultiplexInit(), "multiplex");
     INIT(ServiceInit(), "service");
     INIT(DispatchersInit(), "dispatchers");
@@ -451,7 +465,6 @@ int main(int argc, char *argv[])
     {
         DispatchersStart(TRUE);
         LogModule(LOG_DEBUGV, MAIN, "Remote interface finished, shutting down\n");
-        RemoteInterfaceDeInit();
     }
     else
     {
@@ -466,13 +479,15 @@ int main(int argc, char *argv[])
             LogModule(LOG_DEBUGV, MAIN, "Command loop finished, shutting down\n");
             ExitProgram = TRUE;
         }
-
-        if (remoteInterface)
-        {
-            RemoteInterfaceDeInit();
-        }
     }
     DispatchersStop();
+
+    /* The remote interface must be shutdown after the network dispatcher has
+     * stopped as it owns watchers on the network event loop. */
+    if (DaemonMode || remoteInterface)
+    {
+        RemoteInterfaceDeInit();
+    }
     TSReaderEnable(TSReader, FALSE);
 
     ServiceFilterDestroyAll(TSReader);
@@ -548,9 +563,11 @@ int main(int argc, char *argv[])
     DEINIT(DispatchersDeInit(), "dispatchers");
     DEINIT(ServiceDeInit(), "service");
     DEINIT(MultiplexDeInit(), "multiplex");
+    DEINIT(EPGDBaseDeInit(), "EPG database");
     DEINIT(EPGChannelDeInit(), "EPG channel");
     DEINIT(EPGTypesDeInit(), "EPG types");
     DEINIT(DBaseDeInit(), "database");
+    ObjectClassRegisteredCallbackSet(NULL);
     DEINIT(PropertiesDeInit(), "properties");
     DEINIT(EventsDeInit(), "events");
     DEINIT(ObjectDeinit(), "objects");
@@ -583,6 +600,27 @@ static void InstallSysProperties(void)
                       PropertyType_String, NULL, SysPropertyGetUptime, NULL);
     PropertiesAddProperty("sys.uptime", "seconds", "The time that this instance has been running in seconds.",
                           PropertyType_Int, NULL, SysPropertyGetUptimeSecs, NULL);
+
+    ObjectClassForEach(SysObjectClassPropertiesAdd);
+    ObjectClassRegisteredCallbackSet(SysObjectClassPropertiesAdd);
+}
+
+static void SysObjectClassPropertiesAdd(ObjectClass_t clazz)
+{
+    char path[PROPERTIES_PATH_MAX];
+    ObjectPoolStats_t stats;
+
+    if (!ObjectClassPoolStatsGet(clazz, &stats))
+    {
+        return;
+    }
+    snprintf(path, sizeof(path), "sys.objects.%s", ObjectClassName(clazz));
+    PropertiesAddProperty(path, "blocks", "Number of blocks in the pool objects of this class are allocated from.",
+                          PropertyType_Int, clazz, SysPropertyGetPoolBlocks, NULL);
+    PropertiesAddProperty(path, "free", "Number of blocks in the pool not currently in use.",
+                          PropertyType_Int, clazz, SysPropertyGetPoolFree, NULL);
+    PropertiesAddProperty(path, "hitrate", "Percentage of allocations satisfied without growing the pool.",
+                          PropertyType_Float, clazz, SysPropertyGetPoolHitRate, NULL);
 }
 
 static int SysPropertyGetUptime(void *userArg, PropertyValue_t *value)
@@ -614,6 +652,32 @@ static int SysPropertyGetUptimeSecs(void *userArg, PropertyValue_t *value)
     return 0;
 }
 
+static int SysPropertyGetPoolBlocks(void *userArg, PropertyValue_t *value)
+{
+    ObjectPoolStats_t stats;
+    ObjectClassPoolStatsGet(userArg, &stats);
+    value->u.integer = stats.nrofBlocks;
+    return 0;
+}
+
+static int SysPropertyGetPoolFree(void *userArg, PropertyValue_t *value)
+{
+    ObjectPoolStats_t stats;
+    ObjectClassPoolStatsGet(userArg, &stats);
+    value->u.integer = stats.nrofFreeBlocks;
+    return 0;
+}
+
+static int SysPropertyGetPoolHitRate(void *userArg, PropertyValue_t *value)
+{
+    ObjectPoolStats_t stats;
+    unsigned long long total;
+    ObjectClassPoolStatsGet(userArg, &stats);
+    total = stats.hits + stats.misses;
+    value->u.fp = total ? ((double)stats.hits * 100.0) / (double)total : 0.0;
+    return 0;
+}
+
 
 TSReader_t *MainTSReaderGet(void)
 {
@@ -705,6 +769,7 @@ static void usage(char *appname)
             "      -v            : Increase the amount of debug output, can be used multiple\n"
             "                      times for more output\n"
             "      -L <file>     : Set the location of the log file.\n"
+            "      -A            : Write the log file from a background thread.\n"
             "      -V            : Print version information then exit\n"
             "      -o <mrl>      : Output primary service to the specified mrl.\n"
             "      -a <adapter>  : Use adapter number (ie /dev/dvb/adapter<adapter>/...)\n"
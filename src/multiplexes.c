@@ -97,9 +97,10 @@ Multiplex_t *MultiplexFindUID(int uid)
     Multiplex_t *result = NULL;
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("SELECT " MULTIPLEX_FIELDS " "
-                        "FROM " MULTIPLEXES_TABLE " WHERE " MULTIPLEX_UID "=%d;",uid);
+    STATEMENT_PREPARE_CACHED("SELECT " MULTIPLEX_FIELDS " "
+                             "FROM " MULTIPLEXES_TABLE " WHERE " MULTIPLEX_UID "=?;");
     RETURN_ON_ERROR(NULL);
+    STATEMENT_BIND_INT(1, uid);
 
     result = MultiplexGetNext((MultiplexEnumerator_t)stmt);
 
@@ -112,11 +113,12 @@ Multiplex_t *MultiplexFindId(int netid, int tsid)
     Multiplex_t *result = NULL;
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("SELECT " MULTIPLEX_FIELDS " "
-                        "FROM " MULTIPLEXES_TABLE
-                        " WHERE " MULTIPLEX_NETID "=%d AND " MULTIPLEX_TSID "=%d;",
-                        netid, tsid);
+    STATEMENT_PREPARE_CACHED("SELECT " MULTIPLEX_FIELDS " "
+                             "FROM " MULTIPLEXES_TABLE
+                             " WHERE " MULTIPLEX_NETID "=? AND " MULTIPLEX_TSID "=?;");
     RETURN_ON_ERROR(NULL);
+    STATEMENT_BIND_INT(1, netid);
+    STATEMENT_BIND_INT(2, tsid);
 
     result = MultiplexGetNext((MultiplexEnumerator_t)stmt);
 
@@ -127,8 +129,8 @@ Multiplex_t *MultiplexFindId(int netid, int tsid)
 MultiplexEnumerator_t MultiplexEnumeratorGet()
 {
     STATEMENT_INIT;
-    STATEMENT_PREPARE("SELECT " MULTIPLEX_FIELDS " "
-                      "FROM " MULTIPLEXES_TABLE ";");
+    STATEMENT_PREPARE_CACHED("SELECT " MULTIPLEX_FIELDS " "
+                             "FROM " MULTIPLEXES_TABLE ";");
     RETURN_ON_ERROR(NULL);
     return stmt;
 }
@@ -180,8 +182,8 @@ MultiplexList_t *MultiplexGetAll(void)
 
     count = DBaseCount(MULTIPLEXES_TABLE, NULL);
     
-    STATEMENT_PREPARE("SELECT " MULTIPLEX_FIELDS " "
-                      "FROM " MULTIPLEXES_TABLE ";");
+    STATEMENT_PREPARE_CACHED("SELECT " MULTIPLEX_FIELDS " "
+                             "FROM " MULTIPLEXES_TABLE ";");
     RETURN_ON_ERROR(NULL);
 
     list = (MultiplexList_t*)ObjectCollectionCreate(TOSTRING(MultiplexList_t),count);
@@ -198,12 +200,15 @@ int MultiplexAdd(DVBDeliverySystem_e delSys, char *tuningParams, Multiplex_t **m
     Multiplex_t *multiplex;
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("INSERT INTO " MULTIPLEXES_TABLE "("
-                        MULTIPLEX_UID ","
-                        MULTIPLEX_TYPE ","
-                        MULTIPLEX_TUNINGPARAMS ")"
-                        "VALUES (%d, %d, %Q);", uidSeed, delSys, tuningParams);
+    STATEMENT_PREPARE_CACHED("INSERT INTO " MULTIPLEXES_TABLE "("
+                             MULTIPLEX_UID ","
+                             MULTIPLEX_TYPE ","
+                             MULTIPLEX_TUNINGPARAMS ")"
+                             "VALUES (?, ?, ?);");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, uidSeed);
+    STATEMENT_BIND_INT(2, delSys);
+    STATEMENT_BIND_TEXT(3, tuningParams);
 
     STATEMENT_STEP();
 
@@ -226,10 +231,11 @@ int MultiplexAdd(DVBDeliverySystem_e delSys, char *tuningParams, Multiplex_t **m
 int MultiplexDelete(Multiplex_t *multiplex)
 {
     STATEMENT_INIT;
-    STATEMENT_PREPAREVA("DELETE FROM " MULTIPLEXES_TABLE
-                        " WHERE " MULTIPLEX_UID "=%d;", multiplex->uid);
+    STATEMENT_PREPARE_CACHED("DELETE FROM " MULTIPLEXES_TABLE
+                             " WHERE " MULTIPLEX_UID "=?;");
 
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, multiplex->uid);
 
     STATEMENT_STEP();
 
@@ -245,11 +251,13 @@ int MultiplexDelete(Multiplex_t *multiplex)
 int MultiplexTSIdSet(Multiplex_t *multiplex, int tsid)
 {
     STATEMENT_INIT;
-    STATEMENT_PREPAREVA("UPDATE " MULTIPLEXES_TABLE " "
-                        "SET " MULTIPLEX_TSID "=%d "
-                        "WHERE " MULTIPLEX_UID "=%d;", tsid, multiplex->uid);
+    STATEMENT_PREPARE_CACHED("UPDATE " MULTIPLEXES_TABLE " "
+                             "SET " MULTIPLEX_TSID "=? "
+                             "WHERE " MULTIPLEX_UID "=?;");
     multiplex->tsId = tsid;
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, tsid);
+    STATEMENT_BIND_INT(2, multiplex->uid);
 
     STATEMENT_STEP();
 
@@ -260,11 +268,13 @@ int MultiplexTSIdSet(Multiplex_t *multiplex, int tsid)
 int MultiplexNetworkIdSet(Multiplex_t *multiplex, int netid)
 {
     STATEMENT_INIT;
-    STATEMENT_PREPAREVA("UPDATE " MULTIPLEXES_TABLE " "
-                        "SET " MULTIPLEX_NETID "=%d "
-                        "WHERE " MULTIPLEX_UID "=%d;", netid, multiplex->uid);
+    STATEMENT_PREPARE_CACHED("UPDATE " MULTIPLEXES_TABLE " "
+                             "SET " MULTIPLEX_NETID "=? "
+                             "WHERE " MULTIPLEX_UID "=?;");
     multiplex->networkId = netid;
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, netid);
+    STATEMENT_BIND_INT(2, multiplex->uid);
 
     STATEMENT_STEP();
 
@@ -36,6 +36,12 @@ Object memory management.
 
 //#define USE_MALLOC_FOR_ALLOC
 
+/* Define to keep a list of all live objects so any outstanding at shutdown can
+ * be listed individually, without it only the number outstanding per class is
+ * reported.
+ */
+//#define OBJECT_TRACK
+
 #define OBJECTS_ASSERT(_pred, _msg...) \
     do { \
         if (!(_pred)) \
@@ -45,6 +51,14 @@ Object memory management.
         } \
     }while (0)
 
+/* Objects of classes up to this size (including the object header) are
+ * allocated from per-class pools.
+ */
+#define POOL_MAX_BLOCK_SIZE 1024
+/* Size of the slabs pools are grown by. */
+#define POOL_SLAB_SIZE      16384
+#define CACHE_LINE_SIZE     64
+
 #define ObjectToData(_ptr) (void *)(((char*)(_ptr)) + sizeof(Object_t))
 #define DataToObject(_ptr) (Object_t *)(((char*)(_ptr)) - sizeof(Object_t))
 
@@ -56,13 +70,32 @@ typedef enum ClassType_e{
     ClassType_Collection,
 }ClassType_t;
 
+typedef struct PoolBlock_s {
+    struct PoolBlock_s *next;
+}PoolBlock_t;
+
+typedef struct PoolSlab_s {
+    struct PoolSlab_s *next;
+}PoolSlab_t;
+
 typedef struct Class_s {
     char *name;
     ClassType_t type;
     unsigned int size;
     ObjectDestructor_t destructor;
-    unsigned int allocatedCount;
+    volatile unsigned int allocatedCount;
+    volatile int liveCount;
     struct Class_s *next;
+
+    /* Pool, only used if blockSize != 0 */
+    unsigned int blockSize;         /* Size of each block (object header + object) rounded up to a cache line. */
+    pthread_mutex_t poolMutex;
+    PoolBlock_t *freeBlocks;
+    PoolSlab_t *slabs;
+    unsigned int nrofBlocks;        /* Total number of blocks in all slabs. */
+    unsigned int nrofFreeBlocks;
+    unsigned long long poolHits;    /* Allocations satisfied from the free list. */
+    unsigned long long poolMisses;  /* Allocations that required a new slab. */
 }Class_t;
 
 typedef struct Object_s {
@@ -70,9 +103,12 @@ typedef struct Object_s {
     char    sig[8];
 #endif
     Class_t *clazz;
-    int32_t refCount;
+    volatile int32_t refCount;
     uint32_t size;
+#ifdef OBJECT_TRACK
     struct Object_s *next;
+    struct Object_s *prev;
+#endif
 }Object_t;
 
 
@@ -82,7 +118,14 @@ typedef struct Object_s {
 static Class_t *FindClass(char *classname);
 static int ObjectRegisterClassType(char *name, ClassType_t type, unsigned size, ObjectDestructor_t destructor);
 static void *ObjectAllocInstance(int size, Class_t *clazz);
+static void ObjectFreeInstance(Object_t *object);
+static Object_t *PoolAlloc(Class_t *clazz);
+static void PoolFree(Class_t *clazz, Object_t *object);
+static void PoolDestroy(Class_t *clazz);
+#ifdef OBJECT_TRACK
+static void AddReferencedObject(Object_t *toAdd);
 static void RemoveReferencedObject(Object_t *toRemove);
+#endif
 
 
 /*******************************************************************************
@@ -91,10 +134,18 @@ static void RemoveReferencedObject(Object_t *toRemove);
 static char OBJECT[] = "Object";
 static Class_t *classes = NULL;
 static unsigned int classesCount = 0;
-static Object_t *referencedObjects = NULL;
+static volatile int mallocedLiveCount = 0;
 
+/* Protects the class list, reference counts are updated atomically. */
 static pthread_mutex_t objectMutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
+#ifdef OBJECT_TRACK
+static Object_t *referencedObjects = NULL;
+static pthread_mutex_t referencedObjectsMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static ObjectClassCallback_t classRegisteredCallback = NULL;
+
 /*******************************************************************************
 * Global functions                                                             *
 *******************************************************************************/
@@ -102,13 +153,17 @@ int ObjectInit(void)
 {
     classes = NULL;
     classesCount = 0;
+    mallocedLiveCount = 0;
+#ifdef OBJECT_TRACK
     referencedObjects = NULL;
+#endif
 
     return OBJECT_OK;
 }
 
 int ObjectDeinit(void)
 {
+#ifdef OBJECT_TRACK
     if (referencedObjects)
     {
         Object_t *current; 
@@ -126,25 +181,37 @@ int ObjectDeinit(void)
                 LogModule(LOG_DEBUG, OBJECT, "\t%p (size %u) (malloc'ed)\n", ObjectToData(current), current->size);
             }
             next = current->next;
-            free(current);
+            /* Pooled objects are freed with their slabs. */
+            if ((current->clazz == NULL) || (current->clazz->blockSize == 0))
+            {
+                free(current);
+            }
          }
     }
+#endif
+    if (mallocedLiveCount)
+    {
+        LogModule(LOG_DEBUG, OBJECT, "%d malloc'ed blocks outstanding\n", mallocedLiveCount);
+    }
 
     if (classesCount > 0)
     {
         Class_t *clazz, *next = NULL;
         LogModule(LOG_DEBUG, OBJECT, "%u Registered Classes:\n", classesCount);
-        LogModule(LOG_DEBUG, OBJECT, "\tClass Name                       | Size       | Count      |Destructor?\n");
-        LogModule(LOG_DEBUG, OBJECT, "\t---------------------------------|------------|------------|------------\n");
+        LogModule(LOG_DEBUG, OBJECT, "\tClass Name                       | Size       | Count      | Live       | Pooled     |Destructor?\n");
+        LogModule(LOG_DEBUG, OBJECT, "\t---------------------------------|------------|------------|------------|------------|------------\n");
         for (clazz = classes; clazz; clazz = next)
         {
-            LogModule(LOG_DEBUG, OBJECT, "\t%-32s | %10d | %10d | %s\n", 
-                clazz->name, clazz->size, clazz->allocatedCount, clazz->destructor ? "Yes":"No");
+            LogModule(LOG_DEBUG, OBJECT, "\t%-32s | %10d | %10d | %10d | %10d | %s\n", 
+                clazz->name, clazz->size, clazz->allocatedCount, clazz->liveCount, clazz->nrofBlocks,
+                clazz->destructor ? "Yes":"No");
             next = clazz->next;
+            PoolDestroy(clazz);
             free(clazz->name);
             free(clazz);
         }
     }
+    classRegisteredCallback = NULL;
     pthread_mutex_destroy(&objectMutex);
 
     return OBJECT_OK;
@@ -158,6 +225,10 @@ int ObjectRegisterClass(char *classname, unsigned int size, ObjectDestructor_t d
     if (result == OBJECT_OK)
     {
         LogModule(LOG_DEBUGV, OBJECT, "Registered Class \"%s\" size %d destructor? %s\n", classname, size, destructor? "Yes":"No");
+        if (classRegisteredCallback)
+        {
+            classRegisteredCallback(classes);
+        }
     }
     pthread_mutex_unlock(&objectMutex);
     return result;
@@ -172,6 +243,10 @@ int ObjectRegisterCollection(char *name, unsigned entrysize, ObjectDestructor_t
     if (result == OBJECT_OK)
     {
         LogModule(LOG_DEBUGV, OBJECT, "Registered Collection \"%s\" size %d destructor? %s\n", name, entrysize, destructor? "Yes":"No");
+        if (classRegisteredCallback)
+        {
+            classRegisteredCallback(classes);
+        }
     }
     pthread_mutex_unlock(&objectMutex);
     return result;
@@ -194,11 +269,16 @@ static int ObjectRegisterClassType(char *name, ClassType_t type, unsigned size,
     }
     
     
+    memset(clazz, 0, sizeof(Class_t));
     clazz->name = strdup(name);
     clazz->type = type;
     clazz->size = size;
     clazz->destructor = destructor;
-    clazz->allocatedCount = 0;
+    if ((type == ClassType_Object) && (sizeof(Object_t) + size <= POOL_MAX_BLOCK_SIZE))
+    {
+        clazz->blockSize = (sizeof(Object_t) + size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+        pthread_mutex_init(&clazz->poolMutex, NULL);
+    }
     clazz->next = classes;
     classes = clazz;
     classesCount ++;
@@ -206,16 +286,65 @@ static int ObjectRegisterClassType(char *name, ClassType_t type, unsigned size,
 }
 
 
-void *ObjectCreateImpl(char *classname, char *file, int line)
+ObjectClass_t ObjectClassGet(char *classname)
 {
     Class_t *clazz;
-    void *result;
     pthread_mutex_lock(&objectMutex);
     clazz = FindClass(classname);
+    pthread_mutex_unlock(&objectMutex);
+    return clazz;
+}
+
+char *ObjectClassName(ObjectClass_t clazz)
+{
+    return clazz->name;
+}
+
+void ObjectClassForEach(ObjectClassCallback_t callback)
+{
+    Class_t *clazz;
+    pthread_mutex_lock(&objectMutex);
+    for (clazz = classes; clazz; clazz = clazz->next)
+    {
+        callback(clazz);
+    }
+    pthread_mutex_unlock(&objectMutex);
+}
+
+void ObjectClassRegisteredCallbackSet(ObjectClassCallback_t callback)
+{
+    pthread_mutex_lock(&objectMutex);
+    classRegisteredCallback = callback;
+    pthread_mutex_unlock(&objectMutex);
+}
+
+bool ObjectClassPoolStatsGet(ObjectClass_t clazz, ObjectPoolStats_t *stats)
+{
+    if (clazz->blockSize == 0)
+    {
+        return FALSE;
+    }
+    pthread_mutex_lock(&clazz->poolMutex);
+    stats->blockSize = clazz->blockSize;
+    stats->nrofBlocks = clazz->nrofBlocks;
+    stats->nrofFreeBlocks = clazz->nrofFreeBlocks;
+    stats->hits = clazz->poolHits;
+    stats->misses = clazz->poolMisses;
+    pthread_mutex_unlock(&clazz->poolMutex);
+    return TRUE;
+}
+
+void *ObjectCreateImpl(char *classname, char *file, int line)
+{
+    return ObjectCreateClassImpl(ObjectClassGet(classname), classname, file, line);
+}
+
+void *ObjectCreateClassImpl(ObjectClass_t clazz, char *classname, char *file, int line)
+{
+    void *result;
 
     if (clazz == NULL)
     {
-        pthread_mutex_unlock(&objectMutex);
         return NULL;
     }
 
@@ -228,21 +357,21 @@ void *ObjectCreateImpl(char *classname, char *file, int line)
     {
         LogModule(LOG_ERROR, OBJECT, "Failed to create object of class \"%s\"\n", classname);
     }
-    clazz->allocatedCount ++;
-    pthread_mutex_unlock(&objectMutex);
+    __sync_add_and_fetch(&clazz->allocatedCount, 1);
     return result;
 }
 
 ObjectCollection_t *ObjectCollectionCreateImpl(char *name, unsigned int entries, char *file, int line)
 {
-    Class_t *clazz;
+    return ObjectCollectionCreateClassImpl(ObjectClassGet(name), name, entries, file, line);
+}
+
+ObjectCollection_t *ObjectCollectionCreateClassImpl(ObjectClass_t clazz, char *name, unsigned int entries, char *file, int line)
+{
     ObjectCollection_t *result;
-    pthread_mutex_lock(&objectMutex);
-    clazz = FindClass(name);
 
     if (clazz == NULL)
     {
-        pthread_mutex_unlock(&objectMutex);
         return NULL;
     }
 
@@ -256,25 +385,22 @@ ObjectCollection_t *ObjectCollectionCreateImpl(char *name, unsigned int entries,
     {
         LogModule(LOG_ERROR, OBJECT, "Failed to create collection of class \"%s\" entries %d\n", name, entries);
     }
-    clazz->allocatedCount ++;
-    pthread_mutex_unlock(&objectMutex);
+    __sync_add_and_fetch(&clazz->allocatedCount, 1);
     return result;
-
 }
 
 void ObjectRefIncImpl(void *ptr, char *file, int line)
 {
     Object_t *object;
     char *clazzName = "<Malloc>";
-    pthread_mutex_lock(&objectMutex);
+    int32_t refCount;
     object = DataToObject(ptr);
-    object->refCount ++;
+    refCount = __sync_add_and_fetch(&object->refCount, 1);
     if (object->clazz)
     {
         clazzName = object->clazz->name;
     }
-    LogModule(LOG_DIARRHEA, OBJECT, "(%p:%s) Incrementing ref count, now %d (%s:%d)\n", object, clazzName, object->refCount, file, line);
-    pthread_mutex_unlock(&objectMutex);
+    LogModule(LOG_DIARRHEA, OBJECT, "(%p:%s) Incrementing ref count, now %d (%s:%d)\n", object, clazzName, refCount, file, line);
 }
 
 bool ObjectRefDecImpl(void *ptr, char *file, int line)
@@ -282,13 +408,13 @@ bool ObjectRefDecImpl(void *ptr, char *file, int line)
     bool result = TRUE;
     Object_t *object;
     char *clazzName = "<Malloc>";
+    int32_t refCount;
     if (ptr == NULL)
     {
         LogModule(LOG_ERROR, OBJECT, "Attempt to decrement the reference of NULL! Offending code %s:%d\n", file, line);        
         return FALSE;
     }
     
-    pthread_mutex_lock(&objectMutex);
     object = DataToObject(ptr);
 #ifdef OBJECT_CHECK
     if (memcmp("ObjectP", object->sig, 8))
@@ -302,13 +428,15 @@ bool ObjectRefDecImpl(void *ptr, char *file, int line)
         clazzName = object->clazz->name;
     }
     
-    if (object->refCount > 0)
+    refCount = __sync_sub_and_fetch(&object->refCount, 1);
+    if (refCount < 0)
     {
-        object->refCount --;
-        LogModule(LOG_DIARRHEA, OBJECT, "(%p:%s) Decrementing ref count, now %d (%s:%d)\n", object, clazzName, object->refCount, file, line);        
+        LogModule(LOG_ERROR, OBJECT, "(%p:%s) Attempt to decrement the reference of a released object! Offending code %s:%d\n", object, clazzName, file, line);
+        return FALSE;
     }
+    LogModule(LOG_DIARRHEA, OBJECT, "(%p:%s) Decrementing ref count, now %d (%s:%d)\n", object, clazzName, refCount, file, line);
 
-    if (object->refCount == 0)
+    if (refCount == 0)
     {
         if (object->clazz)
         {
@@ -328,14 +456,10 @@ bool ObjectRefDecImpl(void *ptr, char *file, int line)
         {
             LogModule(LOG_ERROR, OBJECT, "(%p) Class size != Object size! (class %u object %u)\n", object, object->clazz->size, object->size);
         }
-        /* Remove from referenced list */
-        RemoveReferencedObject(object);
-        memset(ObjectToData(object), 0 , object->size);
-        free(object);
+        ObjectFreeInstance(object);
 
         result = FALSE;
     }
-    pthread_mutex_unlock(&objectMutex);
     return result;
 }
 
@@ -349,14 +473,11 @@ void *ObjectAllocImpl(int size, char *file, int line)
         memset(result, 0, size);
     }
 #else
-    pthread_mutex_lock(&objectMutex);
-
     result = ObjectAllocInstance(size, NULL);
     if (result != NULL)
     {
         LogModule(LOG_DEBUGV, OBJECT,"(%p) Malloc'ed memory size %d app ptr %p (%s:%d)\n", DataToObject(result), size, result, file, line);
     }
-    pthread_mutex_unlock(&objectMutex);
 #endif
     return result;
 }
@@ -365,7 +486,14 @@ static void *ObjectAllocInstance(int size, Class_t *clazz)
 {
     Object_t *result = NULL;
 
-    result = malloc(size + sizeof(Object_t));
+    if (clazz && clazz->blockSize)
+    {
+        result = PoolAlloc(clazz);
+    }
+    else
+    {
+        result = malloc(size + sizeof(Object_t));
+    }
     if (!result)
     {
         return NULL;
@@ -378,12 +506,44 @@ static void *ObjectAllocInstance(int size, Class_t *clazz)
     result->clazz = clazz;
     result->size = size;
     result->refCount = 1;
-    result->next = referencedObjects;
-    referencedObjects = result;
-    
+    if (clazz)
+    {
+        __sync_add_and_fetch(&clazz->liveCount, 1);
+    }
+    else
+    {
+        __sync_add_and_fetch(&mallocedLiveCount, 1);
+    }
+#ifdef OBJECT_TRACK
+    AddReferencedObject(result);
+#endif
     return ObjectToData(result);
 }
 
+static void ObjectFreeInstance(Object_t *object)
+{
+    if (object->clazz)
+    {
+        __sync_sub_and_fetch(&object->clazz->liveCount, 1);
+    }
+    else
+    {
+        __sync_sub_and_fetch(&mallocedLiveCount, 1);
+    }
+#ifdef OBJECT_TRACK
+    RemoveReferencedObject(object);
+#endif
+    memset(ObjectToData(object), 0 , object->size);
+    if (object->clazz && object->clazz->blockSize)
+    {
+        PoolFree(object->clazz, object);
+    }
+    else
+    {
+        free(object);
+    }
+}
+
 void ObjectFreeImpl(void *ptr, char *file, int line)
 {
 #ifdef USE_MALLOC_FOR_ALLOC
@@ -413,18 +573,25 @@ void ObjectDump(void *ptr)
 
 bool ObjectIsObject(void *ptr)
 {
+    bool result = FALSE;
+#ifdef OBJECT_TRACK
     Object_t *object;
     Object_t *possibleObject = DataToObject(ptr);
 
+    pthread_mutex_lock(&referencedObjectsMutex);
     for (object = referencedObjects; object; object = object->next)
     {
         if (object == possibleObject)
         {
-            return TRUE;
+            result = TRUE;
+            break;
         }
     }
-
-    return FALSE;
+    pthread_mutex_unlock(&referencedObjectsMutex);
+#elif defined(OBJECT_CHECK)
+    result = memcmp("ObjectP", DataToObject(ptr)->sig, 8) == 0;
+#endif
+    return result;
 }
 
 char * ObjectGetObjectClass(void *ptr)
@@ -461,26 +628,104 @@ static Class_t *FindClass(char *classname)
      return NULL;
 }
 
-static void RemoveReferencedObject(Object_t *toRemove)
+static Object_t *PoolAlloc(Class_t *clazz)
 {
-    Object_t *current = referencedObjects;
-    Object_t *previous = NULL;
+    PoolBlock_t *block;
 
-    while(current)
+    pthread_mutex_lock(&clazz->poolMutex);
+    if (clazz->freeBlocks == NULL)
     {
-        if (current == toRemove)
+        PoolSlab_t *slab;
+        unsigned int nrofBlocks = (POOL_SLAB_SIZE - CACHE_LINE_SIZE) / clazz->blockSize;
+        unsigned int i;
+        char *blocks;
+
+        /* The first cache line of the slab holds the slab header. */
+        if (posix_memalign((void**)&slab, CACHE_LINE_SIZE, CACHE_LINE_SIZE + (nrofBlocks * clazz->blockSize)))
         {
-            if (previous)
-            {
-                previous->next = current->next;
-            }
-            else
-            {
-                referencedObjects = current->next;
-            }
-            break;
+            pthread_mutex_unlock(&clazz->poolMutex);
+            return NULL;
+        }
+        slab->next = clazz->slabs;
+        clazz->slabs = slab;
+        blocks = ((char*)slab) + CACHE_LINE_SIZE;
+        for (i = 0; i < nrofBlocks; i ++)
+        {
+            block = (PoolBlock_t*)(blocks + (i * clazz->blockSize));
+            block->next = clazz->freeBlocks;
+            clazz->freeBlocks = block;
         }
-        previous = current;
-        current = current->next;
+        clazz->nrofBlocks += nrofBlocks;
+        clazz->nrofFreeBlocks += nrofBlocks;
+        clazz->poolMisses ++;
+    }
+    else
+    {
+        clazz->poolHits ++;
+    }
+    block = clazz->freeBlocks;
+    clazz->freeBlocks = block->next;
+    clazz->nrofFreeBlocks --;
+    pthread_mutex_unlock(&clazz->poolMutex);
+    return (Object_t*)block;
+}
+
+static void PoolFree(Class_t *clazz, Object_t *object)
+{
+    PoolBlock_t *block = (PoolBlock_t*)object;
+    pthread_mutex_lock(&clazz->poolMutex);
+    block->next = clazz->freeBlocks;
+    clazz->freeBlocks = block;
+    clazz->nrofFreeBlocks ++;
+    pthread_mutex_unlock(&clazz->poolMutex);
+}
+
+static void PoolDestroy(Class_t *clazz)
+{
+    PoolSlab_t *slab;
+    PoolSlab_t *next;
+
+    if (clazz->blockSize == 0)
+    {
+        return;
+    }
+    for (slab = clazz->slabs; slab; slab = next)
+    {
+        next = slab->next;
+        free(slab);
+    }
+    pthread_mutex_destroy(&clazz->poolMutex);
+}
+
+#ifdef OBJECT_TRACK
+static void AddReferencedObject(Object_t *toAdd)
+{
+    pthread_mutex_lock(&referencedObjectsMutex);
+    toAdd->prev = NULL;
+    toAdd->next = referencedObjects;
+    if (referencedObjects)
+    {
+        referencedObjects->prev = toAdd;
     }
+    referencedObjects = toAdd;
+    pthread_mutex_unlock(&referencedObjectsMutex);
 }
+
+static void RemoveReferencedObject(Object_t *toRemove)
+{
+    pthread_mutex_lock(&referencedObjectsMutex);
+    if (toRemove->prev)
+    {
+        toRemove->prev->next = toRemove->next;
+    }
+    else
+    {
+        referencedObjects = toRemove->next;
+    }
+    if (toRemove->next)
+    {
+        toRemove->next->prev = toRemove->prev;
+    }
+    pthread_mutex_unlock(&referencedObjectsMutex);
+}
+#endif
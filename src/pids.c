@@ -32,6 +32,12 @@ Manage PIDs.
 *******************************************************************************/
 #define SPECIAL_PID_PMT 0x2001
 #define SPECIAL_PID_PCR 0x8000
+
+/* Columns of the PID information following SERVICE_FIELDS in the query used
+ * by ProgramInfoGetForMultiplex */
+#define COLUMN_PID          (SERVICE_FIELDS_COUNT)
+#define COLUMN_TYPE         (SERVICE_FIELDS_COUNT + 1)
+#define COLUMN_DESCRIPTORS  (SERVICE_FIELDS_COUNT + 2)
 /*******************************************************************************
 * Prototypes                                                                   *
 *******************************************************************************/
@@ -40,6 +46,7 @@ static void *RollUpDescriptors(dvbpsi_descriptor_t *descriptors, int *datasize);
 static dvbpsi_descriptor_t *UnRollDescriptors(uint8_t *descriptors, int size);
 static int PIDListCount(Service_t *service);
 static int PIDAdd(Service_t *service, StreamInfo_t *pid);
+static ProgramInfo_t *ProgramInfoFromStreams(StreamInfo_t *streams, int nrofStreams, int pcrPID, dvbpsi_descriptor_t *descriptors);
 
 static void ProgramInfoDestructor(void *ptr);
 static void StreamInfoListDestructor(void *ptr);
@@ -102,15 +109,16 @@ ProgramInfo_t *ProgramInfoGet(Service_t *service)
         {
             int i;
             STATEMENT_INIT;
-            STATEMENT_PREPAREVA("SELECT "
+            STATEMENT_PREPARE_CACHED("SELECT "
                         PID_PID ","
                         PID_TYPE ","
                         PID_DESCRIPTORS " "
-                        "FROM " PIDS_TABLE " WHERE " PID_MULTIPLEXUID "=%d AND " PID_SERVICEID "=%d AND "
-                        PID_PID "<8192;",
-                        service->multiplexUID, service->id);
+                        "FROM " PIDS_TABLE " WHERE " PID_MULTIPLEXUID "=? AND " PID_SERVICEID "=? AND "
+                        PID_PID "<8192;");
             if (rc == SQLITE_OK)
             {
+                STATEMENT_BIND_INT(1, service->multiplexUID);
+                STATEMENT_BIND_INT(2, service->id);
                 for (i = 0; i < count; i ++)
                 {
                     STATEMENT_STEP();
@@ -129,14 +137,16 @@ ProgramInfo_t *ProgramInfoGet(Service_t *service)
 
                 STATEMENT_FINALIZE();
                 
-                STATEMENT_PREPAREVA("SELECT "
+                STATEMENT_PREPARE_CACHED("SELECT "
                         PID_PID ","
                         PID_DESCRIPTORS " "
-                        "FROM " PIDS_TABLE " WHERE " PID_MULTIPLEXUID "=%d AND " PID_SERVICEID "=%d AND "
-                        PID_PID ">%d;",
-                        service->multiplexUID, service->id, SPECIAL_PID_PCR);
+                        "FROM " PIDS_TABLE " WHERE " PID_MULTIPLEXUID "=? AND " PID_SERVICEID "=? AND "
+                        PID_PID ">?;");
                 if (rc == SQLITE_OK)
                 {
+                    STATEMENT_BIND_INT(1, service->multiplexUID);
+                    STATEMENT_BIND_INT(2, service->id);
+                    STATEMENT_BIND_INT(3, SPECIAL_PID_PCR);
                     STATEMENT_STEP();
                     if (rc == SQLITE_ROW)
                     {
@@ -157,15 +167,116 @@ ProgramInfo_t *ProgramInfoGet(Service_t *service)
     return result;
 }
 
+int ProgramInfoGetForMultiplex(Multiplex_t *multiplex, ProgramInfoServiceCallback_t callback, void *userArg)
+{
+    STATEMENT_INIT;
+    Service_t *service = NULL;
+    StreamInfo_t *streams = NULL;
+    StreamInfo_t *newStreams;
+    int maxStreams = 0;
+    int nrofStreams = 0;
+    int pcrPID = 0;
+    bool pcrFound = FALSE;
+    dvbpsi_descriptor_t *descriptors = NULL;
+    int pid;
+
+    STATEMENT_PREPARE_CACHED("SELECT " SERVICE_FIELDS ","
+                             PIDS_TABLE "." PID_PID ","
+                             PIDS_TABLE "." PID_TYPE ","
+                             PIDS_TABLE "." PID_DESCRIPTORS " "
+                             "FROM " SERVICES_TABLE " JOIN " MULTIPLEXES_TABLE " ON "
+                             MULTIPLEXES_TABLE "." MULTIPLEX_UID "=" SERVICES_TABLE "." SERVICE_MULTIPLEXUID " "
+                             "LEFT JOIN " PIDS_TABLE " ON "
+                             PIDS_TABLE "." PID_MULTIPLEXUID "=" SERVICES_TABLE "." SERVICE_MULTIPLEXUID " AND "
+                             PIDS_TABLE "." PID_SERVICEID "=" SERVICES_TABLE "." SERVICE_ID " "
+                             "WHERE " SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=? "
+                             "ORDER BY " SERVICES_TABLE "." SERVICE_ID "," PIDS_TABLE "." PID_PID ";");
+    RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, multiplex->uid);
+
+    /* Rows are grouped by service, the streams for the current service are
+     * collected in a single buffer reused for every service and copied in to
+     * the ProgramInfo once all the rows for the service have been read. */
+    for (STATEMENT_STEP(); rc == SQLITE_ROW; STATEMENT_STEP())
+    {
+        if ((service == NULL) || (service->id != (STATEMENT_COLUMN_INT(1) & 0xffff)))
+        {
+            if (service)
+            {
+                callback(userArg, service, ProgramInfoFromStreams(streams, nrofStreams, pcrPID, descriptors));
+            }
+            service = ServiceGetCurrent((ServiceEnumerator_t)stmt);
+            nrofStreams = 0;
+            pcrPID = 0;
+            pcrFound = FALSE;
+            descriptors = NULL;
+            if (service == NULL)
+            {
+                break;
+            }
+        }
+
+        if (sqlite3_column_type(stmt, COLUMN_PID) == SQLITE_NULL)
+        {
+            continue;
+        }
+
+        pid = STATEMENT_COLUMN_INT(COLUMN_PID);
+        if (pid < 8192)
+        {
+            if (nrofStreams == maxStreams)
+            {
+                maxStreams = maxStreams ? maxStreams * 2 : 16;
+                newStreams = realloc(streams, maxStreams * sizeof(StreamInfo_t));
+                if (newStreams == NULL)
+                {
+                    LogModule(LOG_ERROR, "PIDS", "Failed to allocate memory to load streams!\n");
+                    break;
+                }
+                streams = newStreams;
+            }
+            streams[nrofStreams].pid = pid;
+            streams[nrofStreams].type = STATEMENT_COLUMN_INT(COLUMN_TYPE);
+            streams[nrofStreams].descriptors = UnRollDescriptors((uint8_t *)sqlite3_column_blob(stmt, COLUMN_DESCRIPTORS),
+                                                                 sqlite3_column_bytes(stmt, COLUMN_DESCRIPTORS));
+            nrofStreams ++;
+        }
+        else if ((pid > SPECIAL_PID_PCR) && !pcrFound)
+        {
+            pcrFound = TRUE;
+            pcrPID = pid & PID_MASK;
+            descriptors = UnRollDescriptors((uint8_t *)sqlite3_column_blob(stmt, COLUMN_DESCRIPTORS),
+                                            sqlite3_column_bytes(stmt, COLUMN_DESCRIPTORS));
+        }
+    }
+
+    if (service)
+    {
+        callback(userArg, service, ProgramInfoFromStreams(streams, nrofStreams, pcrPID, descriptors));
+    }
+
+    if ((rc != SQLITE_DONE) && (rc != SQLITE_ROW))
+    {
+        PRINTLOG_SQLITE3ERROR();
+    }
+    else
+    {
+        rc = SQLITE_OK;
+    }
+    free(streams);
+    STATEMENT_FINALIZE();
+    return rc;
+}
 
 int ProgramInfoRemove(Service_t *service)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("DELETE FROM " PIDS_TABLE " "
-                        "WHERE " PID_MULTIPLEXUID "=%d AND " PID_SERVICEID "=%d;",
-                        service->multiplexUID, service->id);
+    STATEMENT_PREPARE_CACHED("DELETE FROM " PIDS_TABLE " "
+                             "WHERE " PID_MULTIPLEXUID "=? AND " PID_SERVICEID "=?;");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, service->multiplexUID);
+    STATEMENT_BIND_INT(2, service->id);
 
     STATEMENT_STEP();
 
@@ -181,10 +292,11 @@ static int PIDListCount(Service_t *service)
     STATEMENT_INIT;
     int result = -1;
 
-    STATEMENT_PREPAREVA("SELECT count () FROM " PIDS_TABLE " "
-                        "WHERE " PID_MULTIPLEXUID "=%d AND " PID_SERVICEID "=%d AND " PID_PID "<8192;",
-                        service->multiplexUID, service->id);
+    STATEMENT_PREPARE_CACHED("SELECT count () FROM " PIDS_TABLE " "
+                             "WHERE " PID_MULTIPLEXUID "=? AND " PID_SERVICEID "=? AND " PID_PID "<8192;");
     RETURN_ON_ERROR(-1);
+    STATEMENT_BIND_INT(1, service->multiplexUID);
+    STATEMENT_BIND_INT(2, service->id);
 
     STATEMENT_STEP();
     if (rc == SQLITE_ROW)
@@ -202,23 +314,58 @@ static int PIDAdd(Service_t *service, StreamInfo_t *pid)
     int size;
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("INSERT INTO " PIDS_TABLE " (" PID_MULTIPLEXUID ","
-                        PID_SERVICEID ","       
-                        PID_PID ","
-                        PID_TYPE ","
-                        PID_DESCRIPTORS ") "
-                        "VALUES (%d,%d,%d,%d,?);",
-                        service->multiplexUID, service->id,
-                        pid->pid, pid->type);
+    STATEMENT_PREPARE_CACHED("INSERT INTO " PIDS_TABLE " (" PID_MULTIPLEXUID ","
+                             PID_SERVICEID ","
+                             PID_PID ","
+                             PID_TYPE ","
+                             PID_DESCRIPTORS ") "
+                             "VALUES (?,?,?,?,?);");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, service->multiplexUID);
+    STATEMENT_BIND_INT(2, service->id);
+    STATEMENT_BIND_INT(3, pid->pid);
+    STATEMENT_BIND_INT(4, pid->type);
     descriptorblob = RollUpDescriptors(pid->descriptors, &size);
-    sqlite3_bind_blob(stmt, 1, descriptorblob, size, free);
+    sqlite3_bind_blob(stmt, 5, descriptorblob, size, free);
 
     STATEMENT_STEP();
     STATEMENT_FINALIZE();
     return rc;
 }
 
+static ProgramInfo_t *ProgramInfoFromStreams(StreamInfo_t *streams, int nrofStreams, int pcrPID, dvbpsi_descriptor_t *descriptors)
+{
+    ProgramInfo_t *result = NULL;
+    int i;
+
+    /* Same as ProgramInfoGet(), no ProgramInfo if there are no streams */
+    if (nrofStreams > 0)
+    {
+        result = ProgramInfoNew(nrofStreams);
+    }
+    if (result)
+    {
+        memcpy(result->streamInfoList->streams, streams, nrofStreams * sizeof(StreamInfo_t));
+        result->pcrPID = pcrPID;
+        result->descriptors = descriptors;
+    }
+    else
+    {
+        for (i = 0; i < nrofStreams; i ++)
+        {
+            if (streams[i].descriptors)
+            {
+                dvbpsi_DeleteDescriptors(streams[i].descriptors);
+            }
+        }
+        if (descriptors)
+        {
+            dvbpsi_DeleteDescriptors(descriptors);
+        }
+    }
+    return result;
+}
+
 static void *RollUpDescriptors(dvbpsi_descriptor_t *descriptors, int *datasize)
 {
     uint8_t *result;
@@ -225,7 +225,8 @@ static void ProcessETT(void *arg, dvbpsi_atsc_ett_t *newETT)
     info->netId = multiplex->networkId;
     info->tsId = multiplex->tsId;
     info->u.ett = newETT;
-    DeferredProcessingAddJob(DeferredProcessETT, info);
+    /* ETTs and EITs update the same events so are processed in order. */
+    DeferredProcessingAddJobKeyed(DeferredProcessETT, info, ATSCTOEPG);
     ObjectRefDec(info);
     MultiplexRefDec(multiplex);    
 }
@@ -237,7 +238,7 @@ static void ProcessEIT(void *arg, dvbpsi_atsc_eit_t *newEIT)
     info->netId = multiplex->networkId;
     info->tsId = multiplex->tsId;
     info->u.eit = newEIT;
-    DeferredProcessingAddJob(DeferredProcessEIT, info);
+    DeferredProcessingAddJobKeyed(DeferredProcessEIT, info, ATSCTOEPG);
     ObjectRefDec(info);
     MultiplexRefDec(multiplex);    
 }
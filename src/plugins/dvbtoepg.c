@@ -26,10 +26,12 @@ Plugin to collect EPG schedule information.
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "plugin.h"
 #include "main.h"
 #include "epgchannel.h"
+#include "epgdbase.h"
 #include "dvbpsi/datetime.h"
 #include "dvbpsi/eit.h"
 #include "dvbpsi/dr_4d.h"
@@ -41,6 +43,7 @@ Plugin to collect EPG schedule information.
 #include "logging.h"
 #include "dvbtext.h"
 #include "deferredproc.h"
+#include "properties.h"
 
 #include "freesat_huffman.h"
 
@@ -61,6 +64,9 @@ Plugin to collect EPG schedule information.
 
 #define  EED_MAX_TEXT_DESCS 16
 
+#define SECTION_CACHE_MIN_BUCKETS 1024
+#define SECTION_CACHE_MAX_ENTRIES 65536 /* Sections beyond this are always processed. */
+
 /*******************************************************************************
 * Typedefs                                                                     *
 *******************************************************************************/
@@ -87,6 +93,20 @@ typedef struct ServiceNowNextInfo_s
     NNEvent_t  next;
 }ServiceNowNextInfo_t;
 
+/* Last version/CRC seen for a single EIT section, used to drop repeats of the
+   schedule carousel before the events are decoded. */
+typedef struct SectionCacheEntry_s
+{
+    struct SectionCacheEntry_s *next;
+    uint16_t networkId;
+    uint16_t tsId;
+    uint16_t serviceId;
+    uint8_t tableId;
+    uint8_t sectionNumber;
+    uint8_t version;
+    uint32_t crc;
+}SectionCacheEntry_t;
+
 /*******************************************************************************
 * Prototypes                                                                   *
 *******************************************************************************/
@@ -95,6 +115,9 @@ static void SubTableHandler(void * arg, dvbpsi_handle demuxHandle, uint8_t table
 static void ProcessEIT(void *arg, dvbpsi_eit_t *newEIT);
 static void ProcessPFEIT(void *arg, dvbpsi_eit_t *newEIT);
 static void DeferredProcessEIT(void *arg);
+static bool SectionCacheUpdate(dvbpsi_eit_t *eit);
+static unsigned int SectionCacheHash(uint16_t networkId, uint16_t tsId, uint16_t serviceId, uint8_t tableId, uint8_t sectionNumber);
+static void SectionCacheClear(void);
 
 static void CommandEPGCapRestart(int argc, char **argv);
 static void CommandEPGCapStart(int argc, char **argv);
@@ -109,9 +132,11 @@ static void ExtTextDescDestructor(void *ptr);
 
 static void CommandNow(int argc, char **argv);
 static void CommandNext(int argc, char **argv);
+static void PrintNowNext(char *name, bool now);
 static void PrintEvent(NNEvent_t *event);
+static bool GetStoredEvent(EPGServiceRef_t *serviceRef, bool now, NNEvent_t *event);
+static void GetStoredDetail(EPGServiceRef_t *serviceRef, unsigned int eventId, char *name, char *value);
 
-static ServiceNowNextInfo_t *FindServiceName(char *name);
 static ServiceNowNextInfo_t *FindService(uint16_t networkId, uint16_t tsId, uint16_t serviceId);
 static void SubTableHandler(void * arg, dvbpsi_handle demuxHandle, uint8_t tableId, uint16_t extension);
 static void ProcessPFEIT(void *arg, dvbpsi_eit_t *newEIT);
@@ -206,6 +231,15 @@ static TSFilterGroup_t *tsgroup = NULL;
 static dvbpsi_handle eitDemux = NULL, freesatDemux = NULL;
 static List_t *serviceNowNextInfoList;
 
+static pthread_mutex_t sectionCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static SectionCacheEntry_t **sectionCacheBuckets = NULL;
+static unsigned int sectionCacheBucketCount = 0;
+static int sectionCacheCount = 0;
+static int sectionsProcessed = 0;
+static int sectionsDropped = 0;
+
+static const char propertyParent[] = "dvbtoepg.sections";
+
 /*******************************************************************************
 * Filter Functions                                                             *
 *******************************************************************************/
@@ -215,9 +249,19 @@ static void Install(bool installed)
     {
         serviceNowNextInfoList = ListCreate();
         ObjectRegisterTypeDestructor(ExtTextDesc_t, ExtTextDescDestructor);
+        PropertiesAddSimpleProperty(propertyParent, "processed",
+            "Number of schedule EIT sections decoded into EPG events.",
+            PropertyType_Int, &sectionsProcessed, SIMPLEPROPERTY_R);
+        PropertiesAddSimpleProperty(propertyParent, "dropped",
+            "Number of schedule EIT sections dropped because the same version and CRC had already been processed.",
+            PropertyType_Int, &sectionsDropped, SIMPLEPROPERTY_R);
+        PropertiesAddSimpleProperty(propertyParent, "cached",
+            "Number of schedule EIT sections whose version and CRC are remembered, cleared when the multiplex changes.",
+            PropertyType_Int, &sectionCacheCount, SIMPLEPROPERTY_R);
     }
     else
     {
+        PropertiesRemoveAllProperties(propertyParent);
         if (tsgroup)
         {
             TSFilterGroupDestroy(tsgroup);
@@ -225,7 +269,7 @@ static void Install(bool installed)
             dvbpsi_DetachDemux(freesatDemux); 
         }
         ListFree(serviceNowNextInfoList, free);
-        
+        SectionCacheClear();
     }
 }
 
@@ -233,6 +277,8 @@ static void DVBtoEPGFilterGroupEventCallback(void *arg, TSFilterGroup_t *group,
 {
     if ((event == TSFilterEventType_MuxChanged) && tsgroup)
     {
+        /* The sections seen on the old multiplex won't be seen again. */
+        SectionCacheClear();
         if (eitDemux)
         {
             TSFilterGroupRemoveSectionFilter(tsgroup, PID_EIT);
@@ -269,7 +315,10 @@ static void ProcessEIT(void *arg, dvbpsi_eit_t *newEIT)
 {
     LogModule(LOG_DEBUG, DVBTOEPG, "EIT received (version %d) net id %x ts id %x service id %x\n",
         newEIT->i_version, newEIT->i_network_id, newEIT->i_ts_id, newEIT->i_service_id);
-    DeferredProcessingAddJob(DeferredProcessEIT, newEIT );
+    if (SectionCacheUpdate(newEIT))
+    {
+        DeferredProcessingAddJob(DeferredProcessEIT, newEIT );
+    }
     ObjectRefDec(newEIT);
 }
 
@@ -299,6 +348,8 @@ static void CommandEPGCapRestart(int argc, char **argv)
 {
     if (tsgroup)
     {
+        /* Capture applications expect to be sent everything again, handling
+         * the mux change also clears the section cache. */
         DVBtoEPGFilterGroupEventCallback(NULL, tsgroup, TSFilterEventType_MuxChanged, NULL);
     }
 }
@@ -310,6 +361,7 @@ static void CommandEPGCapStart(int argc, char **argv)
         CommandError(COMMAND_ERROR_GENERIC, "Already started!");
         return;
     }
+    SectionCacheClear();
     tsgroup = TSReaderCreateFilterGroup(MainTSReaderGet(), DVBTOEPG, "DVB", DVBtoEPGFilterGroupEventCallback, NULL);
     eitDemux = dvbpsi_AttachDemux(SubTableHandler, NULL);
     TSFilterGroupAddSectionFilter(tsgroup, PID_EIT, 3, eitDemux);
@@ -335,27 +387,45 @@ static void CommandEPGCapStop(int argc, char **argv)
 
 static void CommandNow(int argc, char **argv)
 {
-    ServiceNowNextInfo_t *info = FindServiceName(argv[0]);
-    if (info)
-    {
-        PrintEvent(&info->now);
-    }
-    else
-    {
-        CommandError(COMMAND_ERROR_GENERIC, "No info found for \"%s\"", argv[0]);
-    }
+    PrintNowNext(argv[0], TRUE);
 }
 
 static void CommandNext(int argc, char **argv)
 {
-    ServiceNowNextInfo_t *info = FindServiceName(argv[0]);
+    PrintNowNext(argv[0], FALSE);
+}
+
+static void PrintNowNext(char *name, bool now)
+{
+    Service_t *service = ServiceFind(name);
+    ServiceNowNextInfo_t *info;
+    EPGServiceRef_t serviceRef;
+    NNEvent_t event;
+
+    if (!service)
+    {
+        CommandError(COMMAND_ERROR_GENERIC, "Unknown service \"%s\"", name);
+        return;
+    }
+    serviceRef.netId = service->networkId;
+    serviceRef.tsId = service->tsId;
+    serviceRef.serviceId = service->id;
+    ServiceRefDec(service);
+
+    /* Present/following tables are only received for the current TS, other
+     * services are looked up in the schedule. */
+    info = FindService(serviceRef.netId, serviceRef.tsId, serviceRef.serviceId);
     if (info)
     {
-        PrintEvent(&info->next);
+        PrintEvent(now ? &info->now : &info->next);
+    }
+    else if (GetStoredEvent(&serviceRef, now, &event))
+    {
+        PrintEvent(&event);
     }
     else
     {
-        CommandError(COMMAND_ERROR_GENERIC, "No info found for \"%s\"", argv[0]);
+        CommandError(COMMAND_ERROR_GENERIC, "No info found for \"%s\"", name);
     }
 }
 
@@ -376,6 +446,46 @@ static void PrintEvent(NNEvent_t *event)
 /*******************************************************************************
 * Helper Functions                                                             *
 *******************************************************************************/
+static bool GetStoredEvent(EPGServiceRef_t *serviceRef, bool now, NNEvent_t *event)
+{
+    EPGEvent_t *stored;
+    time_t currentTime = time(NULL);
+
+    if (now)
+    {
+        stored = EPGDBaseEventGetAt(serviceRef, currentTime);
+    }
+    else
+    {
+        stored = EPGDBaseEventGetAfter(serviceRef, currentTime);
+    }
+    if (stored == NULL)
+    {
+        return FALSE;
+    }
+    event->startTime = stored->startTime;
+    event->duration = timegm(&stored->endTime) - timegm(&stored->startTime);
+    GetStoredDetail(serviceRef, stored->eventId, EPG_EVENT_DETAIL_TITLE, event->name);
+    GetStoredDetail(serviceRef, stored->eventId, EPG_EVENT_DETAIL_DESCRIPTION, event->description);
+    ObjectRefDec(stored);
+    return TRUE;
+}
+
+static void GetStoredDetail(EPGServiceRef_t *serviceRef, unsigned int eventId, char *name, char *value)
+{
+    EPGDBaseEnumerator_t enumerator = EPGDBaseDetailGet(serviceRef, eventId, name);
+    EPGEventDetail_t *detail = EPGDBaseDetailGetNext(enumerator);
+
+    value[0] = 0;
+    if (detail)
+    {
+        strncpy(value, detail->value, MAX_STRING_LEN - 1);
+        value[MAX_STRING_LEN - 1] = 0;
+        ObjectRefDec(detail);
+    }
+    EPGDBaseEnumeratorDestroy(enumerator);
+}
+
 static void ProcessEvent(EPGServiceRef_t *serviceRef, dvbpsi_eit_event_t *eitevent)
 {
     EPGEventRef_t eventRef;
@@ -644,6 +754,138 @@ static void ExtTextDescDestructor(void *ptr)
 }
 
 
+/*
+ * Records the version and CRC of the section the EIT was decoded from and
+ * returns whether the section differs from the last one seen with the same
+ * table id, service and section number. Entries are kept across mux changes
+ * as the key includes the network and transport stream ids.
+ */
+static bool SectionCacheUpdate(dvbpsi_eit_t *eit)
+{
+    SectionCacheEntry_t *entry;
+    unsigned int hash;
+    bool changed = TRUE;
+
+    if (eit->i_section_crc == 0)
+    {
+        /* Not decoded from a single section so nothing to compare against. */
+        pthread_mutex_lock(&sectionCacheMutex);
+        sectionsProcessed ++;
+        pthread_mutex_unlock(&sectionCacheMutex);
+        return TRUE;
+    }
+
+    hash = SectionCacheHash(eit->i_network_id, eit->i_ts_id, eit->i_service_id, eit->i_table_id, eit->i_section_number);
+
+    pthread_mutex_lock(&sectionCacheMutex);
+    if ((sectionCacheCount >= (int)(sectionCacheBucketCount * 2)) &&
+        (sectionCacheCount < SECTION_CACHE_MAX_ENTRIES))
+    {
+        unsigned int newCount = sectionCacheBucketCount ? sectionCacheBucketCount * 2 : SECTION_CACHE_MIN_BUCKETS;
+        SectionCacheEntry_t **newBuckets = calloc(newCount, sizeof(SectionCacheEntry_t *));
+        if (newBuckets)
+        {
+            unsigned int i;
+            for (i = 0; i < sectionCacheBucketCount; i ++)
+            {
+                while (sectionCacheBuckets[i])
+                {
+                    unsigned int entryHash;
+                    entry = sectionCacheBuckets[i];
+                    sectionCacheBuckets[i] = entry->next;
+                    entryHash = SectionCacheHash(entry->networkId, entry->tsId, entry->serviceId, entry->tableId, entry->sectionNumber);
+                    entry->next = newBuckets[entryHash % newCount];
+                    newBuckets[entryHash % newCount] = entry;
+                }
+            }
+            free(sectionCacheBuckets);
+            sectionCacheBuckets = newBuckets;
+            sectionCacheBucketCount = newCount;
+        }
+    }
+
+    if (sectionCacheBucketCount)
+    {
+        for (entry = sectionCacheBuckets[hash % sectionCacheBucketCount]; entry; entry = entry->next)
+        {
+            if ((entry->serviceId == eit->i_service_id) && (entry->sectionNumber == eit->i_section_number) &&
+                (entry->tableId == eit->i_table_id) && (entry->tsId == eit->i_ts_id) &&
+                (entry->networkId == eit->i_network_id))
+            {
+                break;
+            }
+        }
+        if (entry == NULL)
+        {
+            if (sectionCacheCount < SECTION_CACHE_MAX_ENTRIES)
+            {
+                entry = malloc(sizeof(SectionCacheEntry_t));
+            }
+            if (entry)
+            {
+                entry->networkId = eit->i_network_id;
+                entry->tsId = eit->i_ts_id;
+                entry->serviceId = eit->i_service_id;
+                entry->tableId = eit->i_table_id;
+                entry->sectionNumber = eit->i_section_number;
+                entry->next = sectionCacheBuckets[hash % sectionCacheBucketCount];
+                sectionCacheBuckets[hash % sectionCacheBucketCount] = entry;
+                sectionCacheCount ++;
+            }
+        }
+        else if ((entry->version == eit->i_version) && (entry->crc == eit->i_section_crc))
+        {
+            changed = FALSE;
+        }
+        if (entry)
+        {
+            entry->version = eit->i_version;
+            entry->crc = eit->i_section_crc;
+        }
+    }
+    if (changed)
+    {
+        sectionsProcessed ++;
+    }
+    else
+    {
+        sectionsDropped ++;
+    }
+    pthread_mutex_unlock(&sectionCacheMutex);
+    return changed;
+}
+
+static unsigned int SectionCacheHash(uint16_t networkId, uint16_t tsId, uint16_t serviceId, uint8_t tableId, uint8_t sectionNumber)
+{
+    unsigned int hash = networkId;
+    hash = (hash * 31) + tsId;
+    hash = (hash * 31) + serviceId;
+    hash = (hash * 31) + tableId;
+    hash = (hash * 31) + sectionNumber;
+    return hash;
+}
+
+static void SectionCacheClear(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&sectionCacheMutex);
+    for (i = 0; i < sectionCacheBucketCount; i ++)
+    {
+        while (sectionCacheBuckets[i])
+        {
+            SectionCacheEntry_t *entry = sectionCacheBuckets[i];
+            sectionCacheBuckets[i] = entry->next;
+            free(entry);
+        }
+    }
+    free(sectionCacheBuckets);
+    sectionCacheBuckets = NULL;
+    sectionCacheBucketCount = 0;
+    sectionCacheCount = 0;
+    pthread_mutex_unlock(&sectionCacheMutex);
+}
+
 static void ProcessPFEIT(void *arg, dvbpsi_eit_t *newEIT)
 {
     ServiceNowNextInfo_t *info = FindService(newEIT->i_network_id, newEIT->i_ts_id, newEIT->i_service_id);
@@ -702,20 +944,6 @@ static void UpdateEvent(NNEvent_t *event, dvbpsi_eit_event_t *eitevent)
 /*******************************************************************************
 * Event List Helper Functions                                                  *
 *******************************************************************************/
-static ServiceNowNextInfo_t *FindServiceName(char *name)
-{
-    Service_t *service = ServiceFind(name);
-    ServiceNowNextInfo_t *info;
-    if (!service)
-    {
-        CommandError(COMMAND_ERROR_GENERIC, "Unknown service \"%s\"", name);
-        return NULL;
-    }
-    info = FindService(service->networkId, service->tsId, service->id);
-    ServiceRefDec(service);
-    return info;
-}
-
 static ServiceNowNextInfo_t *FindService(uint16_t networkId, uint16_t tsId, uint16_t serviceId)
 {
     ListIterator_t iterator;
@@ -23,321 +23,530 @@ Plugin to dump the EPG Database out in XMLTV format.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include "main.h"
-#include "utf8.h"
 #include "plugin.h"
 #include "epgdbase.h"
-#include "dbase.h"
+#include "services.h"
 
 #include "list.h"
 #include "logging.h"
 
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define XMLTV_BUFFER_SIZE (64 * 1024)
+
+/* XMLTV date format, also accepted by the -s option. */
+#define XMLTV_DATE_FORMAT "%Y%m%d%H%M%S"
+
 /*******************************************************************************
 * Typedefs                                                                     *
 *******************************************************************************/
-typedef struct ServiceMultiplexInfo_s
+typedef struct XMLTVWriter_s
 {
-    Service_t *service;
-    Multiplex_t *mux;
-}ServiceMultiplexInfo_t;
+    FILE *fp;   /* Used when not compressing */
+    gzFile gz;  /* Used when compressing */
+    bool error;
+    int used;
+    char buffer[XMLTV_BUFFER_SIZE];
+}XMLTVWriter_t;
+
+typedef struct XMLTVExport_s
+{
+    List_t *services;
+    time_t since;    /* Only export events changed since this time, 0 for all */
+    char *path;      /* File to write to or NULL for the command context */
+    bool compress;
+}XMLTVExport_t;
 
 /*******************************************************************************
 * Prototypes                                                                   *
 *******************************************************************************/
+static void Install(bool installed);
 static void CommandDump(int argc, char **argv);
-static void DumpChannels(List_t *infoList);
-static void DumpProgrammes(List_t *infoList);
-static void DumpServiceProgrammes(Multiplex_t *multiplex, Service_t *service);
-static void DumpProgramme(Multiplex_t *multiplex, Service_t *service, EPGEvent_t *event);
-static void PrintXmlified(char *text);
-static List_t *GetServiceMultiplexInfo(void);
-static void ServiceMultiplexInfoDestructor(void *obj);
+static void *ExportThread(void *arg);
+static void ExportFree(XMLTVExport_t *export);
+static bool ExportXMLTV(XMLTVWriter_t *writer, XMLTVExport_t *export);
+static void DumpChannels(XMLTVWriter_t *writer, List_t *services);
+static void DumpProgrammes(XMLTVWriter_t *writer, List_t *services, time_t since);
+static void DumpServiceProgrammes(XMLTVWriter_t *writer, Service_t *service, time_t since);
+static void DumpProgramme(XMLTVWriter_t *writer, Service_t *service, EPGEvent_t *event);
+static void DumpDetails(XMLTVWriter_t *writer, List_t *details, const char *name, const char *element);
+
+static void WriterWrite(XMLTVWriter_t *writer, const char *data, int len);
+static void WriterPrintf(XMLTVWriter_t *writer, const char *fmt, ...);
+static void WriterXmlified(XMLTVWriter_t *writer, const char *text);
+static void WriterFlush(XMLTVWriter_t *writer);
+
+/*******************************************************************************
+* Global variables                                                             *
+*******************************************************************************/
+static const char EPGTOXMLTV[] = "EPGtoXMLTV";
+
+static pthread_mutex_t exportMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t exportCond = PTHREAD_COND_INITIALIZER;
+static int exportsRunning = 0;
+
+/* Replacement for each byte when writing XML text, NULL means the byte is
+ * copied as is and "" that it is dropped (control characters are not allowed
+ * in XML 1.0). UTF-8 sequences are left untouched. */
+static const char *XmlEscapes[256] = {
+    [0x00 ... 0x08] = "",
+    [0x0b ... 0x0c] = "",
+    [0x0e ... 0x1f] = "",
+    ['&'] = "&amp;",
+    ['<'] = "&lt;",
+    ['>'] = "&gt;",
+    ['"'] = "&quot;",
+};
+
 /*******************************************************************************
 * Plugin Setup                                                                 *
 *******************************************************************************/
+PLUGIN_FEATURES(
+    PLUGIN_FEATURE_INSTALL(Install)
+    );
+
 PLUGIN_COMMANDS(
     {
         "dumpxmltv",
-        FALSE, 0, 0,
+        0, 4,
         "Dump the EPG Database in XMLTV format.",
-        "Output the contents of the EPG Database in XMLTV format.",
+        "dumpxmltv [-z] [-s <time>] [<file>]\n"
+        "Output the contents of the EPG Database in XMLTV format.\n"
+        "If <file> is specified the guide is written to the file in the background, "
+        "the file is only replaced once the guide is complete.\n"
+        "-z        Compress the file with gzip.\n"
+        "-s <time> Only output programmes that have changed since <time>, either "
+        "seconds since 1970 or the date attribute of a previous dump (YYYYMMDDhhmmss).",
         CommandDump
     }
 );
 
-PLUGIN_INTERFACE_C(
+PLUGIN_INTERFACE_CF(
     PLUGIN_FOR_ALL,
-    "EPGtoXMLTV", "0.1",
+    "EPGtoXMLTV", "0.2",
     "Plugin to dump the EPG Database out in XMLTV format.",
     "charrea6@users.sourceforge.net"
     );
 
+/*******************************************************************************
+* Filter Functions                                                             *
+*******************************************************************************/
+static void Install(bool installed)
+{
+    if (!installed)
+    {
+        /* Background exports are running code from this plugin. */
+        pthread_mutex_lock(&exportMutex);
+        while (exportsRunning)
+        {
+            pthread_cond_wait(&exportCond, &exportMutex);
+        }
+        pthread_mutex_unlock(&exportMutex);
+    }
+}
+
 /*******************************************************************************
 * Command Functions                                                            *
 *******************************************************************************/
 static void CommandDump(int argc, char **argv)
 {
-    List_t *infoList;
-    ObjectRegisterTypeDestructor(ServiceMultiplexInfo_t, ServiceMultiplexInfoDestructor);
-    infoList = GetServiceMultiplexInfo();
-    CommandPrintf("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n");
-    CommandPrintf("<tv generator-info-name=\"DVBStreamer-EPGSchedule\">\n");
-    
-    DumpChannels(infoList);
-    DumpProgrammes(infoList);
-    CommandPrintf("</tv>\n");
-    ObjectListFree(infoList);
+    XMLTVExport_t *export;
+    XMLTVWriter_t *writer;
+    pthread_t thread;
+    struct tm sinceTm;
+    char *end;
+    int i;
+
+    export = calloc(1, sizeof(XMLTVExport_t));
+    if (export == NULL)
+    {
+        CommandError(COMMAND_ERROR_GENERIC, "Out of memory!");
+        return;
+    }
+    for (i = 0; i < argc; i ++)
+    {
+        if (strcmp(argv[i], "-z") == 0)
+        {
+            export->compress = TRUE;
+        }
+        else if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc))
+        {
+            i ++;
+            memset(&sinceTm, 0, sizeof(sinceTm));
+            /* Seconds since 1970 will be 10 digits for a long while yet. */
+            end = NULL;
+            if (strlen(argv[i]) >= 14)
+            {
+                end = strptime(argv[i], XMLTV_DATE_FORMAT, &sinceTm);
+            }
+            if (end && (*end == 0 || *end == ' '))
+            {
+                export->since = timegm(&sinceTm);
+            }
+            else
+            {
+                export->since = strtol(argv[i], &end, 10);
+                if (*end)
+                {
+                    CommandError(COMMAND_ERROR_WRONG_ARGS, "Invalid time \"%s\"", argv[i]);
+                    ExportFree(export);
+                    return;
+                }
+            }
+        }
+        else if ((argv[i][0] != '-') && (export->path == NULL))
+        {
+            export->path = strdup(argv[i]);
+        }
+        else
+        {
+            CommandError(COMMAND_ERROR_WRONG_ARGS, "Unknown argument \"%s\"", argv[i]);
+            ExportFree(export);
+            return;
+        }
+    }
+    if (export->compress && (export->path == NULL))
+    {
+        CommandError(COMMAND_ERROR_WRONG_ARGS, "Compression is only supported when writing to a file.");
+        ExportFree(export);
+        return;
+    }
+
+    export->services = ServiceListAll();
+
+    if (export->path)
+    {
+        pthread_mutex_lock(&exportMutex);
+        exportsRunning ++;
+        pthread_mutex_unlock(&exportMutex);
+        if (pthread_create(&thread, NULL, ExportThread, export))
+        {
+            pthread_mutex_lock(&exportMutex);
+            exportsRunning --;
+            pthread_mutex_unlock(&exportMutex);
+            CommandError(COMMAND_ERROR_GENERIC, "Failed to start export!");
+            ExportFree(export);
+            return;
+        }
+        pthread_detach(thread);
+        CommandPrintf("Exporting to %s\n", export->path);
+        return;
+    }
+
+    writer = malloc(sizeof(XMLTVWriter_t));
+    if (writer)
+    {
+        writer->fp = CommandContextGet()->outfp;
+        writer->gz = NULL;
+        writer->error = FALSE;
+        writer->used = 0;
+        ExportXMLTV(writer, export);
+        fflush(writer->fp);
+        free(writer);
+    }
+    ExportFree(export);
 }
-static void DumpChannels(List_t *infoList)
+
+/*******************************************************************************
+* Helper Functions                                                             *
+*******************************************************************************/
+static void *ExportThread(void *arg)
+{
+    XMLTVExport_t *export = arg;
+    XMLTVWriter_t *writer;
+    char *tmpPath = NULL;
+    bool ok = FALSE;
+
+    LogRegisterThread(pthread_self(), EPGTOXMLTV);
+    writer = calloc(1, sizeof(XMLTVWriter_t));
+    if (writer && (asprintf(&tmpPath, "%s.tmp", export->path) != -1))
+    {
+        if (export->compress)
+        {
+            writer->gz = gzopen(tmpPath, "wb");
+        }
+        else
+        {
+            writer->fp = fopen(tmpPath, "w");
+        }
+        if (writer->gz || writer->fp)
+        {
+            ok = ExportXMLTV(writer, export);
+            if (writer->gz)
+            {
+                ok = (gzclose(writer->gz) == Z_OK) && ok;
+            }
+            else
+            {
+                ok = (fclose(writer->fp) == 0) && ok;
+            }
+            if (ok && rename(tmpPath, export->path))
+            {
+                ok = FALSE;
+            }
+            if (!ok)
+            {
+                unlink(tmpPath);
+            }
+        }
+    }
+    if (ok)
+    {
+        LogModule(LOG_INFO, EPGTOXMLTV, "Exported XMLTV to %s\n", export->path);
+    }
+    else
+    {
+        LogModule(LOG_ERROR, EPGTOXMLTV, "Failed to export XMLTV to %s\n", export->path);
+    }
+    free(tmpPath);
+    free(writer);
+    ExportFree(export);
+
+    pthread_mutex_lock(&exportMutex);
+    exportsRunning --;
+    pthread_cond_broadcast(&exportCond);
+    pthread_mutex_unlock(&exportMutex);
+    return NULL;
+}
+
+static void ExportFree(XMLTVExport_t *export)
+{
+    if (export->services)
+    {
+        ObjectListFree(export->services);
+    }
+    free(export->path);
+    free(export);
+}
+
+static bool ExportXMLTV(XMLTVWriter_t *writer, XMLTVExport_t *export)
+{
+    time_t now = time(NULL);
+    struct tm nowTm;
+    char date[15];
+
+    gmtime_r(&now, &nowTm);
+    strftime(date, sizeof(date), XMLTV_DATE_FORMAT, &nowTm);
+    WriterPrintf(writer, "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n");
+    WriterPrintf(writer, "<tv date=\"%s +0000\" generator-info-name=\"DVBStreamer-EPGSchedule\">\n", date);
+
+    DumpChannels(writer, export->services);
+    DumpProgrammes(writer, export->services, export->since);
+    WriterPrintf(writer, "</tv>\n");
+    WriterFlush(writer);
+    return !writer->error && !ExitProgram;
+}
+
+static void DumpChannels(XMLTVWriter_t *writer, List_t *services)
 {
     ListIterator_t iterator;
-    ServiceMultiplexInfo_t *info;
     Service_t *service;
-    Multiplex_t *multiplex;
-    
-    for (ListIterator_Init(iterator, infoList);
-         ListIterator_MoreEntries(iterator);
+
+    for (ListIterator_Init(iterator, services);
+         ListIterator_MoreEntries(iterator) && !writer->error;
          ListIterator_Next(iterator))
     {
-        info = ListIterator_Current(iterator);
-        service = info->service;
-        multiplex = info->mux;
-        CommandPrintf("<channel id=\"%04x.%04x.%04x\">\n",
-            multiplex->networkId, multiplex->tsId, service->id);
-        CommandPrintf("<display-name>");
-        PrintXmlified(service->name);
-        CommandPrintf("</display-name>\n");
-        CommandPrintf("</channel>\n");
+        service = ListIterator_Current(iterator);
+        WriterPrintf(writer, "<channel id=\"%04x.%04x.%04x\">\n<display-name>",
+            service->networkId, service->tsId, service->id);
+        WriterXmlified(writer, service->name);
+        WriterPrintf(writer, "</display-name>\n</channel>\n");
     }
 }
 
-static void DumpProgrammes(List_t *infoList)
+static void DumpProgrammes(XMLTVWriter_t *writer, List_t *services, time_t since)
 {
     ListIterator_t iterator;
-    ServiceMultiplexInfo_t *info;
 
-    EPGDBaseTransactionStart();
-    
-    for (ListIterator_Init(iterator, infoList);
-         ListIterator_MoreEntries(iterator);
+    for (ListIterator_Init(iterator, services);
+         ListIterator_MoreEntries(iterator) && !writer->error && !ExitProgram;
          ListIterator_Next(iterator))
     {
-        info = ListIterator_Current(iterator);
-        DumpServiceProgrammes(info->mux, info->service);
+        DumpServiceProgrammes(writer, ListIterator_Current(iterator), since);
     }
-    EPGDBaseTransactionCommit();
 }
 
-static void DumpServiceProgrammes(Multiplex_t *multiplex, Service_t *service)
+static void DumpServiceProgrammes(XMLTVWriter_t *writer, Service_t *service, time_t since)
 {
     EPGEvent_t *event;
     EPGDBaseEnumerator_t enumerator;
     EPGServiceRef_t serviceRef;
-    serviceRef.netId = multiplex->networkId;
-    serviceRef.tsId = multiplex->tsId;
+    serviceRef.netId = service->networkId;
+    serviceRef.tsId = service->tsId;
     serviceRef.serviceId = service->source;
 
-    enumerator = EPGDBaseEventEnumeratorGetService(&serviceRef);
+    if (since)
+    {
+        enumerator = EPGDBaseEventEnumeratorGetChanged(&serviceRef, since);
+    }
+    else
+    {
+        enumerator = EPGDBaseEventEnumeratorGetService(&serviceRef);
+    }
     do
     {
         event = EPGDBaseEventGetNext(enumerator);
         if (event)
         {
-            DumpProgramme(multiplex, service, event);
+            DumpProgramme(writer, service, event);
             ObjectRefDec(event);
         }
-    }while(event && !ExitProgram);
+    }while(event && !writer->error && !ExitProgram);
 
     EPGDBaseEnumeratorDestroy(enumerator);
 }
 
-static void DumpProgramme(Multiplex_t *multiplex, Service_t *service, EPGEvent_t *event)
+static void DumpProgramme(XMLTVWriter_t *writer, Service_t *service, EPGEvent_t *event)
 {
     EPGDBaseEnumerator_t enumerator;
     EPGEventDetail_t *detail;
     EPGServiceRef_t serviceRef;
-    serviceRef.netId = multiplex->networkId;
-    serviceRef.tsId = multiplex->tsId;
+    List_t *details = ObjectListCreate();
+    serviceRef.netId = service->networkId;
+    serviceRef.tsId = service->tsId;
     serviceRef.serviceId = service->source;
 
-    CommandPrintf("<programme start=\"%04d%02d%02d%02d%02d%02d +0000\" stop=\"%04d%02d%02d%02d%02d%02d +0000\" channel=\"%04x.%04x.%04x\">\n",
+    WriterPrintf(writer, "<programme start=\"%04d%02d%02d%02d%02d%02d +0000\" stop=\"%04d%02d%02d%02d%02d%02d +0000\" channel=\"%04x.%04x.%04x\">\n",
                     event->startTime.tm_year + 1900, event->startTime.tm_mon + 1, event->startTime.tm_mday,
                     event->startTime.tm_hour, event->startTime.tm_min, event->startTime.tm_sec,
                     event->endTime.tm_year + 1900, event->endTime.tm_mon + 1, event->endTime.tm_mday,
                     event->endTime.tm_hour, event->endTime.tm_min, event->endTime.tm_sec,
-                    multiplex->networkId, multiplex->tsId, service->id);
-
-    enumerator = EPGDBaseDetailGet(&serviceRef, event->eventId, EPG_EVENT_DETAIL_TITLE);
-    do
-    {
-        detail = EPGDBaseDetailGetNext(enumerator);
-        if (detail)
-        {
-            CommandPrintf("<title lang=\"%s\">", detail->lang);
-            PrintXmlified(detail->value);
-            CommandPrintf("</title>\n");
-            ObjectRefDec(detail);
-        }
-    }while(detail && !ExitProgram);
+                    service->networkId, service->tsId, service->id);
 
-    EPGDBaseEnumeratorDestroy(enumerator);
-    enumerator = EPGDBaseDetailGet(&serviceRef, event->eventId, EPG_EVENT_DETAIL_DESCRIPTION);
-    do
+    /* Fetch all the details at once rather than a lookup per element. */
+    enumerator = EPGDBaseDetailGet(&serviceRef, event->eventId, NULL);
+    while ((detail = EPGDBaseDetailGetNext(enumerator)) != NULL)
     {
-        detail = EPGDBaseDetailGetNext(enumerator);
-        if (detail)
-        {
-            CommandPrintf("<desc lang=\"%s\">", detail->lang);
-            PrintXmlified(detail->value);
-            CommandPrintf("</desc>\n");
-            ObjectRefDec(detail);
-        }
-    }while(detail && !ExitProgram);
+        ListAdd(details, detail);
+    }
     EPGDBaseEnumeratorDestroy(enumerator);
 
+    DumpDetails(writer, details, EPG_EVENT_DETAIL_TITLE, "title");
+    DumpDetails(writer, details, EPG_EVENT_DETAIL_DESCRIPTION, "desc");
     /* output seriesid and programid fields */
-    enumerator = EPGDBaseDetailGet(&serviceRef, event->eventId, "content");
-    do
+    DumpDetails(writer, details, "content", "content");
+    DumpDetails(writer, details, "series", "series");
+    ObjectListFree(details);
+
+    WriterPrintf(writer, "</programme>\n");
+}
+
+static void DumpDetails(XMLTVWriter_t *writer, List_t *details, const char *name, const char *element)
+{
+    ListIterator_t iterator;
+    EPGEventDetail_t *detail;
+
+    for (ListIterator_Init(iterator, details);
+         ListIterator_MoreEntries(iterator);
+         ListIterator_Next(iterator))
     {
-        detail = EPGDBaseDetailGetNext(enumerator);
-        if (detail)
+        detail = ListIterator_Current(iterator);
+        if (strcmp(detail->name, name) == 0)
         {
-            CommandPrintf("<content lang=\"%s\">", detail->lang);
-            PrintXmlified(detail->value);
-            CommandPrintf("</content>\n");
-            ObjectRefDec(detail);            
+            WriterPrintf(writer, "<%s lang=\"%s\">", element, detail->lang);
+            WriterXmlified(writer, detail->value);
+            WriterPrintf(writer, "</%s>\n", element);
         }
-    }while(detail && !ExitProgram);
-    EPGDBaseEnumeratorDestroy(enumerator);
-    enumerator = EPGDBaseDetailGet(&serviceRef, event->eventId, "series");
-    do
+    }
+}
+
+static void WriterWrite(XMLTVWriter_t *writer, const char *data, int len)
+{
+    if (writer->used + len > XMLTV_BUFFER_SIZE)
     {
-        detail = EPGDBaseDetailGetNext(enumerator);
-        if (detail)
+        WriterFlush(writer);
+        if (len > XMLTV_BUFFER_SIZE)
         {
-            CommandPrintf("<series lang=\"%s\">", detail->lang);
-            PrintXmlified(detail->value);
-            CommandPrintf("</series>\n");
-            ObjectRefDec(detail);            
+            int written;
+            if (writer->gz)
+            {
+                written = gzwrite(writer->gz, data, len);
+            }
+            else
+            {
+                written = fwrite(data, 1, len, writer->fp);
+            }
+            if (written != len)
+            {
+                writer->error = TRUE;
+            }
+            return;
         }
-    }while(detail && !ExitProgram);
-    EPGDBaseEnumeratorDestroy(enumerator);
-
-    CommandPrintf("</programme>\n");
+    }
+    memcpy(writer->buffer + writer->used, data, len);
+    writer->used += len;
 }
 
-static void PrintXmlified(char *text)
+static void WriterPrintf(XMLTVWriter_t *writer, const char *fmt, ...)
 {
-    char buffer[256];
-    char temp[10];
-    int bufferIndex = 0;
-    int i;
-    int utf8CharLen;
-    int len = strlen(text);
+    va_list args;
+    int len;
+    int retries;
 
-    buffer[0] = 0;
-    for (i = 0; i < len;)
+    for (retries = 0; retries < 2; retries ++)
     {
-        unsigned int ch = UTF8_nextchar(text, &i);
-        switch (ch) {
-            case '\t':
-            case '\n':
-            case ' ' ... '%': // &
-            case '\'' ... ';': // <
-            case '=': // >
-            case '?' ... 0x7E:
-                temp[0] = (char)ch;
-                temp[1] = 0;
-                break;
-            case '&':
-                strcpy(temp, "&amp;");
-                break;
-            case '<':
-                strcpy(temp, "&lt;");
-                break;
-            case '>':
-                strcpy(temp, "&gt;");
-                break;
-            case 0x0000 ... 0x0008:
-            case 0x000B ... 0x001F:
-            case 0x007F:
-                fprintf(stderr, "Illegal char %04x\n", i);
-            default:
-                utf8CharLen = UTF8_wc_toutf8(temp, ch);
-                temp[utf8CharLen] = 0;
-                break;
-        } // switch
-        if (strlen(temp) + bufferIndex >= sizeof(buffer) - 1)
+        va_start(args, fmt);
+        len = vsnprintf(writer->buffer + writer->used, XMLTV_BUFFER_SIZE - writer->used, fmt, args);
+        va_end(args);
+        if (len < XMLTV_BUFFER_SIZE - writer->used)
         {
-            CommandPrintf("%s", buffer);
-            bufferIndex = 0;
-            buffer[0] = 0;
+            writer->used += len;
+            return;
         }
-        strcat(buffer, temp);
-        bufferIndex += strlen(temp);
-    }
-    if (bufferIndex)
-    {
-        CommandPrintf("%s", buffer);
+        WriterFlush(writer);
     }
+    LogModule(LOG_ERROR, EPGTOXMLTV, "Output too long, truncated\n");
+    writer->used = XMLTV_BUFFER_SIZE - 1;
 }
 
-static List_t *GetServiceMultiplexInfo(void)
+static void WriterXmlified(XMLTVWriter_t *writer, const char *text)
 {
-    Multiplex_t *multiplex;
-    Service_t *service;
-    List_t *multiplexes;
-    List_t *services;
-    ListIterator_t muxIterator;
-    ListIterator_t serviceIterator;    
-    ServiceMultiplexInfo_t *info;
-    
-    List_t *result = ObjectListCreate();
-    
-    DBaseTransactionBegin();
-
-    multiplexes = MultiplexListAll();
-    
-    for (ListIterator_Init(muxIterator, multiplexes); 
-         ListIterator_MoreEntries(muxIterator);
-         ListIterator_Next(muxIterator))
-    {
-        multiplex = ListIterator_Current(muxIterator);
-        services = ServiceListForMultiplex(multiplex);
+    const unsigned char *run = (const unsigned char *)text;
+    const unsigned char *ch;
+    const char *escape;
 
-        for (ListIterator_Init(serviceIterator, services); 
-             ListIterator_MoreEntries(serviceIterator);
-             ListIterator_Next(serviceIterator))
+    for (ch = run; *ch; ch ++)
+    {
+        escape = XmlEscapes[*ch];
+        if (escape)
         {
-            service = ListIterator_Current(serviceIterator);
-            info = ObjectCreateType(ServiceMultiplexInfo_t);
-            if (info)
-            {
-                info->service = service;
-                info->mux = multiplex;
-                MultiplexRefInc(multiplex);
-                ListAdd(result, info);
-            }
+            WriterWrite(writer, (const char *)run, ch - run);
+            WriterWrite(writer, escape, strlen(escape));
+            run = ch + 1;
         }
-        /* Just free the list not the contained objects */
-        ListFree(services, NULL);
     }
-    /* This won't actually free the objects, but reduces the ref count by 1 
-     * so that can be free'd later when the returned list is free'd.
-     */
-    ObjectListFree(multiplexes);   
-
-    DBaseTransactionCommit();
-    return result;
+    WriterWrite(writer, (const char *)run, ch - run);
 }
 
-static void ServiceMultiplexInfoDestructor(void *obj)
+static void WriterFlush(XMLTVWriter_t *writer)
 {
-    ServiceMultiplexInfo_t *info = obj;
-    ServiceRefDec(info->service);
-    MultiplexRefDec(info->mux);
-}
\ No newline at end of file
+    int written;
+
+    if (writer->used == 0)
+    {
+        return;
+    }
+    if (writer->gz)
+    {
+        written = gzwrite(writer->gz, writer->buffer, writer->used);
+    }
+    else
+    {
+        written = fwrite(writer->buffer, 1, writer->used, writer->fp);
+    }
+    if (written != writer->used)
+    {
+        writer->error = TRUE;
+    }
+    writer->used = 0;
+}
@@ -25,11 +25,26 @@ File Delivery Method handler, all packets are written to the file of choosing.
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
 
 #include "plugin.h"
 #include "ts.h"
 #include "deliverymethod.h"
 #include "logging.h"
+#include "properties.h"
+
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define DIRECT_ALIGN       4096              /* Alignment required for O_DIRECT writes */
+#define DIRECT_BUFFER_SIZE (256 * DIRECT_ALIGN) /* Bytes written with each O_DIRECT write */
+
+#ifndef O_DIRECT
+#define O_DIRECT 0 /* Stage the writes anyway on systems without it */
+#endif
 
 /*******************************************************************************
 * Typedefs                                                                     *
@@ -42,7 +57,11 @@ struct FileOutputInstance_t
      */
     DeliveryMethodInstance_t instance;
 
-    FILE *fp;
+    int fd;
+    bool direct;       /* Whether the file is being written with O_DIRECT. */
+    uint8_t *staging;  /* Aligned buffer data is collected in for O_DIRECT writes. */
+    int staged;        /* Number of bytes in staging. */
+    off_t written;     /* Offset in the file staging will be written to. */
 };
 
 
@@ -51,12 +70,17 @@ struct FileOutputInstance_t
 *******************************************************************************/
 bool FileOutputCanHandle(char *mrl);
 DeliveryMethodInstance_t *FileOutputCreate(char *arg);
+void FileOutputInstall(bool installed);
 void FileOutputSendPacket(DeliveryMethodInstance_t *this, TSPacket_t *packet);
+void FileOutputSendPackets(DeliveryMethodInstance_t *this, TSPacket_t **packets, int count);
 void FileOutputSendBlock(DeliveryMethodInstance_t *this, void *block, unsigned long blockLen);
 void FileOutputDestroy(DeliveryMethodInstance_t *this);
 void FileReserveHeaderSpace(DeliveryMethodInstance_t *this, int packets);
 void FileSetHeader(struct DeliveryMethodInstance_t *this,
                         TSPacket_t *packets, int count);
+static int FileWrite(int fd, void *data, size_t len);
+static void FileDirectStage(struct FileOutputInstance_t *instance, void *data, size_t len);
+static void FileDirectStop(struct FileOutputInstance_t *instance);
 
 /*******************************************************************************
 * Global variables                                                             *
@@ -71,15 +95,21 @@ DeliveryMethodInstanceOps_t FileInstanceOps ={
     FileOutputDestroy,
     FileReserveHeaderSpace,
     FileSetHeader,
+    NULL,
+    NULL,
+    FileOutputSendPackets
 };
 
 static const char FILEOUTPUT[] = "FileOutput";
+static const char propertyParent[] = "fileoutput";
+static bool directIO = FALSE;
 
 /*******************************************************************************
 * Plugin Setup                                                                 *
 *******************************************************************************/
 PLUGIN_FEATURES(
-    PLUGIN_FEATURE_DELIVERYMETHOD(FileOutputCanHandle, FileOutputCreate)
+    PLUGIN_FEATURE_DELIVERYMETHOD(FileOutputCanHandle, FileOutputCreate),
+    PLUGIN_FEATURE_INSTALL(FileOutputInstall)
 );
 
 PLUGIN_INTERFACE_F(
@@ -94,6 +124,20 @@ PLUGIN_INTERFACE_F(
     "charrea6@users.sourceforge.net"
 );
 
+void FileOutputInstall(bool installed)
+{
+    if (installed)
+    {
+        PropertiesAddSimpleProperty(propertyParent, "direct",
+            "Whether files are written with O_DIRECT, bypassing the page cache (applies to outputs created afterwards).",
+            PropertyType_Boolean, &directIO, SIMPLEPROPERTY_RW);
+    }
+    else
+    {
+        PropertiesRemoveAllProperties(propertyParent);
+    }
+}
+
 /*******************************************************************************
 * Delivery Method Functions                                                    *
 *******************************************************************************/
@@ -108,8 +152,9 @@ DeliveryMethodInstance_t *FileOutputCreate(char *arg)
 {
     struct FileOutputInstance_t *instance = calloc(1, sizeof(struct FileOutputInstance_t));
     bool append = (strncmp(FileAppendPrefix, arg, sizeof(FileAppendPrefix)-1) == 0);
-    char *mode;
+    int flags = O_WRONLY | O_CREAT;
     int prefixLen;
+    char *path;
     
     if (instance == NULL)
     {
@@ -117,19 +162,48 @@ DeliveryMethodInstance_t *FileOutputCreate(char *arg)
     }
     if (append)
     {
-        mode = "ab";
+        flags |= O_APPEND;
         prefixLen = sizeof(FileAppendPrefix)-1;
     }
     else
     {
-        mode = "wb";
+        flags |= O_TRUNC;
         prefixLen = sizeof(FilePrefix)-1;
     }
     instance->instance.ops = &FileInstanceOps;
+    path = (char*)(arg + prefixLen);
+    instance->fd = -1;
 
-    instance->fp = fopen((char*)(arg + prefixLen), mode);
+    if (directIO)
+    {
+        if (posix_memalign((void**)&instance->staging, DIRECT_ALIGN, DIRECT_BUFFER_SIZE) == 0)
+        {
+            instance->fd = open(path, flags | O_DIRECT, 0666);
+            if (instance->fd == -1)
+            {
+                /* Not all file systems support O_DIRECT. */
+                LogModule(LOG_INFO, FILEOUTPUT, "Failed to open %s for direct I/O (%s), using buffered I/O.\n", path, strerror(errno));
+                free(instance->staging);
+                instance->staging = NULL;
+            }
+            else
+            {
+                instance->direct = TRUE;
+                /* Appending has to start on an aligned offset. */
+                instance->written = lseek(instance->fd, 0, SEEK_END);
+                if (instance->written % DIRECT_ALIGN)
+                {
+                    FileDirectStop(instance);
+                }
+            }
+        }
+    }
+    if (instance->fd == -1)
+    {
+        instance->fd = open(path, flags, 0666);
+    }
 
-    if (!instance->fp)
+    if (instance->fd == -1)
     {
         free(instance);
         return NULL;
@@ -144,20 +218,45 @@ void FileOutputSendPacket(DeliveryMethodInstance_t *this, TSPacket_t *packet)
     FileOutputSendBlock(this, (void *)packet, sizeof(TSPacket_t));
 }
 
+void FileOutputSendPackets(DeliveryMethodInstance_t *this, TSPacket_t **packets, int count)
+{
+    struct FileOutputInstance_t *instance = (struct FileOutputInstance_t*)this;
+    int i;
+
+    if (instance->direct)
+    {
+        for (i = 0; i < count; i ++)
+        {
+            FileDirectStage(instance, packets[i], TSPACKET_SIZE);
+        }
+    }
+    else if (DeliveryMethodWritePackets(instance->fd, packets, count))
+    {
+        LogModule(LOG_INFO, FILEOUTPUT, "Failed to write all packets to file!\n");
+    }
+}
+
 void FileOutputSendBlock(DeliveryMethodInstance_t *this, void *block, unsigned long blockLen)
 {
     struct FileOutputInstance_t *instance = (struct FileOutputInstance_t*)this;
-    if (fwrite(block, 1, blockLen, instance->fp) != blockLen)
+    if (instance->direct)
+    {
+        FileDirectStage(instance, block, blockLen);
+    }
+    else if (FileWrite(instance->fd, block, blockLen))
     {
         LogModule(LOG_INFO, FILEOUTPUT, "Failed to write entire block to file!\n");
     }
-    fflush(instance->fp);
 }
 
 void FileOutputDestroy(DeliveryMethodInstance_t *this)
 {
     struct FileOutputInstance_t *instance = (struct FileOutputInstance_t*)this;
-    fclose(instance->fp);
+    if (instance->direct)
+    {
+        FileDirectStop(instance);
+    }
+    close(instance->fd);
     free(this->mrl);
     free(this);
 }
@@ -175,10 +274,7 @@ void FileReserveHeaderSpace(DeliveryMethodInstance_t *this, int packets)
 
     for (i=0; i< packets; i ++)
     {
-        if (fwrite(&nullPacket, TSPACKET_SIZE, 1, instance->fp) != 1)
-        {
-            LogModule(LOG_INFO, FILEOUTPUT, "Failed to write all of null packet to start of file.\n");
-        }
+        FileOutputSendBlock(&instance->instance, &nullPacket, TSPACKET_SIZE);
     }
 }
 
@@ -186,15 +282,116 @@ void FileSetHeader(struct DeliveryMethodInstance_t *this,
                         TSPacket_t *packets, int count)
 {
     struct FileOutputInstance_t *instance = (struct FileOutputInstance_t*)this;
-    fpos_t current;
-    fgetpos(instance->fp, &current);
+    size_t len = count * TSPACKET_SIZE;
+    int flags = 0;
 
-    rewind(instance->fp);
+    if (instance->direct)
+    {
+        if (instance->written < (off_t)len)
+        {
+            /* The end of the header hasn't been written to the file yet. */
+            size_t staged = len - instance->written;
+            if (staged > instance->staged)
+            {
+                staged = instance->staged;
+            }
+            memcpy(instance->staging, ((uint8_t*)packets) + instance->written, staged);
+            len = instance->written;
+        }
+        /* The header isn't aligned so is written through the page cache. */
+        flags = fcntl(instance->fd, F_GETFL);
+        fcntl(instance->fd, F_SETFL, flags & ~O_DIRECT);
+    }
 
-    if (fwrite(packets, TSPACKET_SIZE, count, instance->fp))
+    if (len && (pwrite(instance->fd, packets, len, 0) != len))
     {
         LogModule(LOG_INFO, FILEOUTPUT, "Failed to write all of packet to file.\n");
     }
 
-    fsetpos(instance->fp, &current);
+    if (instance->direct)
+    {
+        fcntl(instance->fd, F_SETFL, flags);
+    }
+}
+
+/*******************************************************************************
+* Local Functions                                                              *
+*******************************************************************************/
+static int FileWrite(int fd, void *data, size_t len)
+{
+    ssize_t result;
+
+    while (len)
+    {
+        result = write(fd, data, len);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data = ((uint8_t*)data) + result;
+        len -= result;
+    }
+    return 0;
+}
+
+/*
+ * Copy data to the staging buffer, writing the buffer to the file each time it
+ * is full so every write is a multiple of DIRECT_ALIGN from an aligned buffer.
+ */
+static void FileDirectStage(struct FileOutputInstance_t *instance, void *data, size_t len)
+{
+    size_t count;
+
+    while (len && instance->direct)
+    {
+        count = DIRECT_BUFFER_SIZE - instance->staged;
+        if (count > len)
+        {
+            count = len;
+        }
+        memcpy(instance->staging + instance->staged, data, count);
+        instance->staged += count;
+        data = ((uint8_t*)data) + count;
+        len -= count;
+
+        if (instance->staged == DIRECT_BUFFER_SIZE)
+        {
+            if (FileWrite(instance->fd, instance->staging, DIRECT_BUFFER_SIZE))
+            {
+                LogModule(LOG_INFO, FILEOUTPUT, "Direct write to %s failed (%s), using buffered I/O.\n",
+                          instance->instance.mrl, strerror(errno));
+                FileDirectStop(instance);
+                break;
+            }
+            instance->staged = 0;
+            instance->written += DIRECT_BUFFER_SIZE;
+        }
+    }
+    if (len && FileWrite(instance->fd, data, len))
+    {
+        LogModule(LOG_INFO, FILEOUTPUT, "Failed to write entire block to file!\n");
+    }
+}
+
+/*
+ * Switch back to buffered I/O, writing out anything still in the staging
+ * buffer (which needn't be a multiple of DIRECT_ALIGN).
+ */
+static void FileDirectStop(struct FileOutputInstance_t *instance)
+{
+    int flags = fcntl(instance->fd, F_GETFL);
+
+    fcntl(instance->fd, F_SETFL, flags & ~O_DIRECT);
+    if (instance->staged && FileWrite(instance->fd, instance->staging, instance->staged))
+    {
+        LogModule(LOG_INFO, FILEOUTPUT, "Failed to write entire block to file!\n");
+    }
+    free(instance->staging);
+    instance->staging = NULL;
+    instance->staged = 0;
+    instance->direct = FALSE;
 }
@@ -55,6 +55,7 @@ struct PipeOutputInstance_t
 bool PipeOutputCanHandle(char *mrl);
 DeliveryMethodInstance_t *PipeOutputCreate(char *arg);
 void PipeOutputSendPacket(DeliveryMethodInstance_t *this, TSPacket_t *packet);
+void PipeOutputSendPackets(DeliveryMethodInstance_t *this, TSPacket_t **packets, int count);
 void PipeOutputSendBlock(DeliveryMethodInstance_t *this, void *block, unsigned long blockLen);
 void PipeOutputDestroy(DeliveryMethodInstance_t *this);
 
@@ -70,6 +71,9 @@ DeliveryMethodInstanceOps_t PipeInstanceOps ={
     PipeOutputDestroy,
     NULL,
     NULL,
+    NULL,
+    NULL,
+    PipeOutputSendPackets
 };
 
 static const char PIPEOUTPUT[] = "PipeOutput";
@@ -146,6 +150,15 @@ void PipeOutputSendPacket(DeliveryMethodInstance_t *this, TSPacket_t *packet)
     PipeOutputSendBlock(this, (void *)packet, sizeof(TSPacket_t));
 }
 
+void PipeOutputSendPackets(DeliveryMethodInstance_t *this, TSPacket_t **packets, int count)
+{
+    struct PipeOutputInstance_t *instance = (struct PipeOutputInstance_t*)this;
+    if (DeliveryMethodWritePackets(instance->fd, packets, count))
+    {
+        LogModule(LOG_INFO, PIPEOUTPUT, "Failed to write all packets to pipe!\n");
+    }
+}
+
 void PipeOutputSendBlock(DeliveryMethodInstance_t *this, void *block, unsigned long blockLen)
 {
     struct PipeOutputInstance_t *instance = (struct PipeOutputInstance_t*)this;
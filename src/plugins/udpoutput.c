@@ -24,17 +24,24 @@ UDP Output Delivery Method handler.
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "plugin.h"
 #include "ts.h"
 #include "udp.h"
 #include "deliverymethod.h"
 #include "logging.h"
+#include "properties.h"
 #include "sap.h"
 
 /*******************************************************************************
@@ -46,6 +53,28 @@ UDP Output Delivery Method handler.
 #define MAX_TS_PACKETS_PER_DATAGRAM ((MTU - (IP_HEADER+UDP_HEADER)) / sizeof(TSPacket_t))
 #define RTP_HEADER_SIZE 12
 
+/* Datagram batching limits */
+#define DEFAULT_BATCH_DATAGRAMS 1   /* Batching disabled */
+#define MAX_BATCH_DATAGRAMS     1024
+#define MAX_BATCH_LATENCY       1000 /* ms */
+#define MAX_GSO_SEGMENTS        64
+#define MAX_GSO_PAYLOAD         65000
+#define IOVS_PER_DATAGRAM       (MAX_TS_PACKETS_PER_DATAGRAM + 1) /* RTP header + packets */
+
+/* Pacing limits */
+#define DEFAULT_PACING_DELAY    100  /* ms */
+#define MAX_PACING_DELAY        2000 /* ms */
+#define DEFAULT_PACING_QUEUE    1024 /* datagrams */
+#define MIN_PACING_QUEUE        16
+#define MAX_PACING_QUEUE        65536
+#define PACER_TICK_NS           100000ULL /* Timer wheel resolution (100us) */
+#define PACER_WHEEL_SLOTS       4096
+#define PACER_MAX_PCR_GAP       (TSPACKET_PCR_HZ / 2) /* Longer gaps are treated as discontinuities */
+#define PACER_RATE_SHIFT        3    /* New rate samples are weighted 1/8 */
+#define PACED_HISTOGRAM_BUCKETS 16
+#define NS_PER_MS               1000000ULL
+#define NS_PER_SEC              1000000000ULL
+
 /* Default output targets if only host or port part is given */
 #define DEFAULT_HOST "localhost"
 #define DEFAULT_PORT "1234"
@@ -53,6 +82,21 @@ UDP Output Delivery Method handler.
 /*******************************************************************************
 * Typedefs                                                                     *
 *******************************************************************************/
+/* Packet batches a queued datagram holds references to. */
+typedef struct BatchDatagramRefs_t
+{
+    int nrofRefs;
+    TSPacketBatch_t *refs[MAX_TS_PACKETS_PER_DATAGRAM];
+}BatchDatagramRefs_t;
+
+/* Counts of values in power of 2 sized buckets, bucket 0 only counts 0 and
+ * bucket n counts values from 2^(n-1) up to 2^n.
+ */
+typedef struct PacedHistogram_t
+{
+    unsigned int buckets[PACED_HISTOGRAM_BUCKETS];
+}PacedHistogram_t;
+
 struct UDPOutputState_t
 {
     /* !!! MUST BE THE FIRST FIELD IN THE STRUCTURE !!!
@@ -73,6 +117,58 @@ struct UDPOutputState_t
     */
     uint8_t rtpHeader[RTP_HEADER_SIZE];
     TSPacket_t outputBuffer[MAX_TS_PACKETS_PER_DATAGRAM];
+
+    /* Batching state, only used when more than 1 datagram is sent per flush. */
+    int batchSize;              /* Maximum number of datagrams queued. */
+    int datagramSize;           /* Size of each datagram including any RTP header. */
+    int headerSize;             /* RTP_HEADER_SIZE for RTP, 0 for UDP. */
+    int nrofDatagrams;          /* Number of complete datagrams queued. */
+    uint64_t firstQueued;       /* Time the first datagram in the batch was queued (ns, CLOCK_MONOTONIC). */
+    bool gso;                   /* Whether to try UDP segmentation offload. */
+    uint8_t *batch;             /* RTP headers and copied packets, datagramSize bytes per datagram. */
+    struct iovec *iovs;         /* IOVS_PER_DATAGRAM entries per datagram. */
+    struct mmsghdr *msgs;
+    BatchDatagramRefs_t *refs;  /* Packet batches referenced by each datagram. */
+    struct iovec *gsoIovs;      /* Datagrams gathered for a single GSO send. */
+    bool batchHeld;             /* Datagrams are held in the timer wheel for up to maxlatency,
+                                 * only changed by the thread writing to the output with
+                                 * pacerMutex held. */
+
+    /* Pacing state, only used when datagrams are sent at the time the PCR says
+     * their packets are due rather than as soon as they are full.
+     */
+    bool paced;
+    char pacedPropertyPath[PROPERTIES_PATH_MAX];
+    int pacedSlots;             /* Number of datagrams the queue can hold. */
+    uint8_t *pacedBuffer;       /* datagramSize bytes per slot. */
+    uint64_t *pacedDepartures;  /* Time each queued datagram is due to be sent (ns, CLOCK_MONOTONIC). */
+    int pacedHead;              /* First queued datagram. */
+    int pacedCount;             /* Number of queued datagrams, protected by pacerMutex. */
+    int pacedFill;              /* Slot being filled by the input thread. */
+    uint64_t pacedLastDeparture;
+    int pcrPid;                 /* PID the PCR is taken from, -1 until one has been seen. */
+    bool pcrSeen;
+    uint64_t pcrLast;           /* Last PCR value seen. */
+    uint64_t pcrTime;           /* Time of the last PCR in 27MHz ticks with wraps removed. */
+    int pcrPackets;             /* Packets received since the last PCR. */
+    double ticksPerPacket;      /* Estimated packet duration in 27MHz ticks, 0 until known. */
+    bool anchored;              /* Whether anchorPcrTime/anchorDeparture are valid. */
+    uint64_t anchorPcrTime;
+    uint64_t anchorDeparture;
+    /* Timer wheel linkage, protected by pacerMutex. Also used to release held
+     * batches.
+     */
+    struct UDPOutputState_t *wheelNext;
+    uint64_t wheelDeadline;
+    int wheelSlot;
+    bool inWheel;
+    bool sending;               /* Pacer thread is sending datagrams from the queue or batch. */
+    bool closing;
+    /* Statistics */
+    int pacedDropped;
+    int pacedReanchors;
+    PacedHistogram_t jitter;    /* Time sent minus time due in us. */
+    PacedHistogram_t bursts;    /* Datagrams sent per pacer wakeup. */
 };
 
 /*******************************************************************************
@@ -85,6 +181,45 @@ static void UDPOutputSendPacket(DeliveryMethodInstance_t *this, TSPacket_t *pack
 static void UDPOutputSendBlock(DeliveryMethodInstance_t *this, void *block, unsigned long blockLen);
 static void UDPOutputDestroy(DeliveryMethodInstance_t *this);
 static void RTPOutputSendPacket(DeliveryMethodInstance_t *this, TSPacket_t *packet);
+static void BatchOutputSendPacket(DeliveryMethodInstance_t *this, TSPacket_t *packet);
+static void BatchOutputSendPacketRef(DeliveryMethodInstance_t *this, TSPacket_t *packet, TSPacketBatch_t *batch);
+static void BatchOutputSendBlock(DeliveryMethodInstance_t *this, void *block, unsigned long blockLen);
+static bool BatchOutputFlush(DeliveryMethodInstance_t *this);
+static int BatchInit(struct UDPOutputState_t *state, bool rtp);
+static void BatchFree(struct UDPOutputState_t *state);
+static void BatchDatagramInit(struct UDPOutputState_t *state, int datagram);
+static void BatchAddPacket(struct UDPOutputState_t *state, TSPacket_t *packet);
+static void BatchReleaseRefs(BatchDatagramRefs_t *refs);
+static void BatchSend(struct UDPOutputState_t *state);
+static void BatchReclaim(struct UDPOutputState_t *state);
+static void BatchExpire(struct UDPOutputState_t *state);
+#ifdef UDP_SEGMENT
+static int BatchSendGSO(struct UDPOutputState_t *state);
+#endif
+static int BatchDatagramsSet(void *userArg, PropertyValue_t *value);
+static int BatchMaxLatencySet(void *userArg, PropertyValue_t *value);
+static void PacedOutputSendPacket(DeliveryMethodInstance_t *this, TSPacket_t *packet);
+static int PacedInit(struct UDPOutputState_t *state, bool rtp);
+static void PacedFree(struct UDPOutputState_t *state);
+static void PacedClockPacket(struct UDPOutputState_t *state, TSPacket_t *packet);
+static void PacedQueueDatagram(struct UDPOutputState_t *state);
+static void PacedHistogramAdd(PacedHistogram_t *histogram, unsigned int value);
+static char *PacedHistogramToString(PacedHistogram_t *histogram, const char *unit);
+static int PacedBitrateGet(void *userArg, PropertyValue_t *value);
+static int PacedMRLGet(void *userArg, PropertyValue_t *value);
+static int PacedJitterGet(void *userArg, PropertyValue_t *value);
+static int PacedBurstsGet(void *userArg, PropertyValue_t *value);
+static int PacingDelaySet(void *userArg, PropertyValue_t *value);
+static int PacingQueueSet(void *userArg, PropertyValue_t *value);
+static int PacerStart(void);
+static void PacerStop(void);
+static void *PacerThread(void *arg);
+static void PacerSend(struct UDPOutputState_t *state);
+static uint64_t PacerNow(void);
+static void PacerWheelInsert(struct UDPOutputState_t *state, uint64_t deadline);
+static void PacerWheelRemove(struct UDPOutputState_t *state);
+static struct UDPOutputState_t *PacerWheelExpire(uint64_t now);
+static uint64_t PacerWheelNextDeadline(void);
 static void RTPHeaderInit(uint8_t *header, uint16_t sequence);
 static void CreateSAPSession(struct UDPOutputState_t *state, bool rtp, unsigned char ttl, char *sessionName);
 
@@ -102,6 +237,7 @@ DeliveryMethodInstanceOps_t UDPInstanceOps = {
     UDPOutputSendBlock,
     UDPOutputDestroy,
     NULL,
+    NULL,
     NULL
 };
 
@@ -110,11 +246,76 @@ DeliveryMethodInstanceOps_t RTPInstanceOps = {
     NULL,
     UDPOutputDestroy,
     NULL,
+    NULL,
+    NULL
+};
+
+DeliveryMethodInstanceOps_t UDPBatchInstanceOps = {
+    BatchOutputSendPacket,
+    BatchOutputSendBlock,
+    UDPOutputDestroy,
+    NULL,
+    NULL,
+    BatchOutputFlush,
+    BatchOutputSendPacketRef
+};
+
+DeliveryMethodInstanceOps_t RTPBatchInstanceOps = {
+    BatchOutputSendPacket,
+    NULL,
+    UDPOutputDestroy,
+    NULL,
+    NULL,
+    BatchOutputFlush,
+    BatchOutputSendPacketRef
+};
+
+/* Blocks aren't part of the TS so aren't paced. */
+DeliveryMethodInstanceOps_t UDPPacedInstanceOps = {
+    PacedOutputSendPacket,
+    UDPOutputSendBlock,
+    UDPOutputDestroy,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+DeliveryMethodInstanceOps_t RTPPacedInstanceOps = {
+    PacedOutputSendPacket,
+    NULL,
+    UDPOutputDestroy,
+    NULL,
+    NULL,
+    NULL,
     NULL
 };
 
 const char UDPOUTPUT[] = "UDPOutput";
 
+static const char propertyParent[] = "udpoutput";
+static int batchDatagrams = DEFAULT_BATCH_DATAGRAMS;
+static int batchMaxLatency = 0;
+static bool batchGSO = TRUE;
+static bool pacing = FALSE;
+static int pacingDelay = DEFAULT_PACING_DELAY;
+static int pacingQueue = DEFAULT_PACING_QUEUE;
+static int pacedOutputCount = 0;
+
+/* Paced outputs are sent by a single thread, each output with queued datagrams
+ * is held in a hashed timer wheel keyed on the time its next datagram is due.
+ */
+static pthread_mutex_t pacerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pacerCond;
+static pthread_cond_t pacerIdleCond = PTHREAD_COND_INITIALIZER;
+static pthread_t pacerThread;
+static bool pacerStarted = FALSE;
+static bool pacerQuit = FALSE;
+static struct UDPOutputState_t *pacerWheel[PACER_WHEEL_SLOTS];
+static int pacerWheelCount = 0;
+static uint64_t pacerCursor;           /* Next tick of the wheel to expire. */
+static uint64_t pacerWake = UINT64_MAX; /* Time the pacer thread will next wake. */
+
 /*******************************************************************************
 * Plugin Setup                                                                 *
 *******************************************************************************/
@@ -140,9 +341,29 @@ void UDPOutputInstall(bool installed)
     if (installed)
     {
         SAPServerInit();
+        PropertiesAddProperty(propertyParent, "batchdatagrams",
+            "Maximum number of datagrams each output queues before sending them with one system call (1 disables batching, applies to outputs created afterwards).",
+            PropertyType_Int, &batchDatagrams, PropertiesSimplePropertyGet, BatchDatagramsSet);
+        PropertiesAddProperty(propertyParent, "maxlatency",
+            "Maximum time in ms queued datagrams are held over to following DVR reads before they are sent (0 sends them at the end of every DVR read).",
+            PropertyType_Int, &batchMaxLatency, PropertiesSimplePropertyGet, BatchMaxLatencySet);
+        PropertiesAddSimpleProperty(propertyParent, "gso",
+            "Whether to use UDP segmentation offload to send queued datagrams when available.",
+            PropertyType_Boolean, &batchGSO, SIMPLEPROPERTY_RW);
+        PropertiesAddSimpleProperty(propertyParent, "pacing",
+            "Whether outputs send datagrams at the times given by the PCR rather than as soon as they are full (applies to outputs created afterwards).",
+            PropertyType_Boolean, &pacing, SIMPLEPROPERTY_RW);
+        PropertiesAddProperty(propertyParent, "pacingdelay",
+            "Time in ms paced datagrams are held for to smooth out bursts from the DVR.",
+            PropertyType_Int, &pacingDelay, PropertiesSimplePropertyGet, PacingDelaySet);
+        PropertiesAddProperty(propertyParent, "pacingqueue",
+            "Maximum number of datagrams each paced output queues, datagrams are dropped when the queue is full.",
+            PropertyType_Int, &pacingQueue, PropertiesSimplePropertyGet, PacingQueueSet);
     }
     else
     {
+        PropertiesRemoveAllProperties(propertyParent);
+        PacerStop();
         SAPServerDeinit();
     }
 }
@@ -328,14 +549,67 @@ static DeliveryMethodInstance_t *UDPOutputCreate(char *arg)
        CreateSAPSession(state, rtp, ttl, sessionName);
     }
 
+    if (pacing)
+    {
+        if (PacedInit(state, rtp) == 0)
+        {
+            state->instance.ops = rtp ? &RTPPacedInstanceOps:&UDPPacedInstanceOps;
+        }
+        else
+        {
+            LogModule(LOG_INFO, UDPOUTPUT, "Failed to setup pacing, sending datagrams as soon as they are full\n");
+        }
+    }
+
+    if ((batchDatagrams > 1) && !state->paced)
+    {
+        if (BatchInit(state, rtp) == 0)
+        {
+            state->instance.ops = rtp ? &RTPBatchInstanceOps:&UDPBatchInstanceOps;
+        }
+        else
+        {
+            LogModule(LOG_INFO, UDPOUTPUT, "Failed to allocate datagram batch, sending datagrams individually\n");
+        }
+    }
+
     state->datagramFullCount = MAX_TS_PACKETS_PER_DATAGRAM;
     state->instance.mrl = strdup(arg);
+    if (state->paced)
+    {
+        PropertiesAddProperty(state->pacedPropertyPath, "mrl", "The destination of this output.",
+            PropertyType_String, state, PacedMRLGet, NULL);
+        PropertiesAddSimpleProperty(state->pacedPropertyPath, "pcrpid", "PID the PCR used to pace the output is taken from (-1 if none seen yet).",
+            PropertyType_Int, &state->pcrPid, SIMPLEPROPERTY_R);
+        PropertiesAddProperty(state->pacedPropertyPath, "bitrate", "Rate of the output in bits per second estimated from the PCR.",
+            PropertyType_Int, state, PacedBitrateGet, NULL);
+        PropertiesAddSimpleProperty(state->pacedPropertyPath, "queued", "Number of datagrams waiting to be sent.",
+            PropertyType_Int, &state->pacedCount, SIMPLEPROPERTY_R);
+        PropertiesAddSimpleProperty(state->pacedPropertyPath, "dropped", "Number of datagrams dropped because the queue was full.",
+            PropertyType_Int, &state->pacedDropped, SIMPLEPROPERTY_R);
+        PropertiesAddSimpleProperty(state->pacedPropertyPath, "reanchors", "Number of times the PCR has been remapped to the local clock.",
+            PropertyType_Int, &state->pacedReanchors, SIMPLEPROPERTY_R);
+        PropertiesAddProperty(state->pacedPropertyPath, "jitter", "Histogram of how late datagrams were sent in us.",
+            PropertyType_String, state, PacedJitterGet, NULL);
+        PropertiesAddProperty(state->pacedPropertyPath, "bursts", "Histogram of the number of datagrams sent together.",
+            PropertyType_String, state, PacedBurstsGet, NULL);
+    }
     return &state->instance;
 }
 
 static void UDPOutputDestroy(DeliveryMethodInstance_t *this)
 {
     struct UDPOutputState_t *state = (struct UDPOutputState_t *)this;
+    if (state->batch)
+    {
+        BatchReclaim(state);
+        BatchSend(state);
+        BatchFree(state);
+    }
+    if (state->paced)
+    {
+        PacedFree(state);
+    }
     close(state->socket);
     if (state->sapHandle)
     {
@@ -381,6 +655,973 @@ static void RTPOutputSendPacket(DeliveryMethodInstance_t *this, TSPacket_t *pack
     }
 }
 
+/*******************************************************************************
+* Datagram Batching Functions                                                  *
+*******************************************************************************/
+static void BatchOutputSendPacket(DeliveryMethodInstance_t *this, TSPacket_t *packet)
+{
+    struct UDPOutputState_t *state = (struct UDPOutputState_t*)this;
+    uint8_t *copy;
+
+    if (state->batchHeld)
+    {
+        BatchReclaim(state);
+    }
+    copy = state->batch + (state->nrofDatagrams * state->datagramSize) +
+           state->headerSize + (state->tsPacketCount * TSPACKET_SIZE);
+    memcpy(copy, packet, TSPACKET_SIZE);
+    BatchAddPacket(state, (TSPacket_t *)copy);
+}
+
+static void BatchOutputSendPacketRef(DeliveryMethodInstance_t *this, TSPacket_t *packet, TSPacketBatch_t *batch)
+{
+    struct UDPOutputState_t *state = (struct UDPOutputState_t*)this;
+    BatchDatagramRefs_t *refs;
+
+    if (state->batchHeld)
+    {
+        BatchReclaim(state);
+    }
+    refs = &state->refs[state->nrofDatagrams];
+    /* Packets for a datagram will nearly always come from the same batch so
+     * only take a new reference when the batch changes.
+     */
+    if ((refs->nrofRefs == 0) || (refs->refs[refs->nrofRefs - 1] != batch))
+    {
+        TSPacketBatchRef(batch);
+        refs->refs[refs->nrofRefs] = batch;
+        refs->nrofRefs ++;
+    }
+    BatchAddPacket(state, packet);
+}
+
+static void BatchOutputSendBlock(DeliveryMethodInstance_t *this, void *block, unsigned long blockLen)
+{
+    struct UDPOutputState_t *state = (struct UDPOutputState_t*)this;
+    if (state->batchHeld)
+    {
+        BatchReclaim(state);
+    }
+    /* Keep the block in order with any queued packets. */
+    BatchSend(state);
+    UDPSendTo(state->socket, (char*)block,
+              blockLen,
+              (struct sockaddr *)(&state->address), state->addressLen);
+}
+
+static bool BatchOutputFlush(DeliveryMethodInstance_t *this)
+{
+    struct UDPOutputState_t *state = (struct UDPOutputState_t*)this;
+    uint64_t deadline;
+
+    if (state->batchHeld)
+    {
+        BatchReclaim(state);
+    }
+    if (state->nrofDatagrams == 0)
+    {
+        return FALSE;
+    }
+    if ((batchMaxLatency > 0) && (state->nrofDatagrams < state->batchSize))
+    {
+        deadline = state->firstQueued + (batchMaxLatency * NS_PER_MS);
+        if (deadline > PacerNow())
+        {
+            /* Hold the datagrams over to the next DVR read, if it doesn't come
+             * before the deadline the pacer thread sends them.
+             */
+            pthread_mutex_lock(&pacerMutex);
+            state->batchHeld = TRUE;
+            PacerWheelInsert(state, deadline);
+            pthread_mutex_unlock(&pacerMutex);
+            return TRUE;
+        }
+    }
+    BatchSend(state);
+    return FALSE;
+}
+
+static int BatchInit(struct UDPOutputState_t *state, bool rtp)
+{
+    int i;
+
+    state->batchSize = batchDatagrams;
+    state->headerSize = rtp ? RTP_HEADER_SIZE : 0;
+    state->datagramSize = state->headerSize + (MAX_TS_PACKETS_PER_DATAGRAM * TSPACKET_SIZE);
+    state->batch = malloc(state->batchSize * state->datagramSize);
+    state->iovs = calloc(state->batchSize * IOVS_PER_DATAGRAM, sizeof(struct iovec));
+    state->msgs = calloc(state->batchSize, sizeof(struct mmsghdr));
+    state->refs = calloc(state->batchSize, sizeof(BatchDatagramRefs_t));
+    state->gsoIovs = calloc(MAX_GSO_SEGMENTS * IOVS_PER_DATAGRAM, sizeof(struct iovec));
+    if ((state->batch == NULL) || (state->iovs == NULL) || (state->msgs == NULL) ||
+        (state->refs == NULL) || (state->gsoIovs == NULL))
+    {
+        BatchFree(state);
+        return -1;
+    }
+    for (i = 0; i < state->batchSize; i ++)
+    {
+        state->msgs[i].msg_hdr.msg_name = &state->address;
+        state->msgs[i].msg_hdr.msg_namelen = state->addressLen;
+        state->msgs[i].msg_hdr.msg_iov = &state->iovs[i * IOVS_PER_DATAGRAM];
+    }
+    BatchDatagramInit(state, 0);
+    state->gso = FALSE;
+#ifdef UDP_SEGMENT
+    if (batchGSO)
+    {
+        /* Kernels without GSO support don't know the option. */
+        int segmentSize;
+        socklen_t optionLen = sizeof(segmentSize);
+        state->gso = getsockopt(state->socket, SOL_UDP, UDP_SEGMENT, &segmentSize, &optionLen) == 0;
+    }
+#endif
+    return 0;
+}
+
+static void BatchFree(struct UDPOutputState_t *state)
+{
+    if (state->refs)
+    {
+        /* Only the datagram being filled can still hold references. */
+        BatchReleaseRefs(&state->refs[state->nrofDatagrams]);
+    }
+    free(state->batch);
+    free(state->iovs);
+    free(state->msgs);
+    free(state->refs);
+    free(state->gsoIovs);
+    state->batch = NULL;
+    state->iovs = NULL;
+    state->msgs = NULL;
+    state->refs = NULL;
+    state->gsoIovs = NULL;
+}
+
+static void BatchDatagramInit(struct UDPOutputState_t *state, int datagram)
+{
+    struct msghdr *hdr = &state->msgs[datagram].msg_hdr;
+
+    hdr->msg_iovlen = 0;
+    if (state->headerSize)
+    {
+        hdr->msg_iov[0].iov_base = state->batch + (datagram * state->datagramSize);
+        hdr->msg_iov[0].iov_len = state->headerSize;
+        hdr->msg_iovlen = 1;
+    }
+    state->refs[datagram].nrofRefs = 0;
+}
+
+static void BatchAddPacket(struct UDPOutputState_t *state, TSPacket_t *packet)
+{
+    struct msghdr *hdr = &state->msgs[state->nrofDatagrams].msg_hdr;
+    struct iovec *last = hdr->msg_iovlen ? &hdr->msg_iov[hdr->msg_iovlen - 1] : NULL;
+
+    /* Extend the previous entry if the packet follows on from it. */
+    if (last && (((uint8_t *)last->iov_base) + last->iov_len == (uint8_t *)packet))
+    {
+        last->iov_len += TSPACKET_SIZE;
+    }
+    else
+    {
+        hdr->msg_iov[hdr->msg_iovlen].iov_base = packet;
+        hdr->msg_iov[hdr->msg_iovlen].iov_len = TSPACKET_SIZE;
+        hdr->msg_iovlen ++;
+    }
+
+    state->tsPacketCount ++;
+    if (state->tsPacketCount < state->datagramFullCount)
+    {
+        return;
+    }
+
+    if (state->headerSize)
+    {
+        RTPHeaderInit(state->batch + (state->nrofDatagrams * state->datagramSize), state->sequence);
+        state->sequence ++;
+    }
+    state->tsPacketCount = 0;
+    state->nrofDatagrams ++;
+    if (state->nrofDatagrams == 1)
+    {
+        state->firstQueued = PacerNow();
+        DeliveryMethodFlushRequired(&state->instance);
+    }
+    if (state->nrofDatagrams >= state->batchSize)
+    {
+        BatchSend(state);
+    }
+    else
+    {
+        BatchDatagramInit(state, state->nrofDatagrams);
+    }
+}
+
+static void BatchReleaseRefs(BatchDatagramRefs_t *refs)
+{
+    int i;
+    for (i = 0; i < refs->nrofRefs; i ++)
+    {
+        TSPacketBatchRelease(refs->refs[i]);
+    }
+    refs->nrofRefs = 0;
+}
+
+static void BatchSend(struct UDPOutputState_t *state)
+{
+    int sent = 0;
+    int result;
+    int i;
+
+    if (state->nrofDatagrams == 0)
+    {
+        return;
+    }
+#ifdef UDP_SEGMENT
+    if (state->gso)
+    {
+        sent = BatchSendGSO(state);
+    }
+#endif
+    while (sent < state->nrofDatagrams)
+    {
+        result = sendmmsg(state->socket, &state->msgs[sent], state->nrofDatagrams - sent, 0);
+        if (result <= 0)
+        {
+            /* As with sendto the datagrams are dropped on error. */
+            break;
+        }
+        sent += result;
+    }
+
+    for (i = 0; i < state->nrofDatagrams; i ++)
+    {
+        BatchReleaseRefs(&state->refs[i]);
+    }
+
+    /* Move any partially filled datagram to the start of the batch. */
+    if (state->tsPacketCount)
+    {
+        struct msghdr *from = &state->msgs[state->nrofDatagrams].msg_hdr;
+        struct msghdr *to = &state->msgs[0].msg_hdr;
+        uint8_t *fromStart = state->batch + (state->nrofDatagrams * state->datagramSize);
+        uint8_t *fromEnd = fromStart + state->datagramSize;
+        size_t offset = state->nrofDatagrams * state->datagramSize;
+
+        memcpy(state->batch, fromStart, state->datagramSize);
+        for (i = 0; i < from->msg_iovlen; i ++)
+        {
+            to->msg_iov[i] = from->msg_iov[i];
+            /* Only copied packets (and the RTP header) need rebasing, referenced
+             * packets stay where they are.
+             */
+            if (((uint8_t *)to->msg_iov[i].iov_base >= fromStart) &&
+                ((uint8_t *)to->msg_iov[i].iov_base < fromEnd))
+            {
+                to->msg_iov[i].iov_base = ((uint8_t *)to->msg_iov[i].iov_base) - offset;
+            }
+        }
+        to->msg_iovlen = from->msg_iovlen;
+        state->refs[0] = state->refs[state->nrofDatagrams];
+        state->refs[state->nrofDatagrams].nrofRefs = 0;
+    }
+    else
+    {
+        BatchDatagramInit(state, 0);
+    }
+    state->nrofDatagrams = 0;
+}
+
+/*
+ * Take a held batch back from the timer wheel before the thread writing to the
+ * output changes it, waiting if the pacer thread is sending it.
+ */
+static void BatchReclaim(struct UDPOutputState_t *state)
+{
+    pthread_mutex_lock(&pacerMutex);
+    while (state->sending)
+    {
+        pthread_cond_wait(&pacerIdleCond, &pacerMutex);
+    }
+    if (state->inWheel)
+    {
+        PacerWheelRemove(state);
+    }
+    state->batchHeld = FALSE;
+    pthread_mutex_unlock(&pacerMutex);
+}
+
+/*
+ * Send a held batch whose maxlatency has expired without another DVR read,
+ * called by the pacer thread with pacerMutex held.
+ */
+static void BatchExpire(struct UDPOutputState_t *state)
+{
+    pthread_mutex_unlock(&pacerMutex);
+    BatchSend(state);
+    pthread_mutex_lock(&pacerMutex);
+    state->sending = FALSE;
+    pthread_cond_broadcast(&pacerIdleCond);
+}
+
+#ifdef UDP_SEGMENT
+/*
+ * Send the queued datagrams as large buffers the kernel (or NIC) splits into
+ * datagramSize segments. Returns the number of datagrams sent, if GSO isn't
+ * supported it is disabled for this output and the remaining datagrams are left
+ * for sendmmsg.
+ */
+static int BatchSendGSO(struct UDPOutputState_t *state)
+{
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    }control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int perSend = MAX_GSO_PAYLOAD / state->datagramSize;
+    int sent = 0;
+    int count;
+    int nrofIovs;
+    int i;
+
+    if (perSend > MAX_GSO_SEGMENTS)
+    {
+        perSend = MAX_GSO_SEGMENTS;
+    }
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_name = &state->address;
+    msg.msg_namelen = state->addressLen;
+    msg.msg_iov = state->gsoIovs;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    *(uint16_t *)CMSG_DATA(cmsg) = (uint16_t)state->datagramSize;
+
+    while (sent < state->nrofDatagrams)
+    {
+        count = state->nrofDatagrams - sent;
+        if (count > perSend)
+        {
+            count = perSend;
+        }
+        /* Gather the datagrams into one vector, the kernel splits it back up. */
+        nrofIovs = 0;
+        for (i = sent; i < sent + count; i ++)
+        {
+            memcpy(&state->gsoIovs[nrofIovs], state->msgs[i].msg_hdr.msg_iov,
+                   state->msgs[i].msg_hdr.msg_iovlen * sizeof(struct iovec));
+            nrofIovs += state->msgs[i].msg_hdr.msg_iovlen;
+        }
+        msg.msg_iovlen = nrofIovs;
+        if (sendmsg(state->socket, &msg, 0) < 0)
+        {
+            if ((errno == EINVAL) || (errno == ENOPROTOOPT) || (errno == EOPNOTSUPP) || (errno == EIO))
+            {
+                LogModule(LOG_INFO, UDPOUTPUT, "UDP segmentation offload not available for %s, using sendmmsg\n", state->instance.mrl);
+                state->gso = FALSE;
+            }
+            break;
+        }
+        sent += count;
+    }
+    return sent;
+}
+#endif
+
+static int BatchDatagramsSet(void *userArg, PropertyValue_t *value)
+{
+    if ((value->u.integer < 1) || (value->u.integer > MAX_BATCH_DATAGRAMS))
+    {
+        return -1;
+    }
+    batchDatagrams = value->u.integer;
+    return 0;
+}
+
+static int BatchMaxLatencySet(void *userArg, PropertyValue_t *value)
+{
+    if ((value->u.integer < 0) || (value->u.integer > MAX_BATCH_LATENCY))
+    {
+        return -1;
+    }
+    /* Held batches are sent by the pacer thread once they expire. */
+    if ((value->u.integer > 0) && PacerStart())
+    {
+        return -1;
+    }
+    batchMaxLatency = value->u.integer;
+    return 0;
+}
+
+/*******************************************************************************
+* Pacing Functions                                                             *
+*******************************************************************************/
+static void PacedOutputSendPacket(DeliveryMethodInstance_t *this, TSPacket_t *packet)
+{
+    struct UDPOutputState_t *state = (struct UDPOutputState_t*)this;
+    uint8_t *copy = state->pacedBuffer + (state->pacedFill * state->datagramSize) +
+                    state->headerSize + (state->tsPacketCount * TSPACKET_SIZE);
+
+    PacedClockPacket(state, packet);
+    memcpy(copy, packet, TSPACKET_SIZE);
+    state->tsPacketCount ++;
+    if (state->tsPacketCount >= state->datagramFullCount)
+    {
+        PacedQueueDatagram(state);
+        state->tsPacketCount = 0;
+    }
+}
+
+static int PacedInit(struct UDPOutputState_t *state, bool rtp)
+{
+    if (PacerStart())
+    {
+        return -1;
+    }
+    state->headerSize = rtp ? RTP_HEADER_SIZE : 0;
+    state->datagramSize = state->headerSize + (MAX_TS_PACKETS_PER_DATAGRAM * TSPACKET_SIZE);
+    state->pacedSlots = pacingQueue;
+    state->pacedBuffer = malloc(state->pacedSlots * state->datagramSize);
+    state->pacedDepartures = calloc(state->pacedSlots, sizeof(uint64_t));
+    if ((state->pacedBuffer == NULL) || (state->pacedDepartures == NULL))
+    {
+        free(state->pacedBuffer);
+        free(state->pacedDepartures);
+        state->pacedBuffer = NULL;
+        state->pacedDepartures = NULL;
+        return -1;
+    }
+    state->pcrPid = -1;
+    state->paced = TRUE;
+    pthread_mutex_lock(&pacerMutex);
+    sprintf(state->pacedPropertyPath, "%s.paced.%d", propertyParent, pacedOutputCount);
+    pacedOutputCount ++;
+    pthread_mutex_unlock(&pacerMutex);
+    return 0;
+}
+
+static void PacedFree(struct UDPOutputState_t *state)
+{
+    PropertiesRemoveAllProperties(state->pacedPropertyPath);
+
+    /* Any datagrams still queued are dropped. */
+    pthread_mutex_lock(&pacerMutex);
+    state->closing = TRUE;
+    if (state->inWheel)
+    {
+        PacerWheelRemove(state);
+    }
+    while (state->sending)
+    {
+        pthread_cond_wait(&pacerIdleCond, &pacerMutex);
+    }
+    pthread_mutex_unlock(&pacerMutex);
+
+    free(state->pacedBuffer);
+    free(state->pacedDepartures);
+}
+
+/*
+ * Track the PCR of the stream, the PCR is taken from the first PID seen with
+ * one which for a service filter is the PCR PID of the service. The time of
+ * packets between PCRs is interpolated using the packet rate measured between
+ * the previous PCRs.
+ */
+static void PacedClockPacket(struct UDPOutputState_t *state, TSPacket_t *packet)
+{
+    uint64_t pcr;
+    uint64_t delta;
+    double sample;
+
+    if (TSPACKET_HASPCR(*packet))
+    {
+        int pid = TSPACKET_GETPID(*packet);
+        if (state->pcrPid == -1)
+        {
+            LogModule(LOG_DEBUG, UDPOUTPUT, "%s: Pacing using PCR on PID 0x%04x\n", state->instance.mrl, pid);
+            state->pcrPid = pid;
+        }
+        if (pid == state->pcrPid)
+        {
+            pcr = TSPACKET_GETPCR(*packet);
+            if (state->pcrSeen)
+            {
+                delta = (pcr + TSPACKET_PCR_WRAP - state->pcrLast) % TSPACKET_PCR_WRAP;
+                if ((delta == 0) || (delta > PACER_MAX_PCR_GAP))
+                {
+                    /* Discontinuity, map the new timebase to the local clock. */
+                    state->anchored = FALSE;
+                }
+                else
+                {
+                    sample = (double)delta / (state->pcrPackets + 1);
+                    if (state->ticksPerPacket == 0.0)
+                    {
+                        state->ticksPerPacket = sample;
+                    }
+                    else
+                    {
+                        state->ticksPerPacket += (sample - state->ticksPerPacket) / (1 << PACER_RATE_SHIFT);
+                    }
+                }
+                state->pcrTime += delta;
+            }
+            state->pcrSeen = TRUE;
+            state->pcrLast = pcr;
+            state->pcrPackets = 0;
+            return;
+        }
+    }
+    state->pcrPackets ++;
+}
+
+static void PacedQueueDatagram(struct UDPOutputState_t *state)
+{
+    uint64_t now = PacerNow();
+    uint64_t delay = pacingDelay * NS_PER_MS;
+    uint64_t departure = now;
+    uint64_t pcrTime;
+
+    /* Until the packet rate is known datagrams are sent straight away. */
+    if (state->ticksPerPacket > 0.0)
+    {
+        /* The datagram is due when its last packet is. */
+        pcrTime = state->pcrTime + (uint64_t)(state->pcrPackets * state->ticksPerPacket);
+        if (state->anchored)
+        {
+            departure = state->anchorDeparture + TSPACKET_PCR_TO_NS(pcrTime - state->anchorPcrTime);
+            /* Remap if the stream has drifted too far from the local clock,
+             * for example when it is being read faster than real time.
+             */
+            if ((departure + delay < now) || (departure > now + (2 * delay)))
+            {
+                state->anchored = FALSE;
+                state->pacedReanchors ++;
+            }
+        }
+        if (!state->anchored)
+        {
+            state->anchorPcrTime = pcrTime;
+            state->anchorDeparture = now + delay;
+            state->anchored = TRUE;
+            departure = state->anchorDeparture;
+        }
+    }
+    if (departure < state->pacedLastDeparture)
+    {
+        departure = state->pacedLastDeparture;
+    }
+    state->pacedLastDeparture = departure;
+
+    if (state->headerSize)
+    {
+        RTPHeaderInit(state->pacedBuffer + (state->pacedFill * state->datagramSize), state->sequence);
+        state->sequence ++;
+    }
+
+    pthread_mutex_lock(&pacerMutex);
+    /* The slot being filled is never part of the queue. */
+    if (state->pacedCount >= state->pacedSlots - 1)
+    {
+        state->pacedDropped ++;
+    }
+    else
+    {
+        state->pacedDepartures[state->pacedFill] = departure;
+        state->pacedCount ++;
+        state->pacedFill = (state->pacedFill + 1) % state->pacedSlots;
+        if (!state->inWheel && !state->sending)
+        {
+            PacerWheelInsert(state, departure);
+        }
+    }
+    pthread_mutex_unlock(&pacerMutex);
+}
+
+static void PacedHistogramAdd(PacedHistogram_t *histogram, unsigned int value)
+{
+    int bucket = 0;
+
+    if (value)
+    {
+        bucket = 32 - __builtin_clz(value);
+        if (bucket >= PACED_HISTOGRAM_BUCKETS)
+        {
+            bucket = PACED_HISTOGRAM_BUCKETS - 1;
+        }
+    }
+    histogram->buckets[bucket] ++;
+}
+
+/*
+ * Format the non-empty buckets of a histogram as "<lower bound><unit>:<count>"
+ * separated by spaces.
+ */
+static char *PacedHistogramToString(PacedHistogram_t *histogram, const char *unit)
+{
+    PacedHistogram_t copy;
+    char buffer[PACED_HISTOGRAM_BUCKETS * 32];
+    int len = 0;
+    int i;
+
+    pthread_mutex_lock(&pacerMutex);
+    copy = *histogram;
+    pthread_mutex_unlock(&pacerMutex);
+
+    buffer[0] = 0;
+    for (i = 0; i < PACED_HISTOGRAM_BUCKETS; i ++)
+    {
+        if (copy.buckets[i])
+        {
+            len += sprintf(buffer + len, "%s%u%s%s:%u", len ? " ":"",
+                           i ? (1U << (i - 1)) : 0, unit,
+                           (i == PACED_HISTOGRAM_BUCKETS - 1) ? "+":"",
+                           copy.buckets[i]);
+        }
+    }
+    return strdup(buffer);
+}
+
+static int PacedBitrateGet(void *userArg, PropertyValue_t *value)
+{
+    struct UDPOutputState_t *state = userArg;
+    double ticksPerPacket = state->ticksPerPacket;
+
+    value->u.integer = 0;
+    if (ticksPerPacket > 0.0)
+    {
+        value->u.integer = (int)(((double)TSPACKET_PCR_HZ * TSPACKET_SIZE * 8) / ticksPerPacket);
+    }
+    return 0;
+}
+
+static int PacedMRLGet(void *userArg, PropertyValue_t *value)
+{
+    struct UDPOutputState_t *state = userArg;
+    value->u.string = strdup(state->instance.mrl);
+    return 0;
+}
+
+static int PacedJitterGet(void *userArg, PropertyValue_t *value)
+{
+    struct UDPOutputState_t *state = userArg;
+    value->u.string = PacedHistogramToString(&state->jitter, "us");
+    return 0;
+}
+
+static int PacedBurstsGet(void *userArg, PropertyValue_t *value)
+{
+    struct UDPOutputState_t *state = userArg;
+    value->u.string = PacedHistogramToString(&state->bursts, "");
+    return 0;
+}
+
+static int PacingDelaySet(void *userArg, PropertyValue_t *value)
+{
+    if ((value->u.integer < 0) || (value->u.integer > MAX_PACING_DELAY))
+    {
+        return -1;
+    }
+    pacingDelay = value->u.integer;
+    return 0;
+}
+
+static int PacingQueueSet(void *userArg, PropertyValue_t *value)
+{
+    if ((value->u.integer < MIN_PACING_QUEUE) || (value->u.integer > MAX_PACING_QUEUE))
+    {
+        return -1;
+    }
+    pacingQueue = value->u.integer;
+    return 0;
+}
+
+static int PacerStart(void)
+{
+    pthread_condattr_t attr;
+    int result = 0;
+
+    pthread_mutex_lock(&pacerMutex);
+    if (!pacerStarted)
+    {
+        /* Wait against the monotonic clock so deadlines aren't affected by the
+         * time of day being changed.
+         */
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&pacerCond, &attr);
+        pthread_condattr_destroy(&attr);
+        pacerQuit = FALSE;
+        if (pthread_create(&pacerThread, NULL, PacerThread, NULL))
+        {
+            LogModule(LOG_ERROR, UDPOUTPUT, "Failed to create pacer thread\n");
+            pthread_cond_destroy(&pacerCond);
+            result = -1;
+        }
+        else
+        {
+            pacerStarted = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&pacerMutex);
+    return result;
+}
+
+static void PacerStop(void)
+{
+    pthread_mutex_lock(&pacerMutex);
+    if (!pacerStarted)
+    {
+        pthread_mutex_unlock(&pacerMutex);
+        return;
+    }
+    pacerQuit = TRUE;
+    pthread_cond_signal(&pacerCond);
+    pthread_mutex_unlock(&pacerMutex);
+    pthread_join(pacerThread, NULL);
+    pthread_cond_destroy(&pacerCond);
+    pacerStarted = FALSE;
+}
+
+static void *PacerThread(void *arg)
+{
+    struct UDPOutputState_t *due;
+    struct UDPOutputState_t *next;
+    struct timespec wake;
+
+    pthread_mutex_lock(&pacerMutex);
+    while (!pacerQuit)
+    {
+        /* PacerSend() may put the output back in the wheel so get the next
+         * due output first.
+         */
+        for (due = PacerWheelExpire(PacerNow()); due; due = next)
+        {
+            next = due->wheelNext;
+            if (due->paced)
+            {
+                PacerSend(due);
+            }
+            else
+            {
+                BatchExpire(due);
+            }
+        }
+        if (pacerWheelCount == 0)
+        {
+            pacerWake = UINT64_MAX;
+            pthread_cond_wait(&pacerCond, &pacerMutex);
+        }
+        else
+        {
+            pacerWake = PacerWheelNextDeadline();
+            if (pacerWake > PacerNow())
+            {
+                wake.tv_sec = pacerWake / NS_PER_SEC;
+                wake.tv_nsec = pacerWake % NS_PER_SEC;
+                pthread_cond_timedwait(&pacerCond, &pacerMutex, &wake);
+            }
+        }
+    }
+    pthread_mutex_unlock(&pacerMutex);
+    return NULL;
+}
+
+/*
+ * Send the datagrams from the output's queue that are due, called with
+ * pacerMutex held but the datagrams are sent without it so the input thread
+ * can keep queueing.
+ */
+static void PacerSend(struct UDPOutputState_t *state)
+{
+    int head = state->pacedHead;
+    int count = state->closing ? 0 : state->pacedCount;
+    int sent = 0;
+    int i;
+    uint64_t now;
+    PacedHistogram_t jitter;
+
+    pthread_mutex_unlock(&pacerMutex);
+
+    /* The histograms are read by the property getters under pacerMutex so
+     * collect the jitter locally and merge it once the mutex is retaken.
+     */
+    memset(&jitter, 0, sizeof(jitter));
+
+    while (sent < count)
+    {
+        now = PacerNow();
+        if (state->pacedDepartures[head] > now)
+        {
+            break;
+        }
+        UDPSendTo(state->socket, (char*)state->pacedBuffer + (head * state->datagramSize),
+                  state->datagramSize,
+                  (struct sockaddr *)(&state->address), state->addressLen);
+        PacedHistogramAdd(&jitter, (unsigned int)((now - state->pacedDepartures[head]) / 1000));
+        head = (head + 1) % state->pacedSlots;
+        sent ++;
+    }
+
+    pthread_mutex_lock(&pacerMutex);
+    if (sent)
+    {
+        PacedHistogramAdd(&state->bursts, sent);
+        for (i = 0; i < PACED_HISTOGRAM_BUCKETS; i ++)
+        {
+            state->jitter.buckets[i] += jitter.buckets[i];
+        }
+    }
+    state->pacedHead = head;
+    state->pacedCount -= sent;
+    state->sending = FALSE;
+    if (state->closing)
+    {
+        pthread_cond_broadcast(&pacerIdleCond);
+    }
+    else if (state->pacedCount)
+    {
+        PacerWheelInsert(state, state->pacedDepartures[head]);
+    }
+}
+
+/*
+ * Add an output to the timer wheel, the output is expired on the first tick at
+ * or after its deadline. Deadlines further away than the wheel covers stay in
+ * their slot until the wheel comes round to them again.
+ */
+static void PacerWheelInsert(struct UDPOutputState_t *state, uint64_t deadline)
+{
+    uint64_t tick = deadline / PACER_TICK_NS;
+
+    if (pacerWheelCount == 0)
+    {
+        /* Nothing to catch up on so start the wheel from now. */
+        pacerCursor = PacerNow() / PACER_TICK_NS;
+    }
+    if (tick < pacerCursor)
+    {
+        tick = pacerCursor;
+    }
+    state->wheelSlot = tick % PACER_WHEEL_SLOTS;
+    state->wheelDeadline = deadline;
+    state->wheelNext = pacerWheel[state->wheelSlot];
+    pacerWheel[state->wheelSlot] = state;
+    state->inWheel = TRUE;
+    pacerWheelCount ++;
+    if (deadline < pacerWake)
+    {
+        pthread_cond_signal(&pacerCond);
+    }
+}
+
+static void PacerWheelRemove(struct UDPOutputState_t *state)
+{
+    struct UDPOutputState_t **link;
+
+    for (link = &pacerWheel[state->wheelSlot]; *link; link = &(*link)->wheelNext)
+    {
+        if (*link == state)
+        {
+            *link = state->wheelNext;
+            state->inWheel = FALSE;
+            pacerWheelCount --;
+            break;
+        }
+    }
+}
+
+/*
+ * Remove all the outputs that are due from the wheel, returns them as a list
+ * linked through wheelNext.
+ */
+static struct UDPOutputState_t *PacerWheelExpire(uint64_t now)
+{
+    uint64_t nowTick = now / PACER_TICK_NS;
+    struct UDPOutputState_t *due = NULL;
+    struct UDPOutputState_t **link;
+    struct UDPOutputState_t *state;
+
+    if (pacerWheelCount == 0)
+    {
+        return NULL;
+    }
+    /* There is no need to visit a slot more than once. */
+    if ((pacerCursor < nowTick) && (nowTick - pacerCursor >= PACER_WHEEL_SLOTS))
+    {
+        pacerCursor = nowTick - PACER_WHEEL_SLOTS + 1;
+    }
+    for (;;)
+    {
+        link = &pacerWheel[pacerCursor % PACER_WHEEL_SLOTS];
+        while (*link)
+        {
+            state = *link;
+            if (state->wheelDeadline <= now)
+            {
+                *link = state->wheelNext;
+                state->inWheel = FALSE;
+                /* Stop the output being destroyed until it has been sent. */
+                state->sending = TRUE;
+                state->wheelNext = due;
+                due = state;
+                pacerWheelCount --;
+            }
+            else
+            {
+                link = &state->wheelNext;
+            }
+        }
+        /* The current tick isn't over yet so stay on it. */
+        if (pacerCursor >= nowTick)
+        {
+            break;
+        }
+        pacerCursor ++;
+    }
+    return due;
+}
+
+/*
+ * Find the earliest deadline in the wheel, stopping at the first slot with a
+ * deadline in the current turn of the wheel.
+ */
+static uint64_t PacerWheelNextDeadline(void)
+{
+    uint64_t next = UINT64_MAX;
+    uint64_t tick;
+    struct UDPOutputState_t *state;
+
+    for (tick = pacerCursor; tick < pacerCursor + PACER_WHEEL_SLOTS; tick ++)
+    {
+        for (state = pacerWheel[tick % PACER_WHEEL_SLOTS]; state; state = state->wheelNext)
+        {
+            if (state->wheelDeadline < next)
+            {
+                next = state->wheelDeadline;
+            }
+        }
+        if (next / PACER_TICK_NS <= tick)
+        {
+            break;
+        }
+    }
+    return next;
+}
+
+static uint64_t PacerNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * NS_PER_SEC) + now.tv_nsec;
+}
+
 static void RTPHeaderInit(uint8_t *header, uint16_t sequence)
 {
     uint32_t temp;
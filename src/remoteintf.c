@@ -29,8 +29,9 @@ Remote Interface functions.
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
-#include <sys/poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -39,6 +40,8 @@ Remote Interface functions.
 #include "main.h"
 #include "dispatchers.h"
 #include "logging.h"
+#include "objects.h"
+#include "list.h"
 #include "commands.h"
 #include "remoteintf.h"
 
@@ -47,8 +50,33 @@ Remote Interface functions.
 /*******************************************************************************
 * Defines                                                                      *
 *******************************************************************************/
-#define MAX_CONNECTIONS   2 /* 1 for monitoring by web and another for control */
-#define MAX_LINE_LENGTH 256
+#define MAX_CONNECTIONS   256
+#define MAX_LINE_LENGTH   256
+
+/* Maximum number of threads executing commands, threads are only created when
+ * there are commands waiting and no idle threads. */
+#define MAX_WORKERS        16
+
+/* Seconds after which a command that is still running (ie epgdata) no longer
+ * counts towards MAX_WORKERS, so it can't hold up other connections. */
+#define SLOW_COMMAND_TIME  1.0
+
+/* Seconds a command can be blocked waiting for the client to read its output
+ * before the connection is closed. */
+#define WRITE_TIMEOUT      30
+
+/* Number of received lines waiting to be executed before reading from the
+ * connection is paused. */
+#define MAX_PENDING_LINES  32
+
+/* Amount of output waiting to be sent before commands writing to the
+ * connection are blocked. */
+#define MAX_OUTPUT_BUFFERED (64 * 1024)
+
+/* Seconds a connection can be idle before it is closed. */
+#define CONNECTION_TIMEOUT 30.0
+
+#define LISTEN_BACKLOG     SOMAXCONN
 
 /* Max connection string = [xxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx]:xxxxx */
 #define MAX_CONNECTION_STR_LENGTH 48
@@ -59,28 +87,78 @@ Remote Interface functions.
 typedef struct Connection_t
 {
     int socketfd;
-    FILE *fp;
+    FILE *fp;              /* Used by commands to read from/write to the connection */
 
     struct sockaddr_storage clientAddress;
-    bool connected;
-    pthread_t thread;
+    char connectionStr[MAX_CONNECTION_STR_LENGTH];
+    CommandContext_t context;
+    bool connected;        /* Cleared when the client logs out or disconnects */
+    bool notified;         /* On notifyList, protected by notifyMutex */
+    bool removed;          /* Removed by the network dispatcher */
+
+    /* Only accessed from the network dispatcher thread */
+    ev_io readWatcher;
+    ev_io writeWatcher;
+    ev_timer idleTimer;
+    char inBuffer[MAX_LINE_LENGTH];
+    int inLength;
+    bool readPaused;
+
+    /* Protected by mutex */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;   /* Signalled when output has been sent or lines received */
+    bool closed;           /* The client has gone away */
+    bool eof;              /* The client has finished sending, no more lines will be received */
+    bool queued;           /* On the run queue or being executed by a worker */
+    List_t *pendingLines;  /* Lines received but not yet executed or read */
+    char *readLine;        /* Line currently being read by CommandGets() */
+    int readOffset;
+    char *outBuffer;
+    int outLength;
+    int outSize;
 }
 Connection_t;
 
+/* Protected by runQueueMutex */
+typedef struct RemoteWorker_s
+{
+    ev_tstamp started;     /* When the current command was started, 0 if idle */
+    bool counted;          /* Counts towards MAX_WORKERS */
+}
+RemoteWorker_t;
+
 
 /*******************************************************************************
 * Prototypes                                                                   *
 *******************************************************************************/
 static void RemoteInterfaceAcceptCallback(struct ev_loop *loop, ev_io *w, int revents);
-static void AddConnection(int socketfd, struct sockaddr_storage *clientAddress);
-static void RemoveConnection(Connection_t *connection);
+static void RemoteInterfaceReject(int socketfd, char *connectionStr);
+static void AddConnection(struct ev_loop *loop, int socketfd, struct sockaddr_storage *clientAddress);
+static void RemoveConnection(struct ev_loop *loop, Connection_t *connection);
+static void ConnectionDestructor(void *ptr);
+static void ConnectionClosed(struct ev_loop *loop, Connection_t *connection);
+static void ConnectionEndOfInput(struct ev_loop *loop, Connection_t *connection);
+static bool ConnectionIsFinished(Connection_t *connection);
+static void ConnectionReadCallback(struct ev_loop *loop, ev_io *w, int revents);
+static void ConnectionWriteCallback(struct ev_loop *loop, ev_io *w, int revents);
+static void ConnectionTimeoutCallback(struct ev_loop *loop, ev_timer *w, int revents);
+static void ConnectionsAsyncCallback(struct ev_loop *loop, ev_async *w, int revents);
+static void ConnectionQueueLine(Connection_t *connection, char *line, int length);
+static void ConnectionNotify(Connection_t *connection);
+static ssize_t ConnectionRead(void *cookie, char *buffer, size_t size);
+static ssize_t ConnectionWrite(void *cookie, const char *buffer, size_t size);
+static void RunQueueAdd(Connection_t *connection);
+static void RunQueueStartWorkers(void);
+static void RunQueueWorkerBlocked(void);
+static void RunQueueTimerCallback(struct ev_loop *loop, ev_timer *w, int revents);
+static void *RemoteInterfaceWorker(void *arg);
 static void HandleConnection(Connection_t *connection);
 static void GetConnectionString(struct sockaddr_storage *connAddr, char *output);
 
 static void RemoteInterfaceAuthenticate(int argc, char **argv);
 static void RemoteInterfaceWho(int argc, char **argv);
 static void RemoteInterfaceLogout(int argc, char **argv);
-static void PrintResponse(FILE *fp, uint16_t errno, char * msg);
+static void PrintResponse(FILE *fp, uint16_t errorNumber, char * msg);
 
 /*******************************************************************************
 * Global variables                                                             *
@@ -115,14 +193,40 @@ static Command_t ConnectionCommands[] = {
     COMMANDS_SENTINEL
 };
 
-static bool remoteIntfExit = FALSE;
+static cookie_io_functions_t ConnectionIOFunctions = {
+    ConnectionRead,
+    ConnectionWrite,
+    NULL,
+    NULL
+};
+
+static volatile bool remoteIntfExit = FALSE;
 
+/* Connections are only added and removed by the network dispatcher thread,
+ * the mutex is only needed when accessing the list from other threads. */
 static pthread_mutex_t connectionsMutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t connectionCondVar = PTHREAD_COND_INITIALIZER;
+static List_t *connectionsList;
 
 static int serverSocket;
 static ev_io serverSocketWatcher;
-static List_t *connectionsList;
+
+/* Connections that other threads need the network dispatcher to look at, ie
+ * because they have output to send. */
+static pthread_mutex_t notifyMutex = PTHREAD_MUTEX_INITIALIZER;
+static List_t *notifyList;
+static ev_async connectionsAsync;
+
+/* Connections with lines waiting to be executed by the worker threads. */
+static pthread_mutex_t runQueueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t runQueueCondVar = PTHREAD_COND_INITIALIZER;
+static List_t *runQueue;
+static List_t *workersList;
+static pthread_cond_t workersExitedCondVar = PTHREAD_COND_INITIALIZER;
+static int nrofWorkers = 0;      /* Worker threads running */
+static int idleWorkers = 0;      /* Workers not executing a command */
+static int countedWorkers = 0;   /* Workers counted towards MAX_WORKERS */
+static ev_timer runQueueTimer;
+static __thread RemoteWorker_t *currentWorker = NULL;
 
 static char *infoStreamerName;
 static char *authUsername;
@@ -142,6 +246,7 @@ static char REMOTEINTERFACE[] = "RemoteInterface";
 int RemoteInterfaceInit(int adapter, char *streamerName, char *bindAddress, char *username, char *password)
 {
     struct ev_loop *netLoop = DispatchersGetNetwork();
+    int reuseAddr = 1;
 #ifdef USE_GETADDRINFO
     socklen_t address_len;
     struct sockaddr_storage address;
@@ -176,6 +281,9 @@ int RemoteInterfaceInit(int adapter, char *streamerName, char *bindAddress, char
         return 1;
     }
 
+    /* Connections closed by the server leave the port in TIME_WAIT */
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuseAddr, sizeof(reuseAddr));
+
     if (bind(serverSocket, (struct sockaddr *) &address, address_len) < 0)
     {
         LogModule(LOG_ERROR, REMOTEINTERFACE, "Failed to bind server to port %d\n", REMOTEINTERFACE_PORT + adapter);
@@ -196,6 +304,9 @@ int RemoteInterfaceInit(int adapter, char *streamerName, char *bindAddress, char
     serverAddress.sin_addr.s_addr = INADDR_ANY;
     serverAddress.sin_port = htons(REMOTEINTERFACE_PORT + adapter);
 
+    /* Connections closed by the server leave the port in TIME_WAIT */
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuseAddr, sizeof(reuseAddr));
+
     if (bind(serverSocket, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0)
     {
         LogModule(LOG_ERROR, REMOTEINTERFACE, "Failed to bind server to port %d\n", REMOTEINTERFACE_PORT + adapter);
@@ -204,10 +315,14 @@ int RemoteInterfaceInit(int adapter, char *streamerName, char *bindAddress, char
     }
 #endif
 
-    ObjectRegisterType(Connection_t);
+    ObjectRegisterTypeDestructor(Connection_t, ConnectionDestructor);
     connectionsList = ListCreate();
+    runQueue = ListCreate();
+    workersList = ListCreate();
+    notifyList = ListCreate();
 
-    listen(serverSocket, 1);
+    fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL) | O_NONBLOCK);
+    listen(serverSocket, LISTEN_BACKLOG);
     
     infoStreamerName = strdup(streamerName);
     authUsername = strdup(username);
@@ -233,183 +348,847 @@ int RemoteInterfaceInit(int adapter, char *streamerName, char *bindAddress, char
 
     ev_io_init(&serverSocketWatcher, RemoteInterfaceAcceptCallback, serverSocket, EV_READ);
     ev_io_start(netLoop, &serverSocketWatcher);
+    ev_async_init(&connectionsAsync, ConnectionsAsyncCallback);
+    ev_async_start(netLoop, &connectionsAsync);
+    ev_timer_init(&runQueueTimer, RunQueueTimerCallback, SLOW_COMMAND_TIME, SLOW_COMMAND_TIME);
+    ev_timer_start(netLoop, &runQueueTimer);
     
     return 0;
 }
 
 void RemoteInterfaceDeInit(void)
 {
+    struct ev_loop *netLoop = DispatchersGetNetwork();
     ListIterator_t iterator;
-    
-    ev_io_start(DispatchersGetNetwork(), &serverSocketWatcher);
-    
+    Connection_t *connection;
+
+    /* Called once the network dispatcher has stopped so the watchers can be
+     * stopped from this thread. */
+    ev_io_stop(netLoop, &serverSocketWatcher);
+    ev_async_stop(netLoop, &connectionsAsync);
+    ev_timer_stop(netLoop, &runQueueTimer);
+
     CommandUnRegisterCommands(RemoteInterfaceCommands);
 
-    remoteIntfExit = TRUE;
     close(serverSocket);
 
-    pthread_mutex_lock(&connectionsMutex);
-    if (ListCount(connectionsList) > 0)
+    /* Stop the workers, any commands blocked writing to a connection are woken
+     * by marking the connection as closed. */
+    pthread_mutex_lock(&runQueueMutex);
+    remoteIntfExit = TRUE;
+    pthread_cond_broadcast(&runQueueCondVar);
+    pthread_mutex_unlock(&runQueueMutex);
+
+    for (ListIterator_Init(iterator, connectionsList);
+         ListIterator_MoreEntries(iterator);
+         ListIterator_Next(iterator))
     {
-        for (ListIterator_Init(iterator, connectionsList);
-             ListIterator_MoreEntries(iterator);
-             ListIterator_Next(iterator))
-        {
-            Connection_t *connection = (Connection_t*)ListIterator_Current(iterator);
-            close(connection->socketfd);
-        }
+        connection = (Connection_t*)ListIterator_Current(iterator);
+        pthread_mutex_lock(&connection->mutex);
+        connection->closed = TRUE;
+        pthread_cond_broadcast(&connection->cond);
+        pthread_mutex_unlock(&connection->mutex);
+    }
 
-        pthread_cond_wait(&connectionCondVar, &connectionsMutex);
+    pthread_mutex_lock(&runQueueMutex);
+    while (nrofWorkers > 0)
+    {
+        pthread_cond_wait(&workersExitedCondVar, &runQueueMutex);
+    }
+    pthread_mutex_unlock(&runQueueMutex);
+
+    while (ListGet(connectionsList, 0, (void **)&connection))
+    {
+        RemoveConnection(netLoop, connection);
     }
-    pthread_mutex_unlock(&connectionsMutex);
 
     free(infoStreamerName);
     free(authUsername);
     free(authPassword);
     ListFree(connectionsList, NULL);
+    ListFree(runQueue, NULL);
+    ListFree(workersList, NULL);
+    while (ListGet(notifyList, 0, (void **)&connection))
+    {
+        ListRemove(notifyList, connection);
+        ObjectRefDec(connection);
+    }
+    ListFree(notifyList, NULL);
 }
 
+/*******************************************************************************
+* Connection functions (network dispatcher thread)                             *
+*******************************************************************************/
 static void RemoteInterfaceAcceptCallback(struct ev_loop *loop, ev_io *w, int revents)
 {
     int clientfd;
     struct sockaddr_storage clientAddress;
     socklen_t clientAddressSize;
 
-    clientAddressSize = sizeof(clientAddress);
-    clientfd = accept(serverSocket, (struct sockaddr *) &clientAddress, &clientAddressSize);
-    if (clientfd < 0)
+    while (TRUE)
     {
-        return;
+        clientAddressSize = sizeof(clientAddress);
+        clientfd = accept(serverSocket, (struct sockaddr *) &clientAddress, &clientAddressSize);
+        if (clientfd < 0)
+        {
+            break;
+        }
+        AddConnection(loop, clientfd, &clientAddress);
     }
-    AddConnection(clientfd, &clientAddress);
 }
 
-static void AddConnection(int socketfd, struct sockaddr_storage *clientAddress)
+static void RemoteInterfaceReject(int socketfd, char *connectionStr)
+{
+    char response[MAX_LINE_LENGTH];
+    int len;
+
+    LogModule(LOG_INFO, REMOTEINTERFACE, "Connection attempt from %s rejected as no connections structures left!\n",
+             connectionStr);
+    len = snprintf(response, sizeof(response), "%s%d %s\n", responselineStart,
+                   COMMAND_ERROR_TOO_MANY_CONNS, "Too many connect clients!");
+    send(socketfd, response, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(socketfd);
+}
+
+static void AddConnection(struct ev_loop *loop, int socketfd, struct sockaddr_storage *clientAddress)
 {
     char connectionStr[MAX_CONNECTION_STR_LENGTH];
-    FILE *fp;
-    Connection_t *connection = ObjectCreateType(Connection_t);
+    Connection_t *connection = NULL;
 
     GetConnectionString(clientAddress, connectionStr);
 
-    fp = fdopen(socketfd, "r+");
+    if (ListCount(connectionsList) < MAX_CONNECTIONS)
+    {
+        connection = ObjectCreateType(Connection_t);
+    }
+    if (connection == NULL)
+    {
+        RemoteInterfaceReject(socketfd, connectionStr);
+        return;
+    }
 
-    if (connection)
+    connection->fp = fopencookie(connection, "r+", ConnectionIOFunctions);
+    connection->pendingLines = ListCreate();
+    pthread_mutex_init(&connection->mutex, NULL);
+    pthread_cond_init(&connection->cond, NULL);
+    if ((connection->fp == NULL) || (connection->pendingLines == NULL))
     {
-        connection->connected = TRUE;
-        connection->socketfd = socketfd;
-        connection->fp = fp;
-        connection->clientAddress = *clientAddress;
-        LogModule(LOG_INFO, REMOTEINTERFACE, "Connection attempt from %s accepted!\n",
-                 connectionStr);
+        ObjectRefDec(connection);
+        RemoteInterfaceReject(socketfd, connectionStr);
+        return;
+    }
+
+    fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL) | O_NONBLOCK);
+    connection->connected = TRUE;
+    connection->socketfd = socketfd;
+    connection->clientAddress = *clientAddress;
+    strcpy(connection->connectionStr, connectionStr);
 
-        pthread_mutex_lock(&connectionsMutex);
-        ListAdd(connectionsList, connection);
-        pthread_mutex_unlock(&connectionsMutex);
+    /* Setup context */
+    connection->context.interface = connection->connectionStr;
+    connection->context.authenticated = FALSE;
+    connection->context.remote = TRUE;
+    connection->context.infp = connection->fp;
+    connection->context.outfp = connection->fp;
+    connection->context.privateArg = connection;
+    connection->context.commands = ConnectionCommands;
+
+    LogModule(LOG_INFO, REMOTEINTERFACE, "Connection attempt from %s accepted!\n",
+             connectionStr);
+
+    ev_io_init(&connection->readWatcher, ConnectionReadCallback, socketfd, EV_READ);
+    connection->readWatcher.data = connection;
+    ev_io_init(&connection->writeWatcher, ConnectionWriteCallback, socketfd, EV_WRITE);
+    connection->writeWatcher.data = connection;
+    ev_timer_init(&connection->idleTimer, ConnectionTimeoutCallback, 0.0, CONNECTION_TIMEOUT);
+    connection->idleTimer.data = connection;
 
-        pthread_create(&connection->thread, NULL, (void*)HandleConnection, (void*)connection);
-        LogRegisterThread(connection->thread, connectionStr);
+    pthread_mutex_lock(&connectionsMutex);
+    ListAdd(connectionsList, connection);
+    pthread_mutex_unlock(&connectionsMutex);
+
+    ev_io_start(loop, &connection->readWatcher);
+    ev_timer_again(loop, &connection->idleTimer);
+
+    PrintResponse(connection->fp, COMMAND_OK, "Ready");
+}
+
+static void RemoveConnection(struct ev_loop *loop, Connection_t *connection)
+{
+    LogModule(LOG_INFO, REMOTEINTERFACE, "%s: Connection closed!\n", connection->connectionStr);
+
+    ev_io_stop(loop, &connection->readWatcher);
+    ev_io_stop(loop, &connection->writeWatcher);
+    ev_timer_stop(loop, &connection->idleTimer);
+
+    pthread_mutex_lock(&connectionsMutex);
+    ListRemove(connectionsList, connection);
+    pthread_mutex_unlock(&connectionsMutex);
+
+    /* Nothing more can be written to the connection. */
+    pthread_mutex_lock(&connection->mutex);
+    connection->closed = TRUE;
+    pthread_mutex_unlock(&connection->mutex);
+
+    connection->removed = TRUE;
+    close(connection->socketfd);
+    ObjectRefDec(connection);
+}
+
+static void ConnectionDestructor(void *ptr)
+{
+    Connection_t *connection = ptr;
+
+    if (connection->fp)
+    {
+        fclose(connection->fp);
+    }
+    if (connection->pendingLines)
+    {
+        ListFree(connection->pendingLines, free);
+    }
+    if (connection->readLine)
+    {
+        free(connection->readLine);
+    }
+    if (connection->outBuffer)
+    {
+        free(connection->outBuffer);
+    }
+    pthread_mutex_destroy(&connection->mutex);
+    pthread_cond_destroy(&connection->cond);
+}
+
+/* The client has gone away, any output waiting is discarded and a command
+ * blocked writing to the connection is woken. */
+static void ConnectionClosed(struct ev_loop *loop, Connection_t *connection)
+{
+    ev_io_stop(loop, &connection->readWatcher);
+    ev_io_stop(loop, &connection->writeWatcher);
+    ev_timer_stop(loop, &connection->idleTimer);
+
+    pthread_mutex_lock(&connection->mutex);
+    connection->closed = TRUE;
+    connection->connected = FALSE;
+    connection->outLength = 0;
+    pthread_cond_broadcast(&connection->cond);
+    pthread_mutex_unlock(&connection->mutex);
+
+    if (ConnectionIsFinished(connection))
+    {
+        RemoveConnection(loop, connection);
+    }
+}
+
+/* The client has shutdown its side of the connection (ie echo cmd | nc), the
+ * lines already received are still executed and their output sent before the
+ * connection is closed. */
+static void ConnectionEndOfInput(struct ev_loop *loop, Connection_t *connection)
+{
+    bool queue = FALSE;
+
+    ev_io_stop(loop, &connection->readWatcher);
+
+    pthread_mutex_lock(&connection->mutex);
+    /* Execute a last line without a newline in the same way fgets would */
+    if (connection->inLength > 0)
+    {
+        ConnectionQueueLine(connection, connection->inBuffer, connection->inLength);
+        connection->inLength = 0;
+    }
+    connection->eof = TRUE;
+    if (!connection->queued)
+    {
+        if (ListCount(connection->pendingLines) > 0)
+        {
+            connection->queued = TRUE;
+            queue = TRUE;
+        }
+        else
+        {
+            connection->connected = FALSE;
+        }
+    }
+    pthread_cond_broadcast(&connection->cond);
+    pthread_mutex_unlock(&connection->mutex);
+
+    if (queue)
+    {
+        RunQueueAdd(connection);
+    }
+    else if (ConnectionIsFinished(connection))
+    {
+        RemoveConnection(loop, connection);
+    }
+}
+
+/* A connection can be removed once it is no longer connected, no commands are
+ * executing for it and all its output has been sent. */
+static bool ConnectionIsFinished(Connection_t *connection)
+{
+    bool result;
+
+    pthread_mutex_lock(&connection->mutex);
+    result = !connection->connected && !connection->queued && (connection->outLength == 0);
+    pthread_mutex_unlock(&connection->mutex);
+    return result;
+}
+
+static void ConnectionReadCallback(struct ev_loop *loop, ev_io *w, int revents)
+{
+    Connection_t *connection = w->data;
+    ssize_t len;
+    char *start;
+    char *nl;
+    bool queue = FALSE;
+
+    len = recv(connection->socketfd, connection->inBuffer + connection->inLength,
+               MAX_LINE_LENGTH - 1 - connection->inLength, 0);
+    if (len == 0)
+    {
+        ConnectionEndOfInput(loop, connection);
+        return;
+    }
+    if ((len < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+    {
+        ConnectionClosed(loop, connection);
+        return;
+    }
+    if (len < 0)
+    {
+        return;
+    }
+
+    ev_timer_again(loop, &connection->idleTimer);
+    connection->inLength += len;
+    start = connection->inBuffer;
+
+    pthread_mutex_lock(&connection->mutex);
+    while ((nl = memchr(start, '\n', connection->inLength - (start - connection->inBuffer))) != NULL)
+    {
+        ConnectionQueueLine(connection, start, nl - start);
+        start = nl + 1;
+    }
+    connection->inLength -= start - connection->inBuffer;
+    /* Line too long, execute what we have in the same way fgets would */
+    if (connection->inLength == MAX_LINE_LENGTH - 1)
+    {
+        ConnectionQueueLine(connection, start, connection->inLength);
+        connection->inLength = 0;
+    }
+    memmove(connection->inBuffer, start, connection->inLength);
+
+    if (ListCount(connection->pendingLines) >= MAX_PENDING_LINES)
+    {
+        connection->readPaused = TRUE;
+    }
+    if (!connection->queued && (ListCount(connection->pendingLines) > 0))
+    {
+        connection->queued = TRUE;
+        queue = TRUE;
+    }
+    pthread_mutex_unlock(&connection->mutex);
+
+    if (connection->readPaused)
+    {
+        ev_io_stop(loop, &connection->readWatcher);
+    }
+    if (queue)
+    {
+        RunQueueAdd(connection);
+    }
+}
+
+static void ConnectionWriteCallback(struct ev_loop *loop, ev_io *w, int revents)
+{
+    Connection_t *connection = w->data;
+    ssize_t len = 0;
+    bool failed;
+    bool sent = FALSE;
+
+    pthread_mutex_lock(&connection->mutex);
+    while (connection->outLength > 0)
+    {
+        len = send(connection->socketfd, connection->outBuffer, connection->outLength, MSG_NOSIGNAL);
+        if (len <= 0)
+        {
+            break;
+        }
+        sent = TRUE;
+        connection->outLength -= len;
+        memmove(connection->outBuffer, connection->outBuffer + len, connection->outLength);
+    }
+    failed = (len < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR);
+    pthread_cond_broadcast(&connection->cond);
+    pthread_mutex_unlock(&connection->mutex);
+
+    /* The client is still reading its output */
+    if (sent)
+    {
+        ev_timer_again(loop, &connection->idleTimer);
+    }
+    if (failed)
+    {
+        ConnectionClosed(loop, connection);
+    }
+    else if (connection->outLength == 0)
+    {
+        ev_io_stop(loop, &connection->writeWatcher);
+        if (ConnectionIsFinished(connection))
+        {
+            RemoveConnection(loop, connection);
+        }
+    }
+}
+
+static void ConnectionTimeoutCallback(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    Connection_t *connection = w->data;
+    bool busy;
+
+    /* Don't timeout while a command is running, ie epgdata, a command blocked
+     * on a client that isn't reading has its own timeout. */
+    pthread_mutex_lock(&connection->mutex);
+    busy = connection->queued;
+    pthread_mutex_unlock(&connection->mutex);
+
+    if (busy)
+    {
+        ev_timer_again(loop, &connection->idleTimer);
     }
     else
     {
-        LogModule(LOG_INFO, REMOTEINTERFACE, "Connection attempt from %s rejected as no connections structures left!\n",
-                 connectionStr);
+        LogModule(LOG_DEBUG, REMOTEINTERFACE, "%s: Connection timed out\n", connection->connectionStr);
+        ConnectionClosed(loop, connection);
+    }
+}
 
-        PrintResponse(fp, COMMAND_ERROR_TOO_MANY_CONNS, "Too many connect clients!");
-        fclose(fp);
+/* Woken by other threads when a connection has output to send, has finished
+ * executing commands or has read some of its pending lines. */
+static void ConnectionsAsyncCallback(struct ev_loop *loop, ev_async *w, int revents)
+{
+    Connection_t *connection;
+    bool hasOutput;
+    bool resumeRead;
+
+    while (TRUE)
+    {
+        pthread_mutex_lock(&notifyMutex);
+        if (ListGet(notifyList, 0, (void **)&connection))
+        {
+            ListRemove(notifyList, connection);
+            connection->notified = FALSE;
+        }
+        else
+        {
+            connection = NULL;
+        }
+        pthread_mutex_unlock(&notifyMutex);
+        if (connection == NULL)
+        {
+            break;
+        }
+        if (connection->removed)
+        {
+            ObjectRefDec(connection);
+            continue;
+        }
+
+        pthread_mutex_lock(&connection->mutex);
+        hasOutput = (connection->outLength > 0) && !connection->closed;
+        resumeRead = connection->readPaused && connection->connected && !connection->eof &&
+                     (ListCount(connection->pendingLines) < MAX_PENDING_LINES);
+        pthread_mutex_unlock(&connection->mutex);
+
+        if (hasOutput && !ev_is_active(&connection->writeWatcher))
+        {
+            ev_io_start(loop, &connection->writeWatcher);
+        }
+        if (!connection->connected)
+        {
+            /* Logged out, stop accepting new commands */
+            ev_io_stop(loop, &connection->readWatcher);
+        }
+        else if (resumeRead)
+        {
+            connection->readPaused = FALSE;
+            ev_io_start(loop, &connection->readWatcher);
+        }
+        if (ConnectionIsFinished(connection))
+        {
+            RemoveConnection(loop, connection);
+        }
+        ObjectRefDec(connection);
     }
 }
 
-static void RemoveConnection(Connection_t *connection)
+/* Ask the network dispatcher to check the state of the connection, the
+ * notify list holds a reference so the connection can't be freed while on it. */
+static void ConnectionNotify(Connection_t *connection)
 {
-    pthread_mutex_lock(&connectionsMutex);
-    ListRemove(connectionsList, connection);
-    ObjectRefDec(connection);
-    if ((ListCount(connectionsList) == 0) && remoteIntfExit)
+    pthread_mutex_lock(&notifyMutex);
+    if (!connection->notified)
     {
-        pthread_cond_broadcast(&connectionCondVar);
+        connection->notified = TRUE;
+        ObjectRefInc(connection);
+        ListAdd(notifyList, connection);
     }
-    pthread_mutex_unlock(&connectionsMutex);
+    pthread_mutex_unlock(&notifyMutex);
+    ev_async_send(DispatchersGetNetwork(), &connectionsAsync);
 }
+
+/* Called with the connection mutex held. */
+static void ConnectionQueueLine(Connection_t *connection, char *line, int length)
+{
+    char *copy = malloc(length + 2);
+
+    if (copy)
+    {
+        memcpy(copy, line, length);
+        copy[length] = '\n';
+        copy[length + 1] = 0;
+        ListAdd(connection->pendingLines, copy);
+        pthread_cond_broadcast(&connection->cond);
+    }
+}
+
 /******************************************************************************
-* Connection functions                                                        *
+* Connection stream functions (worker threads)                                *
 ******************************************************************************/
-static void HandleConnection(Connection_t *connection)
+/* Used by CommandGets(), returns the next line received from the client. */
+static ssize_t ConnectionRead(void *cookie, char *buffer, size_t size)
 {
-    struct pollfd pfd[1];
-    char connectionStr[MAX_CONNECTION_STR_LENGTH];
-    char line[MAX_LINE_LENGTH];
-    int socketfd;
-    FILE *fp;
-    CommandContext_t context;
+    Connection_t *connection = cookie;
+    ssize_t result = 0;
 
-    /* Setup context */
-    GetConnectionString(&connection->clientAddress, connectionStr);
-    context.interface = connectionStr;
-    context.authenticated = FALSE;
-    context.remote = TRUE;
-    context.infp = connection->fp;
-    context.outfp = connection->fp;
-    context.privateArg = connection;
-    context.commands = ConnectionCommands;
+    pthread_mutex_lock(&connection->mutex);
+    while (connection->readLine == NULL)
+    {
+        if (ListGet(connection->pendingLines, 0, (void **)&connection->readLine))
+        {
+            ListRemove(connection->pendingLines, connection->readLine);
+            connection->readOffset = 0;
+        }
+        else if (connection->closed || connection->eof || remoteIntfExit)
+        {
+            break;
+        }
+        else
+        {
+            pthread_cond_wait(&connection->cond, &connection->mutex);
+        }
+    }
+    if (connection->readLine)
+    {
+        result = strlen(connection->readLine + connection->readOffset);
+        if (result > size)
+        {
+            result = size;
+        }
+        memcpy(buffer, connection->readLine + connection->readOffset, result);
+        connection->readOffset += result;
+        if (connection->readLine[connection->readOffset] == 0)
+        {
+            free(connection->readLine);
+            connection->readLine = NULL;
+        }
+    }
+    pthread_mutex_unlock(&connection->mutex);
+
+    /* Reading may have been paused waiting for lines to be consumed. */
+    ConnectionNotify(connection);
+    return result;
+}
+
+/* Used for all output to the client, the output is buffered and sent by the
+ * network dispatcher. */
+static ssize_t ConnectionWrite(void *cookie, const char *buffer, size_t size)
+{
+    Connection_t *connection = cookie;
+    ssize_t result = size;
+    bool stalled = FALSE;
+    struct timespec deadline;
+    char *newBuffer;
+    int newSize;
+    int lastLength;
+
+    pthread_mutex_lock(&connection->mutex);
+    /* Block the command if the client isn't reading its output fast enough,
+     * closing the connection if the client stops reading altogether. */
+    if ((connection->outLength >= MAX_OUTPUT_BUFFERED) && !connection->closed && !remoteIntfExit)
+    {
+        RunQueueWorkerBlocked();
+        lastLength = connection->outLength + 1;
+        while ((connection->outLength >= MAX_OUTPUT_BUFFERED) && !connection->closed && !remoteIntfExit)
+        {
+            if (connection->outLength < lastLength)
+            {
+                lastLength = connection->outLength;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += WRITE_TIMEOUT;
+            }
+            if ((pthread_cond_timedwait(&connection->cond, &connection->mutex, &deadline) == ETIMEDOUT) &&
+                (connection->outLength >= lastLength))
+            {
+                LogModule(LOG_INFO, REMOTEINTERFACE, "%s: Client not reading output, closing connection\n",
+                          connection->connectionStr);
+                connection->closed = TRUE;
+                connection->connected = FALSE;
+                connection->outLength = 0;
+                stalled = TRUE;
+            }
+        }
+    }
+    if (connection->closed || remoteIntfExit)
+    {
+        result = -1;
+    }
+    else
+    {
+        if (connection->outLength + size > connection->outSize)
+        {
+            newSize = connection->outSize ? connection->outSize * 2 : 4096;
+            while (newSize < connection->outLength + size)
+            {
+                newSize *= 2;
+            }
+            newBuffer = realloc(connection->outBuffer, newSize);
+            if (newBuffer)
+            {
+                connection->outBuffer = newBuffer;
+                connection->outSize = newSize;
+            }
+            else
+            {
+                result = -1;
+            }
+        }
+        if (result > 0)
+        {
+            memcpy(connection->outBuffer + connection->outLength, buffer, size);
+            connection->outLength += size;
+        }
+    }
+    pthread_mutex_unlock(&connection->mutex);
+
+    if ((result > 0) || stalled)
+    {
+        ConnectionNotify(connection);
+    }
+    return result;
+}
 
-    socketfd = connection->socketfd;
-    fp = connection->fp;
+/******************************************************************************
+* Worker functions                                                            *
+******************************************************************************/
+static void RunQueueAdd(Connection_t *connection)
+{
+    pthread_mutex_lock(&runQueueMutex);
+    ListAdd(runQueue, connection);
+    RunQueueStartWorkers();
+    pthread_cond_signal(&runQueueCondVar);
+    pthread_mutex_unlock(&runQueueMutex);
+}
 
-    pfd[0].fd = socketfd;
-    pfd[0].events = POLLIN;
+/* Called with runQueueMutex held. Starts workers while there are more
+ * connections waiting than idle workers. Workers executing slow commands or
+ * waiting on a client don't count towards MAX_WORKERS, so one client can't
+ * stop the others being served. */
+static void RunQueueStartWorkers(void)
+{
+    ListIterator_t iterator;
+    RemoteWorker_t *worker;
+    pthread_attr_t attr;
+    pthread_t thread;
+    ev_tstamp now;
 
-    PrintResponse(fp,COMMAND_OK, "Ready");
+    if (remoteIntfExit || (ListCount(runQueue) <= idleWorkers))
+    {
+        return;
+    }
 
-    while (!remoteIntfExit && connection->connected)
+    if (countedWorkers >= MAX_WORKERS)
     {
-        int r;
-        pfd[0].revents = 0;
-        r = poll(pfd, 1, 30000);
-        if (pfd[0].revents & POLLIN)
+        now = ev_time();
+        for (ListIterator_Init(iterator, workersList);
+             ListIterator_MoreEntries(iterator);
+             ListIterator_Next(iterator))
         {
-            char *nl;
-            // Read in the command
-            if (fgets(line, MAX_LINE_LENGTH, fp))
+            worker = ListIterator_Current(iterator);
+            if (worker->counted && (worker->started > 0) && (now - worker->started >= SLOW_COMMAND_TIME))
             {
-                nl = strchr(line, '\n');
-                if (nl)
-                {
-                    *nl = 0;
-                }
-                nl = strchr(line, '\r');
-                if (nl)
-                {
-                    *nl = 0;
-                }
-                LogModule(LOG_DEBUG, REMOTEINTERFACE, "%s: Received Line: \"%s\"\n", context.interface, line);
-                CommandExecute(&context, line);
-                PrintResponse(fp,context.errorNumber, context.errorMessage);
+                worker->counted = FALSE;
+                countedWorkers --;
             }
-            else
+        }
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while ((ListCount(runQueue) > idleWorkers) && (countedWorkers < MAX_WORKERS))
+    {
+        worker = calloc(1, sizeof(RemoteWorker_t));
+        if (worker == NULL)
+        {
+            break;
+        }
+        worker->counted = TRUE;
+        if (pthread_create(&thread, &attr, RemoteInterfaceWorker, worker))
+        {
+            LogModule(LOG_ERROR, REMOTEINTERFACE, "Failed to create worker thread\n");
+            free(worker);
+            break;
+        }
+        ListAdd(workersList, worker);
+        nrofWorkers ++;
+        idleWorkers ++;
+        countedWorkers ++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* The command being executed by this thread is waiting for the client, so stop
+ * counting the worker towards MAX_WORKERS until the command finishes. */
+static void RunQueueWorkerBlocked(void)
+{
+    if (currentWorker == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&runQueueMutex);
+    if (currentWorker->counted)
+    {
+        currentWorker->counted = FALSE;
+        countedWorkers --;
+        RunQueueStartWorkers();
+    }
+    pthread_mutex_unlock(&runQueueMutex);
+}
+
+/* Start more workers if connections are waiting behind slow commands. */
+static void RunQueueTimerCallback(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    pthread_mutex_lock(&runQueueMutex);
+    RunQueueStartWorkers();
+    pthread_mutex_unlock(&runQueueMutex);
+}
+
+static void *RemoteInterfaceWorker(void *arg)
+{
+    RemoteWorker_t *worker = arg;
+    Connection_t *connection;
+
+    LogRegisterThread(pthread_self(), "RemoteWorker");
+    currentWorker = worker;
+    pthread_mutex_lock(&runQueueMutex);
+    while (!remoteIntfExit)
+    {
+        if (ListGet(runQueue, 0, (void **)&connection))
+        {
+            ListRemove(runQueue, connection);
+            idleWorkers --;
+            worker->started = ev_time();
+            pthread_mutex_unlock(&runQueueMutex);
+            HandleConnection(connection);
+            pthread_mutex_lock(&runQueueMutex);
+            worker->started = 0;
+            idleWorkers ++;
+            if (!worker->counted)
             {
-                connection->connected = FALSE;
+                /* Extra worker started while this one was busy, exit if the
+                 * pool is already full. */
+                if (countedWorkers >= MAX_WORKERS)
+                {
+                    break;
+                }
+                worker->counted = TRUE;
+                countedWorkers ++;
             }
         }
         else
+        {
+            pthread_cond_wait(&runQueueCondVar, &runQueueMutex);
+        }
+    }
+    idleWorkers --;
+    if (worker->counted)
+    {
+        countedWorkers --;
+    }
+    nrofWorkers --;
+    ListRemove(workersList, worker);
+    pthread_cond_broadcast(&workersExitedCondVar);
+    pthread_mutex_unlock(&runQueueMutex);
+    free(worker);
+    LogUnregisterThread(pthread_self());
+    return NULL;
+}
+
+/* Execute the next line received on the connection, commands for a connection
+ * are executed one at a time and in order. */
+static void HandleConnection(Connection_t *connection)
+{
+    char *line = NULL;
+    char *nl;
+    bool requeue = FALSE;
+
+    pthread_mutex_lock(&connection->mutex);
+    if (connection->connected && ListGet(connection->pendingLines, 0, (void **)&line))
+    {
+        ListRemove(connection->pendingLines, line);
+    }
+    pthread_mutex_unlock(&connection->mutex);
+
+    if (line)
+    {
+        nl = strchr(line, '\n');
+        if (nl)
+        {
+            *nl = 0;
+        }
+        nl = strchr(line, '\r');
+        if (nl)
+        {
+            *nl = 0;
+        }
+        LogModule(LOG_DEBUG, REMOTEINTERFACE, "%s: Received Line: \"%s\"\n", connection->context.interface, line);
+        CommandExecute(&connection->context, line);
+        PrintResponse(connection->fp, connection->context.errorNumber, connection->context.errorMessage);
+        free(line);
+    }
+
+    /* Hold a reference as the connection may be removed by the network
+     * dispatcher as soon as it is no longer queued. */
+    ObjectRefInc(connection);
+
+    pthread_mutex_lock(&connection->mutex);
+    if (connection->connected && !connection->closed && (ListCount(connection->pendingLines) > 0))
+    {
+        requeue = TRUE;
+    }
+    else
+    {
+        connection->queued = FALSE;
+        /* All the lines sent before the client shutdown have been executed */
+        if (connection->eof)
         {
             connection->connected = FALSE;
         }
     }
-    LogModule(LOG_INFO, REMOTEINTERFACE, "%s: Connection closed!\n", context.interface);
-    /* Close the socket and free our resources */
-    fclose(fp);
-    connection->connected = FALSE;
+    pthread_mutex_unlock(&connection->mutex);
 
-    LogModule(LOG_DEBUG,REMOTEINTERFACE,"Connection thread exiting.\n");
-    LogUnregisterThread(pthread_self());    
-    pthread_detach(connection->thread);
-    RemoveConnection(connection);
+    if (requeue)
+    {
+        RunQueueAdd(connection);
+    }
+    /* Let the network dispatcher resume reading or remove the connection */
+    ConnectionNotify(connection);
+    ObjectRefDec(connection);
 }
 
-static void PrintResponse(FILE *fp, uint16_t errno, char * msg)
+static void PrintResponse(FILE *fp, uint16_t errorNumber, char * msg)
 {
-    fprintf(fp, "%s%d %s\n", responselineStart, errno, msg);
+    fprintf(fp, "%s%d %s\n", responselineStart, errorNumber, msg);
     fflush(fp);
 }
 
@@ -434,20 +1213,39 @@ static void RemoteInterfaceAuthenticate(int argc, char **argv)
 
 static void RemoteInterfaceWho(int argc, char **argv)
 {
-    char connectionStr[MAX_CONNECTION_STR_LENGTH];
     ListIterator_t iterator;
-
+    char (*connectionStrs)[MAX_CONNECTION_STR_LENGTH];
+    int count = 0;
+    int i;
+
+    /* Take a copy rather than printing with the mutex held, as printing can
+     * block until the network dispatcher has sent some output and it needs the
+     * mutex to add and remove connections. */
+    connectionStrs = malloc(MAX_CONNECTIONS * MAX_CONNECTION_STR_LENGTH);
+    if (connectionStrs == NULL)
+    {
+        CommandError(COMMAND_ERROR_GENERIC, "Out of memory!");
+        return;
+    }
+    pthread_mutex_lock(&connectionsMutex);
     for (ListIterator_Init(iterator, connectionsList);
-         ListIterator_MoreEntries(iterator);
+         ListIterator_MoreEntries(iterator) && (count < MAX_CONNECTIONS);
          ListIterator_Next(iterator))
     {
         Connection_t *connection = (Connection_t*)ListIterator_Current(iterator);
         if (connection->connected)
         {
-            GetConnectionString(&connection->clientAddress, connectionStr);
-            CommandPrintf("%s\n", connectionStr);
+            strcpy(connectionStrs[count], connection->connectionStr);
+            count ++;
         }
     }
+    pthread_mutex_unlock(&connectionsMutex);
+
+    for (i = 0; i < count; i ++)
+    {
+        CommandPrintf("%s\n", connectionStrs[i]);
+    }
+    free(connectionStrs);
 }
 static void RemoteInterfaceLogout(int argc, char **argv)
 {
@@ -109,6 +109,8 @@ static int ServiceFilterEventToString(yaml_document_t *document, Event_t event,
 static int ServiceFilterPropertyServiceGet(void *userArg, PropertyValue_t *value);
 static int ServiceFilterPropertyAVSOnlyGet(void *userArg, PropertyValue_t *value);
 static int ServiceFilterPropertyAVSOnlySet(void *userArg, PropertyValue_t *value);
+static int ServiceFilterPropertyAffinityGet(void *userArg, PropertyValue_t *value);
+static int ServiceFilterPropertyAffinitySet(void *userArg, PropertyValue_t *value);
 /*******************************************************************************
 * Global variables                                                             *
 *******************************************************************************/
@@ -164,6 +166,9 @@ ServiceFilter_t ServiceFilterCreate(TSReader_t *reader, char* name)
         PropertiesAddProperty(result->propertyPath, "avsonly", "Whether only the first Audio/Video/Subtitle streams should be filtered.", 
             PropertyType_Boolean, result, ServiceFilterPropertyAVSOnlyGet, ServiceFilterPropertyAVSOnlySet);
 
+        PropertiesAddProperty(result->propertyPath, "affinity", "Worker thread packets for this filter are processed on (-1 automatic, -2 input thread).", 
+            PropertyType_Int, result, ServiceFilterPropertyAffinityGet, ServiceFilterPropertyAffinitySet);
+
         cachePIDSUpdatedEvent = EventsFindEvent("Cache.PIDsUpdated");
         EventsRegisterEventListener(cachePIDSUpdatedEvent, ServiceFilterPIDSUpdatedListener, result);
         ListAdd(ServiceFilterList, result);
@@ -244,6 +249,7 @@ ServiceFilter_t ServiceFilterFindFilter(TSReader_t *reader, const char *name)
 
 void ServiceFilterServiceSet(ServiceFilter_t filter, Service_t *service)
 {
+    TSReaderLock(filter->tsgroup->tsReader);
     if (filter->service)
     {
         ServiceRefDec(filter->service);
@@ -266,6 +272,7 @@ void ServiceFilterServiceSet(ServiceFilter_t filter, Service_t *service)
     {
         filter->multiplex = NULL;
     }
+    TSReaderUnLock(filter->tsgroup->tsReader);
     EventsFireEventListeners(serviceChangedEvent, filter); 
 }
 
@@ -303,10 +310,15 @@ bool ServiceFilterAVSOnlyGet(ServiceFilter_t filter)
 
 void ServiceFilterDeliveryMethodSet(ServiceFilter_t filter, DeliveryMethodInstance_t *instance)
 {
-    DeliveryMethodInstance_t *prevInstance = filter->dmInstance;
+    DeliveryMethodInstance_t *prevInstance;
+
+    /* Make sure the instance isn't being used to output packets while it is changed. */
+    TSReaderLock(filter->tsgroup->tsReader);
+    prevInstance = filter->dmInstance;
     DeliveryMethodReserveHeaderSpace(instance, HEADER_PACKETS);
     filter->dmInstance = instance;
     filter->setHeader = TRUE;
+    TSReaderUnLock(filter->tsgroup->tsReader);
 
     if (prevInstance)
     {
@@ -641,6 +653,21 @@ static int ServiceFilterPropertyAVSOnlySet(void *userArg, PropertyValue_t *value
     return 0;
 }
 
+static int ServiceFilterPropertyAffinityGet(void *userArg, PropertyValue_t *value)
+{
+    ServiceFilter_t state = userArg;
+    value->type = PropertyType_Int;
+    value->u.integer = TSFilterGroupAffinityGet(state->tsgroup);
+    return 0;
+}
+
+static int ServiceFilterPropertyAffinitySet(void *userArg, PropertyValue_t *value)
+{
+    ServiceFilter_t filter = userArg;
+    TSFilterGroupAffinitySet(filter->tsgroup, value->u.integer);
+    return 0;
+}
+
 static int ServiceFilterEventToString(yaml_document_t *document, Event_t event, void *payload)
 {
     ServiceFilter_t filter = payload;
@@ -35,17 +35,6 @@ Manage services and PIDs.
 * Defines                                                                      *
 *******************************************************************************/
 
-#define SERVICE_FIELDS SERVICES_TABLE "." SERVICE_MULTIPLEXUID "," \
-                       SERVICES_TABLE "." SERVICE_ID "," \
-                       SERVICES_TABLE "." SERVICE_SOURCE "," \
-                       SERVICES_TABLE "." SERVICE_CA "," \
-                       SERVICES_TABLE "." SERVICE_TYPE "," \
-                       SERVICES_TABLE "." SERVICE_NAME "," \
-                       SERVICES_TABLE "." SERVICE_PMTPID ","\
-                       SERVICES_TABLE "." SERVICE_PROVIDER "," \
-                       SERVICES_TABLE "." SERVICE_DEFAUTHORITY "," \
-                       MULTIPLEXES_TABLE "." MULTIPLEX_NETID ","  \
-                       MULTIPLEXES_TABLE "." MULTIPLEX_TSID " "
 
 /*******************************************************************************
 * Prototypes                                                                   *
@@ -99,10 +88,11 @@ int ServiceDelete(Service_t  *service)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("DELETE FROM " SERVICES_TABLE " "
-                        "WHERE " SERVICE_MULTIPLEXUID "=%d AND " SERVICE_ID "=%d;",
-                        service->multiplexUID, service->id);
+    STATEMENT_PREPARE_CACHED("DELETE FROM " SERVICES_TABLE " "
+                             "WHERE " SERVICE_MULTIPLEXUID "=? AND " SERVICE_ID "=?;");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, service->multiplexUID);
+    STATEMENT_BIND_INT(2, service->id);
 
     STATEMENT_STEP();
 
@@ -116,10 +106,10 @@ int ServiceDeleteAll(Multiplex_t *mux)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("DELETE FROM " SERVICES_TABLE " "
-                        "WHERE " SERVICE_MULTIPLEXUID "=%d;",
-                        mux->uid);
+    STATEMENT_PREPARE_CACHED("DELETE FROM " SERVICES_TABLE " "
+                             "WHERE " SERVICE_MULTIPLEXUID "=?;");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, mux->uid);
 
     STATEMENT_STEP();
 
@@ -135,17 +125,23 @@ int ServiceAdd(int uid, char *name, int id, int source)
 
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("INSERT INTO "SERVICES_TABLE "("
-                        SERVICE_MULTIPLEXUID ","
-                        SERVICE_ID ","
-                        SERVICE_SOURCE ","
-                        SERVICE_CA ","
-                        SERVICE_TYPE ","
-                        SERVICE_PMTPID ","
-                        SERVICE_NAME ")"
-                        "VALUES (%d,%d,%d,%d,%d,%d,'%q');",
-                        uid, id, source, FALSE, ServiceType_Unknown, 8191, name);
+    STATEMENT_PREPARE_CACHED("INSERT INTO "SERVICES_TABLE "("
+                             SERVICE_MULTIPLEXUID ","
+                             SERVICE_ID ","
+                             SERVICE_SOURCE ","
+                             SERVICE_CA ","
+                             SERVICE_TYPE ","
+                             SERVICE_PMTPID ","
+                             SERVICE_NAME ")"
+                             "VALUES (?,?,?,?,?,?,?);");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, uid);
+    STATEMENT_BIND_INT(2, id);
+    STATEMENT_BIND_INT(3, source);
+    STATEMENT_BIND_INT(4, FALSE);
+    STATEMENT_BIND_INT(5, ServiceType_Unknown);
+    STATEMENT_BIND_INT(6, 8191);
+    STATEMENT_BIND_TEXT(7, name);
 
     STATEMENT_STEP();
     RETURN_RC_ON_ERROR;
@@ -171,11 +167,13 @@ int ServicePMTPIDSet(Service_t  *service, int pmtpid)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("UPDATE " SERVICES_TABLE " "
-                        "SET " SERVICE_PMTPID "=%d "
-                        "WHERE " SERVICE_MULTIPLEXUID "=%d AND " SERVICE_ID "=%d;",
-                        pmtpid, service->multiplexUID,  service->id);
+    STATEMENT_PREPARE_CACHED("UPDATE " SERVICES_TABLE " "
+                             "SET " SERVICE_PMTPID "=? "
+                             "WHERE " SERVICE_MULTIPLEXUID "=? AND " SERVICE_ID "=?;");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, pmtpid);
+    STATEMENT_BIND_INT(2, service->multiplexUID);
+    STATEMENT_BIND_INT(3, service->id);
 
     STATEMENT_STEP();
     if (rc == SQLITE_DONE)
@@ -195,11 +193,13 @@ int ServiceNameSet(Service_t  *service, char *name)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("UPDATE " SERVICES_TABLE " "
-                        "SET " SERVICE_NAME "='%q' "
-                        "WHERE " SERVICE_MULTIPLEXUID "=%d AND " SERVICE_ID "=%d;",
-                        name, service->multiplexUID,  service->id);
+    STATEMENT_PREPARE_CACHED("UPDATE " SERVICES_TABLE " "
+                             "SET " SERVICE_NAME "=? "
+                             "WHERE " SERVICE_MULTIPLEXUID "=? AND " SERVICE_ID "=?;");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_TEXT(1, name);
+    STATEMENT_BIND_INT(2, service->multiplexUID);
+    STATEMENT_BIND_INT(3, service->id);
 
     STATEMENT_STEP();
     if (rc == SQLITE_DONE)
@@ -226,11 +226,13 @@ int ServiceSourceSet(Service_t  *service, int source)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("UPDATE " SERVICES_TABLE " "
-                        "SET " SERVICE_SOURCE "=%d "
-                        "WHERE " SERVICE_MULTIPLEXUID "=%d AND " SERVICE_ID "=%d;",
-                        source, service->multiplexUID,  service->id);
+    STATEMENT_PREPARE_CACHED("UPDATE " SERVICES_TABLE " "
+                             "SET " SERVICE_SOURCE "=? "
+                             "WHERE " SERVICE_MULTIPLEXUID "=? AND " SERVICE_ID "=?;");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, source);
+    STATEMENT_BIND_INT(2, service->multiplexUID);
+    STATEMENT_BIND_INT(3, service->id);
 
     STATEMENT_STEP();
     if (rc == SQLITE_DONE)
@@ -250,11 +252,13 @@ int ServiceConditionalAccessSet(Service_t  *service, bool ca)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("UPDATE " SERVICES_TABLE " "
-                        "SET " SERVICE_CA "=%d "
-                        "WHERE " SERVICE_MULTIPLEXUID "=%d AND " SERVICE_ID "=%d;",
-                        ca, service->multiplexUID,  service->id);
+    STATEMENT_PREPARE_CACHED("UPDATE " SERVICES_TABLE " "
+                             "SET " SERVICE_CA "=? "
+                             "WHERE " SERVICE_MULTIPLEXUID "=? AND " SERVICE_ID "=?;");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, ca);
+    STATEMENT_BIND_INT(2, service->multiplexUID);
+    STATEMENT_BIND_INT(3, service->id);
 
     STATEMENT_STEP();
     if (rc == SQLITE_DONE)
@@ -274,11 +278,13 @@ int ServiceTypeSet(Service_t  *service, ServiceType type)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("UPDATE " SERVICES_TABLE " "
-                        "SET " SERVICE_TYPE "=%d "
-                        "WHERE " SERVICE_MULTIPLEXUID "=%d AND " SERVICE_ID "=%d;",
-                        type, service->multiplexUID,  service->id);
+    STATEMENT_PREPARE_CACHED("UPDATE " SERVICES_TABLE " "
+                             "SET " SERVICE_TYPE "=? "
+                             "WHERE " SERVICE_MULTIPLEXUID "=? AND " SERVICE_ID "=?;");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_INT(1, type);
+    STATEMENT_BIND_INT(2, service->multiplexUID);
+    STATEMENT_BIND_INT(3, service->id);
 
     STATEMENT_STEP();
     if (rc == SQLITE_DONE)
@@ -298,11 +304,13 @@ int ServiceProviderSet(Service_t  *service, char *provider)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("UPDATE " SERVICES_TABLE " "
-                        "SET " SERVICE_PROVIDER "='%q' "
-                        "WHERE " SERVICE_MULTIPLEXUID "=%d AND " SERVICE_ID "=%d;",
-                        provider, service->multiplexUID,  service->id);
+    STATEMENT_PREPARE_CACHED("UPDATE " SERVICES_TABLE " "
+                             "SET " SERVICE_PROVIDER "=? "
+                             "WHERE " SERVICE_MULTIPLEXUID "=? AND " SERVICE_ID "=?;");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_TEXT(1, provider);
+    STATEMENT_BIND_INT(2, service->multiplexUID);
+    STATEMENT_BIND_INT(3, service->id);
 
     STATEMENT_STEP();
     if (rc == SQLITE_DONE)
@@ -329,11 +337,13 @@ int ServiceDefaultAuthoritySet(Service_t  *service, char *defaultAuthority)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("UPDATE " SERVICES_TABLE " "
-                        "SET " SERVICE_DEFAUTHORITY "='%q' "
-                        "WHERE " SERVICE_MULTIPLEXUID "=%d AND " SERVICE_ID "=%d;",
-                        defaultAuthority, service->multiplexUID,  service->id);
+    STATEMENT_PREPARE_CACHED("UPDATE " SERVICES_TABLE " "
+                             "SET " SERVICE_DEFAUTHORITY "=? "
+                             "WHERE " SERVICE_MULTIPLEXUID "=? AND " SERVICE_ID "=?;");
     RETURN_RC_ON_ERROR;
+    STATEMENT_BIND_TEXT(1, defaultAuthority);
+    STATEMENT_BIND_INT(2, service->multiplexUID);
+    STATEMENT_BIND_INT(3, service->id);
 
     STATEMENT_STEP();
     if (rc == SQLITE_DONE)
@@ -371,11 +381,11 @@ Service_t *ServiceFindName(char *name)
     STATEMENT_INIT;
     Service_t *result;
 
-    STATEMENT_PREPAREVA("SELECT " SERVICE_FIELDS
-                        "FROM " SERVICES_TABLE "," MULTIPLEXES_TABLE " WHERE " SERVICES_TABLE "." SERVICE_NAME "='%q' AND " 
-                        MULTIPLEXES_TABLE "." MULTIPLEX_UID "=" SERVICES_TABLE "." SERVICE_MULTIPLEXUID ";",
-                        name);
+    STATEMENT_PREPARE_CACHED("SELECT " SERVICE_FIELDS
+                             "FROM " SERVICES_TABLE "," MULTIPLEXES_TABLE " WHERE " SERVICES_TABLE "." SERVICE_NAME "=? AND "
+                             MULTIPLEXES_TABLE "." MULTIPLEX_UID "=" SERVICES_TABLE "." SERVICE_MULTIPLEXUID ";");
     RETURN_ON_ERROR(NULL);
+    STATEMENT_BIND_TEXT(1, name);
 
     result = ServiceGetNext((ServiceEnumerator_t) stmt);
     STATEMENT_FINALIZE();
@@ -388,12 +398,13 @@ Service_t *ServiceFindId(Multiplex_t *multiplex, int id)
     STATEMENT_INIT;
     Service_t *result;
 
-    STATEMENT_PREPAREVA("SELECT " SERVICE_FIELDS
-                        "FROM " SERVICES_TABLE "," MULTIPLEXES_TABLE " WHERE " SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=%d AND " 
-                        SERVICES_TABLE "." SERVICE_ID "=%d AND " 
-                        MULTIPLEXES_TABLE "." MULTIPLEX_UID "=" SERVICES_TABLE "." SERVICE_MULTIPLEXUID ";",
-                        multiplex->uid, id);
+    STATEMENT_PREPARE_CACHED("SELECT " SERVICE_FIELDS
+                             "FROM " SERVICES_TABLE "," MULTIPLEXES_TABLE " WHERE " SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=? AND "
+                             SERVICES_TABLE "." SERVICE_ID "=? AND "
+                             MULTIPLEXES_TABLE "." MULTIPLEX_UID "=" SERVICES_TABLE "." SERVICE_MULTIPLEXUID ";");
     RETURN_ON_ERROR(NULL);
+    STATEMENT_BIND_INT(1, multiplex->uid);
+    STATEMENT_BIND_INT(2, id);
 
     result = ServiceGetNext((ServiceEnumerator_t) stmt);
     STATEMENT_FINALIZE();
@@ -405,14 +416,16 @@ Service_t *ServiceFindFQID(uint16_t networkId, uint16_t tsId, uint16_t serviceId
     STATEMENT_INIT;
     Service_t *result;
 
-    STATEMENT_PREPAREVA("SELECT " SERVICE_FIELDS
-                        "FROM " SERVICES_TABLE "," MULTIPLEXES_TABLE " WHERE "
-                        MULTIPLEXES_TABLE "." MULTIPLEX_NETID "=%d AND "
-                        MULTIPLEXES_TABLE "." MULTIPLEX_TSID "=%d AND "
-                        SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=" MULTIPLEXES_TABLE "." MULTIPLEX_UID " AND "
-                        SERVICE_ID "=%d;",
-                        networkId, tsId, serviceId);
+    STATEMENT_PREPARE_CACHED("SELECT " SERVICE_FIELDS
+                             "FROM " SERVICES_TABLE "," MULTIPLEXES_TABLE " WHERE "
+                             MULTIPLEXES_TABLE "." MULTIPLEX_NETID "=? AND "
+                             MULTIPLEXES_TABLE "." MULTIPLEX_TSID "=? AND "
+                             SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=" MULTIPLEXES_TABLE "." MULTIPLEX_UID " AND "
+                             SERVICE_ID "=?;");
     RETURN_ON_ERROR(NULL);
+    STATEMENT_BIND_INT(1, networkId);
+    STATEMENT_BIND_INT(2, tsId);
+    STATEMENT_BIND_INT(3, serviceId);
 
     result = ServiceGetNext((ServiceEnumerator_t) stmt);
 
@@ -437,9 +450,9 @@ Service_t *ServiceFindFQIDStr(char *FQIdStr)
 ServiceEnumerator_t ServiceEnumeratorGet()
 {
     STATEMENT_INIT;
-    STATEMENT_PREPARE("SELECT " SERVICE_FIELDS
-                      "FROM " SERVICES_TABLE"," MULTIPLEXES_TABLE " WHERE " 
-                      SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=" MULTIPLEXES_TABLE "." MULTIPLEX_UID ";");
+    STATEMENT_PREPARE_CACHED("SELECT " SERVICE_FIELDS
+                             "FROM " SERVICES_TABLE"," MULTIPLEXES_TABLE " WHERE "
+                             SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=" MULTIPLEXES_TABLE "." MULTIPLEX_UID ";");
     RETURN_ON_ERROR(NULL);
     return stmt;
 }
@@ -458,12 +471,12 @@ ServiceEnumerator_t ServiceEnumeratorForMultiplex(Multiplex_t *multiplex)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("SELECT " SERVICE_FIELDS
-                        "FROM " SERVICES_TABLE"," MULTIPLEXES_TABLE " WHERE " 
-                        SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=" MULTIPLEXES_TABLE "." MULTIPLEX_UID " AND "
-                        SERVICES_TABLE "."SERVICE_MULTIPLEXUID"=%d;",
-                         multiplex->uid);
+    STATEMENT_PREPARE_CACHED("SELECT " SERVICE_FIELDS
+                             "FROM " SERVICES_TABLE"," MULTIPLEXES_TABLE " WHERE "
+                             SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=" MULTIPLEXES_TABLE "." MULTIPLEX_UID " AND "
+                             SERVICES_TABLE "."SERVICE_MULTIPLEXUID"=?;");
     RETURN_ON_ERROR(NULL);
+    STATEMENT_BIND_INT(1, multiplex->uid);
 
     return stmt;
 }
@@ -485,12 +498,12 @@ ServiceEnumerator_t ServiceQueryNameLike(char *query)
 {
     STATEMENT_INIT;
 
-    STATEMENT_PREPAREVA("SELECT " SERVICE_FIELDS
-                        "FROM " SERVICES_TABLE"," MULTIPLEXES_TABLE " WHERE " 
-                        SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=" MULTIPLEXES_TABLE "." MULTIPLEX_UID " AND " 
-                        SERVICES_TABLE "." SERVICE_NAME " LIKE %Q;",
-                        query);
+    STATEMENT_PREPARE_CACHED("SELECT " SERVICE_FIELDS
+                             "FROM " SERVICES_TABLE"," MULTIPLEXES_TABLE " WHERE "
+                             SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=" MULTIPLEXES_TABLE "." MULTIPLEX_UID " AND "
+                             SERVICES_TABLE "." SERVICE_NAME " LIKE ?;");
     RETURN_ON_ERROR(NULL);
+    STATEMENT_BIND_TEXT(1, query);
 
     return stmt;
 }
@@ -525,10 +538,25 @@ Service_t *ServiceGetNext(ServiceEnumerator_t enumerator)
     STATEMENT_STEP();
     if (rc == SQLITE_ROW)
     {
-        Service_t *service = NULL;
-        char *name;
+        return ServiceGetCurrent(enumerator);
+    }
+
+    if (rc != SQLITE_DONE)
+    {
+        PRINTLOG_SQLITE3ERROR();
+    }
+    return NULL;
+}
+
+Service_t *ServiceGetCurrent(ServiceEnumerator_t enumerator)
+{
+    sqlite3_stmt *stmt = (sqlite3_stmt *)enumerator;
+    Service_t *service = NULL;
+    char *name;
 
-        service = ServiceNew();
+    service = ServiceNew();
+    if (service)
+    {
         service->multiplexUID = STATEMENT_COLUMN_INT( 0);
         service->id = STATEMENT_COLUMN_INT( 1) & 0xffff;
         service->source = STATEMENT_COLUMN_INT( 2);
@@ -552,14 +580,8 @@ Service_t *ServiceGetNext(ServiceEnumerator_t enumerator)
         }
         service->networkId = STATEMENT_COLUMN_INT(9) & 0xffff;
         service->tsId =  STATEMENT_COLUMN_INT(10) & 0xffff;
-        return service;
-    }
-
-    if (rc != SQLITE_DONE)
-    {
-        PRINTLOG_SQLITE3ERROR();
     }
-    return NULL;
+    return service;
 }
 
 char *ServiceGetIDStr(Service_t *service, char *buffer)
@@ -626,9 +648,9 @@ static ServiceList_t *ServiceGetList(char *where)
     }
     else
     {
-        STATEMENT_PREPARE("SELECT " SERVICE_FIELDS
-                          "FROM " SERVICES_TABLE"," MULTIPLEXES_TABLE " WHERE " 
-                          SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=" MULTIPLEXES_TABLE "." MULTIPLEX_UID ";");
+        STATEMENT_PREPARE_CACHED("SELECT " SERVICE_FIELDS
+                                 "FROM " SERVICES_TABLE"," MULTIPLEXES_TABLE " WHERE "
+                                 SERVICES_TABLE "." SERVICE_MULTIPLEXUID "=" MULTIPLEXES_TABLE "." MULTIPLEX_UID ";");
 
     }
     list = (ServiceList_t*)ObjectCollectionCreate(TOSTRING(ServiceList_t), count);
@@ -0,0 +1,111 @@
+/*
+Copyright (C) 2010  Adam Charrett
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+crc32bench.c
+
+Measure the throughput of each CRC_32 engine in libdvbpsi for typical PSI
+section sizes.
+
+*/
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <dvbpsi/dvbpsi.h>
+#include <dvbpsi/psi.h>
+
+#include "testsupport.h"
+
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define BYTES_PER_RUN   (256 * 1024 * 1024)
+#define MAX_SECTION     4096
+
+/*******************************************************************************
+* Typedefs                                                                     *
+*******************************************************************************/
+typedef struct Engine_t
+{
+    dvbpsi_crc32_engine_t engine;
+    char *name;
+}Engine_t;
+
+/*******************************************************************************
+* Global variables                                                             *
+*******************************************************************************/
+static Engine_t engines[] = {
+    {DVBPSI_CRC32_BYTE,   "byte"},
+    {DVBPSI_CRC32_SLICE8, "slice8"},
+    {DVBPSI_CRC32_PCLMUL, "pclmul"},
+};
+
+/* Smallest PAT, a typical PMT/SDT, a full PSI section and a full EIT schedule
+ * or DSM-CC section.
+ */
+static int sectionSizes[] = {16, 188, 1024, 4096};
+
+/*******************************************************************************
+* Global functions                                                             *
+*******************************************************************************/
+int main(int argc, char *argv[])
+{
+    static uint8_t data[MAX_SECTION];
+    volatile uint32_t sink = 0;
+    unsigned int e, s;
+    int i;
+
+    for (i = 0; i < MAX_SECTION; i ++)
+    {
+        data[i] = rand() & 0xff;
+    }
+
+    printf("%-8s", "engine");
+    for (s = 0; s < sizeof(sectionSizes) / sizeof(sectionSizes[0]); s ++)
+    {
+        printf(" %9d B", sectionSizes[s]);
+    }
+    printf("   (MB/s)\n");
+
+    for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e ++)
+    {
+        if (dvbpsi_SelectCRC32Engine(engines[e].engine))
+        {
+            printf("%-8s not supported on this CPU\n", engines[e].name);
+            continue;
+        }
+        printf("%-8s", engines[e].name);
+        for (s = 0; s < sizeof(sectionSizes) / sizeof(sectionSizes[0]); s ++)
+        {
+            int size = sectionSizes[s];
+            int sections = BYTES_PER_RUN / size;
+            double start = TestTimeNow();
+            double elapsed;
+
+            for (i = 0; i < sections; i ++)
+            {
+                sink ^= dvbpsi_CRC32(data, size);
+            }
+            elapsed = TestTimeNow() - start;
+            printf(" %11.1f", ((double)sections * size) / (elapsed * 1000000.0));
+        }
+        printf("\n");
+    }
+    return 0;
+}
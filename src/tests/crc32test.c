@@ -0,0 +1,158 @@
+/*
+Copyright (C) 2010  Adam Charrett
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+crc32test.c
+
+Check each CRC_32 engine in libdvbpsi against a bit by bit implementation.
+
+*/
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <dvbpsi/dvbpsi.h>
+#include <dvbpsi/psi.h>
+
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define MAX_LENGTH      4200
+#define MAX_ALIGNMENT   16   /* Covers the 8 byte and 16 byte loads used. */
+#define CRC32_POLY      0x04c11db7
+
+/*******************************************************************************
+* Typedefs                                                                     *
+*******************************************************************************/
+typedef struct Engine_t
+{
+    dvbpsi_crc32_engine_t engine;
+    char *name;
+}Engine_t;
+
+/*******************************************************************************
+* Prototypes                                                                   *
+*******************************************************************************/
+static uint32_t CRC32Bitwise(uint32_t crc, uint8_t byte);
+static int CheckEngine(Engine_t *engine, uint8_t *data, uint32_t *expected);
+
+/*******************************************************************************
+* Global variables                                                             *
+*******************************************************************************/
+static Engine_t engines[] = {
+    {DVBPSI_CRC32_BYTE,   "byte"},
+    {DVBPSI_CRC32_SLICE8, "slice8"},
+    {DVBPSI_CRC32_PCLMUL, "pclmul"},
+};
+
+/*******************************************************************************
+* Global functions                                                             *
+*******************************************************************************/
+int main(int argc, char *argv[])
+{
+    static uint8_t data[MAX_LENGTH];
+    static uint32_t expected[MAX_LENGTH + 1];
+    int failures = 0;
+    unsigned int i;
+
+    srand(0x4d504547);
+    for (i = 0; i < MAX_LENGTH; i ++)
+    {
+        data[i] = rand() & 0xff;
+    }
+
+    /* expected[n] is the CRC of the first n bytes of data. */
+    expected[0] = 0xffffffff;
+    for (i = 0; i < MAX_LENGTH; i ++)
+    {
+        expected[i + 1] = CRC32Bitwise(expected[i], data[i]);
+    }
+
+    for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i ++)
+    {
+        failures += CheckEngine(&engines[i], data, expected);
+    }
+    return failures ? 1 : 0;
+}
+
+/*******************************************************************************
+* Local Functions                                                              *
+*******************************************************************************/
+static uint32_t CRC32Bitwise(uint32_t crc, uint8_t byte)
+{
+    int bit;
+
+    crc ^= (uint32_t)byte << 24;
+    for (bit = 0; bit < 8; bit ++)
+    {
+        crc = (crc << 1) ^ ((crc & 0x80000000) ? CRC32_POLY : 0);
+    }
+    return crc;
+}
+
+/*
+ * Calculate the CRC of every length of data at every alignment, returns the
+ * number of mismatches.
+ */
+static int CheckEngine(Engine_t *engine, uint8_t *data, uint32_t *expected)
+{
+    static uint8_t buffer[MAX_LENGTH + MAX_ALIGNMENT] __attribute__((aligned(64)));
+    uint8_t section[8];
+    int alignment;
+    int length;
+    int failures = 0;
+
+    if (dvbpsi_SelectCRC32Engine(engine->engine))
+    {
+        printf("%-8s not supported on this CPU, skipped\n", engine->name);
+        return 0;
+    }
+
+    for (alignment = 0; alignment < MAX_ALIGNMENT; alignment ++)
+    {
+        memcpy(buffer + alignment, data, MAX_LENGTH);
+        for (length = 0; length <= MAX_LENGTH; length ++)
+        {
+            uint32_t crc = dvbpsi_CRC32(buffer + alignment, length);
+            if (crc != expected[length])
+            {
+                if (failures < 10)
+                {
+                    printf("%-8s length %d alignment %d: got 0x%08x expected 0x%08x\n",
+                           engine->name, length, alignment, crc, expected[length]);
+                }
+                failures ++;
+            }
+        }
+    }
+
+    /* Data followed by its CRC should give 0, as used to validate sections. */
+    memcpy(section, data, 4);
+    section[4] = expected[4] >> 24;
+    section[5] = expected[4] >> 16;
+    section[6] = expected[4] >> 8;
+    section[7] = expected[4];
+    if (dvbpsi_CRC32(section, sizeof(section)) != 0)
+    {
+        printf("%-8s CRC of data and its CRC is not 0\n", engine->name);
+        failures ++;
+    }
+
+    printf("%-8s %s\n", engine->name, failures ? "FAILED" : "passed");
+    return failures;
+}
@@ -0,0 +1,262 @@
+/*
+Copyright (C) 2010  Adam Charrett
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+dispatchbench.c
+
+Measure the cost of dispatching packets from the TSReader to packet filters
+with 1, 10 and 100 filters installed, and the cost of a disabled log message
+in each filter's callback.
+
+*/
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ts.h"
+#include "objects.h"
+#include "properties.h"
+#include "dispatchers.h"
+#include "deliverymethod.h"
+#include "logging.h"
+#include "dvbadapter.h"
+
+#include "testsupport.h"
+
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define PACKETS_PER_BATCH   1024    /* A typical DVR read */
+#define PACKETS_PER_RUN     (20 * 1000 * 1000)
+#define FIRST_PID           0x100
+#define NROF_PIDS           128     /* PIDs in the stream, only some are filtered */
+#define LOGGING_FILTERS     10
+
+/*******************************************************************************
+* Typedefs                                                                     *
+*******************************************************************************/
+typedef struct LoggingCallback_t
+{
+    char *name;
+    TSPacketFilterCallback_t callback;
+}LoggingCallback_t;
+
+/*******************************************************************************
+* Prototypes                                                                   *
+*******************************************************************************/
+static double RunBatches(TSReader_t *reader, TSPacketBatch_t *batch, int runs);
+static void PacketCallback(void *userArg, TSFilterGroup_t *group, TSPacket_t *packet);
+static void PacketLogMacroCallback(void *userArg, TSFilterGroup_t *group, TSPacket_t *packet);
+static void PacketLogFunctionCallback(void *userArg, TSFilterGroup_t *group, TSPacket_t *packet);
+
+/*******************************************************************************
+* Global variables                                                             *
+*******************************************************************************/
+static int filterCounts[] = {1, 10, 100};
+static LoggingCallback_t loggingCallbacks[] = {
+    {"none",     PacketCallback},
+    {"macro",    PacketLogMacroCallback},  /* LogModule() as the code base uses it */
+    {"function", PacketLogFunctionCallback}, /* Calling the function directly */
+};
+static char BENCH[] = "bench";
+static unsigned long packetsFiltered = 0;
+static int dvrPipe[2] = {-1, -1};
+
+/*******************************************************************************
+* Global functions                                                             *
+*******************************************************************************/
+int main(int argc, char *argv[])
+{
+    TSPacket_t *packets;
+    TSReader_t *reader;
+    TSPacketBatch_t *batch;
+    double baseline = 0.0;
+    unsigned int f;
+    int i;
+
+    if ((LoggingInitFile("-", 0) != 0) || (ObjectInit() != 0) || (PropertiesInit() != 0) || (DispatchersInit() != 0) ||
+        (DeliveryMethodManagerInit() != 0))
+    {
+        printf("Failed to initialise\n");
+        return 1;
+    }
+    reader = TSReaderCreate(NULL);
+    if (reader == NULL)
+    {
+        printf("Failed to create TSReader\n");
+        return 1;
+    }
+    TSReaderEnable(reader, TRUE);
+
+    /* The batch holds a reference on the memory the packets are in. */
+    packets = ObjectAlloc(PACKETS_PER_BATCH * sizeof(TSPacket_t));
+    memset(packets, 0xff, PACKETS_PER_BATCH * sizeof(TSPacket_t));
+    for (i = 0; i < PACKETS_PER_BATCH; i ++)
+    {
+        uint16_t pid = FIRST_PID + (i % NROF_PIDS);
+        packets[i].header[0] = 0x47;
+        packets[i].header[1] = (pid >> 8) & 0x1f;
+        packets[i].header[2] = pid & 0xff;
+        packets[i].header[3] = 0x10 | ((i / NROF_PIDS) & 0xf);
+    }
+    batch = TSPacketBatchCreateExternal(packets, PACKETS_PER_BATCH, packets);
+
+    printf("%-8s %12s %12s %12s\n", "filters", "Mpackets/s", "ns/packet", "% filtered");
+    for (f = 0; f < sizeof(filterCounts) / sizeof(filterCounts[0]); f ++)
+    {
+        TSFilterGroup_t *group = TSReaderCreateFilterGroup(reader, "bench", "bench", NULL, NULL);
+        double elapsed;
+        int runs = PACKETS_PER_RUN / PACKETS_PER_BATCH;
+
+        for (i = 0; i < filterCounts[f]; i ++)
+        {
+            /* Spread the filters over the PIDs in the stream. */
+            if (!TSFilterGroupAddPacketFilter(group, FIRST_PID + ((i * NROF_PIDS) / filterCounts[f]), PacketCallback, NULL))
+            {
+                printf("Failed to add packet filter\n");
+                return 1;
+            }
+        }
+        packetsFiltered = 0;
+
+        elapsed = RunBatches(reader, batch, runs);
+        printf("%-8d %12.2f %12.2f %12.1f\n", filterCounts[f],
+               ((double)runs * PACKETS_PER_BATCH) / (elapsed * 1000000.0),
+               (elapsed * 1000000000.0) / ((double)runs * PACKETS_PER_BATCH),
+               (packetsFiltered * 100.0) / ((double)runs * PACKETS_PER_BATCH));
+
+        TSFilterGroupDestroy(group);
+    }
+
+    /* Every callback logs at LOG_DEBUGV which is disabled at level 0. */
+    printf("\n%-8s %12s %12s %12s\n", "logging", "Mpackets/s", "ns/packet", "ns/message");
+    for (f = 0; f < sizeof(loggingCallbacks) / sizeof(loggingCallbacks[0]); f ++)
+    {
+        TSFilterGroup_t *group = TSReaderCreateFilterGroup(reader, "bench", "bench", NULL, NULL);
+        int runs = PACKETS_PER_RUN / PACKETS_PER_BATCH;
+        double elapsed;
+
+        for (i = 0; i < LOGGING_FILTERS; i ++)
+        {
+            if (!TSFilterGroupAddPacketFilter(group, FIRST_PID + ((i * NROF_PIDS) / LOGGING_FILTERS),
+                                              loggingCallbacks[f].callback, NULL))
+            {
+                printf("Failed to add packet filter\n");
+                return 1;
+            }
+        }
+        packetsFiltered = 0;
+
+        elapsed = RunBatches(reader, batch, runs);
+        if (f == 0)
+        {
+            baseline = elapsed;
+        }
+        printf("%-8s %12.2f %12.2f %12.2f\n", loggingCallbacks[f].name,
+               ((double)runs * PACKETS_PER_BATCH) / (elapsed * 1000000.0),
+               (elapsed * 1000000000.0) / ((double)runs * PACKETS_PER_BATCH),
+               ((elapsed - baseline) * 1000000000.0) / (double)packetsFiltered);
+
+        TSFilterGroupDestroy(group);
+    }
+
+    TSPacketBatchRelease(batch);
+    ObjectRefDec(packets);
+    TSReaderDestroy(reader);
+    return 0;
+}
+
+/*******************************************************************************
+* DVB adapter stubs, the packets are supplied directly to the TSReader.       *
+*******************************************************************************/
+bool DVBFrontEndIsLocked(DVBAdapter_t *adapter)
+{
+    return TRUE;
+}
+
+int DVBDemuxSetBufferSize(DVBAdapter_t *adapter, unsigned long size)
+{
+    return 0;
+}
+
+bool DVBDemuxIsHardwareRestricted(DVBAdapter_t *adapter)
+{
+    return FALSE;
+}
+
+int DVBDemuxGetMaxFilters(DVBAdapter_t *adapter)
+{
+    return TSREADER_NROF_FILTERS;
+}
+
+int DVBDemuxAllocateFilter(DVBAdapter_t *adapter, uint16_t pid)
+{
+    return 0;
+}
+
+int DVBDemuxReleaseFilter(DVBAdapter_t *adapter, uint16_t pid)
+{
+    return 0;
+}
+
+int DVBDVRGetFD(DVBAdapter_t *adapter)
+{
+    /* The TSReader watches the DVR so give it something that never becomes
+     * readable.
+     */
+    if ((dvrPipe[0] == -1) && (pipe(dvrPipe) != 0))
+    {
+        return -1;
+    }
+    return dvrPipe[0];
+}
+
+/*******************************************************************************
+* Local Functions                                                              *
+*******************************************************************************/
+static double RunBatches(TSReader_t *reader, TSPacketBatch_t *batch, int runs)
+{
+    double start = TestTimeNow();
+    int r;
+
+    for (r = 0; r < runs; r ++)
+    {
+        TSReaderProcessBatch(reader, batch);
+    }
+    return TestTimeNow() - start;
+}
+
+static void PacketCallback(void *userArg, TSFilterGroup_t *group, TSPacket_t *packet)
+{
+    packetsFiltered ++;
+}
+
+static void PacketLogMacroCallback(void *userArg, TSFilterGroup_t *group, TSPacket_t *packet)
+{
+    packetsFiltered ++;
+    LogModule(LOG_DEBUGV, BENCH, "Packet for PID 0x%04x (cc %d)\n",
+        TSPACKET_GETPID(*packet), TSPACKET_GETCOUNT(*packet));
+}
+
+static void PacketLogFunctionCallback(void *userArg, TSFilterGroup_t *group, TSPacket_t *packet)
+{
+    packetsFiltered ++;
+    (LogModule)(LOG_DEBUGV, BENCH, "Packet for PID 0x%04x (cc %d)\n",
+        TSPACKET_GETPID(*packet), TSPACKET_GETCOUNT(*packet));
+}
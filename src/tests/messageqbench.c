@@ -0,0 +1,180 @@
+/*
+Copyright (C) 2010  Adam Charrett
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+messageqbench.c
+
+Measure the throughput of a MessageQ with 1 to 8 producer threads sending to a
+single consumer, checking every message arrives in the order its producer sent
+it.
+
+*/
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "messageq.h"
+#include "objects.h"
+#include "logging.h"
+
+#include "testsupport.h"
+
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define MAX_PRODUCERS       8
+#define MESSAGES_PER_RUN    (2 * 1000 * 1000) /* Split between the producers */
+#define RECEIVE_MAX         64
+
+/*******************************************************************************
+* Typedefs                                                                     *
+*******************************************************************************/
+typedef struct BenchMessage_t
+{
+    int producer;
+    int sequence;
+}BenchMessage_t;
+
+typedef struct Producer_t
+{
+    pthread_t thread;
+    int index;
+    int messages;
+}Producer_t;
+
+/*******************************************************************************
+* Prototypes                                                                   *
+*******************************************************************************/
+static int RunProducers(int nrofProducers);
+static void *ProducerThread(void *arg);
+
+/*******************************************************************************
+* Global variables                                                             *
+*******************************************************************************/
+static int producerCounts[] = {1, 2, 4, 8};
+static MessageQ_t msgQ;
+
+/*******************************************************************************
+* Global functions                                                             *
+*******************************************************************************/
+int main(int argc, char *argv[])
+{
+    unsigned int p;
+    int failures = 0;
+
+    if ((LoggingInitFile("-", 0) != 0) || (ObjectInit() != 0))
+    {
+        printf("Failed to initialise\n");
+        return 1;
+    }
+    ObjectRegisterType(BenchMessage_t);
+
+    printf("%-10s %12s %12s %12s %12s %12s\n", "producers", "Mmsgs/s", "overflowed",
+           "avg lat us", "max lat us", "max depth");
+    for (p = 0; p < sizeof(producerCounts) / sizeof(producerCounts[0]); p ++)
+    {
+        failures += RunProducers(producerCounts[p]);
+    }
+    return failures ? 1 : 0;
+}
+
+/*******************************************************************************
+* Local Functions                                                              *
+*******************************************************************************/
+/*
+ * Send MESSAGES_PER_RUN messages from the producers and receive them on this
+ * thread, returns the number of messages received out of order.
+ */
+static int RunProducers(int nrofProducers)
+{
+    Producer_t producers[MAX_PRODUCERS];
+    int nextSequence[MAX_PRODUCERS];
+    void *msgs[RECEIVE_MAX];
+    MessageQStats_t stats;
+    int perProducer = MESSAGES_PER_RUN / nrofProducers;
+    int remaining = perProducer * nrofProducers;
+    int failures = 0;
+    double start;
+    double elapsed;
+    int count;
+    int i;
+
+    msgQ = MessageQCreate();
+    start = TestTimeNow();
+    for (i = 0; i < nrofProducers; i ++)
+    {
+        producers[i].index = i;
+        producers[i].messages = perProducer;
+        nextSequence[i] = 0;
+        if (pthread_create(&producers[i].thread, NULL, ProducerThread, &producers[i]))
+        {
+            printf("Failed to start producer\n");
+            exit(1);
+        }
+    }
+
+    while (remaining > 0)
+    {
+        count = MessageQReceiveMany(msgQ, msgs, RECEIVE_MAX);
+        for (i = 0; i < count; i ++)
+        {
+            BenchMessage_t *msg = msgs[i];
+            if (msg->sequence != nextSequence[msg->producer])
+            {
+                if (failures < 10)
+                {
+                    printf("Producer %d message %d received when %d was expected\n",
+                           msg->producer, msg->sequence, nextSequence[msg->producer]);
+                }
+                failures ++;
+            }
+            nextSequence[msg->producer] = msg->sequence + 1;
+            ObjectRefDec(msg);
+        }
+        remaining -= count;
+    }
+    elapsed = TestTimeNow() - start;
+
+    for (i = 0; i < nrofProducers; i ++)
+    {
+        pthread_join(producers[i].thread, NULL);
+    }
+    MessageQStatsGet(msgQ, &stats);
+    MessageQDestroy(msgQ);
+
+    printf("%-10d %12.2f %12lu %12lu %12lu %12d\n", nrofProducers,
+           ((double)perProducer * nrofProducers) / (elapsed * 1000000.0),
+           stats.overflowed, stats.averageLatency, stats.maxLatency, stats.maxDepth);
+    return failures;
+}
+
+static void *ProducerThread(void *arg)
+{
+    Producer_t *producer = arg;
+    BenchMessage_t *msg;
+    int i;
+
+    for (i = 0; i < producer->messages; i ++)
+    {
+        msg = ObjectCreateType(BenchMessage_t);
+        msg->producer = producer->index;
+        msg->sequence = i;
+        MessageQSend(msgQ, msg);
+        ObjectRefDec(msg);
+    }
+    return NULL;
+}
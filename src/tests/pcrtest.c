@@ -0,0 +1,126 @@
+/*
+Copyright (C) 2010  Adam Charrett
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+pcrtest.c
+
+Check the conversion of Program Clock References to nanoseconds, including
+durations long enough to overflow a naive conversion.
+
+*/
+#include "config.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ts.h"
+
+/*******************************************************************************
+* Prototypes                                                                   *
+*******************************************************************************/
+static int CheckToNS(uint64_t ticks);
+static int CheckGetPCR(uint64_t pcr);
+
+/*******************************************************************************
+* Global variables                                                             *
+*******************************************************************************/
+static const uint64_t durations[] = {
+    0,
+    1,
+    TSPACKET_PCR_HZ - 1,
+    TSPACKET_PCR_HZ,
+    TSPACKET_PCR_HZ * 600,
+    TSPACKET_PCR_HZ * 683,
+    TSPACKET_PCR_HZ * 684,      /* First whole second a naive conversion overflows at. */
+    (TSPACKET_PCR_HZ * 700) + 1,
+    TSPACKET_PCR_HZ * 3600 * 24,
+    TSPACKET_PCR_WRAP - 1,
+};
+
+/*******************************************************************************
+* Global functions                                                             *
+*******************************************************************************/
+int main(int argc, char *argv[])
+{
+    int failures = 0;
+    unsigned int i;
+    uint64_t ticks;
+
+    for (i = 0; i < sizeof(durations) / sizeof(durations[0]); i ++)
+    {
+        failures += CheckToNS(durations[i]);
+    }
+    /* Every remainder within a second around the 700s mark. */
+    for (ticks = TSPACKET_PCR_HZ * 700; ticks < TSPACKET_PCR_HZ * 701; ticks += 997)
+    {
+        failures += CheckToNS(ticks);
+    }
+
+    for (i = 0; i < sizeof(durations) / sizeof(durations[0]); i ++)
+    {
+        failures += CheckGetPCR(durations[i]);
+    }
+
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
+
+/*******************************************************************************
+* Local Functions                                                              *
+*******************************************************************************/
+static int CheckToNS(uint64_t ticks)
+{
+    uint64_t expected = (uint64_t)(((unsigned __int128)ticks * 1000000000ULL) / TSPACKET_PCR_HZ);
+    uint64_t ns = TSPACKET_PCR_TO_NS(ticks);
+
+    if (ns != expected)
+    {
+        printf("TSPACKET_PCR_TO_NS(%llu) = %llu expected %llu\n",
+               (unsigned long long)ticks, (unsigned long long)ns, (unsigned long long)expected);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Encode a PCR in an adaptation field and check it is extracted unchanged.
+ */
+static int CheckGetPCR(uint64_t pcr)
+{
+    TSPacket_t packet;
+    uint64_t base = (pcr / 300) & ((1ULL << 33) - 1);
+    unsigned int extension = pcr % 300;
+
+    memset(&packet, 0xff, sizeof(packet));
+    packet.header[0] = 0x47;
+    packet.header[3] = 0x20;  /* Adaptation field only. */
+    packet.payload[0] = 183;
+    packet.payload[1] = 0x10; /* PCR flag */
+    packet.payload[2] = base >> 25;
+    packet.payload[3] = base >> 17;
+    packet.payload[4] = base >> 9;
+    packet.payload[5] = base >> 1;
+    packet.payload[6] = ((base & 1) << 7) | 0x7e | (extension >> 8);
+    packet.payload[7] = extension & 0xff;
+
+    if (!TSPACKET_HASPCR(packet) || (TSPACKET_GETPCR(packet) != (pcr % TSPACKET_PCR_WRAP)))
+    {
+        printf("TSPACKET_GETPCR() = %llu expected %llu\n",
+               (unsigned long long)TSPACKET_GETPCR(packet), (unsigned long long)pcr);
+        return 1;
+    }
+    return 0;
+}
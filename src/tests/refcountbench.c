@@ -0,0 +1,153 @@
+/*
+Copyright (C) 2010  Adam Charrett
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+refcountbench.c
+
+Measure ObjectRefInc/ObjectRefDec with 1 to 8 threads, both on one object
+shared by all the threads and on an object per thread.
+
+*/
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "objects.h"
+#include "logging.h"
+
+#include "testsupport.h"
+
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define MAX_THREADS     8
+#define PAIRS_PER_RUN   (8 * 1000 * 1000) /* Split between the threads */
+
+/*******************************************************************************
+* Typedefs                                                                     *
+*******************************************************************************/
+typedef struct BenchObject_t
+{
+    int value;
+}BenchObject_t;
+
+typedef struct BenchThread_t
+{
+    pthread_t thread;
+    BenchObject_t *object;
+    int pairs;
+}BenchThread_t;
+
+/*******************************************************************************
+* Prototypes                                                                   *
+*******************************************************************************/
+static double RunThreads(int nrofThreads, bool shared);
+static void *BenchThread(void *arg);
+
+/*******************************************************************************
+* Global variables                                                             *
+*******************************************************************************/
+static int threadCounts[] = {1, 2, 4, 8};
+static pthread_barrier_t startBarrier;
+
+/*******************************************************************************
+* Global functions                                                             *
+*******************************************************************************/
+int main(int argc, char *argv[])
+{
+    unsigned int t;
+
+    if ((LoggingInitFile("-", 0) != 0) || (ObjectInit() != 0))
+    {
+        printf("Failed to initialise\n");
+        return 1;
+    }
+    ObjectRegisterType(BenchObject_t);
+
+    printf("%-8s %14s %14s   (M inc/dec pairs per second)\n", "threads", "shared", "per thread");
+    for (t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t ++)
+    {
+        double shared = RunThreads(threadCounts[t], TRUE);
+        double perThread = RunThreads(threadCounts[t], FALSE);
+        if ((shared < 0) || (perThread < 0))
+        {
+            printf("Failed to start threads\n");
+            return 1;
+        }
+        printf("%-8d %14.2f %14.2f\n", threadCounts[t], shared, perThread);
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Local Functions                                                              *
+*******************************************************************************/
+/*
+ * Run the threads and return the total rate in millions of pairs per second or
+ * -1 if the threads could not be started.
+ */
+static double RunThreads(int nrofThreads, bool shared)
+{
+    BenchThread_t threads[MAX_THREADS];
+    BenchObject_t *sharedObject = ObjectCreateType(BenchObject_t);
+    double start;
+    double elapsed;
+    int i;
+
+    pthread_barrier_init(&startBarrier, NULL, nrofThreads + 1);
+    for (i = 0; i < nrofThreads; i ++)
+    {
+        threads[i].object = shared ? sharedObject : ObjectCreateType(BenchObject_t);
+        threads[i].pairs = PAIRS_PER_RUN / nrofThreads;
+        if (pthread_create(&threads[i].thread, NULL, BenchThread, &threads[i]))
+        {
+            return -1;
+        }
+    }
+    pthread_barrier_wait(&startBarrier);
+    start = TestTimeNow();
+    for (i = 0; i < nrofThreads; i ++)
+    {
+        pthread_join(threads[i].thread, NULL);
+    }
+    elapsed = TestTimeNow() - start;
+    pthread_barrier_destroy(&startBarrier);
+
+    for (i = 0; i < nrofThreads; i ++)
+    {
+        if (threads[i].object != sharedObject)
+        {
+            ObjectRefDec(threads[i].object);
+        }
+    }
+    ObjectRefDec(sharedObject);
+    return ((double)(PAIRS_PER_RUN / nrofThreads) * nrofThreads) / (elapsed * 1000000.0);
+}
+
+static void *BenchThread(void *arg)
+{
+    BenchThread_t *thread = arg;
+    int i;
+
+    pthread_barrier_wait(&startBarrier);
+    for (i = 0; i < thread->pairs; i ++)
+    {
+        ObjectRefInc(thread->object);
+        ObjectRefDec(thread->object);
+    }
+    return NULL;
+}
@@ -0,0 +1,536 @@
+/*
+Copyright (C) 2010  Adam Charrett
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+remoteload.c
+
+Load generator for the remote interface. Runs many clients at once each sending
+commands one at a time, while other clients leave long running commands
+waiting and others pipeline commands and half-close their socket. Reports
+commands/sec and the latency of the commands.
+
+*/
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "types.h"
+#include "remoteintf.h"
+
+#include "testsupport.h"
+
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define MAX_LINE_LENGTH     1024
+#define CONNECT_WAIT        10      /* Seconds to wait for the server to start */
+#define SOCKET_TIMEOUT      30      /* Seconds to wait for a response */
+#define HALFCLOSE_COMMANDS  20      /* Commands sent before each half-close */
+#define LONG_COMMAND        "epgdata"
+
+/*******************************************************************************
+* Typedefs                                                                     *
+*******************************************************************************/
+typedef struct Connection_t
+{
+    int socket;
+    int start;
+    int end;
+    char buffer[MAX_LINE_LENGTH];
+}Connection_t;
+
+typedef struct Client_t
+{
+    pthread_t thread;
+    int index;
+    Connection_t connection;
+}Client_t;
+
+/*******************************************************************************
+* Prototypes                                                                   *
+*******************************************************************************/
+static void usage(char *appname);
+static bool WaitForServer(void);
+static bool Connect(Connection_t *connection);
+static bool SendLine(Connection_t *connection, char *line);
+static bool ReadLine(Connection_t *connection, char *line);
+static int ReadResponse(Connection_t *connection);
+static bool Authenticate(Connection_t *connection);
+static void *ClientThread(void *arg);
+static void *HalfCloseThread(void *arg);
+static void Error(char *format, ...);
+static int CompareLatency(const void *a, const void *b);
+
+/*******************************************************************************
+* Global variables                                                             *
+*******************************************************************************/
+static const char responselineStart[] = "DVBStreamer/";
+static struct sockaddr_in serverAddress;
+static char *username = "dvbstreamer";
+static char *password = "control";
+static char *command = "lsservices";
+static int nrofCommands = 50;
+static double *latencies;
+
+static pthread_mutex_t errorsMutex = PTHREAD_MUTEX_INITIALIZER;
+static int errors = 0;
+
+/*******************************************************************************
+* Global functions                                                             *
+*******************************************************************************/
+int main(int argc, char *argv[])
+{
+    Client_t *clients;
+    Client_t *longClients;
+    Client_t *halfCloseClients;
+    int nrofClients = 100;
+    int nrofLongClients = 20;
+    int nrofHalfCloseClients = 20;
+    int adapterNumber = 0;
+    int totalCommands;
+    double start;
+    double elapsed;
+    int i;
+
+    while (TRUE)
+    {
+        int c = getopt(argc, argv, "a:u:p:c:n:l:H:C:");
+        if (c == -1)
+        {
+            break;
+        }
+        switch (c)
+        {
+            case 'a': adapterNumber = atoi(optarg);
+                break;
+            case 'u': username = optarg;
+                break;
+            case 'p': password = optarg;
+                break;
+            case 'c': nrofClients = atoi(optarg);
+                break;
+            case 'n': nrofCommands = atoi(optarg);
+                break;
+            case 'l': nrofLongClients = atoi(optarg);
+                break;
+            case 'H': nrofHalfCloseClients = atoi(optarg);
+                break;
+            case 'C': command = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if ((nrofClients < 1) || (nrofCommands < 1) || (nrofLongClients < 0) || (nrofHalfCloseClients < 0))
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddress.sin_port = htons(REMOTEINTERFACE_PORT + adapterNumber);
+
+    if (!WaitForServer())
+    {
+        printf("No server listening on port %d\n", REMOTEINTERFACE_PORT + adapterNumber);
+        /* Tell make check to skip rather than fail the test. */
+        exit(77);
+    }
+
+    clients = calloc(nrofClients + nrofLongClients + nrofHalfCloseClients, sizeof(Client_t));
+    latencies = calloc(nrofClients * nrofCommands, sizeof(double));
+    if ((clients == NULL) || (latencies == NULL))
+    {
+        printf("Failed to allocate clients\n");
+        exit(1);
+    }
+    longClients = clients + nrofClients;
+    halfCloseClients = longClients + nrofLongClients;
+
+    /* Clients with a command that never finishes and whose output is never
+     * read, these should not stop other clients being served.
+     */
+    for (i = 0; i < nrofLongClients; i ++)
+    {
+        if (Connect(&longClients[i].connection) && Authenticate(&longClients[i].connection))
+        {
+            SendLine(&longClients[i].connection, LONG_COMMAND);
+        }
+    }
+
+    start = TestTimeNow();
+    for (i = 0; i < nrofHalfCloseClients; i ++)
+    {
+        halfCloseClients[i].index = i;
+        if (pthread_create(&halfCloseClients[i].thread, NULL, HalfCloseThread, &halfCloseClients[i]))
+        {
+            printf("Failed to start client thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nrofClients; i ++)
+    {
+        clients[i].index = i;
+        if (pthread_create(&clients[i].thread, NULL, ClientThread, &clients[i]))
+        {
+            printf("Failed to start client thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nrofClients; i ++)
+    {
+        pthread_join(clients[i].thread, NULL);
+    }
+    elapsed = TestTimeNow() - start;
+    for (i = 0; i < nrofHalfCloseClients; i ++)
+    {
+        pthread_join(halfCloseClients[i].thread, NULL);
+    }
+    for (i = 0; i < nrofLongClients; i ++)
+    {
+        if (longClients[i].connection.socket > 0)
+        {
+            close(longClients[i].connection.socket);
+        }
+    }
+
+    totalCommands = nrofClients * nrofCommands;
+    qsort(latencies, totalCommands, sizeof(double), CompareLatency);
+    printf("%d clients x %d \"%s\", %d long running clients, %d half-closing clients\n",
+           nrofClients, nrofCommands, command, nrofLongClients, nrofHalfCloseClients);
+    printf("%-10s %12s %12s %12s %12s\n", "errors", "commands/s", "p50 ms", "p99 ms", "max ms");
+    printf("%-10d %12.0f %12.2f %12.2f %12.2f\n", errors, totalCommands / elapsed,
+           latencies[totalCommands / 2] * 1000.0,
+           latencies[(totalCommands * 99) / 100] * 1000.0,
+           latencies[totalCommands - 1] * 1000.0);
+
+    free(latencies);
+    free(clients);
+    return errors ? 1 : 0;
+}
+
+/*******************************************************************************
+* Local Functions                                                              *
+*******************************************************************************/
+static void usage(char *appname)
+{
+    fprintf(stderr, "%s [-a <adapter>] [-u <username>] [-p <password>] [-c <clients>] [-n <commands>]\n"
+            "    [-l <long running clients>] [-H <half-closing clients>] [-C <command>]\n\n"
+            "-a : Adapter number of the server to connect to on this machine.\n"
+            "-u : Username to authenticate with.\n"
+            "-p : Password to authenticate with.\n"
+            "-c : Number of clients sending commands one at a time (default 100).\n"
+            "-n : Number of commands each client sends (default 50).\n"
+            "-l : Number of clients running " LONG_COMMAND " without reading the output (default 20).\n"
+            "-H : Number of clients that pipeline commands then half-close (default 20).\n"
+            "-C : Command sent by the clients (default lsservices).\n\n"
+            "The server accepts at most 256 connections so the total number of clients\n"
+            "should not be more than that.\n",
+            appname);
+}
+
+/*
+ * Send the commands one at a time, recording the time from sending each
+ * command to receiving the final response line.
+ */
+static void *ClientThread(void *arg)
+{
+    Client_t *client = arg;
+    Connection_t *connection = &client->connection;
+    double *latency = &latencies[client->index * nrofCommands];
+    double sent;
+    int i;
+
+    if (Connect(connection) && Authenticate(connection))
+    {
+        for (i = 0; i < nrofCommands; i ++)
+        {
+            sent = TestTimeNow();
+            if (!SendLine(connection, command))
+            {
+                break;
+            }
+            if (ReadResponse(connection) == -1)
+            {
+                break;
+            }
+            latency[i] = TestTimeNow() - sent;
+        }
+        /* Count commands that were not answered as taking forever. */
+        for (; i < nrofCommands; i ++)
+        {
+            latency[i] = SOCKET_TIMEOUT;
+        }
+        SendLine(connection, "logout");
+    }
+    else
+    {
+        for (i = 0; i < nrofCommands; i ++)
+        {
+            latency[i] = SOCKET_TIMEOUT;
+        }
+    }
+    if (connection->socket > 0)
+    {
+        close(connection->socket);
+    }
+    return NULL;
+}
+
+/*
+ * Send all the commands at once then shutdown the sending side of the socket,
+ * every command should still be answered before the server closes the
+ * connection.
+ */
+static void *HalfCloseThread(void *arg)
+{
+    Client_t *client = arg;
+    Connection_t *connection = &client->connection;
+    char line[MAX_LINE_LENGTH];
+    int responses = 0;
+    int i;
+
+    if (!Connect(connection))
+    {
+        return NULL;
+    }
+    sprintf(line, "auth %s %s", username, password);
+    SendLine(connection, line);
+    for (i = 0; i < HALFCLOSE_COMMANDS; i ++)
+    {
+        SendLine(connection, command);
+    }
+    shutdown(connection->socket, SHUT_WR);
+
+    while (ReadLine(connection, line))
+    {
+        if (strncmp(line, responselineStart, sizeof(responselineStart) - 1) == 0)
+        {
+            responses ++;
+        }
+    }
+    /* Auth and each command have a response line. */
+    if (responses != HALFCLOSE_COMMANDS + 1)
+    {
+        Error("Half-closed client %d received %d of %d responses\n", client->index,
+              responses, HALFCLOSE_COMMANDS + 1);
+    }
+    close(connection->socket);
+    return NULL;
+}
+
+/*
+ * Give the server time to start listening, returns FALSE if it doesn't start
+ * within CONNECT_WAIT seconds.
+ */
+static bool WaitForServer(void)
+{
+    double start = TestTimeNow();
+    int probe;
+
+    while (TestTimeNow() - start < CONNECT_WAIT)
+    {
+        probe = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (probe < 0)
+        {
+            return FALSE;
+        }
+        if (connect(probe, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) == 0)
+        {
+            close(probe);
+            return TRUE;
+        }
+        close(probe);
+        usleep(100000);
+    }
+    return FALSE;
+}
+
+static bool Connect(Connection_t *connection)
+{
+    struct timeval timeout;
+    char line[MAX_LINE_LENGTH];
+
+    connection->start = 0;
+    connection->end = 0;
+    connection->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (connection->socket < 0)
+    {
+        Error("Failed to create socket (%s)\n", strerror(errno));
+        return FALSE;
+    }
+    timeout.tv_sec = SOCKET_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(connection->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(connection->socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(connection->socket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)))
+    {
+        Error("Failed to connect (%s)\n", strerror(errno));
+        close(connection->socket);
+        connection->socket = -1;
+        return FALSE;
+    }
+    /* Wait for the greeting */
+    if (!ReadLine(connection, line) || (strncmp(line, responselineStart, sizeof(responselineStart) - 1) != 0))
+    {
+        Error("No greeting from the server\n");
+        close(connection->socket);
+        connection->socket = -1;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static bool Authenticate(Connection_t *connection)
+{
+    char line[MAX_LINE_LENGTH];
+
+    sprintf(line, "auth %s %s", username, password);
+    if (!SendLine(connection, line))
+    {
+        return FALSE;
+    }
+    if (ReadResponse(connection) != 0)
+    {
+        Error("Failed to authenticate\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static bool SendLine(Connection_t *connection, char *line)
+{
+    char buffer[MAX_LINE_LENGTH];
+    int len = snprintf(buffer, sizeof(buffer), "%s\n", line);
+    int sent = 0;
+
+    while (sent < len)
+    {
+        int result = send(connection->socket, buffer + sent, len - sent, MSG_NOSIGNAL);
+        if (result <= 0)
+        {
+            Error("Failed to send \"%s\" (%s)\n", line, strerror(errno));
+            return FALSE;
+        }
+        sent += result;
+    }
+    return TRUE;
+}
+
+/*
+ * Read a line without the new line character, returns FALSE when the
+ * connection is closed.
+ */
+static bool ReadLine(Connection_t *connection, char *line)
+{
+    int len = 0;
+
+    while (TRUE)
+    {
+        if (connection->start == connection->end)
+        {
+            int result = recv(connection->socket, connection->buffer, sizeof(connection->buffer), 0);
+            if (result < 0)
+            {
+                Error("Failed to receive (%s)\n", strerror(errno));
+                return FALSE;
+            }
+            if (result == 0)
+            {
+                return FALSE;
+            }
+            connection->start = 0;
+            connection->end = result;
+        }
+        while (connection->start < connection->end)
+        {
+            char c = connection->buffer[connection->start ++];
+            if (c == '\n')
+            {
+                line[len] = 0;
+                return TRUE;
+            }
+            if (len < MAX_LINE_LENGTH - 1)
+            {
+                line[len ++] = c;
+            }
+        }
+    }
+}
+
+/*
+ * Read the output of a command up to and including the response line,
+ * returns the error code from the response line or -1 if the connection
+ * was closed.
+ */
+static int ReadResponse(Connection_t *connection)
+{
+    char line[MAX_LINE_LENGTH];
+    char *code;
+
+    while (ReadLine(connection, line))
+    {
+        if (strncmp(line, responselineStart, sizeof(responselineStart) - 1) == 0)
+        {
+            /* DVBStreamer/<version>/<error code> <message> */
+            code = strchr(line + sizeof(responselineStart) - 1, '/');
+            return code ? atoi(code + 1) : -1;
+        }
+    }
+    Error("Connection closed while waiting for a response\n");
+    return -1;
+}
+
+static void Error(char *format, ...)
+{
+    va_list args;
+
+    pthread_mutex_lock(&errorsMutex);
+    /* Only show the first few as the rest are likely to be the same. */
+    if (errors < 10)
+    {
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+    }
+    errors ++;
+    pthread_mutex_unlock(&errorsMutex);
+}
+
+static int CompareLatency(const void *a, const void *b)
+{
+    double latencyA = *(const double *)a;
+    double latencyB = *(const double *)b;
+
+    if (latencyA < latencyB)
+    {
+        return -1;
+    }
+    return latencyA > latencyB ? 1 : 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Start fdvbstreamer with the remote interface enabled and run the remoteload
+# load generator against it. The file adapter is used with no streams so no
+# hardware or stream files are needed. Skipped if fdvbstreamer has not been
+# built.
+#
+ADAPTER=9
+USERNAME=loadtest
+PASSWORD=loadtest
+
+if test ! -x ./fdvbstreamer; then
+    echo "fdvbstreamer not built, skipping"
+    exit 77
+fi
+
+TESTHOME=`mktemp -d` || exit 1
+trap 'rm -rf "$TESTHOME"' 0
+mkdir -p "$TESTHOME/.dvbstreamer/file$ADAPTER"
+echo "DVB-T" > "$TESTHOME/.dvbstreamer/file$ADAPTER/info"
+
+HOME="$TESTHOME" ./fdvbstreamer -a $ADAPTER -r -D -u $USERNAME -p $PASSWORD -L "$TESTHOME/fdvbstreamer.log" &
+SERVER=$!
+
+./remoteload -a $ADAPTER -u $USERNAME -p $PASSWORD "$@"
+RESULT=$?
+
+if kill $SERVER 2>/dev/null; then
+    wait $SERVER
+else
+    echo "fdvbstreamer exited during the test"
+    RESULT=1
+fi
+if test $RESULT -ne 0 && test $RESULT -ne 77; then
+    cat "$TESTHOME/fdvbstreamer.log"
+fi
+exit $RESULT
@@ -0,0 +1,43 @@
+/*
+Copyright (C) 2010  Adam Charrett
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+testsupport.c
+
+Functions shared by the tests and benchmarks.
+
+*/
+#include "config.h"
+#include <limits.h>
+#include <time.h>
+
+#include "testsupport.h"
+
+/*******************************************************************************
+* Global variables                                                             *
+*******************************************************************************/
+/* Used by logging.c, empty so logging to a file is relative to the current directory. */
+char DataDirectory[PATH_MAX];
+
+/*******************************************************************************
+* Global functions                                                             *
+*******************************************************************************/
+double TestTimeNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
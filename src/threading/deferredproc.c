@@ -17,42 +17,107 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 
 deferredproc.h
 
-Deferred Processing thread.
+Deferred Processing worker threads.
 
 */
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <dlfcn.h>
 #include <pthread.h>
 
 #include "deferredproc.h"
 #include "messageq.h"
 #include "logging.h"
 #include "objects.h"
-#include "list.h"
+#include "properties.h"
+
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+/* Only take a few jobs at a time so idle workers get the rest. */
+#define MAX_JOBS_PER_WAKEUP 4
+#define DEFAULT_WORKERS     2
+#define MAX_WORKERS         16
+#define STRAND_BUCKETS      64
+#define MAX_PROCESSORS      32  /* Number of processor functions statistics are kept for. */
+#define HISTOGRAM_BUCKETS   24  /* Power of 2 buckets in us, the last is ~4s and over. */
+#define NS_PER_SEC          1000000000ULL
+#define PATH_MAX_NAME_LEN   64  /* Longest file name shown in the processor statistics. */
 
 /*******************************************************************************
 * Typedefs                                                                     *
 *******************************************************************************/
 typedef struct DeferredJob_s
 {
-    DeferredProcessor_t processor;
+    DeferredProcessor_t processor; /* NULL to ask the worker receiving the job to exit. */
     void *arg;
+    const void *key;
+    uint64_t queued;               /* Time the job was added (ns, CLOCK_MONOTONIC). */
+    struct DeferredJob_s *next;    /* Next job waiting for the same key. */
 }DeferredJob_t;
 
+/*
+ * Exists while a job with the key is queued or running, later jobs with the
+ * same key wait here until the worker running the current one takes them.
+ */
+typedef struct DeferredStrand_s
+{
+    const void *key;
+    DeferredJob_t *pendingHead;
+    DeferredJob_t *pendingTail;
+    struct DeferredStrand_s *next;
+}DeferredStrand_t;
+
+typedef struct DeferredProcessorStats_s
+{
+    DeferredProcessor_t processor;
+    unsigned int jobs;
+    unsigned int wait[HISTOGRAM_BUCKETS]; /* Time from being added to being run in us. */
+    unsigned int run[HISTOGRAM_BUCKETS];  /* Time taken to run in us. */
+}DeferredProcessorStats_t;
+
 /*******************************************************************************
 * Prototypes                                                                   *
 *******************************************************************************/
 static void *DeferredProcessingThread(void* arg);
+static void DeferredProcessingRunStrand(DeferredJob_t *job);
+static void DeferredProcessingRun(DeferredJob_t *job);
+static DeferredStrand_t **DeferredProcessingFindStrand(const void *key);
+static void DeferredProcessingDiscard(DeferredJob_t *job);
+static int DeferredProcessingStartWorkers(int count);
+static void DeferredProcessingStatsAdd(DeferredProcessor_t processor, uint64_t wait, uint64_t run);
+static void DeferredProcessingHistogramAdd(unsigned int *histogram, uint64_t ns);
+static int DeferredProcessingHistogramPrint(char *buffer, unsigned int *histogram);
+static uint64_t DeferredProcessingNow(void);
+static int DeferredProcessingWorkersSet(void *userArg, PropertyValue_t *value);
+static int DeferredProcessingStatsGet(void *userArg, PropertyValue_t *value);
+static int DeferredProcessingQueuedGet(void *userArg, PropertyValue_t *value);
+static int DeferredProcessingMaxQueuedGet(void *userArg, PropertyValue_t *value);
+static int DeferredProcessingLatencyGet(void *userArg, PropertyValue_t *value);
+static int DeferredProcessingMaxLatencyGet(void *userArg, PropertyValue_t *value);
 
 /*******************************************************************************
 * Global variables                                                             *
 *******************************************************************************/
 static const char DEFERREDPROC[] = "DeferredProc";
 static MessageQ_t jobQ = NULL;
-static pthread_t processingThread;
+static const char propertyParent[] = "sys.deferredproc";
+
+static pthread_mutex_t workersMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workersCond = PTHREAD_COND_INITIALIZER;
+static int workers = 0;      /* Number of workers wanted. */
+static int liveWorkers = 0;  /* Number of worker threads running. */
 
+static pthread_mutex_t strandMutex = PTHREAD_MUTEX_INITIALIZER;
+static DeferredStrand_t *strands[STRAND_BUCKETS];
+
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static DeferredProcessorStats_t processorStats[MAX_PROCESSORS];
+static int nrofProcessorStats = 0;
 
 /*******************************************************************************
 * Global functions                                                             *
@@ -62,31 +127,141 @@ int DeferredProcessingInit(void)
 {
     ObjectRegisterType(DeferredJob_t);
     jobQ = MessageQCreate();
-    pthread_create(&processingThread, NULL, DeferredProcessingThread, NULL);
+    if (jobQ == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&workersMutex);
+    DeferredProcessingStartWorkers(DEFAULT_WORKERS);
+    pthread_mutex_unlock(&workersMutex);
+
+    PropertiesAddProperty(propertyParent, "workers", "Number of threads deferred jobs are processed on.",
+                          PropertyType_Int, &workers, PropertiesSimplePropertyGet, DeferredProcessingWorkersSet);
+    PropertiesAddProperty(propertyParent, "queued", "Number of jobs waiting to be processed.",
+                          PropertyType_Int, NULL, DeferredProcessingQueuedGet, NULL);
+    PropertiesAddProperty(propertyParent, "maxqueued", "Largest number of jobs that have been waiting to be processed.",
+                          PropertyType_Int, NULL, DeferredProcessingMaxQueuedGet, NULL);
+    PropertiesAddProperty(propertyParent, "latency", "Average time in us jobs wait before being processed.",
+                          PropertyType_Int, NULL, DeferredProcessingLatencyGet, NULL);
+    PropertiesAddProperty(propertyParent, "maxlatency", "Longest time in us a job has waited before being processed.",
+                          PropertyType_Int, NULL, DeferredProcessingMaxLatencyGet, NULL);
+    PropertiesAddProperty(propertyParent, "processors", "Histograms of the time in us jobs wait and take to run for each processor function.",
+                          PropertyType_String, NULL, DeferredProcessingStatsGet, NULL);
     return 0;
 }
 
 void DeferredProcessingDeinit(void)
 {
-    /* Signal thread to exit and wait */
+    DeferredStrand_t *strand;
+    DeferredJob_t *job;
+    int i;
+
+    PropertiesRemoveAllProperties(propertyParent);
+
+    /* Signal the workers to exit and wait */
     MessageQSetQuit(jobQ);
-    pthread_join(processingThread, NULL);
+    pthread_mutex_lock(&workersMutex);
+    while (liveWorkers)
+    {
+        pthread_cond_wait(&workersCond, &workersMutex);
+    }
+    workers = 0;
+    pthread_mutex_unlock(&workersMutex);
 
-    /* Destory thread and queue */
+    MessageQResetQuit(jobQ);
+    LogModule(LOG_DEBUG, DEFERREDPROC, "Discarding %d jobs\n", MessageQAvailable(jobQ));
+    while(MessageQAvailable(jobQ))
+    {
+        job = (DeferredJob_t*)MessageQReceive(jobQ);
+        if (job)
+        {
+            DeferredProcessingDiscard(job);
+        }
+    }
+    for (i = 0; i < STRAND_BUCKETS; i ++)
+    {
+        while (strands[i])
+        {
+            strand = strands[i];
+            strands[i] = strand->next;
+            while (strand->pendingHead)
+            {
+                job = strand->pendingHead;
+                strand->pendingHead = job->next;
+                DeferredProcessingDiscard(job);
+            }
+            free(strand);
+        }
+    }
+
+    /* Destory the queue */
     MessageQDestroy(jobQ);
-    pthread_detach(processingThread);
     jobQ = NULL;
 }
 
+/*
+ * Jobs for different processors used to run one after another on a single
+ * thread, now they may run at the same time. The processors in the tree don't
+ * share state: the DVB EIT processor only touches its section cache and the EPG
+ * channel, which hands messages to listeners through their own message queues,
+ * while DeferredInformListeners only touches the event listeners, under
+ * listenersMutex. The ATSC EIT and ETT processors update the same events, so
+ * they share a key.
+ */
 void DeferredProcessingAddJob(DeferredProcessor_t processor, void *arg)
 {
+    DeferredProcessingAddJobKeyed(processor, arg, processor);
+}
+
+void DeferredProcessingAddJobKeyed(DeferredProcessor_t processor, void *arg, const void *key)
+{
+    DeferredStrand_t **link;
+    DeferredStrand_t *strand;
+
     if (jobQ)
     {
         DeferredJob_t *job = ObjectCreateType(DeferredJob_t);
-        LogModule(LOG_DEBUGV, DEFERREDPROC, "Adding job %p (processor:%p, arg:%p)\n", job, processor, arg);
+        LogModule(LOG_DEBUGV, DEFERREDPROC, "Adding job %p (processor:%p, arg:%p, key:%p)\n", job, processor, arg, key);
         job->processor = processor;
         job->arg = arg;
+        job->key = key;
+        job->queued = DeferredProcessingNow();
         ObjectRefInc(arg);
+
+        pthread_mutex_lock(&strandMutex);
+        link = DeferredProcessingFindStrand(key);
+        if (*link)
+        {
+            /* Wait for the earlier jobs with this key, the strand now owns the
+             * reference to the job.
+             */
+            strand = *link;
+            if (strand->pendingTail)
+            {
+                strand->pendingTail->next = job;
+            }
+            else
+            {
+                strand->pendingHead = job;
+            }
+            strand->pendingTail = job;
+            pthread_mutex_unlock(&strandMutex);
+            return;
+        }
+        strand = calloc(1, sizeof(DeferredStrand_t));
+        if (strand)
+        {
+            strand->key = key;
+            *link = strand;
+        }
+        pthread_mutex_unlock(&strandMutex);
+        if (strand == NULL)
+        {
+            LogModule(LOG_ERROR, DEFERREDPROC, "Failed to allocate strand, job dropped!\n");
+            DeferredProcessingDiscard(job);
+            return;
+        }
+
         MessageQSend(jobQ, job);
         ObjectRefDec(job);
     }
@@ -98,31 +273,301 @@ void DeferredProcessingAddJob(DeferredProcessor_t processor, void *arg)
 *******************************************************************************/
 static void *DeferredProcessingThread(void* arg)
 {
-    DeferredJob_t *job;
-    LogRegisterThread(processingThread, DEFERREDPROC);    
+    DeferredJob_t *jobs[MAX_JOBS_PER_WAKEUP];
+    bool stop = FALSE;
+    int count;
+    int i;
+    LogRegisterThread(pthread_self(), DEFERREDPROC);
     LogModule(LOG_DEBUG, DEFERREDPROC, "Deferred processing thread started\n");
-    while(!MessageQIsQuitSet(jobQ))
+    while(!stop && !MessageQIsQuitSet(jobQ))
     {
-        job = (DeferredJob_t*)MessageQReceive(jobQ);
-        if (job)
+        count = MessageQReceiveMany(jobQ, (void **)jobs, MAX_JOBS_PER_WAKEUP);
+        for (i = 0; i < count; i ++)
         {
-            LogModule(LOG_DEBUGV, DEFERREDPROC, "Running job %p (processor:%p, arg:%p)\n", job, job->processor, job->arg);            
-            job->processor(job->arg);
-            LogModule(LOG_DEBUGV, DEFERREDPROC, "Finished job %p (processor:%p, arg:%p)\n", job, job->processor, job->arg);            
-            ObjectRefDec(job);
+            if (jobs[i]->processor == NULL)
+            {
+                /* Finish the rest of the jobs first. */
+                stop = TRUE;
+                ObjectRefDec(jobs[i]);
+            }
+            else
+            {
+                DeferredProcessingRunStrand(jobs[i]);
+            }
         }
     }
-    MessageQResetQuit(jobQ);
-    LogModule(LOG_DEBUG, DEFERREDPROC, "Discarding %d jobs\n", MessageQAvailable(jobQ));
-    while(MessageQAvailable(jobQ))
+    LogModule(LOG_DEBUG, DEFERREDPROC, "Deferred processing thread stopped\n");
+    pthread_mutex_lock(&workersMutex);
+    liveWorkers --;
+    pthread_cond_broadcast(&workersCond);
+    pthread_mutex_unlock(&workersMutex);
+    return NULL;
+}
+
+/*
+ * Run the job followed by any jobs with the same key that were added while it
+ * was queued or running.
+ */
+static void DeferredProcessingRunStrand(DeferredJob_t *job)
+{
+    const void *key = job->key;
+    DeferredStrand_t **link;
+    DeferredStrand_t *strand;
+
+    while (job)
     {
-        job = (DeferredJob_t*)MessageQReceive(jobQ);
-        if (job)
+        DeferredProcessingRun(job);
+
+        pthread_mutex_lock(&strandMutex);
+        link = DeferredProcessingFindStrand(key);
+        strand = *link;
+        job = strand->pendingHead;
+        if (job && MessageQIsQuitSet(jobQ))
         {
-            ObjectRefDec(job->arg);
-            ObjectRefDec(job);
+            /* Leave the rest to be discarded. */
+            job = NULL;
         }
+        else if (job)
+        {
+            strand->pendingHead = job->next;
+            if (strand->pendingHead == NULL)
+            {
+                strand->pendingTail = NULL;
+            }
+        }
+        else
+        {
+            *link = strand->next;
+            free(strand);
+        }
+        pthread_mutex_unlock(&strandMutex);
     }
-    LogModule(LOG_DEBUG, DEFERREDPROC, "Deferred processing thread stopped\n");
-    return NULL;   
+}
+
+static void DeferredProcessingRun(DeferredJob_t *job)
+{
+    uint64_t start = DeferredProcessingNow();
+    uint64_t end;
+
+    LogModule(LOG_DEBUGV, DEFERREDPROC, "Running job %p (processor:%p, arg:%p)\n", job, job->processor, job->arg);
+    job->processor(job->arg);
+    LogModule(LOG_DEBUGV, DEFERREDPROC, "Finished job %p (processor:%p, arg:%p)\n", job, job->processor, job->arg);
+    end = DeferredProcessingNow();
+    DeferredProcessingStatsAdd(job->processor, start - job->queued, end - start);
+    ObjectRefDec(job);
+}
+
+static DeferredStrand_t **DeferredProcessingFindStrand(const void *key)
+{
+    DeferredStrand_t **link = &strands[((uintptr_t)key >> 4) % STRAND_BUCKETS];
+
+    while (*link && ((*link)->key != key))
+    {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void DeferredProcessingDiscard(DeferredJob_t *job)
+{
+    if (job->processor)
+    {
+        ObjectRefDec(job->arg);
+    }
+    ObjectRefDec(job);
+}
+
+/* Called with workersMutex held. */
+static int DeferredProcessingStartWorkers(int count)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int result = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (workers < count)
+    {
+        if (pthread_create(&thread, &attr, DeferredProcessingThread, NULL))
+        {
+            LogModule(LOG_ERROR, DEFERREDPROC, "Failed to create deferred processing thread\n");
+            result = -1;
+            break;
+        }
+        workers ++;
+        liveWorkers ++;
+    }
+    pthread_attr_destroy(&attr);
+    return result;
+}
+
+static void DeferredProcessingStatsAdd(DeferredProcessor_t processor, uint64_t wait, uint64_t run)
+{
+    DeferredProcessorStats_t *stats = NULL;
+    int i;
+
+    pthread_mutex_lock(&statsMutex);
+    for (i = 0; i < nrofProcessorStats; i ++)
+    {
+        if (processorStats[i].processor == processor)
+        {
+            stats = &processorStats[i];
+            break;
+        }
+    }
+    if ((stats == NULL) && (nrofProcessorStats < MAX_PROCESSORS))
+    {
+        stats = &processorStats[nrofProcessorStats];
+        nrofProcessorStats ++;
+        stats->processor = processor;
+    }
+    if (stats)
+    {
+        stats->jobs ++;
+        DeferredProcessingHistogramAdd(stats->wait, wait);
+        DeferredProcessingHistogramAdd(stats->run, run);
+    }
+    pthread_mutex_unlock(&statsMutex);
+}
+
+static void DeferredProcessingHistogramAdd(unsigned int *histogram, uint64_t ns)
+{
+    unsigned int us = (ns / 1000 > UINT32_MAX) ? UINT32_MAX : (unsigned int)(ns / 1000);
+    int bucket = 0;
+
+    if (us)
+    {
+        bucket = 32 - __builtin_clz(us);
+        if (bucket >= HISTOGRAM_BUCKETS)
+        {
+            bucket = HISTOGRAM_BUCKETS - 1;
+        }
+    }
+    histogram[bucket] ++;
+}
+
+/* Print the non-empty buckets as "<lower bound in us>:<count>". */
+static int DeferredProcessingHistogramPrint(char *buffer, unsigned int *histogram)
+{
+    int len = 0;
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i ++)
+    {
+        if (histogram[i])
+        {
+            len += sprintf(buffer + len, " %u%s:%u", i ? (1U << (i - 1)) : 0,
+                           (i == HISTOGRAM_BUCKETS - 1) ? "+":"", histogram[i]);
+        }
+    }
+    return len;
+}
+
+static uint64_t DeferredProcessingNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * NS_PER_SEC) + now.tv_nsec;
+}
+
+static int DeferredProcessingWorkersSet(void *userArg, PropertyValue_t *value)
+{
+    DeferredJob_t *job;
+    int result = 0;
+
+    if ((value->u.integer < 1) || (value->u.integer > MAX_WORKERS))
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&workersMutex);
+    if (value->u.integer > workers)
+    {
+        result = DeferredProcessingStartWorkers(value->u.integer);
+    }
+    /* Surplus workers exit when they receive a job without a processor. */
+    while (workers > value->u.integer)
+    {
+        job = ObjectCreateType(DeferredJob_t);
+        MessageQSend(jobQ, job);
+        ObjectRefDec(job);
+        workers --;
+    }
+    pthread_mutex_unlock(&workersMutex);
+    return result;
+}
+
+/*
+ * One line per processor function, identified by the file it is in and the
+ * offset into it (for addr2line), with the wait and run time histograms.
+ */
+static int DeferredProcessingStatsGet(void *userArg, PropertyValue_t *value)
+{
+    /* Name + count + 2 histograms of up to ~20 characters per bucket. */
+    char *buffer = malloc(MAX_PROCESSORS * (PATH_MAX_NAME_LEN + (HISTOGRAM_BUCKETS * 2 * 24) + 64));
+    char *name;
+    Dl_info info;
+    int len = 0;
+    int i;
+
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    buffer[0] = 0;
+    pthread_mutex_lock(&statsMutex);
+    for (i = 0; i < nrofProcessorStats; i ++)
+    {
+        DeferredProcessorStats_t *stats = &processorStats[i];
+        if (dladdr((void *)stats->processor, &info) && info.dli_fname)
+        {
+            name = strrchr(info.dli_fname, '/');
+            len += sprintf(buffer + len, "%.*s+0x%lx jobs:%u wait(us):", PATH_MAX_NAME_LEN,
+                           name ? name + 1 : info.dli_fname,
+                           (unsigned long)((uint8_t *)stats->processor - (uint8_t *)info.dli_fbase),
+                           stats->jobs);
+        }
+        else
+        {
+            len += sprintf(buffer + len, "%p jobs:%u wait(us):", (void *)stats->processor, stats->jobs);
+        }
+        len += DeferredProcessingHistogramPrint(buffer + len, stats->wait);
+        len += sprintf(buffer + len, " run(us):");
+        len += DeferredProcessingHistogramPrint(buffer + len, stats->run);
+        len += sprintf(buffer + len, "\n");
+    }
+    pthread_mutex_unlock(&statsMutex);
+    value->u.string = buffer;
+    return 0;
+}
+
+static int DeferredProcessingQueuedGet(void *userArg, PropertyValue_t *value)
+{
+    MessageQStats_t stats;
+    MessageQStatsGet(jobQ, &stats);
+    value->u.integer = stats.depth;
+    return 0;
+}
+
+static int DeferredProcessingMaxQueuedGet(void *userArg, PropertyValue_t *value)
+{
+    MessageQStats_t stats;
+    MessageQStatsGet(jobQ, &stats);
+    value->u.integer = stats.maxDepth;
+    return 0;
+}
+
+static int DeferredProcessingLatencyGet(void *userArg, PropertyValue_t *value)
+{
+    MessageQStats_t stats;
+    MessageQStatsGet(jobQ, &stats);
+    value->u.integer = (int)stats.averageLatency;
+    return 0;
+}
+
+static int DeferredProcessingMaxLatencyGet(void *userArg, PropertyValue_t *value)
+{
+    MessageQStats_t stats;
+    MessageQStatsGet(jobQ, &stats);
+    value->u.integer = (int)stats.maxLatency;
+    return 0;
 }
@@ -23,26 +23,92 @@ Thread safe message queue.
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
 #include <time.h>
+#include <unistd.h>
+#include <sched.h>
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "messageq.h"
 #include "logging.h"
 #include "objects.h"
-#include "list.h"
+
+/*******************************************************************************
+* Defines                                                                      *
+*******************************************************************************/
+#define MESSAGEQ_SIZE   1024 /* Number of messages held in the ring, must be a power of 2. */
+#define MESSAGEQ_MASK   (MESSAGEQ_SIZE - 1)
+#define MESSAGEQ_FULL_RETRIES 32 /* Times a sender yields waiting for space before overflowing. */
+#define CACHE_LINE_SIZE 64
+#define NS_PER_MS       1000000ULL
+#define NS_PER_SEC      1000000000ULL
 
 /*******************************************************************************
 * Typedefs                                                                     *
 *******************************************************************************/
+/*
+ * A slot in the ring, sequence is the position the slot is next written at and
+ * becomes position + 1 once the message has been written (and so can be read).
+ */
+typedef struct MessageQCell_s
+{
+    volatile unsigned long sequence;
+    void *msg;
+    uint64_t sent;
+}MessageQCell_t;
+
+/* Messages that didn't fit in the ring. */
+typedef struct MessageQOverflow_s
+{
+    struct MessageQOverflow_s *next;
+    void *msg;
+    uint64_t sent;
+}MessageQOverflow_t;
 
+/*
+ * Bounded multi-producer/multi-consumer ring, producers and consumers claim
+ * slots by moving enqueuePos/dequeuePos on with a compare and swap. If the ring
+ * is full messages are put on a mutex protected overflow list so sending never
+ * blocks or fails. Receivers only sleep (on a futex) when the queue is empty and
+ * senders only make a system call to wake them when there are sleepers.
+ */
 struct MessageQ_s
 {
-    pthread_mutex_t mutex;
-    pthread_cond_t availableCond;
-    bool quit;
-    List_t *messages;
+    volatile unsigned long enqueuePos;
+    char pad1[CACHE_LINE_SIZE - sizeof(unsigned long)];
+    volatile unsigned long dequeuePos;
+    char pad2[CACHE_LINE_SIZE - sizeof(unsigned long)];
+    volatile int wakeSeq;           /* Futex word, changed whenever sleepers should recheck the queue. */
+    volatile int sleepers;
+    volatile bool quit;
+    volatile int overflowCount;
+    pthread_mutex_t overflowMutex;
+    MessageQOverflow_t *overflowHead;
+    MessageQOverflow_t *overflowTail;
+    /* Statistics */
+    volatile unsigned long overflowed;
+    volatile unsigned long received;
+    volatile int maxDepth;
+    volatile uint64_t totalLatency;
+    volatile uint64_t maxLatency;
+    MessageQCell_t cells[MESSAGEQ_SIZE];
 };
 
+/*******************************************************************************
+* Prototypes                                                                   *
+*******************************************************************************/
+static bool MessageQPush(MessageQ_t msgQ, void *msg, uint64_t now);
+static void MessageQOverflowPush(MessageQ_t msgQ, void *msg, uint64_t now);
+static int MessageQPopMany(MessageQ_t msgQ, void **msgs, int maxMsgs);
+static int MessageQTake(MessageQ_t msgQ, void **msgs, int maxMsgs, uint64_t deadline);
+static void MessageQWait(MessageQ_t msgQ, uint64_t deadline);
+static void MessageQWake(MessageQ_t msgQ, int count);
+static void MessageQLatency(MessageQ_t msgQ, uint64_t sent, uint64_t now);
+static uint64_t MessageQNow(void);
+
 /*******************************************************************************
 * Global variables                                                             *
 *******************************************************************************/
@@ -55,137 +121,347 @@ static const char MESSAGEQ[] = "MessageQ";
 MessageQ_t MessageQCreate()
 {
     MessageQ_t result;
+    unsigned long i;
     ObjectRegisterClass(MessageQClass, sizeof(struct MessageQ_s), NULL);
     
     result = ObjectCreate(MessageQClass);
     if (result)
     {
-        result->messages = ListCreate();
-        if (result->messages)
+        for (i = 0; i < MESSAGEQ_SIZE; i ++)
         {
-            pthread_mutex_init(&result->mutex, NULL);
-            pthread_cond_init(&result->availableCond, NULL);
-            LogModule(LOG_DEBUG, MESSAGEQ, "Create messageq %p\n", result);
-        }
-        else
-        {
-            ObjectRefDec(result);
-            result = NULL;
+            result->cells[i].sequence = i;
         }
+        pthread_mutex_init(&result->overflowMutex, NULL);
+        LogModule(LOG_DEBUG, MESSAGEQ, "Create messageq %p\n", result);
     }
     return result;
 }
 
 void MessageQDestroy(MessageQ_t msgQ)
 {
-    ListIterator_t iterator;
+    void *msgs[MESSAGEQ_SIZE];
+    int count;
+    int i;
     LogModule(LOG_DEBUG, MESSAGEQ, "Destroying messageq %p\n", msgQ);
     MessageQSetQuit(msgQ);
-    pthread_mutex_lock(&msgQ->mutex);
-    for (ListIterator_Init(iterator, msgQ->messages); ListIterator_MoreEntries(iterator); ListIterator_Next(iterator))
+    while ((count = MessageQPopMany(msgQ, msgs, MESSAGEQ_SIZE)) > 0)
     {
-        void *object = ListIterator_Current(iterator);
-        ObjectRefDec(object);
+        for (i = 0; i < count; i ++)
+        {
+            ObjectRefDec(msgs[i]);
+        }
     }
-    ListFree(msgQ->messages, NULL);
-    pthread_mutex_unlock(&msgQ->mutex);
-    pthread_mutex_destroy(&msgQ->mutex);
-    pthread_cond_destroy(&msgQ->availableCond);
+    pthread_mutex_destroy(&msgQ->overflowMutex);
     ObjectRefDec(msgQ);
     LogModule(LOG_DEBUG, MESSAGEQ, "Destroyed messageq %p\n", msgQ);
 }
 
 void MessageQSend(MessageQ_t msgQ, void *msg)
 {
-    pthread_mutex_lock(&msgQ->mutex);
-    if (!msgQ->quit)
+    uint64_t now;
+    int depth;
+    int retries = 0;
+
+    if (msgQ->quit)
+    {
+        return;
+    }
+    ObjectRefInc(msg);
+    now = MessageQNow();
+    /* Once messages have overflowed keep using the overflow list until it is
+     * empty so messages from a sender stay in order. When the ring is full give
+     * the receivers a chance to catch up before resorting to the list.
+     */
+    while (msgQ->overflowCount || !MessageQPush(msgQ, msg, now))
+    {
+        if (msgQ->overflowCount || (retries == MESSAGEQ_FULL_RETRIES))
+        {
+            MessageQOverflowPush(msgQ, msg, now);
+            break;
+        }
+        MessageQWake(msgQ, INT_MAX);
+        sched_yield();
+        retries ++;
+    }
+    depth = MessageQAvailable(msgQ);
+    if (depth > msgQ->maxDepth)
     {
-        ObjectRefInc(msg);
-        ListAdd(msgQ->messages, msg);
-        pthread_cond_signal(&msgQ->availableCond);
+        msgQ->maxDepth = depth;
     }
-    pthread_mutex_unlock(&msgQ->mutex);    
+    MessageQWake(msgQ, 1);
 }
 
 int MessageQAvailable(MessageQ_t msgQ)
 {
-    int count = 0;
-    pthread_mutex_lock(&msgQ->mutex);
-    count = ListCount(msgQ->messages);
-    pthread_mutex_unlock(&msgQ->mutex);        
-    return count;
+    long count = (long)(msgQ->enqueuePos - msgQ->dequeuePos);
+    /* The positions are read separately so may be momentarily inconsistent. */
+    if (count < 0)
+    {
+        count = 0;
+    }
+    return (int)count + msgQ->overflowCount;
 }
 
 void *MessageQReceive(MessageQ_t msgQ)
 {
     void *result = NULL;
-    pthread_mutex_lock(&msgQ->mutex);
-    if (!msgQ->quit)
+    MessageQTake(msgQ, &result, 1, 0);
+    return result;
+}
+
+int MessageQReceiveMany(MessageQ_t msgQ, void **msgs, int maxMsgs)
+{
+    return MessageQTake(msgQ, msgs, maxMsgs, 0);
+}
+
+void *MessageQReceiveTimed(MessageQ_t msgQ, ulong timeout)
+{
+    void *result = NULL;
+    MessageQTake(msgQ, &result, 1, MessageQNow() + (timeout * NS_PER_MS));
+    return result;
+}
+
+void MessageQSetQuit(MessageQ_t msgQ)
+{
+    msgQ->quit = TRUE;
+    __sync_add_and_fetch(&msgQ->wakeSeq, 1);
+    syscall(SYS_futex, &msgQ->wakeSeq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void MessageQResetQuit(MessageQ_t msgQ)
+{
+    msgQ->quit = FALSE;
+    __sync_synchronize();
+}
+
+bool MessageQIsQuitSet(MessageQ_t msgQ)
+{
+    return msgQ->quit;
+}
+
+void MessageQStatsGet(MessageQ_t msgQ, MessageQStats_t *stats)
+{
+    stats->received = msgQ->received;
+    stats->overflowed = msgQ->overflowed;
+    stats->sent = msgQ->enqueuePos + stats->overflowed;
+    stats->depth = MessageQAvailable(msgQ);
+    stats->maxDepth = msgQ->maxDepth;
+    stats->averageLatency = stats->received ? (unsigned long)((msgQ->totalLatency / stats->received) / 1000) : 0;
+    stats->maxLatency = (unsigned long)(msgQ->maxLatency / 1000);
+}
+
+/*******************************************************************************
+* Local Functions                                                              *
+*******************************************************************************/
+static bool MessageQPush(MessageQ_t msgQ, void *msg, uint64_t now)
+{
+    MessageQCell_t *cell;
+    unsigned long pos = msgQ->enqueuePos;
+    long diff;
+
+    for (;;)
     {
-        if (ListCount(msgQ->messages) == 0)
+        cell = &msgQ->cells[pos & MESSAGEQ_MASK];
+        diff = (long)(cell->sequence - pos);
+        if (diff == 0)
         {
-            pthread_cond_wait(&msgQ->availableCond, &msgQ->mutex);
+            if (__sync_bool_compare_and_swap(&msgQ->enqueuePos, pos, pos + 1))
+            {
+                break;
+            }
         }
-        if (!msgQ->quit)
+        else if (diff < 0)
         {
-            ListIterator_t iterator;
-            ListIterator_Init(iterator, msgQ->messages);
-            result = ListIterator_Current(iterator);
-            ListRemoveCurrent(&iterator);
+            /* Full, the slot hasn't been read since the last time round. */
+            return FALSE;
         }
+        pos = msgQ->enqueuePos;
     }
-    pthread_mutex_unlock(&msgQ->mutex);       
-    return result;
+    cell->msg = msg;
+    cell->sent = now;
+    __sync_synchronize();
+    cell->sequence = pos + 1;
+    return TRUE;
 }
 
-void *MessageQReceiveTimed(MessageQ_t msgQ, ulong timeout)
+static void MessageQOverflowPush(MessageQ_t msgQ, void *msg, uint64_t now)
 {
-    void *result = NULL;
-    struct timespec tilltime;
+    MessageQOverflow_t *entry = malloc(sizeof(MessageQOverflow_t));
+
+    if (entry == NULL)
+    {
+        LogModule(LOG_ERROR, MESSAGEQ, "Failed to allocate overflow entry, message dropped!\n");
+        ObjectRefDec(msg);
+        return;
+    }
+    entry->next = NULL;
+    entry->msg = msg;
+    entry->sent = now;
+    pthread_mutex_lock(&msgQ->overflowMutex);
+    if (msgQ->overflowTail)
+    {
+        msgQ->overflowTail->next = entry;
+    }
+    else
+    {
+        msgQ->overflowHead = entry;
+    }
+    msgQ->overflowTail = entry;
+    msgQ->overflowCount ++;
+    msgQ->overflowed ++;
+    pthread_mutex_unlock(&msgQ->overflowMutex);
+}
+
+/*
+ * Take up to maxMsgs messages from the queue without waiting, messages in the
+ * ring are always older than those on the overflow list.
+ */
+static int MessageQPopMany(MessageQ_t msgQ, void **msgs, int maxMsgs)
+{
+    MessageQCell_t *cell;
+    MessageQOverflow_t *entry;
+    unsigned long pos = msgQ->dequeuePos;
+    uint64_t now = 0;
+    int count = 0;
+    long diff;
 
-    pthread_mutex_lock(&msgQ->mutex);
-    if (!msgQ->quit)
+    while (count < maxMsgs)
     {
-        if (ListCount(msgQ->messages) == 0)
+        cell = &msgQ->cells[pos & MESSAGEQ_MASK];
+        diff = (long)(cell->sequence - (pos + 1));
+        if (diff == 0)
+        {
+            if (!__sync_bool_compare_and_swap(&msgQ->dequeuePos, pos, pos + 1))
+            {
+                pos = msgQ->dequeuePos;
+                continue;
+            }
+            if (now == 0)
+            {
+                now = MessageQNow();
+            }
+            msgs[count] = cell->msg;
+            MessageQLatency(msgQ, cell->sent, now);
+            __sync_synchronize();
+            cell->sequence = pos + MESSAGEQ_SIZE;
+            count ++;
+            pos ++;
+        }
+        else if (diff < 0)
         {
-            clock_gettime(CLOCK_REALTIME, &tilltime);
-            tilltime.tv_nsec += timeout * 1000000;
-            pthread_cond_timedwait(&msgQ->availableCond, &msgQ->mutex, &tilltime);
+            /* Empty (or the next message is still being written). */
+            break;
         }
-        if ((!msgQ->quit) && (ListCount(msgQ->messages) > 0))
+        else
         {
-            ListIterator_t iterator;
-            ListIterator_Init(iterator, msgQ->messages);
-            result = ListIterator_Current(iterator);
-            ListRemoveCurrent(&iterator);
+            pos = msgQ->dequeuePos;
         }
     }
-    pthread_mutex_unlock(&msgQ->mutex);       
-    return result;
+
+    if ((count < maxMsgs) && msgQ->overflowCount)
+    {
+        pthread_mutex_lock(&msgQ->overflowMutex);
+        while ((count < maxMsgs) && msgQ->overflowHead)
+        {
+            if (now == 0)
+            {
+                now = MessageQNow();
+            }
+            entry = msgQ->overflowHead;
+            msgQ->overflowHead = entry->next;
+            if (msgQ->overflowHead == NULL)
+            {
+                msgQ->overflowTail = NULL;
+            }
+            msgQ->overflowCount --;
+            msgs[count] = entry->msg;
+            MessageQLatency(msgQ, entry->sent, now);
+            free(entry);
+            count ++;
+        }
+        pthread_mutex_unlock(&msgQ->overflowMutex);
+    }
+    if (count)
+    {
+        __sync_add_and_fetch(&msgQ->received, count);
+    }
+    return count;
 }
 
+/*
+ * Receive between 1 and maxMsgs messages, waiting until deadline (or forever if
+ * deadline is 0). Returns 0 if the quit flag is set or the deadline passes.
+ */
+static int MessageQTake(MessageQ_t msgQ, void **msgs, int maxMsgs, uint64_t deadline)
+{
+    int count;
 
-void MessageQSetQuit(MessageQ_t msgQ)
+    while (!msgQ->quit)
+    {
+        count = MessageQPopMany(msgQ, msgs, maxMsgs);
+        if (count)
+        {
+            return count;
+        }
+        if (deadline && (MessageQNow() >= deadline))
+        {
+            break;
+        }
+        MessageQWait(msgQ, deadline);
+    }
+    return 0;
+}
+
+static void MessageQWait(MessageQ_t msgQ, uint64_t deadline)
 {
-    pthread_mutex_lock(&msgQ->mutex);
-    msgQ->quit = TRUE;
-    pthread_cond_signal(&msgQ->availableCond);
-    pthread_mutex_unlock(&msgQ->mutex);   
+    struct timespec timeout;
+    int seq = msgQ->wakeSeq;
+
+    /* Register as a sleeper before checking the queue again so a sender either
+     * sees the sleeper or the message is seen here.
+     */
+    __sync_add_and_fetch(&msgQ->sleepers, 1);
+    if (!msgQ->quit && (MessageQAvailable(msgQ) == 0))
+    {
+        if (deadline)
+        {
+            /* FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC time. */
+            timeout.tv_sec = deadline / NS_PER_SEC;
+            timeout.tv_nsec = deadline % NS_PER_SEC;
+            syscall(SYS_futex, &msgQ->wakeSeq, FUTEX_WAIT_BITSET_PRIVATE, seq, &timeout, NULL, FUTEX_BITSET_MATCH_ANY);
+        }
+        else
+        {
+            syscall(SYS_futex, &msgQ->wakeSeq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+        }
+    }
+    __sync_sub_and_fetch(&msgQ->sleepers, 1);
 }
 
-void MessageQResetQuit(MessageQ_t msgQ)
+static void MessageQWake(MessageQ_t msgQ, int count)
 {
-    pthread_mutex_lock(&msgQ->mutex);
-    msgQ->quit = FALSE;
-    pthread_mutex_unlock(&msgQ->mutex); 
+    __sync_synchronize();
+    if (msgQ->sleepers)
+    {
+        __sync_add_and_fetch(&msgQ->wakeSeq, 1);
+        syscall(SYS_futex, &msgQ->wakeSeq, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+    }
 }
 
-bool MessageQIsQuitSet(MessageQ_t msgQ)
+static void MessageQLatency(MessageQ_t msgQ, uint64_t sent, uint64_t now)
 {
-    bool result = FALSE;
-    pthread_mutex_lock(&msgQ->mutex);
-    result = msgQ->quit;
-    pthread_mutex_unlock(&msgQ->mutex); 
-    return result;
+    uint64_t latency = (now > sent) ? now - sent : 0;
+
+    __sync_add_and_fetch(&msgQ->totalLatency, latency);
+    if (latency > msgQ->maxLatency)
+    {
+        msgQ->maxLatency = latency;
+    }
 }
 
+static uint64_t MessageQNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * NS_PER_SEC) + now.tv_nsec;
+}
@@ -26,6 +26,7 @@ Transport stream processing and filter management.
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
@@ -39,6 +40,8 @@ Transport stream processing and filter management.
 #include "ts.h"
 #include "logging.h"
 #include "dispatchers.h"
+#include "properties.h"
+#include "deliverymethod.h"
 
 /*******************************************************************************
 * Defines                                                                      *
@@ -69,6 +72,12 @@ static void StatsAddFilterGroupStats(TSReaderStats_t *stats, const char *type, T
 static void PromiscusModeEnable(TSReader_t *reader, bool enable);
 static TSPacketFilter_t * PacketFilterListAddFilter(TSReader_t *reader, TSFilterGroup_t *group, uint16_t pid, TSPacketFilterCallback_t callback, void *userArg);
 static void PacketFilterListRemoveFilter(TSReader_t *reader, TSPacketFilter_t *packetFilter);
+static void PacketFilterListRebuildDispatchTable(TSReader_t *reader, uint16_t pid);
+static void PacketFilterListFreeRetired(TSReader_t *reader);
+static void PacketFilterListRebuildAllDispatchTables(TSReader_t *reader);
+static TSPIDDispatchTable_t *DispatchTableBuild(TSReader_t *reader, uint16_t pid, int worker);
+static int FilterGroupWorker(TSReader_t *reader, TSFilterGroup_t *group);
+static void FilterGroupSendEvent(TSReader_t *reader, TSFilterGroup_t *group, TSFilterEventType_e event, void *details);
 static TSSectionFilterList_t * SectionFilterListCreate(TSReader_t *reader, uint16_t pid);
 static void SectionFilterListDestroy(TSReader_t *reader, TSSectionFilterList_t *sfList);
 static void SectionFilterListAddFilter(TSReader_t *reader, TSSectionFilter_t *filter);
@@ -84,6 +93,18 @@ static void SectionFilterListPushSection(void *userArg, dvbpsi_handle sectionsHa
 static void TSReaderDVRCallback(struct ev_loop *loop, ev_io *w, int revents);
 static void TSReaderBitrateCallback(struct ev_loop *loop, ev_timer *w, int revents);
 static void TSReaderNotificationCallback(struct ev_loop *loop, ev_async *w, int revents);
+static int TSReaderReadDVR(TSReader_t *reader);
+static bool TSReaderResizeBuffer(TSReader_t *reader, unsigned int packets);
+static int TSReaderPropertyBufferPacketsSet(void *userArg, PropertyValue_t *value);
+static int TSReaderPropertyWorkersGet(void *userArg, PropertyValue_t *value);
+static int TSReaderPropertyWorkersSet(void *userArg, PropertyValue_t *value);
+
+static TSReaderWorker_t *WorkerCreate(TSReader_t *reader, int index);
+static void WorkerDestroy(TSReaderWorker_t *worker);
+static void WorkerQueueBatch(TSReaderWorker_t *worker, TSPacketBatch_t *batch);
+static void *WorkerThread(void *arg);
+static void WorkerSendToPacketFilters(TSReaderWorker_t *worker, uint16_t pid, TSPacket_t *packet);
+static TSPacketBatch_t *PacketBatchCreate(unsigned int packets);
 
 static void ProcessPacket(TSReader_t *reader, TSPacket_t *packet);
 static void SendToPacketFilters(TSReader_t *reader, uint16_t pid, TSPacket_t *packet);
@@ -96,6 +117,10 @@ static void InformMultiplexChanged(TSReader_t *reader);
 
 char PSISIPIDFilterType[] = "PSI/SI";
 static char TSREADER[] = "TSReader";
+static const char propertyParent[] = "tsreader";
+
+/* Batch currently being dispatched on this thread. */
+static __thread TSPacketBatch_t *currentBatch = NULL;
 
 /*******************************************************************************
 * Transport Stream Filter Functions                                            *
@@ -112,6 +137,7 @@ TSReader_t* TSReaderCreate(DVBAdapter_t *adapter)
     ObjectRegisterTypeDestructor(TSReaderStats_t, TSReaderStatsDestructor);
     ObjectRegisterType(TSFilterGroupTypeStats_t);
     ObjectRegisterType(TSFilterGroupStats_t);    
+    ObjectRegisterType(TSReaderWorker_t);
 
     result = ObjectCreateType(TSReader_t);
     if (result)
@@ -119,7 +145,13 @@ TSReader_t* TSReaderCreate(DVBAdapter_t *adapter)
         pthread_mutexattr_t mutexAttr;
 
         result->adapter = adapter;
-        DVBDemuxSetBufferSize(adapter, TSREADER_MAX_PACKETS * TSPACKET_SIZE);
+        if (!TSReaderResizeBuffer(result, TSREADER_DEFAULT_BUFFER_PACKETS))
+        {
+            ObjectRefDec(result);
+            return NULL;
+        }
+        result->requestedBufferPackets = result->bufferPackets;
+        DVBDemuxSetBufferSize(adapter, result->bufferPackets * TSPACKET_SIZE);
         result->groups = ListCreate();
         result->activeSectionFilters = ListCreate();
         result->sectionFilters = ListCreate();
@@ -138,6 +170,11 @@ TSReader_t* TSReaderCreate(DVBAdapter_t *adapter)
         ev_io_start(inputLoop, &result->dvrWatcher);
         ev_timer_start(inputLoop, &result->bitrateWatcher);
         ev_async_start(inputLoop, &result->notificationWatcher);
+
+        PropertiesAddProperty(propertyParent, "bufferpackets", "Maximum number of packets read from the DVR in one wakeup.",
+            PropertyType_Int, &result->requestedBufferPackets, PropertiesSimplePropertyGet, TSReaderPropertyBufferPacketsSet);
+        PropertiesAddProperty(propertyParent, "workers", "Number of worker threads packet filters are run on (0 to run on the input thread).",
+            PropertyType_Int, result, TSReaderPropertyWorkersGet, TSReaderPropertyWorkersSet);
     }
     return result;
 }
@@ -148,6 +185,8 @@ void TSReaderDestroy(TSReader_t* reader)
     struct ev_loop *inputLoop = DispatchersGetInput();
     ev_io_stop(inputLoop, &reader->dvrWatcher);
     ev_timer_stop(inputLoop, &reader->bitrateWatcher);
+    PropertiesRemoveAllProperties(propertyParent);
+    TSReaderWorkersSet(reader, 0);
     SectionFilterListDescheduleFilters(reader);
     pthread_mutex_destroy(&reader->mutex);
     
@@ -172,6 +211,13 @@ void TSReaderDestroy(TSReader_t* reader)
     ListFree(reader->activeSectionFilters,NULL);
     ListFree(reader->sectionFilters,NULL);
 
+    /* Tables and filters retired after the last packet was dispatched. */
+    PacketFilterListFreeRetired(reader);
+    for (i = 0; i < TSREADER_NROF_FILTERS; i ++)
+    {
+        free(reader->dispatchTables[i]);
+    }
+    TSPacketBatchRelease(reader->buffer);
     ObjectRefDec(reader);
 }
 
@@ -186,6 +232,7 @@ void TSReaderEnable(TSReader_t* reader, bool enable)
 TSReaderStats_t *TSReaderExtractStats(TSReader_t *reader)
 {
     ListIterator_t iterator;
+    int i;
     TSReaderStats_t *stats = ObjectCreateType(TSReaderStats_t);
     
     pthread_mutex_lock(&reader->mutex);
@@ -193,6 +240,17 @@ TSReaderStats_t *TSReaderExtractStats(TSReader_t *reader)
     /* Clear all filter stats */
     stats->totalPackets = reader->totalPackets;
     stats->bitrate = reader->bitrate;
+    stats->totalWakeups = reader->totalWakeups;
+    stats->wakeupsPerSec = reader->wakeupsPerSec;
+    stats->lastBatchPackets = reader->lastBatchPackets;
+    stats->maxBatchPackets = reader->maxBatchPackets;
+    stats->bufferPackets = reader->bufferPackets;
+    stats->buffersReplaced = reader->buffersReplaced;
+    stats->nrofWorkers = reader->nrofWorkers;
+    for (i = 0; i < reader->nrofWorkers; i ++)
+    {
+        stats->batchesDropped += reader->workers[i]->batchesDropped;
+    }
 
     for (ListIterator_Init(iterator, reader->groups); ListIterator_MoreEntries(iterator); ListIterator_Next(iterator))
     {
@@ -211,10 +269,23 @@ TSReaderStats_t *TSReaderExtractStats(TSReader_t *reader)
 void TSReaderZeroStats(TSReader_t* reader)
 {
     ListIterator_t iterator;
+    int i;
     pthread_mutex_lock(&reader->mutex);
     /* Clear all filter stats */
     reader->totalPackets = 0;
     reader->bitrate = 0;
+    reader->prevTotalPackets = 0;
+    reader->totalWakeups = 0;
+    reader->wakeupsPerSec = 0;
+    reader->prevTotalWakeups = 0;
+    reader->lastBatchPackets = 0;
+    reader->maxBatchPackets = 0;
+    reader->buffersReplaced = 0;
+    for (i = 0; i < reader->nrofWorkers; i ++)
+    {
+        reader->workers[i]->batchesProcessed = 0;
+        reader->workers[i]->batchesDropped = 0;
+    }
 
     for (ListIterator_Init(iterator, reader->groups); ListIterator_MoreEntries(iterator); ListIterator_Next(iterator))
     {
@@ -271,7 +342,9 @@ TSFilterGroup_t* TSReaderCreateFilterGroup(TSReader_t *reader, const char *name,
         group->eventCallback = callback;
         group->userArg = userArg;
         group->tsReader = reader;
+        group->affinity = TSFILTERGROUP_AFFINITY_AUTO;
         pthread_mutex_lock(&reader->mutex);        
+        group->index = reader->nextGroupIndex ++;
         ListAdd(reader->groups, group);
         pthread_mutex_unlock(&reader->mutex);
         
@@ -460,6 +533,204 @@ void TSFilterGroupRemovePacketFilter(TSFilterGroup_t *group, uint16_t pid)
     pthread_mutex_unlock(&group->tsReader->mutex);
 }
 
+void TSFilterGroupAffinitySet(TSFilterGroup_t *group, int affinity)
+{
+    TSReader_t *reader = group->tsReader;
+    TSPacketFilter_t *packetFilter;
+
+    if (affinity < TSFILTERGROUP_AFFINITY_INPUT)
+    {
+        affinity = TSFILTERGROUP_AFFINITY_AUTO;
+    }
+    LogModule(LOG_DEBUG, TSREADER, "Setting affinity of filter group %s to %d", group->name, affinity);
+    pthread_mutex_lock(&reader->mutex);
+    group->affinity = affinity;
+    for (packetFilter = group->packetFilters; packetFilter; packetFilter = packetFilter->next)
+    {
+        PacketFilterListRebuildDispatchTable(reader, packetFilter->pid);
+    }
+    pthread_mutex_unlock(&reader->mutex);
+}
+
+int TSFilterGroupAffinityGet(TSFilterGroup_t *group)
+{
+    return group->affinity;
+}
+
+int TSReaderWorkersSet(TSReader_t *reader, int nrofWorkers)
+{
+    int i;
+    int result = 0;
+
+    if ((nrofWorkers < 0) || (nrofWorkers > TSREADER_MAX_WORKERS))
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&reader->mutex);
+    if (nrofWorkers != reader->nrofWorkers)
+    {
+        /* Stop the existing workers, the input thread can't queue any more
+         * batches while we hold the lock.
+         */
+        for (i = 0; i < reader->nrofWorkers; i ++)
+        {
+            WorkerDestroy(reader->workers[i]);
+            reader->workers[i] = NULL;
+        }
+        reader->nrofWorkers = 0;
+
+        for (i = 0; i < nrofWorkers; i ++)
+        {
+            reader->workers[i] = WorkerCreate(reader, i);
+            if (reader->workers[i] == NULL)
+            {
+                LogModule(LOG_ERROR, TSREADER, "Failed to create worker thread %d", i);
+                result = -1;
+                break;
+            }
+        }
+        reader->nrofWorkers = i;
+        LogModule(LOG_INFO, TSREADER, "Using %d worker threads", reader->nrofWorkers);
+        PacketFilterListRebuildAllDispatchTables(reader);
+    }
+    pthread_mutex_unlock(&reader->mutex);
+    return result;
+}
+
+int TSReaderWorkersGet(TSReader_t *reader)
+{
+    return reader->nrofWorkers;
+}
+
+void TSReaderLock(TSReader_t *reader)
+{
+    int i;
+    pthread_mutex_lock(&reader->mutex);
+    for (i = 0; i < reader->nrofWorkers; i ++)
+    {
+        pthread_mutex_lock(&reader->workers[i]->mutex);
+    }
+}
+
+void TSReaderUnLock(TSReader_t *reader)
+{
+    int i;
+    for (i = reader->nrofWorkers - 1; i >= 0; i --)
+    {
+        pthread_mutex_unlock(&reader->workers[i]->mutex);
+    }
+    pthread_mutex_unlock(&reader->mutex);
+}
+
+void TSReaderProcessBatch(TSReader_t *reader, TSPacketBatch_t *ingest)
+{
+    int count = ingest->nrofPackets;
+    int p;
+
+    reader->totalWakeups ++;
+    reader->lastBatchPackets = count;
+    if (count > reader->maxBatchPackets)
+    {
+        reader->maxBatchPackets = count;
+    }
+
+    if (DVBFrontEndIsLocked(reader->adapter) && reader->enabled)
+    {
+        TSPacketBatch_t *batch = NULL;
+
+        pthread_mutex_lock(&reader->mutex);
+        if (reader->nrofWorkers && count)
+        {
+            batch = PacketBatchCreate(count);
+        }
+        currentBatch = ingest;
+        for (p = 0; (p < count) && reader->enabled; p ++)
+        {
+            if (!TSPACKET_ISVALID(ingest->packets[p]))
+            {
+                continue;
+            }
+            if (batch)
+            {
+                batch->packets[batch->nrofPackets] = ingest->packets[p];
+                batch->nrofPackets ++;
+            }
+            ProcessPacket(reader, &ingest->packets[p]);
+
+            /* The structure of the transport stream has changed in a major way,
+                (ie new services, services removed) so inform all of the filters
+                that are interested.
+              */
+            if (reader->tsStructureChanged)
+            {
+                InformTSStructureChanged(reader);
+                reader->tsStructureChanged = FALSE;
+            }
+        }
+
+        if (batch)
+        {
+            if (batch->nrofPackets)
+            {
+                int i;
+                batch->refCount = reader->nrofWorkers;
+                for (i = 0; i < reader->nrofWorkers; i ++)
+                {
+                    WorkerQueueBatch(reader->workers[i], batch);
+                }
+            }
+            else
+            {
+                free(batch);
+            }
+        }
+        DeliveryMethodFlushPending();
+        currentBatch = NULL;
+        pthread_mutex_unlock(&reader->mutex);
+    }
+}
+
+TSPacketBatch_t *TSPacketBatchGetCurrent(TSPacket_t *packet)
+{
+    TSPacketBatch_t *batch = currentBatch;
+    if (batch && (packet >= batch->packets) && (packet < &batch->packets[batch->nrofPackets]))
+    {
+        return batch;
+    }
+    return NULL;
+}
+
+void TSPacketBatchRef(TSPacketBatch_t *batch)
+{
+    __sync_add_and_fetch(&batch->refCount, 1);
+}
+
+void TSPacketBatchRelease(TSPacketBatch_t *batch)
+{
+    if (__sync_sub_and_fetch(&batch->refCount, 1) == 0)
+    {
+        if (batch->owner)
+        {
+            ObjectRefDec(batch->owner);
+        }
+        free(batch);
+    }
+}
+
+TSPacketBatch_t *TSPacketBatchCreateExternal(TSPacket_t *packets, int nrofPackets, void *owner)
+{
+    TSPacketBatch_t *batch = malloc(sizeof(TSPacketBatch_t));
+    if (batch)
+    {
+        batch->refCount = 1;
+        batch->nrofPackets = nrofPackets;
+        batch->packets = packets;
+        batch->owner = owner;
+        ObjectRefInc(owner);
+    }
+    return batch;
+}
 
 /*******************************************************************************
 * Internal Functions                                                           *
@@ -609,6 +880,7 @@ static TSPacketFilter_t * PacketFilterListAddFilter(TSReader_t *reader, TSFilter
     packetFilter->userArg = userArg;
     packetFilter->flNext = reader->packetFilters[pid];
     reader->packetFilters[pid] = packetFilter;
+    PacketFilterListRebuildDispatchTable(reader, pid);
     return packetFilter;
 }
 
@@ -618,12 +890,6 @@ static void PacketFilterListRemoveFilter(TSReader_t *reader, TSPacketFilter_t *p
     TSPacketFilter_t *prev = NULL;
 
     LogModule(LOG_DEBUG, TSREADER, "Removing packet filter %p on pid 0x%02x", packetFilter, packetFilter->pid);
-    if (reader->currentlyProcessingPid == (packetFilter->pid & ~PACKET_FILTER_DISABLED))
-    {
-        LogModule(LOG_DEBUG, TSREADER, "Removing packet filter (replaced with NULL)");
-        packetFilter->pid |= PACKET_FILTER_DISABLED;
-        return;
-    }
     for (cur = reader->packetFilters[packetFilter->pid]; cur; cur = cur->flNext)
     {
         if (cur == packetFilter)
@@ -643,6 +909,20 @@ static void PacketFilterListRemoveFilter(TSReader_t *reader, TSPacketFilter_t *p
             prev->flNext = cur->flNext;
         }
     }
+    PacketFilterListRebuildDispatchTable(reader, packetFilter->pid);
+
+    if (reader->currentlyProcessingPid == packetFilter->pid)
+    {
+        /* The filter may still be referenced by the table being used to
+         * dispatch the current packet, so leave freeing it until dispatching
+         * has finished.
+         */
+        LogModule(LOG_DEBUG, TSREADER, "Removing packet filter (deferred)");
+        packetFilter->pid |= PACKET_FILTER_DISABLED;
+        packetFilter->flNext = reader->retiredFilters;
+        reader->retiredFilters = packetFilter;
+        return;
+    }
     if (reader->packetFilters[packetFilter->pid] == NULL)
     {
         if (!reader->promiscuousMode && (packetFilter->pid != TSREADER_PID_ALL))
@@ -653,6 +933,153 @@ static void PacketFilterListRemoveFilter(TSReader_t *reader, TSPacketFilter_t *p
     ObjectRefDec(packetFilter);
 }
 
+static void PacketFilterListRebuildDispatchTable(TSReader_t *reader, uint16_t pid)
+{
+    TSPIDDispatchTable_t *oldTable = reader->dispatchTables[pid];
+    TSPIDDispatchTable_t *newTable;
+    int i;
+
+    for (i = 0; i < reader->nrofWorkers; i ++)
+    {
+        TSReaderWorker_t *worker = reader->workers[i];
+        newTable = DispatchTableBuild(reader, pid, i);
+        /* The worker holds its mutex while processing a batch, so once we have
+         * it the worker can't be using the old table.
+         */
+        pthread_mutex_lock(&worker->mutex);
+        free(worker->dispatchTables[pid]);
+        worker->dispatchTables[pid] = newTable;
+        pthread_mutex_unlock(&worker->mutex);
+    }
+
+    newTable = DispatchTableBuild(reader, pid, -1);
+    reader->dispatchTables[pid] = newTable;
+
+    if (oldTable)
+    {
+        if (reader->currentlyProcessingPid == pid)
+        {
+            oldTable->nextRetired = reader->retiredTables;
+            reader->retiredTables = oldTable;
+        }
+        else
+        {
+            free(oldTable);
+        }
+    }
+}
+
+static void PacketFilterListRebuildAllDispatchTables(TSReader_t *reader)
+{
+    int pid;
+    for (pid = 0; pid < TSREADER_NROF_FILTERS; pid ++)
+    {
+        if (reader->packetFilters[pid] || reader->dispatchTables[pid])
+        {
+            PacketFilterListRebuildDispatchTable(reader, pid);
+        }
+    }
+}
+
+/*
+ * Build a dispatch table containing the packet filters for the specified pid
+ * that should be run on the worker thread (or the input thread if worker is -1).
+ */
+static TSPIDDispatchTable_t *DispatchTableBuild(TSReader_t *reader, uint16_t pid, int worker)
+{
+    TSPIDDispatchTable_t *table;
+    TSPacketFilter_t *cur;
+    int count = 0;
+
+    for (cur = reader->packetFilters[pid]; cur; cur = cur->flNext)
+    {
+        if (FilterGroupWorker(reader, cur->group) == worker)
+        {
+            count ++;
+        }
+    }
+
+    if (count == 0)
+    {
+        return NULL;
+    }
+
+    table = malloc(sizeof(TSPIDDispatchTable_t) + (count * sizeof(TSPacketFilterDispatch_t)));
+    if (table == NULL)
+    {
+        LogModule(LOG_ERROR, TSREADER, "Failed to allocate dispatch table for pid 0x%04x", pid);
+        return NULL;
+    }
+    table->nrofFilters = count;
+    table->nextRetired = NULL;
+    count = 0;
+    for (cur = reader->packetFilters[pid]; cur; cur = cur->flNext)
+    {
+        if (FilterGroupWorker(reader, cur->group) == worker)
+        {
+            table->filters[count].callback = cur->callback;
+            table->filters[count].userArg = cur->userArg;
+            table->filters[count].group = cur->group;
+            table->filters[count].filter = cur;
+            count ++;
+        }
+    }
+    return table;
+}
+
+/*
+ * Determine which worker thread a group's packet filters should be run on,
+ * returns -1 for the input thread.
+ */
+static int FilterGroupWorker(TSReader_t *reader, TSFilterGroup_t *group)
+{
+    if ((reader->nrofWorkers == 0) || (group == NULL) || (group->affinity == TSFILTERGROUP_AFFINITY_INPUT))
+    {
+        return -1;
+    }
+    if (group->affinity == TSFILTERGROUP_AFFINITY_AUTO)
+    {
+        return group->index % reader->nrofWorkers;
+    }
+    return group->affinity % reader->nrofWorkers;
+}
+
+static void FilterGroupSendEvent(TSReader_t *reader, TSFilterGroup_t *group, TSFilterEventType_e event, void *details)
+{
+    int worker = FilterGroupWorker(reader, group);
+    /* Make sure the group's packet filters aren't running while it handles the event. */
+    if (worker != -1)
+    {
+        pthread_mutex_lock(&reader->workers[worker]->mutex);
+    }
+    group->eventCallback(group->userArg, group, event, details);
+    if (worker != -1)
+    {
+        pthread_mutex_unlock(&reader->workers[worker]->mutex);
+    }
+}
+
+static void PacketFilterListFreeRetired(TSReader_t *reader)
+{
+    TSPIDDispatchTable_t *table, *nextTable;
+    TSPacketFilter_t *filter, *nextFilter;
+
+    for (table = reader->retiredTables; table; table = nextTable)
+    {
+        nextTable = table->nextRetired;
+        free(table);
+    }
+    reader->retiredTables = NULL;
+
+    for (filter = reader->retiredFilters; filter; filter = nextFilter)
+    {
+        nextFilter = filter->flNext;
+        LogModule(LOG_DEBUG, TSREADER, "Removing %p (%d) as marked as disabled", filter, filter->pid & ~PACKET_FILTER_DISABLED);
+        ObjectRefDec(filter);
+    }
+    reader->retiredFilters = NULL;
+}
+
 static TSSectionFilterList_t * SectionFilterListCreate(TSReader_t *reader, uint16_t pid)
 {
     TSSectionFilterList_t *sfList = ObjectCreateType(TSSectionFilterList_t);
@@ -848,17 +1275,22 @@ static void SectionFilterListPushSection(void *userArg, dvbpsi_handle sectionsHa
 {
     TSSectionFilterList_t *sfList = userArg;
     ListIterator_t iterator;
-    dvbpsi_psi_section_t *cloned;
+    dvbpsi_psi_section_t *shared;
     
     for (ListIterator_Init(iterator, sfList->filters); ListIterator_MoreEntries(iterator); ListIterator_Next(iterator))
     {
         TSSectionFilter_t *filter = ListIterator_Current(iterator);
-        cloned = dvbpsi_ClonePSISection(filter->sectionHandle, section);
+        /* Subscribers only read the section data so share it rather than copy it */
+        shared = dvbpsi_SharePSISection(section);
+        if (shared == NULL)
+        {
+            continue;
+        }
         if (filter->group)
         {
             filter->group->sectionsProcessed ++;
         }
-        dvbpsi_PushSection(filter->sectionHandle, cloned);
+        dvbpsi_PushSection(filter->sectionHandle, shared);
     }
     
     dvbpsi_ReleasePSISections(sfList->sectionHandle, section);
@@ -875,34 +1307,140 @@ static void SectionFilterListPushSection(void *userArg, dvbpsi_handle sectionsHa
 static void TSReaderDVRCallback(struct ev_loop *loop, ev_io *w, int revents)
 {
     TSReader_t *reader = (TSReader_t*)w->data;
-    DVBAdapter_t *adapter = reader->adapter;
-    int count, p;
-  
-    count = read(DVBDVRGetFD(adapter), (char*)reader->buffer, sizeof(reader->buffer));
-    if (!DVBFrontEndIsLocked(adapter) || !reader->enabled)
+    int count;
+
+    if ((unsigned int)reader->requestedBufferPackets != reader->bufferPackets)
     {
-        return;
+        if (TSReaderResizeBuffer(reader, reader->requestedBufferPackets))
+        {
+            DVBDemuxSetBufferSize(reader->adapter, reader->bufferPackets * TSPACKET_SIZE);
+        }
+        reader->requestedBufferPackets = reader->bufferPackets;
     }
-    pthread_mutex_lock(&reader->mutex);
-    for (p = 0; (p < (count / TSPACKET_SIZE)) && reader->enabled; p ++)
+
+    count = TSReaderReadDVR(reader);
+    reader->buffer->nrofPackets = count;
+    TSReaderProcessBatch(reader, reader->buffer);
+
+    /* If packets are still referenced (ie queued by a delivery method) the
+     * ingest buffer can't be reused, so read in to a new one.
+     */
+    if (reader->buffer->refCount > 1)
     {
-        if (!TSPACKET_ISVALID(reader->buffer[p]))
+        TSPacketBatch_t *buffer = PacketBatchCreate(reader->bufferPackets);
+        if (buffer)
         {
-            continue;
+            memcpy(buffer->packets, &reader->buffer->packets[count], reader->bufferBytesUsed);
+            TSPacketBatchRelease(reader->buffer);
+            reader->buffer = buffer;
+            reader->buffersReplaced ++;
+            return;
         }
-        ProcessPacket(reader, &reader->buffer[p]);
-        
-        /* The structure of the transport stream has changed in a major way,
-            (ie new services, services removed) so inform all of the filters
-            that are interested.
-          */
-        if (reader->tsStructureChanged)
+        LogModule(LOG_ERROR, TSREADER, "Failed to allocate ingest buffer, reusing referenced buffer");
+    }
+    if (reader->bufferBytesUsed)
+    {
+        memmove(reader->buffer->packets, &reader->buffer->packets[count], reader->bufferBytesUsed);
+    }
+}
+
+/*
+ * Drain the DVR into the ingest buffer, reading until the DVR has no more data
+ * available or the buffer is full. Any partial packet at the end of the data
+ * read is moved to the start of the buffer to be completed on the next wakeup.
+ * Returns the number of complete packets now in the buffer.
+ */
+static int TSReaderReadDVR(TSReader_t *reader)
+{
+    int fd = DVBDVRGetFD(reader->adapter);
+    unsigned int bufferSize = reader->bufferPackets * TSPACKET_SIZE;
+    unsigned int used = reader->bufferBytesUsed;
+    int packets;
+
+    while (used < bufferSize)
+    {
+        unsigned int toRead = bufferSize - used;
+        ssize_t count = read(fd, ((uint8_t*)reader->buffer->packets) + used, toRead);
+        if (count <= 0)
+        {
+            if ((count < 0) && (errno == EINTR))
+            {
+                continue;
+            }
+            break;
+        }
+        used += count;
+        if (count < toRead)
         {
-            InformTSStructureChanged(reader);
-            reader->tsStructureChanged = FALSE;
+            /* Short read, the DVR has been drained. */
+            break;
         }
     }
-    pthread_mutex_unlock(&reader->mutex);
+
+    /* Any partial packet is moved to the start of the buffer once the complete
+     * packets have been processed.
+     */
+    packets = used / TSPACKET_SIZE;
+    reader->bufferBytesUsed = used % TSPACKET_SIZE;
+    return packets;
+}
+
+static bool TSReaderResizeBuffer(TSReader_t *reader, unsigned int packets)
+{
+    TSPacketBatch_t *buffer;
+
+    if (packets < TSREADER_MIN_BUFFER_PACKETS)
+    {
+        packets = TSREADER_MIN_BUFFER_PACKETS;
+    }
+    if (packets > TSREADER_MAX_BUFFER_PACKETS)
+    {
+        packets = TSREADER_MAX_BUFFER_PACKETS;
+    }
+
+    buffer = PacketBatchCreate(packets);
+    if (buffer == NULL)
+    {
+        LogModule(LOG_ERROR, TSREADER, "Failed to allocate ingest buffer of %u packets", packets);
+        return FALSE;
+    }
+    if (reader->buffer)
+    {
+        /* Any partial packet is always at the start of the buffer. */
+        memcpy(buffer->packets, reader->buffer->packets, reader->bufferBytesUsed);
+        TSPacketBatchRelease(reader->buffer);
+    }
+    reader->buffer = buffer;
+    reader->bufferPackets = packets;
+    LogModule(LOG_DEBUG, TSREADER, "Ingest buffer set to %u packets", packets);
+    return TRUE;
+}
+
+static int TSReaderPropertyBufferPacketsSet(void *userArg, PropertyValue_t *value)
+{
+    int *requestedBufferPackets = userArg;
+    if ((value->u.integer < TSREADER_MIN_BUFFER_PACKETS) || (value->u.integer > TSREADER_MAX_BUFFER_PACKETS))
+    {
+        return -1;
+    }
+    /* The buffer is only accessed from the input thread, so leave the actual
+     * resize (and resizing the demux buffer to match) to the next DVR wakeup.
+     */
+    *requestedBufferPackets = value->u.integer;
+    return 0;
+}
+
+static int TSReaderPropertyWorkersGet(void *userArg, PropertyValue_t *value)
+{
+    TSReader_t *reader = userArg;
+    value->u.integer = TSReaderWorkersGet(reader);
+    return 0;
+}
+
+static int TSReaderPropertyWorkersSet(void *userArg, PropertyValue_t *value)
+{
+    TSReader_t *reader = userArg;
+    return TSReaderWorkersSet(reader, value->u.integer);
 }
 
 static void TSReaderBitrateCallback(struct ev_loop *loop, ev_timer *w, int revents)
@@ -910,6 +1448,8 @@ static void TSReaderBitrateCallback(struct ev_loop *loop, ev_timer *w, int reven
     TSReader_t *reader = (TSReader_t*)w->data;
     reader->bitrate = (unsigned long)((reader->totalPackets - reader->prevTotalPackets) * (188 * 8));
     reader->prevTotalPackets = reader->totalPackets;
+    reader->wakeupsPerSec = (unsigned long)(reader->totalWakeups - reader->prevTotalWakeups);
+    reader->prevTotalWakeups = reader->totalWakeups;
 }
 
 static void TSReaderNotificationCallback(struct ev_loop *loop, ev_async *w, int revents)
@@ -919,10 +1459,162 @@ static void TSReaderNotificationCallback(struct ev_loop *loop, ev_async *w, int
     if (reader->multiplexChanged)
     {
         LogModule(LOG_INFO, TSREADER, "Informing mux changed!");
+        pthread_mutex_lock(&reader->mutex);
         InformMultiplexChanged(reader);
+        pthread_mutex_unlock(&reader->mutex);
         reader->multiplexChanged = FALSE;
     }
 }
+
+/*******************************************************************************
+* Worker Thread Functions                                                      *
+*******************************************************************************/
+static TSReaderWorker_t *WorkerCreate(TSReader_t *reader, int index)
+{
+    TSReaderWorker_t *worker = ObjectCreateType(TSReaderWorker_t);
+    pthread_mutexattr_t mutexAttr;
+
+    if (worker == NULL)
+    {
+        return NULL;
+    }
+    worker->reader = reader;
+    worker->index = index;
+    pthread_mutexattr_init(&mutexAttr);
+    pthread_mutexattr_settype(&mutexAttr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&worker->mutex, &mutexAttr);
+    pthread_mutexattr_destroy(&mutexAttr);
+    sem_init(&worker->batchesAvailable, 0, 0);
+    if (pthread_create(&worker->thread, NULL, WorkerThread, worker))
+    {
+        sem_destroy(&worker->batchesAvailable);
+        pthread_mutex_destroy(&worker->mutex);
+        ObjectRefDec(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+static void WorkerDestroy(TSReaderWorker_t *worker)
+{
+    int pid;
+
+    worker->quit = TRUE;
+    sem_post(&worker->batchesAvailable);
+    pthread_join(worker->thread, NULL);
+
+    /* Discard any batches that haven't been processed. */
+    while (worker->tail != worker->head)
+    {
+        TSPacketBatchRelease(worker->queue[worker->tail % TSREADER_WORKER_QUEUE_SIZE]);
+        worker->tail ++;
+    }
+    for (pid = 0; pid < TSREADER_NROF_FILTERS; pid ++)
+    {
+        free(worker->dispatchTables[pid]);
+    }
+    sem_destroy(&worker->batchesAvailable);
+    pthread_mutex_destroy(&worker->mutex);
+    ObjectRefDec(worker);
+}
+
+/*
+ * Add a batch to the worker's queue, only called from the input thread.
+ */
+static void WorkerQueueBatch(TSReaderWorker_t *worker, TSPacketBatch_t *batch)
+{
+    if ((worker->head - worker->tail) >= TSREADER_WORKER_QUEUE_SIZE)
+    {
+        worker->batchesDropped ++;
+        TSPacketBatchRelease(batch);
+        return;
+    }
+    worker->queue[worker->head % TSREADER_WORKER_QUEUE_SIZE] = batch;
+    /* Make sure the batch is visible before the worker sees the new head. */
+    __sync_synchronize();
+    worker->head ++;
+    sem_post(&worker->batchesAvailable);
+}
+
+static void *WorkerThread(void *arg)
+{
+    TSReaderWorker_t *worker = arg;
+    TSPacketBatch_t *batch;
+    char name[16];
+    int p;
+
+    sprintf(name, "TSWorker%d", worker->index);
+    LogRegisterThread(pthread_self(), name);
+    LogModule(LOG_DEBUG, TSREADER, "Worker thread %d started", worker->index);
+
+    while (!worker->quit)
+    {
+        if (sem_wait(&worker->batchesAvailable))
+        {
+            continue;
+        }
+        if (worker->quit)
+        {
+            break;
+        }
+        batch = worker->queue[worker->tail % TSREADER_WORKER_QUEUE_SIZE];
+
+        pthread_mutex_lock(&worker->mutex);
+        currentBatch = batch;
+        for (p = 0; p < batch->nrofPackets; p ++)
+        {
+            WorkerSendToPacketFilters(worker, TSPACKET_GETPID(batch->packets[p]), &batch->packets[p]);
+            WorkerSendToPacketFilters(worker, TSREADER_PID_ALL, &batch->packets[p]);
+        }
+        DeliveryMethodFlushPending();
+        currentBatch = NULL;
+        pthread_mutex_unlock(&worker->mutex);
+
+        /* Make sure we have finished with the slot before the input thread can reuse it. */
+        __sync_synchronize();
+        worker->tail ++;
+        worker->batchesProcessed ++;
+        TSPacketBatchRelease(batch);
+    }
+
+    LogModule(LOG_DEBUG, TSREADER, "Worker thread %d stopped", worker->index);
+    LogUnregisterThread(pthread_self());
+    return NULL;
+}
+
+static void WorkerSendToPacketFilters(TSReaderWorker_t *worker, uint16_t pid, TSPacket_t *packet)
+{
+    TSPIDDispatchTable_t *table = worker->dispatchTables[pid];
+    TSPacketFilterDispatch_t *entry;
+    int i;
+
+    if (table == NULL)
+    {
+        return;
+    }
+    /* Filters can only be changed while holding the worker's mutex so the
+     * table won't change while dispatching.
+     */
+    for (i = 0; i < table->nrofFilters; i ++)
+    {
+        entry = &table->filters[i];
+        entry->group->packetsProcessed ++;
+        entry->callback(entry->userArg, entry->group, packet);
+    }
+}
+
+static TSPacketBatch_t *PacketBatchCreate(unsigned int packets)
+{
+    TSPacketBatch_t *batch = malloc(sizeof(TSPacketBatch_t) + (packets * sizeof(TSPacket_t)));
+    if (batch)
+    {
+        batch->refCount = 1;
+        batch->nrofPackets = 0;
+        batch->packets = (TSPacket_t *)(batch + 1);
+        batch->owner = NULL;
+    }
+    return batch;
+}
     
 
 static void ProcessPacket(TSReader_t *reader, TSPacket_t *packet)
@@ -934,46 +1626,37 @@ static void ProcessPacket(TSReader_t *reader, TSPacket_t *packet)
 
 static void SendToPacketFilters(TSReader_t *reader, uint16_t pid, TSPacket_t *packet)
 {
-    TSPacketFilter_t *cur, *prev=NULL, *next;
-    if (reader->packetFilters[pid] == NULL)
+    TSPIDDispatchTable_t *table = reader->dispatchTables[pid];
+    TSPacketFilterDispatch_t *entry;
+    int i;
+
+    if (table == NULL)
     {
         return;
     }
     reader->currentlyProcessingPid = pid;
-    for (cur = reader->packetFilters[pid]; cur; cur = cur->flNext)
+    for (i = 0; i < table->nrofFilters; i ++)
     {
-        if (cur->pid & PACKET_FILTER_DISABLED)
+        entry = &table->filters[i];
+        /* Only need to check whether the filter has been removed if a
+         * previous callback has changed the filters for this PID.
+         */
+        if ((reader->dispatchTables[pid] != table) && (entry->filter->pid & PACKET_FILTER_DISABLED))
         {
             continue;
         }
-        if (cur->group)
+        if (entry->group)
         {
-            cur->group->packetsProcessed ++;
+            entry->group->packetsProcessed ++;
         }
-        cur->callback(cur->userArg, cur->group, packet);
+        entry->callback(entry->userArg, entry->group, packet);
     }
     reader->currentlyProcessingPid = TSREADER_PID_INVALID;
-    for (cur = reader->packetFilters[pid]; cur; cur = next)
+    if ((reader->retiredTables == NULL) && (reader->retiredFilters == NULL))
     {
-        next = cur->flNext;
-        if (cur->pid & PACKET_FILTER_DISABLED)
-        {
-            LogModule(LOG_DEBUG, TSREADER, "Removing %p (%d) as marked as disabled", cur, cur->pid & 0x7fff);
-            if (prev == NULL)
-            {
-                reader->packetFilters[pid] = cur->flNext;
-            }
-            else
-            {
-                prev->flNext = cur->flNext;
-            }
-            ObjectRefDec(cur);
-        }
-        else
-        {
-            prev = cur;
-        }
+        return;
     }
+    PacketFilterListFreeRetired(reader);
     if (reader->packetFilters[pid] == NULL)
     {
         if (!reader->promiscuousMode && (pid != TSREADER_PID_ALL))
@@ -992,7 +1675,7 @@ static void InformTSStructureChanged(TSReader_t *reader)
         TSFilterGroup_t *group =(TSFilterGroup_t *)ListIterator_Current(iterator);
         if (group->eventCallback)
         {
-            group->eventCallback(group->userArg, group, TSFilterEventType_StructureChanged, NULL);
+            FilterGroupSendEvent(reader, group, TSFilterEventType_StructureChanged, NULL);
         }
     }
 }
@@ -1005,7 +1688,7 @@ static void InformMultiplexChanged(TSReader_t *reader)
         TSFilterGroup_t *group =(TSFilterGroup_t *)ListIterator_Current(iterator);
         if (group->eventCallback)
         {
-            group->eventCallback(group->userArg, group, TSFilterEventType_MuxChanged, reader->multiplex);
+            FilterGroupSendEvent(reader, group, TSFilterEventType_MuxChanged, reader->multiplex);
         }
     }
 }
@@ -22,6 +22,7 @@ Control tuning of the dvb adapter.
 */
 #include "config.h"
 #include <stdio.h>
+#include <time.h>
 #include "main.h"
 #include "tuning.h"
 #include "cache.h"
@@ -30,11 +31,13 @@ Control tuning of the dvb adapter.
 #include "ts.h"
 #include "servicefilter.h"
 #include "events.h"
+#include "yamlutils.h"
 
 /*******************************************************************************
 * Prototypes                                                                   *
 *******************************************************************************/
 static void TuneMultiplex(Multiplex_t *multiplex);
+static int CacheLoadedEventToString(yaml_document_t *document, Event_t event, void *payload);
 
 /*******************************************************************************
 * Global variables                                                             *
@@ -45,6 +48,7 @@ static Service_t *CurrentService = NULL;
 static EventSource_t tuningSource;
 static Event_t serviceChangedEvent;
 static Event_t mulitplexChangedEvent;
+static Event_t cacheLoadedEvent;
 
 static pthread_mutex_t lockMutex = PTHREAD_MUTEX_INITIALIZER;
 static bool locked = FALSE;
@@ -60,6 +64,7 @@ int TuningInit(void)
     tuningSource = EventsRegisterSource("Tuning");
     serviceChangedEvent = EventsRegisterEvent(tuningSource, "ServiceChanged", ServiceEventToString);
     mulitplexChangedEvent = EventsRegisterEvent(tuningSource, "MultiplexChanged", MultiplexEventToString);
+    cacheLoadedEvent = EventsRegisterEvent(tuningSource, "CacheLoaded", CacheLoadedEventToString);
     return 0;
 }
 
@@ -244,11 +249,22 @@ static void TuneMultiplex(Multiplex_t *multiplex)
 {
     DVBAdapter_t *dvbAdapter = MainDVBAdapterGet();
     TSReader_t *reader = MainTSReaderGet();
+    TuningCacheLoaded_t cacheLoaded;
+    struct timespec start, end;
 
     MultiplexRefDec(CurrentMultiplex);
 
     LogModule(LOG_DEBUGV, TUNING, "Caching Services\n");
+    clock_gettime(CLOCK_MONOTONIC, &start);
     CacheLoad(multiplex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    cacheLoaded.multiplex = multiplex;
+    CacheServicesGet(&cacheLoaded.nrofServices);
+    CacheServicesRelease();
+    cacheLoaded.loadTime = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    LogModule(LOG_DEBUG, TUNING, "Cached %d services in %luus\n", cacheLoaded.nrofServices, cacheLoaded.loadTime);
+    EventsFireEventListeners(cacheLoadedEvent, &cacheLoaded);
 
     MultiplexRefInc(multiplex);
     CurrentMultiplex = multiplex;
@@ -265,3 +281,18 @@ static void TuneMultiplex(Multiplex_t *multiplex)
     EventsFireEventListeners(mulitplexChangedEvent, multiplex);
 }
 
+static int CacheLoadedEventToString(yaml_document_t *document, Event_t event, void *payload)
+{
+    TuningCacheLoaded_t *cacheLoaded = payload;
+    char valueStr[20];
+    int mappingId = yaml_document_add_mapping(document, (yaml_char_t*)YAML_MAP_TAG, YAML_ANY_MAPPING_STYLE);
+
+    sprintf(valueStr, "%d", cacheLoaded->multiplex->uid);
+    YamlUtils_MappingAdd(document, mappingId, "Multiplex UID", valueStr);
+    sprintf(valueStr, "%d", cacheLoaded->nrofServices);
+    YamlUtils_MappingAdd(document, mappingId, "Services", valueStr);
+    sprintf(valueStr, "%lu", cacheLoaded->loadTime);
+    YamlUtils_MappingAdd(document, mappingId, "Load Time (us)", valueStr);
+    return mappingId;
+}
+